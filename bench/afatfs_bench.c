@@ -0,0 +1,821 @@
+/**
+ * @file  afatfs_bench.c
+ * @date  17-October-2026
+ * @brief Standard workloads run against a freshly formatted RAM disk, image
+ *        file or simulated SD card, so versions of the library can be
+ *        compared.
+ *
+ * Each workload reports its throughput, the device commands it took per byte
+ * (and per operation), and how many calls each operation needed until it was
+ * not OPERATION_RUNNING (p50, p99 and max). The output is a table, CSV or
+ * JSON.
+ *
+ *   afatfs_bench [--backend ram|image|sim] [--image PATH] [--direct]
+ *                [--size MB] [--spc N] [--file-mb MB] [--files N]
+ *                [--mounts N] [--read-size BYTES] [--index SLOTS]
+ *                [--seed N] [--format text|csv|json] [--output PATH]
+ *                [--trace PATH]
+ *
+ * --trace writes the trace events of the run as Chrome trace JSON, with the
+ * library built with AFATFS_TRACE_SIZE above 0.
+ *
+ * The sim backend adds the SD card timing of SIMDISK_DefaultConfig, with
+ * stalls drawn from --seed. Seconds and trace times are then the simulated
+ * time, so two runs with the same arguments print the same numbers.
+ *
+ * @author
+ * @author
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "afatfs.h"
+#include "map_host.h"
+#include "imgdisk.h"
+#include "ramdisk.h"
+#include "simdisk.h"
+#include "fatimage.h"
+#include "tracejson.h"
+
+
+#define BENCH_PARTITION                                                        0
+#define BENCH_MAX_RESULTS                                                     32
+#define BENCH_NAME_SIZE                                                       24
+
+#define BENCH_FORMAT_TEXT                                                      0
+#define BENCH_FORMAT_CSV                                                       1
+#define BENCH_FORMAT_JSON                                                      2
+
+#define BENCH_TRACE_CHUNK                                                    256
+
+
+/**
+ * @brief Calls Call until it is not OPERATION_RUNNING, adding the number of
+ *        calls to Polls.
+ */
+#define BENCH_POLL(Result, Polls, Call)                                        \
+  do{                                                                          \
+    do{                                                                        \
+      (Result) = (Call);                                                       \
+      (Polls)++;                                                               \
+      if(BENCH_TraceOut != NULL){ BENCH_TraceDrain();}                         \
+    }while((Result) == OPERATION_RUNNING);                                     \
+  }while(0)
+
+
+typedef struct
+{
+  char Workload[BENCH_NAME_SIZE];
+  uint32_t Param;
+  uint32_t Ops;
+  uint64_t Bytes;
+  double Seconds;
+  uint64_t Commands;
+  uint64_t Sectors;
+  uint32_t P50;
+  uint32_t P99;
+  uint32_t Max;
+}BenchResult_t;
+
+
+static struct
+{
+  uint8_t Disk;
+  uint8_t isDirect;
+  const char *Image;
+  uint32_t SizeMb;
+  uint8_t SectorsPerCluster;
+  uint32_t FileMb;
+  uint32_t Files;
+  uint32_t Mounts;
+  uint32_t ReadSize;
+  uint32_t IndexSlots;
+  uint32_t Seed;
+  uint8_t Format;
+  const char *Output;
+  const char *Trace;
+}Bench = {HOST_DISK_RAM, 0, "afatfs_bench.img", 256, 8, 8, 256, 20, 4096, 0,
+    1, BENCH_FORMAT_TEXT, NULL, NULL};
+
+static EStatus_t (*BENCH_DevRead)(uint8_t *Buffer, uint32_t Sector,
+    uint32_t Count);
+static EStatus_t (*BENCH_DevWrite)(uint8_t *Buffer, uint32_t Sector,
+    uint32_t Count);
+static uint64_t BENCH_Commands;
+static uint64_t BENCH_Sectors;
+
+static uint8_t *BENCH_Memory;
+static AfatfsDirIndex_t *BENCH_Index;
+static uint32_t *BENCH_Samples;
+static uint32_t BENCH_SampleCount;
+static uint32_t BENCH_SampleSize;
+static uint32_t BENCH_Random;
+
+static BenchResult_t BENCH_Results[BENCH_MAX_RESULTS];
+static uint32_t BENCH_ResultCount;
+
+static FILE *BENCH_TraceOut;
+static uint64_t BENCH_TraceLost;
+
+
+
+/* Device functions placed in Disk_List, counting what reaches the disk */
+static EStatus_t BENCH_Read(uint8_t *Buffer, uint32_t Sector, uint32_t Count)
+{
+  EStatus_t returncode;
+
+  returncode = BENCH_DevRead(Buffer, Sector, Count);
+  if(returncode == ANSWERED_REQUEST){
+    BENCH_Commands++;
+    BENCH_Sectors += Count;
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t BENCH_Write(uint8_t *Buffer, uint32_t Sector, uint32_t Count)
+{
+  EStatus_t returncode;
+
+  returncode = BENCH_DevWrite(Buffer, Sector, Count);
+  if(returncode == ANSWERED_REQUEST){
+    BENCH_Commands++;
+    BENCH_Sectors += Count;
+  }
+
+  return returncode;
+}
+
+
+
+static double BENCH_Now(void)
+{
+  struct timespec now;
+
+  if(Bench.Disk == HOST_DISK_SIM){
+    return (double)SIMDISK_Time() / 1e6;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return (double)now.tv_sec + ((double)now.tv_nsec / 1e9);
+}
+
+
+
+static uint32_t BENCH_Micros(void)
+{
+  if(Bench.Disk == HOST_DISK_SIM){
+    return SIMDISK_Micros();
+  }
+
+  return (uint32_t)(uint64_t)(BENCH_Now() * 1e6);
+}
+
+
+
+static const char *BENCH_Backend(void)
+{
+  if(Bench.Disk == HOST_DISK_SIM){
+    return "sim";
+  }
+
+  return (Bench.Disk == HOST_DISK_RAM) ? "ram" : "image";
+}
+
+
+
+/* Moves the events of the library's ring buffer to the JSON file */
+static void BENCH_TraceDrain(void)
+{
+  static AfatfsTraceEvent_t events[BENCH_TRACE_CHUNK];
+  uint32_t count, lost;
+
+  do{
+    count = 0;
+    lost = 0;
+    if(AFATFS_GetTrace(events, BENCH_TRACE_CHUNK, &count, &lost) !=
+        ANSWERED_REQUEST)
+    {
+      break;
+    }
+    TRACEJSON_Add(events, count);
+    BENCH_TraceLost += lost;
+  }while(count == BENCH_TRACE_CHUNK);
+}
+
+
+
+static uint32_t BENCH_Rand(void)
+{
+  /* xorshift32, the same sequence for the same --seed */
+  BENCH_Random ^= BENCH_Random << 13;
+  BENCH_Random ^= BENCH_Random >> 17;
+  BENCH_Random ^= BENCH_Random << 5;
+
+  return BENCH_Random;
+}
+
+
+
+static void BENCH_Fail(const char *What, EStatus_t Status)
+{
+  fprintf(stderr, "afatfs_bench: %s failed (%d)\n", What, (int)Status);
+  exit(EXIT_FAILURE);
+}
+
+
+
+static void BENCH_Sample(uint32_t Polls)
+{
+  if(BENCH_SampleCount == BENCH_SampleSize){
+    BENCH_SampleSize = (BENCH_SampleSize == 0) ? 4096 : BENCH_SampleSize * 2;
+    BENCH_Samples = realloc(BENCH_Samples,
+        BENCH_SampleSize * sizeof(uint32_t));
+    if(BENCH_Samples == NULL){
+      BENCH_Fail("realloc", ERR_RESOURCE_DEPLETED);
+    }
+  }
+  BENCH_Samples[BENCH_SampleCount++] = Polls;
+}
+
+
+
+static int BENCH_Compare(const void *A, const void *B)
+{
+  uint32_t a = *(const uint32_t*)A;
+  uint32_t b = *(const uint32_t*)B;
+
+  return (a > b) - (a < b);
+}
+
+
+
+static BenchResult_t *BENCH_Begin(const char *Workload, uint32_t Param)
+{
+  BenchResult_t *result;
+
+  if(BENCH_ResultCount == BENCH_MAX_RESULTS){
+    BENCH_Fail("results", ERR_RESOURCE_DEPLETED);
+  }
+  result = &BENCH_Results[BENCH_ResultCount++];
+  memset(result, 0, sizeof(BenchResult_t));
+  snprintf(result->Workload, sizeof(result->Workload), "%s", Workload);
+  result->Param = Param;
+
+  BENCH_SampleCount = 0;
+  BENCH_Commands = 0;
+  BENCH_Sectors = 0;
+  result->Seconds = BENCH_Now();
+
+  return result;
+}
+
+
+
+static void BENCH_End(BenchResult_t *Result)
+{
+  Result->Seconds = BENCH_Now() - Result->Seconds;
+  Result->Commands = BENCH_Commands;
+  Result->Sectors = BENCH_Sectors;
+  Result->Ops = BENCH_SampleCount;
+
+  if(BENCH_SampleCount > 0){
+    qsort(BENCH_Samples, BENCH_SampleCount, sizeof(uint32_t), BENCH_Compare);
+    Result->P50 = BENCH_Samples[(BENCH_SampleCount - 1) / 2];
+    Result->P99 =
+        BENCH_Samples[((uint64_t)(BENCH_SampleCount - 1) * 99) / 100];
+    Result->Max = BENCH_Samples[BENCH_SampleCount - 1];
+  }
+}
+
+
+
+static void BENCH_Mount(void)
+{
+  EStatus_t returncode;
+  uint32_t polls = 0;
+
+  BENCH_POLL(returncode, polls, AFATFS_Mount(Bench.Disk));
+  if(returncode != ANSWERED_REQUEST){
+    BENCH_Fail("mount", returncode);
+  }
+}
+
+
+
+/**
+ * @brief Formats the disk and puts the counting functions in Disk_List.
+ */
+static void BENCH_Setup(void)
+{
+  EStatus_t returncode;
+  SimdiskConfig_t config;
+  uint32_t sectors = Bench.SizeMb * 2048;
+
+  if(Bench.Disk != HOST_DISK_IMAGE){
+    BENCH_Memory = malloc((size_t)sectors * 512);
+    if(BENCH_Memory == NULL){
+      BENCH_Fail("malloc", ERR_RESOURCE_DEPLETED);
+    }
+    returncode = FATIMAGE_Format(BENCH_Memory, sectors,
+        Bench.SectorsPerCluster);
+    if(returncode != ANSWERED_REQUEST){
+      BENCH_Fail("format", returncode);
+    }
+    if(Bench.Disk == HOST_DISK_SIM){
+      SIMDISK_DefaultConfig(&config);
+      config.Seed = Bench.Seed;
+      returncode = SIMDISK_Setup(BENCH_Memory, sectors, &config);
+    }else{
+      returncode = RAMDISK_Setup(BENCH_Memory, sectors);
+    }
+    if(returncode != ANSWERED_REQUEST){
+      BENCH_Fail("disk setup", returncode);
+    }
+  }else{
+    returncode = FATIMAGE_Create(Bench.Image, sectors,
+        Bench.SectorsPerCluster);
+    if(returncode != ANSWERED_REQUEST){
+      BENCH_Fail("format", returncode);
+    }
+    returncode = IMGDISK_Open(Bench.Image,
+        Bench.isDirect ? IMGDISK_FLAG_DIRECT : 0);
+    if(returncode != ANSWERED_REQUEST){
+      BENCH_Fail("IMGDISK_Open", returncode);
+    }
+  }
+
+  BENCH_DevRead = Disk_List[Bench.Disk].Read;
+  BENCH_DevWrite = Disk_List[Bench.Disk].Write;
+  Disk_List[Bench.Disk].Read = BENCH_Read;
+  Disk_List[Bench.Disk].Write = BENCH_Write;
+
+  if(Bench.IndexSlots > 0){
+    BENCH_Index = calloc(Bench.IndexSlots, sizeof(AfatfsDirIndex_t));
+    if(BENCH_Index == NULL){
+      BENCH_Fail("calloc", ERR_RESOURCE_DEPLETED);
+    }
+    returncode = AFATFS_SetDirIndex(Bench.Disk, BENCH_PARTITION, BENCH_Index,
+        Bench.IndexSlots);
+    if(returncode != ANSWERED_REQUEST){
+      BENCH_Fail("AFATFS_SetDirIndex", returncode);
+    }
+  }
+  BENCH_Mount();
+}
+
+
+
+static void BENCH_Release(void)
+{
+  Disk_List[Bench.Disk].Read = BENCH_DevRead;
+  Disk_List[Bench.Disk].Write = BENCH_DevWrite;
+
+  if(Bench.Disk == HOST_DISK_SIM){
+    SIMDISK_Release();
+    free(BENCH_Memory);
+  }else if(Bench.Disk == HOST_DISK_RAM){
+    RAMDISK_Release();
+    free(BENCH_Memory);
+  }else{
+    IMGDISK_Close();
+  }
+  free(BENCH_Index);
+  free(BENCH_Samples);
+}
+
+
+
+static void BENCH_RunMount(void)
+{
+  BenchResult_t *result;
+  EStatus_t returncode;
+  uint32_t i, polls;
+
+  result = BENCH_Begin("mount", 0);
+  for(i = 0; i < Bench.Mounts; i++){
+    polls = 0;
+    BENCH_POLL(returncode, polls, AFATFS_Mount(Bench.Disk));
+    if(returncode != ANSWERED_REQUEST){
+      BENCH_Fail("mount", returncode);
+    }
+    BENCH_Sample(polls);
+  }
+  BENCH_End(result);
+}
+
+
+
+/**
+ * @brief Appends Bench.FileMb of records to a new file. The time and
+ *        commands of the final close are included, so buffered and
+ *        unbuffered runs compare the same amount of work on the disk.
+ */
+static void BENCH_RunAppend(uint32_t RecordSize, uint8_t Mode)
+{
+  BenchResult_t *result;
+  EStatus_t returncode;
+  char name[BENCH_NAME_SIZE];
+  uint8_t *record;
+  uint8_t handle;
+  uint64_t total = (uint64_t)Bench.FileMb << 20;
+  uint64_t done;
+  uint32_t i, polls;
+
+  record = malloc(RecordSize);
+  if(record == NULL){
+    BENCH_Fail("malloc", ERR_RESOURCE_DEPLETED);
+  }
+  for(i = 0; i < RecordSize; i++){
+    record[i] = (uint8_t)BENCH_Rand();
+  }
+  snprintf(name, sizeof(name), "A%05u%c.BIN", (unsigned)(RecordSize % 100000),
+      (Mode & AFATFS_FILE_MODE_BUFFERED) ? 'B' : 'U');
+
+  result = BENCH_Begin((Mode & AFATFS_FILE_MODE_BUFFERED) ?
+      "append_buffered" : "append", RecordSize);
+  polls = 0;
+  BENCH_POLL(returncode, polls, AFATFS_Create(Bench.Disk, BENCH_PARTITION,
+      name, Mode, &handle));
+  if(returncode != ANSWERED_REQUEST){
+    BENCH_Fail("create", returncode);
+  }
+  for(done = 0; done + RecordSize <= total; done += RecordSize){
+    polls = 0;
+    BENCH_POLL(returncode, polls, AFATFS_Write(handle, record, RecordSize));
+    if(returncode != ANSWERED_REQUEST){
+      BENCH_Fail("write", returncode);
+    }
+    BENCH_Sample(polls);
+  }
+  polls = 0;
+  BENCH_POLL(returncode, polls, AFATFS_Close(Bench.Disk, BENCH_PARTITION,
+      &handle));
+  if(returncode != ANSWERED_REQUEST){
+    BENCH_Fail("close", returncode);
+  }
+  result->Bytes = done;
+  BENCH_End(result);
+
+  free(record);
+}
+
+
+
+/**
+ * @brief Reads the file written by the 64 KB append, from a cold cache,
+ *        either from start to end or at random aligned offsets.
+ */
+static void BENCH_RunRead(uint8_t isRandom)
+{
+  BenchResult_t *result;
+  EStatus_t returncode;
+  char name[BENCH_NAME_SIZE];
+  uint8_t *buffer;
+  uint8_t handle;
+  uint32_t blocks = (uint32_t)(((uint64_t)Bench.FileMb << 20) /
+      Bench.ReadSize);
+  uint32_t i, got, polls;
+
+  buffer = malloc(Bench.ReadSize);
+  if(buffer == NULL){
+    BENCH_Fail("malloc", ERR_RESOURCE_DEPLETED);
+  }
+  snprintf(name, sizeof(name), "A%05uU.BIN", 65536u % 100000);
+  BENCH_Mount();
+
+  result = BENCH_Begin(isRandom ? "read_random" : "read_seq", Bench.ReadSize);
+  polls = 0;
+  BENCH_POLL(returncode, polls, AFATFS_Open(Bench.Disk, BENCH_PARTITION,
+      name, 0, &handle));
+  if(returncode != ANSWERED_REQUEST){
+    BENCH_Fail("open", returncode);
+  }
+  for(i = 0; i < blocks; i++){
+    polls = 0;
+    if(isRandom){
+      BENCH_POLL(returncode, polls, AFATFS_Seek(handle,
+          (BENCH_Rand() % blocks) * Bench.ReadSize));
+      if(returncode != ANSWERED_REQUEST){
+        BENCH_Fail("seek", returncode);
+      }
+    }
+    got = 0;
+    BENCH_POLL(returncode, polls, AFATFS_Read(handle, buffer, Bench.ReadSize,
+        &got));
+    if(returncode != ANSWERED_REQUEST || got != Bench.ReadSize){
+      BENCH_Fail("read", returncode);
+    }
+    result->Bytes += got;
+    BENCH_Sample(polls);
+  }
+  polls = 0;
+  BENCH_POLL(returncode, polls, AFATFS_Close(Bench.Disk, BENCH_PARTITION,
+      &handle));
+  if(returncode != ANSWERED_REQUEST){
+    BENCH_Fail("close", returncode);
+  }
+  BENCH_End(result);
+
+  free(buffer);
+}
+
+
+
+/**
+ * @brief Creates Bench.Files empty files in the root directory, then opens
+ *        them again in a random order from a cold cache. Each operation
+ *        counts the polls of the create or open only, the close is left out.
+ */
+static void BENCH_RunStorm(uint8_t isOpen)
+{
+  BenchResult_t *result;
+  EStatus_t returncode;
+  char name[BENCH_NAME_SIZE];
+  uint8_t handle;
+  uint32_t i, number, polls;
+
+  if(isOpen){
+    BENCH_Mount();
+  }
+  result = BENCH_Begin(isOpen ? "open_storm" : "create_storm", Bench.Files);
+  for(i = 0; i < Bench.Files; i++){
+    number = isOpen ? (BENCH_Rand() % Bench.Files) : i;
+    snprintf(name, sizeof(name), "S%07u.DAT", (unsigned)number);
+    polls = 0;
+    if(isOpen){
+      BENCH_POLL(returncode, polls, AFATFS_Open(Bench.Disk, BENCH_PARTITION,
+          name, 0, &handle));
+    }else{
+      BENCH_POLL(returncode, polls, AFATFS_Create(Bench.Disk, BENCH_PARTITION,
+          name, 0, &handle));
+    }
+    if(returncode != ANSWERED_REQUEST){
+      BENCH_Fail(isOpen ? "open" : "create", returncode);
+    }
+    BENCH_Sample(polls);
+    polls = 0;
+    BENCH_POLL(returncode, polls, AFATFS_Close(Bench.Disk, BENCH_PARTITION,
+        &handle));
+    if(returncode != ANSWERED_REQUEST){
+      BENCH_Fail("close", returncode);
+    }
+  }
+  if(!isOpen){
+    polls = 0;
+    BENCH_POLL(returncode, polls, AFATFS_Sync(Bench.Disk));
+    if(returncode != ANSWERED_REQUEST){
+      BENCH_Fail("sync", returncode);
+    }
+  }
+  BENCH_End(result);
+}
+
+
+
+static void BENCH_Print(FILE *Out)
+{
+  BenchResult_t *result;
+  SimdiskStats_t sim;
+  double mbps, opsps, perByte, perOp;
+  uint32_t i;
+
+  if(Bench.Format == BENCH_FORMAT_JSON){
+    fprintf(Out, "{\n  \"backend\": \"%s\",\n  \"size_mb\": %u,\n"
+        "  \"sectors_per_cluster\": %u,\n  \"seed\": %u,\n  \"results\": [\n",
+        BENCH_Backend(), (unsigned)Bench.SizeMb,
+        (unsigned)Bench.SectorsPerCluster, (unsigned)Bench.Seed);
+  }else if(Bench.Format == BENCH_FORMAT_CSV){
+    fprintf(Out, "workload,param,ops,bytes,seconds,mb_per_s,ops_per_s,commands,"
+        "sectors,commands_per_byte,commands_per_op,polls_p50,polls_p99,"
+        "polls_max\n");
+  }else{
+    fprintf(Out, "afatfs_bench: %s backend, %u MB, %u sectors per cluster, "
+        "seed %u\n\n", BENCH_Backend(), (unsigned)Bench.SizeMb,
+        (unsigned)Bench.SectorsPerCluster, (unsigned)Bench.Seed);
+    fprintf(Out, "%-16s %7s %8s %10s %10s %9s %10s %10s %8s %6s %6s %6s\n",
+        "workload", "param", "ops", "MB/s", "ops/s", "seconds", "commands",
+        "cmd/byte",
+        "cmd/op", "p50", "p99", "max");
+  }
+
+  for(i = 0; i < BENCH_ResultCount; i++){
+    result = &BENCH_Results[i];
+    mbps = (result->Seconds > 0) ?
+        ((double)result->Bytes / 1048576.0) / result->Seconds : 0;
+    opsps = (result->Seconds > 0) ? (double)result->Ops / result->Seconds : 0;
+    perByte = (result->Bytes > 0) ?
+        (double)result->Commands / (double)result->Bytes : 0;
+    perOp = (result->Ops > 0) ?
+        (double)result->Commands / (double)result->Ops : 0;
+
+    if(Bench.Format == BENCH_FORMAT_JSON){
+      fprintf(Out, "    {\"workload\": \"%s\", \"param\": %u, \"ops\": %u, "
+          "\"bytes\": %llu, \"seconds\": %.6f, \"mb_per_s\": %.3f, "
+          "\"ops_per_s\": %.1f, "
+          "\"commands\": %llu, \"sectors\": %llu, "
+          "\"commands_per_byte\": %.6g, \"commands_per_op\": %.4f, "
+          "\"polls_p50\": %u, \"polls_p99\": %u, \"polls_max\": %u}%s\n",
+          result->Workload, (unsigned)result->Param, (unsigned)result->Ops,
+          (unsigned long long)result->Bytes, result->Seconds, mbps, opsps,
+          (unsigned long long)result->Commands,
+          (unsigned long long)result->Sectors, perByte, perOp,
+          (unsigned)result->P50, (unsigned)result->P99,
+          (unsigned)result->Max, (i + 1 < BENCH_ResultCount) ? "," : "");
+    }else if(Bench.Format == BENCH_FORMAT_CSV){
+      fprintf(Out, "%s,%u,%u,%llu,%.6f,%.3f,%.1f,%llu,%llu,%.6g,%.4f,"
+          "%u,%u,%u\n",
+          result->Workload, (unsigned)result->Param, (unsigned)result->Ops,
+          (unsigned long long)result->Bytes, result->Seconds, mbps, opsps,
+          (unsigned long long)result->Commands,
+          (unsigned long long)result->Sectors, perByte, perOp,
+          (unsigned)result->P50, (unsigned)result->P99,
+          (unsigned)result->Max);
+    }else{
+      fprintf(Out, "%-16s %7u %8u %10.2f %10.0f %9.4f %10llu %10.3g %8.3f "
+          "%6u %6u %6u\n", result->Workload, (unsigned)result->Param,
+          (unsigned)result->Ops, mbps, opsps, result->Seconds,
+          (unsigned long long)result->Commands, perByte, perOp,
+          (unsigned)result->P50, (unsigned)result->P99,
+          (unsigned)result->Max);
+    }
+  }
+
+  if(Bench.Format == BENCH_FORMAT_JSON){
+    fprintf(Out, "  ]\n}\n");
+  }else if(Bench.Format == BENCH_FORMAT_TEXT && Bench.Disk == HOST_DISK_SIM){
+    SIMDISK_GetStats(&sim, 0);
+    fprintf(Out, "\nsim: %u commands, %u stalls, longest command "
+        "%.1f ms\n", (unsigned)sim.Commands,
+        (unsigned)sim.Stalls, (double)sim.MaxCommand / 1e3);
+  }
+}
+
+
+
+static void BENCH_Usage(void)
+{
+  fprintf(stderr,
+      "usage: afatfs_bench [--backend ram|image|sim] [--image PATH] "
+      "[--direct]\n"
+      "                    [--size MB] [--spc N] [--file-mb MB] [--files N]\n"
+      "                    [--mounts N] [--read-size BYTES] [--index SLOTS]\n"
+      "                    [--seed N] [--format text|csv|json] "
+      "[--output PATH]\n"
+      "                    [--trace PATH]\n");
+  exit(EXIT_FAILURE);
+}
+
+
+
+static void BENCH_Arguments(int argc, char *argv[])
+{
+  const char *option, *value;
+  int i;
+
+  for(i = 1; i < argc; i++){
+    option = argv[i];
+    if(strcmp(option, "--direct") == 0){
+      Bench.isDirect = 1;
+      continue;
+    }
+    if(i + 1 >= argc){
+      BENCH_Usage();
+    }
+    value = argv[++i];
+
+    if(strcmp(option, "--backend") == 0){
+      if(strcmp(value, "ram") == 0){
+        Bench.Disk = HOST_DISK_RAM;
+      }else if(strcmp(value, "image") == 0){
+        Bench.Disk = HOST_DISK_IMAGE;
+      }else if(strcmp(value, "sim") == 0){
+        Bench.Disk = HOST_DISK_SIM;
+      }else{
+        BENCH_Usage();
+      }
+    }else if(strcmp(option, "--image") == 0){
+      Bench.Image = value;
+    }else if(strcmp(option, "--size") == 0){
+      Bench.SizeMb = strtoul(value, NULL, 0);
+    }else if(strcmp(option, "--spc") == 0){
+      Bench.SectorsPerCluster = (uint8_t)strtoul(value, NULL, 0);
+    }else if(strcmp(option, "--file-mb") == 0){
+      Bench.FileMb = strtoul(value, NULL, 0);
+    }else if(strcmp(option, "--files") == 0){
+      Bench.Files = strtoul(value, NULL, 0);
+    }else if(strcmp(option, "--mounts") == 0){
+      Bench.Mounts = strtoul(value, NULL, 0);
+    }else if(strcmp(option, "--read-size") == 0){
+      Bench.ReadSize = strtoul(value, NULL, 0);
+    }else if(strcmp(option, "--index") == 0){
+      Bench.IndexSlots = strtoul(value, NULL, 0);
+    }else if(strcmp(option, "--seed") == 0){
+      Bench.Seed = strtoul(value, NULL, 0);
+    }else if(strcmp(option, "--format") == 0){
+      if(strcmp(value, "text") == 0){
+        Bench.Format = BENCH_FORMAT_TEXT;
+      }else if(strcmp(value, "csv") == 0){
+        Bench.Format = BENCH_FORMAT_CSV;
+      }else if(strcmp(value, "json") == 0){
+        Bench.Format = BENCH_FORMAT_JSON;
+      }else{
+        BENCH_Usage();
+      }
+    }else if(strcmp(option, "--output") == 0){
+      Bench.Output = value;
+    }else if(strcmp(option, "--trace") == 0){
+      Bench.Trace = value;
+    }else{
+      BENCH_Usage();
+    }
+  }
+
+  if(Bench.SizeMb < 4 || Bench.SizeMb > 2097151 || Bench.FileMb == 0 ||
+      ((uint64_t)Bench.FileMb * 6) + 4 > Bench.SizeMb ||
+      Bench.ReadSize == 0 || Bench.Files == 0 || Bench.Files > 9999999)
+  {
+    fprintf(stderr, "afatfs_bench: the disk must hold the six append files "
+        "(--size above 6 * --file-mb)\n");
+    BENCH_Usage();
+  }
+}
+
+
+
+int main(int argc, char *argv[])
+{
+  static const uint32_t records[] = {7, 64, 512, 4096, 65536};
+  FILE *out = stdout;
+  uint32_t i;
+
+  BENCH_Arguments(argc, argv);
+  BENCH_Random = (Bench.Seed == 0) ? 1 : Bench.Seed;
+
+  if(Bench.Trace != NULL){
+    if(AFATFS_GetTrace(NULL, 0, NULL, NULL) == ERR_NOT_IMPLEMENTED){
+      fprintf(stderr, "afatfs_bench: --trace needs the library built with "
+          "AFATFS_TRACE_SIZE above 0\n");
+      return EXIT_FAILURE;
+    }
+    BENCH_TraceOut = fopen(Bench.Trace, "w");
+    if(BENCH_TraceOut == NULL){
+      BENCH_Fail("fopen", ERR_FAILED);
+    }
+    TRACEJSON_Begin(BENCH_TraceOut);
+    AFATFS_SetMicroClock(BENCH_Micros);
+  }
+
+  /*
+   * Steps:
+   * 1 - Format the disk and mount it, then time repeated mounts of the
+   *     empty disk.
+   * 2 - Append Bench.FileMb to one file per record size, unbuffered, and
+   *     once more with small records in a buffered file.
+   * 3 - Read the 64 KB record file back, in order and at random.
+   * 4 - Create then open Bench.Files files in the root directory.
+   */
+  BENCH_Setup();
+  BENCH_RunMount();
+
+  for(i = 0; i < sizeof(records) / sizeof(records[0]); i++){
+    BENCH_RunAppend(records[i], 0);
+  }
+  BENCH_RunAppend(records[0], AFATFS_FILE_MODE_BUFFERED);
+
+  BENCH_RunRead(0);
+  BENCH_RunRead(1);
+
+  BENCH_RunStorm(0);
+  BENCH_RunStorm(1);
+
+  BENCH_Release();
+
+  if(BENCH_TraceOut != NULL){
+    BENCH_TraceDrain();
+    TRACEJSON_End();
+    fclose(BENCH_TraceOut);
+    if(BENCH_TraceLost != 0){
+      fprintf(stderr, "afatfs_bench: %llu trace events lost, raise "
+          "AFATFS_TRACE_SIZE\n", (unsigned long long)BENCH_TraceLost);
+    }
+  }
+
+  if(Bench.Output != NULL){
+    out = fopen(Bench.Output, "w");
+    if(out == NULL){
+      BENCH_Fail("fopen", ERR_FAILED);
+    }
+  }
+  BENCH_Print(out);
+  if(out != stdout){
+    fclose(out);
+  }
+
+  return EXIT_SUCCESS;
+}
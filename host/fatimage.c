@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "fatimage.h"
+
+
+#define FATIMAGE_SECTOR_SIZE                                                 512
+#define FATIMAGE_PARTITION_START                                            2048
+#define FATIMAGE_RESERVED_SECTORS                                             32
+#define FATIMAGE_FAT_COPIES                                                    2
+#define FATIMAGE_MIN_SECTORS                                                8192
+#define FATIMAGE_ROOT_CLUSTER                                                  2
+
+
+
+static void FATIMAGE_Put16(uint8_t *Data, uint16_t Value)
+{
+  Data[0] = Value & 0xFF;
+  Data[1] = (Value >> 8) & 0xFF;
+}
+
+
+
+static void FATIMAGE_Put32(uint8_t *Data, uint32_t Value)
+{
+  Data[0] = Value & 0xFF;
+  Data[1] = (Value >> 8) & 0xFF;
+  Data[2] = (Value >> 16) & 0xFF;
+  Data[3] = (Value >> 24) & 0xFF;
+}
+
+
+
+EStatus_t FATIMAGE_Format(uint8_t *Memory, uint32_t Sectors,
+    uint8_t SectorsPerCluster)
+{
+  uint32_t length, fatSize, clusters, dataStart, i;
+  uint8_t *sector;
+
+  if(Memory == NULL){
+    return ERR_NULL_POINTER;
+  }
+  if(Sectors < FATIMAGE_MIN_SECTORS || SectorsPerCluster == 0 ||
+      (SectorsPerCluster & (SectorsPerCluster - 1)) != 0)
+  {
+    return ERR_PARAM_VALUE;
+  }
+
+  /*
+   * Steps:
+   * 1 - Size the FAT: start from one entry per sector of the partition and
+   *     shrink it until it just holds the clusters left after it.
+   * 2 - Write the MBR, the boot sector and its backup, and FSInfo.
+   * 3 - Clear the FATs and the root cluster, marking the reserved entries
+   *     and the root cluster as used.
+   */
+  length = Sectors - FATIMAGE_PARTITION_START;
+  fatSize = ((length / SectorsPerCluster) + 2 + 127) / 128;
+  while(1){
+    clusters = (length - FATIMAGE_RESERVED_SECTORS -
+        (FATIMAGE_FAT_COPIES * fatSize)) / SectorsPerCluster;
+    if(((clusters + 2 + 127) / 128) >= fatSize){
+      break;
+    }
+    fatSize--;
+  }
+  dataStart = FATIMAGE_PARTITION_START + FATIMAGE_RESERVED_SECTORS +
+      (FATIMAGE_FAT_COPIES * fatSize);
+
+  memset(Memory, 0, (size_t)(dataStart + SectorsPerCluster) *
+      FATIMAGE_SECTOR_SIZE);
+
+  /* MBR, one FAT32 (LBA) partition */
+  sector = Memory;
+  sector[446 + 4] = 0x0C;
+  FATIMAGE_Put32(&sector[446 + 8], FATIMAGE_PARTITION_START);
+  FATIMAGE_Put32(&sector[446 + 12], length);
+  sector[510] = 0x55;
+  sector[511] = 0xAA;
+
+  /* Boot sector and BIOS parameter block */
+  sector = Memory + (size_t)FATIMAGE_PARTITION_START * FATIMAGE_SECTOR_SIZE;
+  sector[0] = 0xEB;
+  sector[1] = 0x58;
+  sector[2] = 0x90;
+  memcpy(&sector[3], "MSWIN4.1", 8);
+  FATIMAGE_Put16(&sector[11], FATIMAGE_SECTOR_SIZE);
+  sector[13] = SectorsPerCluster;
+  FATIMAGE_Put16(&sector[14], FATIMAGE_RESERVED_SECTORS);
+  sector[16] = FATIMAGE_FAT_COPIES;
+  sector[21] = 0xF8;
+  FATIMAGE_Put16(&sector[24], 63);
+  FATIMAGE_Put16(&sector[26], 255);
+  FATIMAGE_Put32(&sector[28], FATIMAGE_PARTITION_START);
+  FATIMAGE_Put32(&sector[32], length);
+  FATIMAGE_Put32(&sector[36], fatSize);
+  FATIMAGE_Put32(&sector[44], FATIMAGE_ROOT_CLUSTER);
+  FATIMAGE_Put16(&sector[48], 1); /* FSInfo */
+  FATIMAGE_Put16(&sector[50], 6); /* Backup boot sector */
+  sector[66] = 0x29;
+  FATIMAGE_Put32(&sector[67], 0x12345678);
+  memcpy(&sector[71], "NO NAME    ", 11);
+  memcpy(&sector[82], "FAT32   ", 8);
+  sector[510] = 0x55;
+  sector[511] = 0xAA;
+  memcpy(sector + (6 * FATIMAGE_SECTOR_SIZE), sector, FATIMAGE_SECTOR_SIZE);
+
+  /* FSInfo, the root cluster is the only one in use */
+  sector = Memory +
+      (size_t)(FATIMAGE_PARTITION_START + 1) * FATIMAGE_SECTOR_SIZE;
+  FATIMAGE_Put32(&sector[0], 0x41615252);
+  FATIMAGE_Put32(&sector[484], 0x61417272);
+  FATIMAGE_Put32(&sector[488], clusters - 1);
+  FATIMAGE_Put32(&sector[492], FATIMAGE_ROOT_CLUSTER + 1);
+  FATIMAGE_Put32(&sector[508], 0xAA550000);
+
+  for(i = 0; i < FATIMAGE_FAT_COPIES; i++){
+    sector = Memory + (size_t)(FATIMAGE_PARTITION_START +
+        FATIMAGE_RESERVED_SECTORS + (i * fatSize)) * FATIMAGE_SECTOR_SIZE;
+    FATIMAGE_Put32(&sector[0], 0x0FFFFFF8);
+    FATIMAGE_Put32(&sector[4], 0x0FFFFFFF);
+    FATIMAGE_Put32(&sector[8], 0x0FFFFFFF);
+  }
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t FATIMAGE_Create(const char *Path, uint32_t Sectors,
+    uint8_t SectorsPerCluster)
+{
+  EStatus_t returncode;
+  uint8_t *memory;
+  FILE *file;
+
+  if(Path == NULL){
+    return ERR_NULL_POINTER;
+  }
+  memory = calloc(Sectors, FATIMAGE_SECTOR_SIZE);
+  if(memory == NULL){
+    return ERR_RESOURCE_DEPLETED;
+  }
+
+  returncode = FATIMAGE_Format(memory, Sectors, SectorsPerCluster);
+  if(returncode == ANSWERED_REQUEST){
+    file = fopen(Path, "wb");
+    if(file == NULL){
+      returncode = ERR_FAILED;
+    }else{
+      if(fwrite(memory, FATIMAGE_SECTOR_SIZE, Sectors, file) != Sectors){
+        returncode = ERR_FAILED;
+      }
+      if(fclose(file) != 0){
+        returncode = ERR_FAILED;
+      }
+    }
+  }
+  free(memory);
+
+  return returncode;
+}
@@ -0,0 +1,47 @@
+/**
+ * @file  fatimage.h
+ * @date  17-October-2026
+ * @brief FAT32 formatting of disk images, for host builds.
+ *
+ * Lays out an MBR with one FAT32 (LBA) partition, its boot sector, FSInfo,
+ * two FATs and an empty root directory, so benchmarks and tests start from a
+ * known image without mkfs.vfat.
+ *
+ * @author
+ * @author
+ */
+
+
+#ifndef FATIMAGE_H
+#define FATIMAGE_H
+
+
+#include <stdint.h>
+#include "stdstatus.h"
+
+
+/**
+ * @brief  This routine formats a disk image held in memory.
+ * @param  Memory : Image, Sectors * 512 bytes.
+ * @param  Sectors : Size of the image in sectors, at least 8192 (4 MB).
+ * @param  SectorsPerCluster : Power of two from 1 to 128.
+ * @retval EStatus_t
+ * @note   The partition starts on sector 2048. Only the system area and the
+ *         root directory cluster are written, the data area is left as is.
+ */
+EStatus_t FATIMAGE_Format(uint8_t *Memory, uint32_t Sectors,
+    uint8_t SectorsPerCluster);
+
+
+/**
+ * @brief  This routine writes a formatted image file.
+ * @param  Path : Path of the image file, replaced if it exists.
+ * @param  Sectors : Size of the image in sectors, at least 8192 (4 MB).
+ * @param  SectorsPerCluster : Power of two from 1 to 128.
+ * @retval EStatus_t
+ */
+EStatus_t FATIMAGE_Create(const char *Path, uint32_t Sectors,
+    uint8_t SectorsPerCluster);
+
+
+#endif /* FATIMAGE_H */
@@ -0,0 +1,191 @@
+/* pread, pwrite and O_DIRECT */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "imgdisk.h"
+
+
+#define IMGDISK_SECTOR_SIZE                                                  512
+#define IMGDISK_ALIGNMENT                                                   4096
+#define IMGDISK_BOUNCE_SECTORS                                                64
+
+
+static int IMGDISK_File = -1;
+static uint8_t IMGDISK_Flags;
+static uint32_t IMGDISK_Sectors; /* Whole sectors on the image */
+static uint8_t *IMGDISK_Bounce; /* Aligned copy for O_DIRECT */
+
+
+
+static EStatus_t IMGDISK_Transfer(uint8_t isWrite, uint8_t *Buffer,
+    uint64_t Offset, size_t Size)
+{
+  ssize_t done;
+
+  /* Short transfers and signals only move the transfer forward */
+  while(Size > 0){
+    if(isWrite){
+      done = pwrite(IMGDISK_File, Buffer, Size, (off_t)Offset);
+    }else{
+      done = pread(IMGDISK_File, Buffer, Size, (off_t)Offset);
+    }
+    if(done < 0 && errno == EINTR){
+      continue;
+    }
+    if(done <= 0){
+      return ERR_FAILED;
+    }
+    Buffer += done;
+    Offset += (uint64_t)done;
+    Size -= (size_t)done;
+  }
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+static EStatus_t IMGDISK_Access(uint8_t isWrite, uint8_t *Buffer,
+    uint32_t Sector, uint32_t Count)
+{
+  EStatus_t returncode = ANSWERED_REQUEST;
+  uint64_t offset = (uint64_t)Sector * IMGDISK_SECTOR_SIZE;
+  uint32_t part;
+
+  if(IMGDISK_File < 0){
+    return ERR_DISABLED;
+  }
+  if(Buffer == NULL){
+    return ERR_NULL_POINTER;
+  }
+  if(Count == 0 || Sector >= IMGDISK_Sectors ||
+      Count > IMGDISK_Sectors - Sector)
+  {
+    return ERR_PARAM_VALUE;
+  }
+  if(isWrite && (IMGDISK_Flags & IMGDISK_FLAG_READ_ONLY)){
+    return ERR_DISABLED;
+  }
+
+  if(!(IMGDISK_Flags & IMGDISK_FLAG_DIRECT) ||
+      ((uintptr_t)Buffer % IMGDISK_ALIGNMENT) == 0)
+  {
+    return IMGDISK_Transfer(isWrite, Buffer, offset,
+        (size_t)Count * IMGDISK_SECTOR_SIZE);
+  }
+
+  /* O_DIRECT with a buffer of the library, copied through aligned memory */
+  while(Count > 0 && returncode == ANSWERED_REQUEST){
+    part = (Count > IMGDISK_BOUNCE_SECTORS) ? IMGDISK_BOUNCE_SECTORS : Count;
+    if(isWrite){
+      memcpy(IMGDISK_Bounce, Buffer, (size_t)part * IMGDISK_SECTOR_SIZE);
+    }
+    returncode = IMGDISK_Transfer(isWrite, IMGDISK_Bounce, offset,
+        (size_t)part * IMGDISK_SECTOR_SIZE);
+    if(!isWrite && returncode == ANSWERED_REQUEST){
+      memcpy(Buffer, IMGDISK_Bounce, (size_t)part * IMGDISK_SECTOR_SIZE);
+    }
+    Buffer += (size_t)part * IMGDISK_SECTOR_SIZE;
+    offset += (uint64_t)part * IMGDISK_SECTOR_SIZE;
+    Count -= part;
+  }
+
+  return returncode;
+}
+
+
+
+EStatus_t IMGDISK_Open(const char *Path, uint8_t Flags)
+{
+  struct stat info;
+  int mode;
+
+  if(Path == NULL){
+    return ERR_NULL_POINTER;
+  }
+  IMGDISK_Close();
+
+  mode = (Flags & IMGDISK_FLAG_READ_ONLY) ? O_RDONLY : O_RDWR;
+  if(Flags & IMGDISK_FLAG_DIRECT){
+    mode |= O_DIRECT;
+    if(IMGDISK_Bounce == NULL && posix_memalign((void **)&IMGDISK_Bounce,
+        IMGDISK_ALIGNMENT, IMGDISK_BOUNCE_SECTORS * IMGDISK_SECTOR_SIZE) != 0)
+    {
+      IMGDISK_Bounce = NULL;
+      return ERR_RESOURCE_DEPLETED;
+    }
+  }
+
+  IMGDISK_File = open(Path, mode);
+  if(IMGDISK_File < 0){
+    return ERR_FAILED;
+  }
+  if(fstat(IMGDISK_File, &info) != 0 ||
+      info.st_size / IMGDISK_SECTOR_SIZE > UINT32_MAX)
+  {
+    IMGDISK_Close();
+    return ERR_PARAM_SIZE;
+  }
+  IMGDISK_Sectors = (uint32_t)(info.st_size / IMGDISK_SECTOR_SIZE);
+  IMGDISK_Flags = Flags;
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t IMGDISK_Close(void)
+{
+  EStatus_t returncode = ANSWERED_REQUEST;
+
+  if(IMGDISK_File >= 0){
+    if(!(IMGDISK_Flags & IMGDISK_FLAG_READ_ONLY) && fsync(IMGDISK_File) != 0){
+      returncode = ERR_FAILED;
+    }
+    close(IMGDISK_File);
+    IMGDISK_File = -1;
+  }
+  IMGDISK_Sectors = 0;
+  IMGDISK_Flags = 0;
+
+  return returncode;
+}
+
+
+
+EStatus_t IMGDISK_IntHwInit(void)
+{
+  return (IMGDISK_File >= 0) ? ANSWERED_REQUEST : ERR_DISABLED;
+}
+
+
+
+EStatus_t IMGDISK_ExtDevConfig(void)
+{
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t IMGDISK_Read(uint8_t *Buffer, uint32_t Sector, uint32_t Count)
+{
+  return IMGDISK_Access(0, Buffer, Sector, Count);
+}
+
+
+
+EStatus_t IMGDISK_Write(uint8_t *Buffer, uint32_t Sector, uint32_t Count)
+{
+  return IMGDISK_Access(1, Buffer, Sector, Count);
+}
+
+
+
+EStatus_t IMGDISK_ReadSpecs(void)
+{
+  return ANSWERED_REQUEST;
+}
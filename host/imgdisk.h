@@ -0,0 +1,63 @@
+/**
+ * @file  imgdisk.h
+ * @date  17-October-2026
+ * @brief Disk served from a FAT32 image file, for host builds.
+ *
+ * The image is read and written with pread and pwrite, so the library can
+ * run on a PC against an image taken from a card (dd) or made by mkfs.vfat.
+ *
+ * @author
+ * @author
+ */
+
+
+#ifndef IMGDISK_H
+#define IMGDISK_H
+
+
+#include <stdint.h>
+#include "stdstatus.h"
+
+
+/**
+ * @brief Flags of IMGDISK_Open.
+ */
+#define IMGDISK_FLAG_DIRECT                                                 0x01
+#define IMGDISK_FLAG_READ_ONLY                                              0x02
+
+
+/**
+ * @brief  This routine opens the image file served as the disk.
+ * @param  Path : Path of the image file, starting with the MBR sector.
+ * @param  Flags : A combination of IMGDISK_FLAG_* values.
+ * @retval EStatus_t
+ * @note   IMGDISK_FLAG_DIRECT opens the file with O_DIRECT, so the page cache
+ *         of the host is left out of benchmarks. Buffers not aligned to
+ *         4096 bytes go through an aligned copy. The file system holding the
+ *         image must accept 512 byte aligned accesses (tmpfs does not accept
+ *         O_DIRECT at all).
+ * @note   An image already opened is closed first.
+ */
+EStatus_t IMGDISK_Open(const char *Path, uint8_t Flags);
+
+
+/**
+ * @brief  This routine writes the pending data of the image to the host disk
+ *         and closes it.
+ * @retval EStatus_t
+ */
+EStatus_t IMGDISK_Close(void);
+
+
+/**
+ * @brief  Functions given to Disk_List (map_afatfs.h).
+ * @note   IMGDISK_IntHwInit fails with ERR_DISABLED if no image is open.
+ */
+EStatus_t IMGDISK_IntHwInit(void);
+EStatus_t IMGDISK_ExtDevConfig(void);
+EStatus_t IMGDISK_Read(uint8_t *Buffer, uint32_t Sector, uint32_t Count);
+EStatus_t IMGDISK_Write(uint8_t *Buffer, uint32_t Sector, uint32_t Count);
+EStatus_t IMGDISK_ReadSpecs(void);
+
+
+#endif /* IMGDISK_H */
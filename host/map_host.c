@@ -0,0 +1,21 @@
+#include "map_host.h"
+
+/* Designated initializers, members left out are set to zero: the queued
+ * interface (Submit, Poll, QueueDepth) of the first disks, and Read and Write
+ * of the queued disk */
+DiskIO_t Disk_List[] = {
+    {.IntHwInit = IMGDISK_IntHwInit, .ExtDevConfig = IMGDISK_ExtDevConfig,
+        .Read = IMGDISK_Read, .Write = IMGDISK_Write,
+        .ReadSpecs = IMGDISK_ReadSpecs},
+    {.IntHwInit = RAMDISK_IntHwInit, .ExtDevConfig = RAMDISK_ExtDevConfig,
+        .Read = RAMDISK_Read, .Write = RAMDISK_Write,
+        .ReadSpecs = RAMDISK_ReadSpecs},
+    {.IntHwInit = SIMDISK_IntHwInit, .ExtDevConfig = SIMDISK_ExtDevConfig,
+        .Read = SIMDISK_Read, .Write = SIMDISK_Write,
+        .ReadSpecs = SIMDISK_ReadSpecs},
+    {.IntHwInit = QUEUEDISK_IntHwInit, .ExtDevConfig = QUEUEDISK_ExtDevConfig,
+        .ReadSpecs = QUEUEDISK_ReadSpecs, .Submit = QUEUEDISK_Submit,
+        .Poll = QUEUEDISK_Poll, .QueueDepth = QUEUEDISK_DEPTH},
+};
+
+uint32_t Disk_ListSize = sizeof(Disk_List) / sizeof(DiskIO_t);
@@ -0,0 +1,34 @@
+/**
+ * @file  map_host.h
+ * @date  17-October-2026
+ * @brief Disks of host builds, listed on "map_host.c".
+ *
+ * @author
+ * @author
+ */
+
+
+#ifndef MAP_HOST_H
+#define MAP_HOST_H
+
+#include "map_afatfs.h"
+#include "imgdisk.h"
+#include "ramdisk.h"
+#include "simdisk.h"
+#include "queuedisk.h"
+
+/**
+ * @brief Disk numbers given to the library routines.
+ */
+typedef enum
+{
+  HOST_DISK_IMAGE = 0, /*!< Image file, see IMGDISK_Open */
+  HOST_DISK_RAM = 1, /*!< Memory, see RAMDISK_Setup and RAMDISK_Load */
+  HOST_DISK_SIM = 2, /*!< Memory with SD card timing, see SIMDISK_Setup */
+  HOST_DISK_QUEUE = 3, /*!< Memory behind a request queue, see
+                            QUEUEDISK_Setup */
+}HOST_Disks_t;
+
+
+
+#endif /* MAP_HOST_H */
@@ -0,0 +1,218 @@
+#include <string.h>
+#include "afatfs.h"
+#include "queuedisk.h"
+
+
+#define QUEUEDISK_SECTOR_SIZE                                                512
+
+
+/**
+ * @brief Request accepted by QUEUEDISK_Submit.
+ */
+typedef struct
+{
+  uint8_t *Buffer;
+
+  uint32_t Sector;
+
+  uint32_t Count;
+
+  uint32_t Tag;
+
+  uint32_t Sequence; /*!< Order of Submit, to count the reordered ones */
+
+  uint32_t Delay; /*!< Poll calls left */
+
+  uint8_t isWrite;
+
+  uint8_t isInUse;
+
+} queuediskRequest_t;
+
+
+static uint8_t *QUEUEDISK_Memory;
+static uint32_t QUEUEDISK_Sectors;
+static uint32_t QUEUEDISK_Random;
+static uint32_t QUEUEDISK_Sequence;
+static queuediskRequest_t QUEUEDISK_Request[QUEUEDISK_DEPTH];
+static QueuediskStats_t QUEUEDISK_Stats;
+
+
+
+static uint32_t QUEUEDISK_Rand(void)
+{
+  /* xorshift32, the same sequence for the same seed */
+  QUEUEDISK_Random ^= QUEUEDISK_Random << 13;
+  QUEUEDISK_Random ^= QUEUEDISK_Random >> 17;
+  QUEUEDISK_Random ^= QUEUEDISK_Random << 5;
+
+  return QUEUEDISK_Random;
+}
+
+
+
+static EStatus_t QUEUEDISK_Check(uint8_t *Buffer, uint32_t Sector,
+    uint32_t Count)
+{
+  if(QUEUEDISK_Memory == NULL){
+    return ERR_DISABLED;
+  }
+  if(Buffer == NULL){
+    return ERR_NULL_POINTER;
+  }
+  if(Count == 0 || Sector >= QUEUEDISK_Sectors ||
+      Count > QUEUEDISK_Sectors - Sector)
+  {
+    return ERR_PARAM_VALUE;
+  }
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t QUEUEDISK_Setup(uint8_t *Memory, uint32_t Sectors, uint32_t Seed)
+{
+  if(Memory == NULL){
+    return ERR_NULL_POINTER;
+  }
+  if(Sectors == 0){
+    return ERR_PARAM_SIZE;
+  }
+
+  QUEUEDISK_Release();
+  QUEUEDISK_Memory = Memory;
+  QUEUEDISK_Sectors = Sectors;
+  QUEUEDISK_Random = (Seed == 0) ? 1 : Seed;
+  memset(&QUEUEDISK_Stats, 0, sizeof(QUEUEDISK_Stats));
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+void QUEUEDISK_Release(void)
+{
+  QUEUEDISK_Memory = NULL;
+  QUEUEDISK_Sectors = 0;
+  QUEUEDISK_Sequence = 0;
+  memset(QUEUEDISK_Request, 0, sizeof(QUEUEDISK_Request));
+}
+
+
+
+void QUEUEDISK_GetStats(QueuediskStats_t *Stats, uint8_t isReset)
+{
+  if(Stats != NULL){
+    *Stats = QUEUEDISK_Stats;
+  }
+  if(isReset){
+    memset(&QUEUEDISK_Stats, 0, sizeof(QUEUEDISK_Stats));
+  }
+}
+
+
+
+EStatus_t QUEUEDISK_IntHwInit(void)
+{
+  return (QUEUEDISK_Memory != NULL) ? ANSWERED_REQUEST : ERR_DISABLED;
+}
+
+
+
+EStatus_t QUEUEDISK_ExtDevConfig(void)
+{
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t QUEUEDISK_ReadSpecs(void)
+{
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t QUEUEDISK_Submit(uint8_t *Buffer, uint32_t Sector, uint32_t Count,
+    uint8_t isWrite, uint32_t Tag)
+{
+  EStatus_t returncode = QUEUEDISK_Check(Buffer, Sector, Count);
+  uint32_t i, inUse;
+
+  if(returncode != ANSWERED_REQUEST){
+    return returncode;
+  }
+
+  for(i = 0, inUse = 0; i < QUEUEDISK_DEPTH; i++){
+    inUse += QUEUEDISK_Request[i].isInUse;
+  }
+  /* Full, or busy one time in eight */
+  if(inUse == QUEUEDISK_DEPTH || (QUEUEDISK_Rand() & 7) == 0){
+    QUEUEDISK_Stats.Busy++;
+    return OPERATION_RUNNING;
+  }
+
+  for(i = 0; QUEUEDISK_Request[i].isInUse; i++);
+  QUEUEDISK_Request[i].Buffer = Buffer;
+  QUEUEDISK_Request[i].Sector = Sector;
+  QUEUEDISK_Request[i].Count = Count;
+  QUEUEDISK_Request[i].Tag = Tag;
+  QUEUEDISK_Request[i].Sequence = ++QUEUEDISK_Sequence;
+  QUEUEDISK_Request[i].Delay = QUEUEDISK_Rand() % (QUEUEDISK_MAX_DELAY + 1);
+  QUEUEDISK_Request[i].isWrite = isWrite;
+  QUEUEDISK_Request[i].isInUse = 1;
+
+  QUEUEDISK_Stats.Requests++;
+  if(inUse + 1 > QUEUEDISK_Stats.MaxInFlight){
+    QUEUEDISK_Stats.MaxInFlight = inUse + 1;
+  }
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+void QUEUEDISK_Poll(void)
+{
+  queuediskRequest_t *request;
+  uint32_t i, j;
+  size_t offset, size;
+
+  /*
+   * Notes:
+   * 1 - The sectors are copied when the request ends, not when it is
+   *     submitted, as a DMA transfer would. A buffer changed or reused while
+   *     its request is in flight gives wrong data, like on a target.
+   * 2 - AFATFS_CompleteRequest is called last, with the request slot already
+   *     free, since the library may submit again from there on.
+   */
+  for(i = 0; i < QUEUEDISK_DEPTH; i++)
+  {
+    request = &QUEUEDISK_Request[i];
+    if(!request->isInUse){ continue;}
+    if(request->Delay != 0){
+      request->Delay--;
+      continue;
+    }
+
+    for(j = 0; j < QUEUEDISK_DEPTH; j++){
+      if(QUEUEDISK_Request[j].isInUse &&
+          QUEUEDISK_Request[j].Sequence < request->Sequence)
+      {
+        QUEUEDISK_Stats.Reordered++;
+        break;
+      }
+    }
+
+    offset = (size_t)request->Sector * QUEUEDISK_SECTOR_SIZE;
+    size = (size_t)request->Count * QUEUEDISK_SECTOR_SIZE;
+    if(request->isWrite){
+      memcpy(QUEUEDISK_Memory + offset, request->Buffer, size);
+    }else{
+      memcpy(request->Buffer, QUEUEDISK_Memory + offset, size);
+    }
+    request->isInUse = 0;
+    AFATFS_CompleteRequest(request->Tag, ANSWERED_REQUEST);
+  }
+}
@@ -0,0 +1,90 @@
+/**
+ * @file  queuedisk.h
+ * @date  17-October-2026
+ * @brief Disk held in memory behind a request queue, for host builds.
+ *
+ * Serves the queued interface of DiskIO_t (Submit, Poll, QueueDepth) the way
+ * a controller with DMA would: each request waits a number of Poll calls
+ * drawn from Seed, so requests in flight end in any order, and the sectors
+ * are copied only when the request ends. Now and then Submit answers that
+ * the queue is full. A run does the same thing every time for the same seed.
+ *
+ * @author
+ * @author
+ */
+
+
+#ifndef QUEUEDISK_H
+#define QUEUEDISK_H
+
+
+#include <stdint.h>
+#include "stdstatus.h"
+
+
+/**
+ * @brief Number of requests accepted at once, given as DiskIO_t.QueueDepth.
+ */
+#define QUEUEDISK_DEPTH                                                        4
+
+/**
+ * @brief Longest wait of a request, in Poll calls.
+ */
+#define QUEUEDISK_MAX_DELAY                                                    6
+
+
+/**
+ * @brief Counters of the queued disk.
+ */
+typedef struct
+{
+  uint32_t Requests; /*!< Requests accepted by Submit */
+
+  uint32_t Busy; /*!< Submit calls answered with a full queue */
+
+  uint32_t Reordered; /*!< Requests that ended before an older one */
+
+  uint32_t MaxInFlight; /*!< Most requests queued at the same time */
+
+}QueuediskStats_t;
+
+
+/**
+ * @brief  This routine serves the disk from memory given by the caller.
+ * @param  Memory : Disk content, starting with the MBR sector.
+ * @param  Sectors : Number of 512 byte sectors in Memory.
+ * @param  Seed : Seed of the waits, 0 is taken as 1.
+ * @retval EStatus_t
+ */
+EStatus_t QUEUEDISK_Setup(uint8_t *Memory, uint32_t Sectors, uint32_t Seed);
+
+
+/**
+ * @brief  This routine stops serving the disk, dropping the requests queued.
+ */
+void QUEUEDISK_Release(void);
+
+
+/**
+ * @brief  This routine gives the counters of the queued disk.
+ * @param  Stats : Copy of the counters.
+ * @param  isReset : Set to 1 to zero the counters after the copy.
+ */
+void QUEUEDISK_GetStats(QueuediskStats_t *Stats, uint8_t isReset);
+
+
+/**
+ * @brief  Functions given to Disk_List (map_afatfs.h).
+ * @note   QUEUEDISK_IntHwInit fails with ERR_DISABLED if there is no memory.
+ *         QUEUEDISK_Submit checks the request and queues it, the result goes
+ *         to AFATFS_CompleteRequest from QUEUEDISK_Poll.
+ */
+EStatus_t QUEUEDISK_IntHwInit(void);
+EStatus_t QUEUEDISK_ExtDevConfig(void);
+EStatus_t QUEUEDISK_ReadSpecs(void);
+EStatus_t QUEUEDISK_Submit(uint8_t *Buffer, uint32_t Sector, uint32_t Count,
+    uint8_t isWrite, uint32_t Tag);
+void QUEUEDISK_Poll(void);
+
+
+#endif /* QUEUEDISK_H */
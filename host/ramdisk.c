@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "ramdisk.h"
+
+
+#define RAMDISK_SECTOR_SIZE                                                  512
+
+
+static uint8_t *RAMDISK_Memory;
+static uint32_t RAMDISK_Sectors;
+static uint8_t RAMDISK_isOwned; /* Memory taken by RAMDISK_Load */
+
+
+
+static EStatus_t RAMDISK_Check(uint8_t *Buffer, uint32_t Sector,
+    uint32_t Count)
+{
+  if(RAMDISK_Memory == NULL){
+    return ERR_DISABLED;
+  }
+  if(Buffer == NULL){
+    return ERR_NULL_POINTER;
+  }
+  if(Count == 0 || Sector >= RAMDISK_Sectors ||
+      Count > RAMDISK_Sectors - Sector)
+  {
+    return ERR_PARAM_VALUE;
+  }
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t RAMDISK_Setup(uint8_t *Memory, uint32_t Sectors)
+{
+  if(Memory == NULL){
+    return ERR_NULL_POINTER;
+  }
+  RAMDISK_Release();
+  RAMDISK_Memory = Memory;
+  RAMDISK_Sectors = Sectors;
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t RAMDISK_Load(const char *Path)
+{
+  EStatus_t returncode = ANSWERED_REQUEST;
+  FILE *file;
+  long size;
+  uint8_t *memory;
+
+  if(Path == NULL){
+    return ERR_NULL_POINTER;
+  }
+  file = fopen(Path, "rb");
+  if(file == NULL){
+    return ERR_FAILED;
+  }
+
+  if(fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <
+      RAMDISK_SECTOR_SIZE || fseek(file, 0, SEEK_SET) != 0)
+  {
+    returncode = ERR_PARAM_SIZE;
+  }else{
+    size -= size % RAMDISK_SECTOR_SIZE;
+    memory = malloc((size_t)size);
+    if(memory == NULL){
+      returncode = ERR_RESOURCE_DEPLETED;
+    }else if(fread(memory, 1, (size_t)size, file) != (size_t)size){
+      free(memory);
+      returncode = ERR_FAILED;
+    }else{
+      RAMDISK_Setup(memory, (uint32_t)(size / RAMDISK_SECTOR_SIZE));
+      RAMDISK_isOwned = 1;
+    }
+  }
+  fclose(file);
+
+  return returncode;
+}
+
+
+
+EStatus_t RAMDISK_Save(const char *Path)
+{
+  EStatus_t returncode = ANSWERED_REQUEST;
+  size_t size = (size_t)RAMDISK_Sectors * RAMDISK_SECTOR_SIZE;
+  FILE *file;
+
+  if(Path == NULL){
+    return ERR_NULL_POINTER;
+  }
+  if(RAMDISK_Memory == NULL){
+    return ERR_DISABLED;
+  }
+  file = fopen(Path, "wb");
+  if(file == NULL){
+    return ERR_FAILED;
+  }
+  if(fwrite(RAMDISK_Memory, 1, size, file) != size){
+    returncode = ERR_FAILED;
+  }
+  if(fclose(file) != 0){
+    returncode = ERR_FAILED;
+  }
+
+  return returncode;
+}
+
+
+
+void RAMDISK_Release(void)
+{
+  if(RAMDISK_isOwned){
+    free(RAMDISK_Memory);
+  }
+  RAMDISK_Memory = NULL;
+  RAMDISK_Sectors = 0;
+  RAMDISK_isOwned = 0;
+}
+
+
+
+EStatus_t RAMDISK_IntHwInit(void)
+{
+  return (RAMDISK_Memory != NULL) ? ANSWERED_REQUEST : ERR_DISABLED;
+}
+
+
+
+EStatus_t RAMDISK_ExtDevConfig(void)
+{
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t RAMDISK_Read(uint8_t *Buffer, uint32_t Sector, uint32_t Count)
+{
+  EStatus_t returncode = RAMDISK_Check(Buffer, Sector, Count);
+
+  if(returncode == ANSWERED_REQUEST){
+    memcpy(Buffer, RAMDISK_Memory + (size_t)Sector * RAMDISK_SECTOR_SIZE,
+        (size_t)Count * RAMDISK_SECTOR_SIZE);
+  }
+
+  return returncode;
+}
+
+
+
+EStatus_t RAMDISK_Write(uint8_t *Buffer, uint32_t Sector, uint32_t Count)
+{
+  EStatus_t returncode = RAMDISK_Check(Buffer, Sector, Count);
+
+  if(returncode == ANSWERED_REQUEST){
+    memcpy(RAMDISK_Memory + (size_t)Sector * RAMDISK_SECTOR_SIZE, Buffer,
+        (size_t)Count * RAMDISK_SECTOR_SIZE);
+  }
+
+  return returncode;
+}
+
+
+
+EStatus_t RAMDISK_ReadSpecs(void)
+{
+  return ANSWERED_REQUEST;
+}
@@ -0,0 +1,67 @@
+/**
+ * @file  ramdisk.h
+ * @date  17-October-2026
+ * @brief Disk held in memory, for host builds.
+ *
+ * Serves sectors from a memory block, so the library is measured without any
+ * device or host file system in the way.
+ *
+ * @author
+ * @author
+ */
+
+
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+
+#include <stdint.h>
+#include "stdstatus.h"
+
+
+/**
+ * @brief  This routine serves the disk from memory given by the caller.
+ * @param  Memory : Disk content, starting with the MBR sector.
+ * @param  Sectors : Number of 512 byte sectors in Memory.
+ * @retval EStatus_t
+ */
+EStatus_t RAMDISK_Setup(uint8_t *Memory, uint32_t Sectors);
+
+
+/**
+ * @brief  This routine copies an image file to memory and serves it.
+ * @param  Path : Path of the image file.
+ * @retval EStatus_t
+ * @note   The memory is allocated here and freed by RAMDISK_Release. The
+ *         image file is not changed, see RAMDISK_Save.
+ */
+EStatus_t RAMDISK_Load(const char *Path);
+
+
+/**
+ * @brief  This routine writes the disk content to a file.
+ * @param  Path : Path of the image file.
+ * @retval EStatus_t
+ */
+EStatus_t RAMDISK_Save(const char *Path);
+
+
+/**
+ * @brief  This routine stops serving the disk, freeing the memory taken by
+ *         RAMDISK_Load.
+ */
+void RAMDISK_Release(void);
+
+
+/**
+ * @brief  Functions given to Disk_List (map_afatfs.h).
+ * @note   RAMDISK_IntHwInit fails with ERR_DISABLED if there is no memory.
+ */
+EStatus_t RAMDISK_IntHwInit(void);
+EStatus_t RAMDISK_ExtDevConfig(void);
+EStatus_t RAMDISK_Read(uint8_t *Buffer, uint32_t Sector, uint32_t Count);
+EStatus_t RAMDISK_Write(uint8_t *Buffer, uint32_t Sector, uint32_t Count);
+EStatus_t RAMDISK_ReadSpecs(void);
+
+
+#endif /* RAMDISK_H */
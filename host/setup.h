@@ -0,0 +1,27 @@
+/**
+ * @file  setup.h
+ * @date  17-October-2026
+ * @brief Configuration file for host builds.
+ *
+ * Used instead of "setup/setup.h" when the library is built on a PC, with
+ * the disk image (disk 0), the RAM disk (disk 1) and the simulated SD card
+ * (disk 2) of "map_host.c".
+ *
+ * @author
+ * @author
+ */
+
+
+#ifndef SETUP_H
+#define SETUP_H
+
+
+#define AFATS_MAX_DISKS                                                        4
+#define AFATS_MAX_PARTITIONS                                                   1
+#define AFATFS_MIN_SECTOR_SIZE                                               512
+#define AFATFS_MAX_SECTOR_SIZE                                               512
+#define AFATS_MAX_FILES                                                        4
+#define AFATFS_FILEBUFFER_SIZE                                                 8
+
+
+#endif  /* SETUP_H */
@@ -0,0 +1,349 @@
+#include <string.h>
+#include "simdisk.h"
+
+
+#define SIMDISK_SECTOR_SIZE                                                  512
+
+
+/**
+ * @brief Sectors set to fail by SIMDISK_AddFault.
+ */
+typedef struct
+{
+  uint32_t Sector;
+
+  uint32_t Count; /*!< 0 if the slot is free */
+
+  uint32_t Times; /*!< Failures left, 0 for no limit */
+
+  EStatus_t Result;
+
+  uint8_t Flags;
+
+} simdiskFault_t;
+
+
+static uint8_t *SIMDISK_Memory;
+static uint32_t SIMDISK_Sectors;
+static SimdiskConfig_t SIMDISK_Config;
+static uint32_t SIMDISK_Random;
+static uint64_t SIMDISK_Clock; /* Virtual time, microseconds */
+static simdiskFault_t SIMDISK_Fault[SIMDISK_MAX_FAULTS];
+static SimdiskStats_t SIMDISK_Stats;
+
+/* Command in progress, identified by the arguments it is polled with */
+static struct
+{
+  uint8_t *Buffer;
+  uint32_t Sector;
+  uint32_t Count;
+  uint8_t isWrite;
+  uint8_t isBusy;
+  uint64_t Start;
+  uint64_t End;
+  EStatus_t Result;
+}SIMDISK_Command;
+
+
+
+static uint32_t SIMDISK_Rand(void)
+{
+  /* xorshift32, the same sequence for the same seed */
+  SIMDISK_Random ^= SIMDISK_Random << 13;
+  SIMDISK_Random ^= SIMDISK_Random >> 17;
+  SIMDISK_Random ^= SIMDISK_Random << 5;
+
+  return SIMDISK_Random;
+}
+
+
+
+static EStatus_t SIMDISK_Check(uint8_t *Buffer, uint32_t Sector,
+    uint32_t Count)
+{
+  if(SIMDISK_Memory == NULL){
+    return ERR_DISABLED;
+  }
+  if(Buffer == NULL){
+    return ERR_NULL_POINTER;
+  }
+  if(Count == 0 || Sector >= SIMDISK_Sectors ||
+      Count > SIMDISK_Sectors - Sector)
+  {
+    return ERR_PARAM_VALUE;
+  }
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+/* Result of a new command, ANSWERED_REQUEST unless a fault covers it */
+static EStatus_t SIMDISK_FaultResult(uint32_t Sector, uint32_t Count,
+    uint8_t isWrite)
+{
+  simdiskFault_t *fault;
+  EStatus_t result;
+  uint32_t i;
+
+  for(i = 0; i < SIMDISK_MAX_FAULTS; i++){
+    fault = &SIMDISK_Fault[i];
+    if(fault->Count != 0 &&
+        (fault->Flags & (isWrite ? SIMDISK_FAULT_WRITE : SIMDISK_FAULT_READ)) &&
+        Sector < fault->Sector + fault->Count &&
+        fault->Sector < Sector + Count)
+    {
+      result = fault->Result;
+      if(fault->Times != 0 && --fault->Times == 0){
+        fault->Count = 0;
+      }
+      SIMDISK_Stats.Faults++;
+      return result;
+    }
+  }
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+static EStatus_t SIMDISK_Run(uint8_t *Buffer, uint32_t Sector, uint32_t Count,
+    uint8_t isWrite)
+{
+  EStatus_t returncode;
+  uint64_t duration;
+  uint32_t random;
+
+  returncode = SIMDISK_Check(Buffer, Sector, Count);
+  if(returncode != ANSWERED_REQUEST){
+    return returncode;
+  }
+
+  /*
+   * Steps:
+   * 1 - A call with other arguments than the command in progress starts a
+   *     new one. Its time is the overhead plus the cost of each sector, and
+   *     a write may stall (StallRate out of 65536). Faults are looked up
+   *     now, so a command fails once.
+   * 2 - Each call moves the virtual clock by PollMicros, the command ends
+   *     on the first call at or after its end time.
+   * 3 - Data is copied when the command ends, failed writes change nothing.
+   */
+  if(!SIMDISK_Command.isBusy || SIMDISK_Command.Buffer != Buffer ||
+      SIMDISK_Command.Sector != Sector || SIMDISK_Command.Count != Count ||
+      SIMDISK_Command.isWrite != isWrite)
+  {
+    if(isWrite){
+      duration = SIMDISK_Config.WriteOverhead +
+          ((uint64_t)SIMDISK_Config.WritePerSector * Count);
+      /* Drawn for every write, so the stalls do not depend on the reads */
+      random = SIMDISK_Rand();
+      if((random & 0xFFFF) < SIMDISK_Config.StallRate){
+        duration += SIMDISK_Config.StallMin;
+        if(SIMDISK_Config.StallMax > SIMDISK_Config.StallMin){
+          duration += (random >> 16) % (SIMDISK_Config.StallMax -
+              SIMDISK_Config.StallMin + 1);
+        }
+        SIMDISK_Stats.Stalls++;
+      }
+    }else{
+      duration = SIMDISK_Config.ReadOverhead +
+          ((uint64_t)SIMDISK_Config.ReadPerSector * Count);
+    }
+    SIMDISK_Command.Buffer = Buffer;
+    SIMDISK_Command.Sector = Sector;
+    SIMDISK_Command.Count = Count;
+    SIMDISK_Command.isWrite = isWrite;
+    SIMDISK_Command.isBusy = 1;
+    SIMDISK_Command.Start = SIMDISK_Clock;
+    SIMDISK_Command.End = SIMDISK_Clock + duration;
+    SIMDISK_Command.Result = SIMDISK_FaultResult(Sector, Count, isWrite);
+    SIMDISK_Stats.Commands++;
+  }
+
+  SIMDISK_Clock += SIMDISK_Config.PollMicros;
+  if(SIMDISK_Clock < SIMDISK_Command.End){
+    SIMDISK_Stats.Polls++;
+    return OPERATION_RUNNING;
+  }
+
+  SIMDISK_Command.isBusy = 0;
+  if(SIMDISK_Clock - SIMDISK_Command.Start > SIMDISK_Stats.MaxCommand){
+    SIMDISK_Stats.MaxCommand =
+        (uint32_t)(SIMDISK_Clock - SIMDISK_Command.Start);
+  }
+  if(SIMDISK_Command.Result == ANSWERED_REQUEST){
+    if(isWrite){
+      memcpy(SIMDISK_Memory + (size_t)Sector * SIMDISK_SECTOR_SIZE, Buffer,
+          (size_t)Count * SIMDISK_SECTOR_SIZE);
+    }else{
+      memcpy(Buffer, SIMDISK_Memory + (size_t)Sector * SIMDISK_SECTOR_SIZE,
+          (size_t)Count * SIMDISK_SECTOR_SIZE);
+    }
+  }
+
+  return SIMDISK_Command.Result;
+}
+
+
+
+void SIMDISK_DefaultConfig(SimdiskConfig_t *Config)
+{
+  if(Config == NULL){
+    return;
+  }
+
+  /* A 25 MHz SPI bus moves a sector in about 170 us. One write in a
+   * thousand waits 100 to 400 ms for the card to erase a block */
+  Config->Seed = 1;
+  Config->PollMicros = 50;
+  Config->ReadOverhead = 300;
+  Config->WriteOverhead = 600;
+  Config->ReadPerSector = 180;
+  Config->WritePerSector = 250;
+  Config->StallRate = 66;
+  Config->StallMin = 100000;
+  Config->StallMax = 400000;
+}
+
+
+
+EStatus_t SIMDISK_Setup(uint8_t *Memory, uint32_t Sectors,
+    const SimdiskConfig_t *Config)
+{
+  if(Memory == NULL){
+    return ERR_NULL_POINTER;
+  }
+  if(Sectors == 0){
+    return ERR_PARAM_SIZE;
+  }
+  if(Config != NULL && Config->StallRate > 65536){
+    return ERR_PARAM_VALUE;
+  }
+
+  if(Config != NULL){
+    SIMDISK_Config = *Config;
+  }else{
+    SIMDISK_DefaultConfig(&SIMDISK_Config);
+  }
+  SIMDISK_Memory = Memory;
+  SIMDISK_Sectors = Sectors;
+  SIMDISK_Random = (SIMDISK_Config.Seed == 0) ? 1 : SIMDISK_Config.Seed;
+  SIMDISK_Clock = 0;
+  memset(&SIMDISK_Command, 0, sizeof(SIMDISK_Command));
+  memset(&SIMDISK_Stats, 0, sizeof(SIMDISK_Stats));
+  SIMDISK_ClearFaults();
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+void SIMDISK_Release(void)
+{
+  SIMDISK_Memory = NULL;
+  SIMDISK_Sectors = 0;
+  SIMDISK_Command.isBusy = 0;
+}
+
+
+
+EStatus_t SIMDISK_AddFault(uint32_t Sector, uint32_t Count, uint8_t Flags,
+    EStatus_t Result, uint32_t Times)
+{
+  uint32_t i;
+
+  if(Count == 0 || Result < RETURN_ERROR_VALUE ||
+      (Flags & (SIMDISK_FAULT_READ | SIMDISK_FAULT_WRITE)) == 0)
+  {
+    return ERR_PARAM_VALUE;
+  }
+
+  for(i = 0; i < SIMDISK_MAX_FAULTS; i++){
+    if(SIMDISK_Fault[i].Count == 0){
+      SIMDISK_Fault[i].Sector = Sector;
+      SIMDISK_Fault[i].Count = Count;
+      SIMDISK_Fault[i].Flags = Flags;
+      SIMDISK_Fault[i].Result = Result;
+      SIMDISK_Fault[i].Times = Times;
+      return ANSWERED_REQUEST;
+    }
+  }
+
+  return ERR_RESOURCE_DEPLETED;
+}
+
+
+
+void SIMDISK_ClearFaults(void)
+{
+  memset(SIMDISK_Fault, 0, sizeof(SIMDISK_Fault));
+}
+
+
+
+uint32_t SIMDISK_Micros(void)
+{
+  return (uint32_t)SIMDISK_Clock;
+}
+
+
+
+void SIMDISK_Advance(uint32_t Micros)
+{
+  SIMDISK_Clock += Micros;
+}
+
+
+
+uint64_t SIMDISK_Time(void)
+{
+  return SIMDISK_Clock;
+}
+
+
+
+void SIMDISK_GetStats(SimdiskStats_t *Stats, uint8_t isReset)
+{
+  if(Stats != NULL){
+    *Stats = SIMDISK_Stats;
+  }
+  if(isReset){
+    memset(&SIMDISK_Stats, 0, sizeof(SIMDISK_Stats));
+  }
+}
+
+
+
+EStatus_t SIMDISK_IntHwInit(void)
+{
+  return (SIMDISK_Memory != NULL) ? ANSWERED_REQUEST : ERR_DISABLED;
+}
+
+
+
+EStatus_t SIMDISK_ExtDevConfig(void)
+{
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t SIMDISK_Read(uint8_t *Buffer, uint32_t Sector, uint32_t Count)
+{
+  return SIMDISK_Run(Buffer, Sector, Count, 0);
+}
+
+
+
+EStatus_t SIMDISK_Write(uint8_t *Buffer, uint32_t Sector, uint32_t Count)
+{
+  return SIMDISK_Run(Buffer, Sector, Count, 1);
+}
+
+
+
+EStatus_t SIMDISK_ReadSpecs(void)
+{
+  return ANSWERED_REQUEST;
+}
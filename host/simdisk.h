@@ -0,0 +1,173 @@
+/**
+ * @file  simdisk.h
+ * @date  17-October-2026
+ * @brief Simulated card held in memory, with the timing and faults of a real
+ *        one, for host builds.
+ *
+ * Commands take virtual time: an overhead per command, a cost per sector and,
+ * now and then, a busy stall of a few hundred milliseconds on writes, as
+ * cards do while erasing. The driver returns OPERATION_RUNNING until the
+ * command's time has passed, the virtual clock moving by PollMicros on each
+ * call. Chosen sectors can fail. Everything comes from Seed, so a run gives
+ * the same poll counts and latencies every time, on any machine.
+ *
+ * @author
+ * @author
+ */
+
+
+#ifndef SIMDISK_H
+#define SIMDISK_H
+
+
+#include <stdint.h>
+#include "stdstatus.h"
+
+
+/**
+ * @brief Max number of faults set at the same time.
+ */
+#define SIMDISK_MAX_FAULTS                                                    16
+
+/**
+ * @brief Commands a fault applies to, see SIMDISK_AddFault.
+ */
+#define SIMDISK_FAULT_READ                                                  0x01
+#define SIMDISK_FAULT_WRITE                                                 0x02
+
+
+/**
+ * @brief Latency model, times in microseconds.
+ */
+typedef struct
+{
+  uint32_t Seed; /*!< Seed of the stalls, 0 is taken as 1 */
+
+  uint32_t PollMicros; /*!< Virtual time that passes on each driver call */
+
+  uint32_t ReadOverhead; /*!< Time of each read command */
+
+  uint32_t WriteOverhead; /*!< Time of each write command */
+
+  uint32_t ReadPerSector; /*!< Time of each sector read */
+
+  uint32_t WritePerSector; /*!< Time of each sector written */
+
+  uint32_t StallRate; /*!< Write commands out of 65536 that stall */
+
+  uint32_t StallMin; /*!< Shortest stall */
+
+  uint32_t StallMax; /*!< Longest stall */
+
+}SimdiskConfig_t;
+
+
+/**
+ * @brief Counters of the simulated card.
+ */
+typedef struct
+{
+  uint32_t Commands; /*!< Commands started */
+
+  uint32_t Polls; /*!< Calls that returned OPERATION_RUNNING */
+
+  uint32_t Stalls; /*!< Write commands that stalled */
+
+  uint32_t Faults; /*!< Commands failed by SIMDISK_AddFault */
+
+  uint32_t MaxCommand; /*!< Longest command, in microseconds */
+
+}SimdiskStats_t;
+
+
+/**
+ * @brief  This routine fills a latency model close to a class 10 SD card on
+ *         a 25 MHz SPI bus.
+ * @param  Config : Model to fill.
+ */
+void SIMDISK_DefaultConfig(SimdiskConfig_t *Config);
+
+
+/**
+ * @brief  This routine serves the disk from memory given by the caller.
+ * @param  Memory : Disk content, starting with the MBR sector.
+ * @param  Sectors : Number of 512 byte sectors in Memory.
+ * @param  Config : Latency model, copied. NULL for SIMDISK_DefaultConfig.
+ * @retval EStatus_t
+ * @note   The virtual clock, the counters and the faults start from zero.
+ */
+EStatus_t SIMDISK_Setup(uint8_t *Memory, uint32_t Sectors,
+    const SimdiskConfig_t *Config);
+
+
+/**
+ * @brief  This routine stops serving the disk. The memory stays with the
+ *         caller.
+ */
+void SIMDISK_Release(void);
+
+
+/**
+ * @brief  This routine makes commands touching some sectors fail.
+ * @param  Sector : First sector of the range.
+ * @param  Count : Number of sectors of the range.
+ * @param  Flags : SIMDISK_FAULT_READ and/or SIMDISK_FAULT_WRITE.
+ * @param  Result : Error returned, ERR_DEVICE for instance.
+ * @param  Times : Number of commands that fail, 0 for all of them.
+ * @retval EStatus_t
+ * @note   A failed command still takes its time. A failed write leaves the
+ *         sectors as they were.
+ */
+EStatus_t SIMDISK_AddFault(uint32_t Sector, uint32_t Count, uint8_t Flags,
+    EStatus_t Result, uint32_t Times);
+
+
+/**
+ * @brief  This routine removes every fault.
+ */
+void SIMDISK_ClearFaults(void);
+
+
+/**
+ * @brief  This routine gives the virtual clock, in microseconds.
+ * @retval Microseconds since SIMDISK_Setup, wrapping around.
+ * @note   Can be given to AFATFS_SetMicroClock, so the AFATFS_Poll budget and
+ *         the trace events follow the simulated time.
+ */
+uint32_t SIMDISK_Micros(void);
+
+
+/**
+ * @brief  This routine moves the virtual clock, as the rest of the program
+ *         would between calls to the library.
+ * @param  Micros : Time that passed.
+ */
+void SIMDISK_Advance(uint32_t Micros);
+
+
+/**
+ * @brief  This routine gives the virtual clock with 64 bits.
+ * @retval Microseconds since SIMDISK_Setup.
+ */
+uint64_t SIMDISK_Time(void);
+
+
+/**
+ * @brief  This routine gives the counters of the simulated card.
+ * @param  Stats : Copy of the counters.
+ * @param  isReset : Set to 1 to zero the counters after the copy.
+ */
+void SIMDISK_GetStats(SimdiskStats_t *Stats, uint8_t isReset);
+
+
+/**
+ * @brief  Functions given to Disk_List (map_afatfs.h).
+ */
+EStatus_t SIMDISK_IntHwInit(void);
+EStatus_t SIMDISK_ExtDevConfig(void);
+EStatus_t SIMDISK_Read(uint8_t *Buffer, uint32_t Sector, uint32_t Count);
+EStatus_t SIMDISK_Write(uint8_t *Buffer, uint32_t Sector, uint32_t Count);
+EStatus_t SIMDISK_ReadSpecs(void);
+
+
+#endif /* SIMDISK_H */
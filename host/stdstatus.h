@@ -0,0 +1,45 @@
+/**
+ * @file  stdstatus.h
+ * @date  17-October-2026
+ * @brief Return codes for host builds.
+ *
+ * Stand-in for "std_headers/stdstatus.h" of the utils repository, used when
+ * that repository is not available (see AFATFS_STDSTATUS_DIR on
+ * "CMakeLists.txt"). Only the codes used by the library are listed.
+ *
+ * @author
+ * @author
+ */
+
+
+#ifndef STDSTATUS_H
+#define STDSTATUS_H
+
+
+/**
+ * @brief Values returned by the routines. Errors are equal to or greater than
+ *        RETURN_ERROR_VALUE.
+ */
+typedef enum
+{
+  ANSWERED_REQUEST = 0,
+  OPERATION_RUNNING,
+  RETURN_ERROR_VALUE,
+  ERR_FAILED = RETURN_ERROR_VALUE,
+  ERR_PARAM_ID,
+  ERR_PARAM_VALUE,
+  ERR_PARAM_NAME,
+  ERR_PARAM_OFFSET,
+  ERR_PARAM_SIZE,
+  ERR_NULL_POINTER,
+  ERR_BUFFER_SIZE,
+  ERR_RESOURCE_DEPLETED,
+  ERR_DISABLED,
+  ERR_NOT_IMPLEMENTED,
+  ERR_INVALID_FILE_SYSTEM,
+  ERR_TIMEOUT,
+  ERR_DEVICE,
+}EStatus_t;
+
+
+#endif /* STDSTATUS_H */
@@ -0,0 +1,333 @@
+#include <string.h>
+#include "tracejson.h"
+
+
+#define TRACEJSON_MAX_DISKS                                                    8
+#define TRACEJSON_MAX_PENDING                                                 64
+#define TRACEJSON_OPERATIONS                         (AFATFS_TRACE_WRITE + 1)
+
+/* Threads of a disk besides its files */
+#define TRACEJSON_TID_MOUNT                                                 1000
+#define TRACEJSON_TID_DEVICE                                                1001
+
+
+/**
+ * @brief Operation of a file (or mount of a disk) being followed.
+ */
+typedef struct
+{
+  uint64_t Start; /*!< Time the operation started */
+
+  uint64_t Enter; /*!< Time the current state was entered */
+
+  uint8_t isStarted; /*!< Flags if the start of the operation was seen */
+
+  uint8_t isInState; /*!< Flags if the start of the current state was seen */
+
+} tracejsonOperation_t;
+
+
+/**
+ * @brief Device command given to the driver and not ended yet.
+ */
+typedef struct
+{
+  uint64_t Start;
+
+  uint32_t Sector;
+
+  uint32_t Count;
+
+  uint8_t Disk;
+
+  uint8_t isWrite;
+
+  uint8_t isUsed;
+
+} tracejsonCommand_t;
+
+
+/* State names, in the order of the state enums of afatfs.c */
+static const char *const TRACEJSON_MountStates[] = {"INT_HW_INIT",
+    "EXT_DEV_CONFIG", "READ_BOOT", "READ_BIOS", "READ_FSINFO", "BUILD_INDEX",
+    "NOP"};
+static const char *const TRACEJSON_CreateStates[] = {"WALK_PATH", "FIND_FILE",
+    "CHECK_SHORT_NAME", "FIND_EMPTY_CLUSTER", "FIND_EMPTY_ROOT_ENTRY",
+    "FIND_DIR_CLUSTER", "CLEAR_DIR_CLUSTER", "LINK_DIR_CLUSTER",
+    "ALOCATE_CLUSTER", "WRITE_LONG_NAME", "WRITE_ROOT_ENTRY",
+    "WRITE_RING_HEADER"};
+static const char *const TRACEJSON_OpenStates[] = {"WALK_PATH", "FIND_FILE",
+    "MAP_RING", "READ_RING_HEADER"};
+static const char *const TRACEJSON_WriteStates[] = {"MAP_CLUSTER",
+    "FIND_EMPTY_CLUSTER", "ALLOCATE_CLUSTER", "READ_FIRST_SECTOR",
+    "READ_LAST_SECTOR", "WRITE_DATA", "UPDATE_ENTRY", "FLUSH_BUFFER",
+    "SYNC_FILE", "STREAM_APPEND", "STREAM_READ_TAIL", "STREAM_WRITE_BUFFER",
+    "STREAM_WRITE_DIRECT", "STREAM_FIND_RUN", "STREAM_CHAIN_RUN",
+    "STREAM_LINK_RUN"};
+
+static const struct
+{
+  const char *Name;
+  const char *const *States;
+  uint8_t StateCount;
+}TRACEJSON_Operation[TRACEJSON_OPERATIONS] = {
+    {"AFATFS_Mount", TRACEJSON_MountStates,
+        sizeof(TRACEJSON_MountStates) / sizeof(char*)},
+    {"AFATFS_Create", TRACEJSON_CreateStates,
+        sizeof(TRACEJSON_CreateStates) / sizeof(char*)},
+    {"AFATFS_Open", TRACEJSON_OpenStates,
+        sizeof(TRACEJSON_OpenStates) / sizeof(char*)},
+    {"AFATFS_Write", TRACEJSON_WriteStates,
+        sizeof(TRACEJSON_WriteStates) / sizeof(char*)},
+};
+
+static FILE *TRACEJSON_Out;
+static uint8_t TRACEJSON_isFirst;
+static uint32_t TRACEJSON_LastTime;
+static uint64_t TRACEJSON_TimeHigh;
+static tracejsonOperation_t TRACEJSON_Op[TRACEJSON_MAX_DISKS]
+                                        [TRACEJSON_OPERATIONS][256];
+static tracejsonCommand_t TRACEJSON_Pending[TRACEJSON_MAX_PENDING];
+static uint8_t TRACEJSON_isDiskNamed[TRACEJSON_MAX_DISKS];
+static uint8_t TRACEJSON_isThreadNamed[TRACEJSON_MAX_DISKS][256 + 2];
+
+
+
+static void TRACEJSON_Separator(void)
+{
+  fprintf(TRACEJSON_Out, TRACEJSON_isFirst ? "\n" : ",\n");
+  TRACEJSON_isFirst = 0;
+}
+
+
+
+static uint32_t TRACEJSON_Thread(uint8_t Disk, uint32_t Tid)
+{
+  uint32_t slot;
+
+  /*
+   * Notes:
+   * 1 - Names are given (metadata events) the first time a disk or a thread
+   *     shows up.
+   */
+  if(!TRACEJSON_isDiskNamed[Disk]){
+    TRACEJSON_isDiskNamed[Disk] = 1;
+    TRACEJSON_Separator();
+    fprintf(TRACEJSON_Out, "{\"name\":\"process_name\",\"ph\":\"M\","
+        "\"pid\":%u,\"tid\":0,\"args\":{\"name\":\"disk %u\"}}",
+        (unsigned)Disk, (unsigned)Disk);
+  }
+
+  slot = (Tid == TRACEJSON_TID_MOUNT) ? 256 :
+      (Tid == TRACEJSON_TID_DEVICE) ? 257 : Tid;
+  if(!TRACEJSON_isThreadNamed[Disk][slot]){
+    TRACEJSON_isThreadNamed[Disk][slot] = 1;
+    TRACEJSON_Separator();
+    fprintf(TRACEJSON_Out, "{\"name\":\"thread_name\",\"ph\":\"M\","
+        "\"pid\":%u,\"tid\":%u,\"args\":{\"name\":\"", (unsigned)Disk,
+        (unsigned)Tid);
+    if(slot == 256){
+      fprintf(TRACEJSON_Out, "mount\"}}");
+    }else if(slot == 257){
+      fprintf(TRACEJSON_Out, "device\"}}");
+    }else{
+      fprintf(TRACEJSON_Out, "file %u\"}}", (unsigned)Tid);
+    }
+  }
+
+  return Tid;
+}
+
+
+
+/* Complete event ("X") from Start to End, Args is a JSON object or NULL */
+static void TRACEJSON_Slice(const char *Name, uint8_t Disk, uint32_t Tid,
+    uint64_t Start, uint64_t End, const char *Args)
+{
+  Tid = TRACEJSON_Thread(Disk, Tid);
+  TRACEJSON_Separator();
+  fprintf(TRACEJSON_Out, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,"
+      "\"tid\":%u,\"ts\":%llu,\"dur\":%llu%s%s}", Name, (unsigned)Disk,
+      (unsigned)Tid, (unsigned long long)Start,
+      (unsigned long long)(End - Start), (Args != NULL) ? ",\"args\":" : "",
+      (Args != NULL) ? Args : "");
+}
+
+
+
+static const char *TRACEJSON_StateName(uint8_t Type, uint8_t State)
+{
+  if(State < TRACEJSON_Operation[Type].StateCount){
+    return TRACEJSON_Operation[Type].States[State];
+  }
+
+  return "UNKNOWN";
+}
+
+
+
+static void TRACEJSON_State(const AfatfsTraceEvent_t *Event, uint64_t Time)
+{
+  tracejsonOperation_t *op;
+  uint32_t tid;
+  char args[96];
+
+  /*
+   * Notes:
+   * 1 - An event closes the slice of state From and opens the one of To.
+   *     From AFATFS_TRACE_IDLE opens the slice of the operation, To
+   *     AFATFS_TRACE_IDLE closes it.
+   * 2 - Slices whose start is not in the trace (overwritten events, or an
+   *     operation already running when tracing started) are left out.
+   */
+  op = &TRACEJSON_Op[Event->Disk][Event->Type][Event->File];
+  tid = (Event->Type == AFATFS_TRACE_MOUNT) ? TRACEJSON_TID_MOUNT :
+      Event->File;
+
+  if(Event->From == AFATFS_TRACE_IDLE){
+    op->isStarted = 1;
+    op->Start = Time;
+  }else if(op->isInState){
+    snprintf(args, sizeof(args), "{\"to\":\"%s\"}",
+        (Event->To == AFATFS_TRACE_IDLE) ? "IDLE" :
+            TRACEJSON_StateName(Event->Type, Event->To));
+    TRACEJSON_Slice(TRACEJSON_StateName(Event->Type, Event->From),
+        Event->Disk, tid, op->Enter, Time, args);
+  }
+
+  if(Event->To == AFATFS_TRACE_IDLE){
+    if(op->isStarted){
+      snprintf(args, sizeof(args), "{\"result\":%u}",
+          (unsigned)Event->Result);
+      TRACEJSON_Slice(TRACEJSON_Operation[Event->Type].Name, Event->Disk, tid,
+          op->Start, Time, args);
+    }
+    op->isStarted = 0;
+    op->isInState = 0;
+  }else{
+    op->isInState = 1;
+    op->Enter = Time;
+  }
+}
+
+
+
+static void TRACEJSON_Command(const AfatfsTraceEvent_t *Event, uint64_t Time)
+{
+  tracejsonCommand_t *command = NULL;
+  char args[96];
+  uint32_t i;
+
+  for(i = 0; i < TRACEJSON_MAX_PENDING; i++){
+    if(TRACEJSON_Pending[i].isUsed &&
+        TRACEJSON_Pending[i].Disk == Event->Disk &&
+        TRACEJSON_Pending[i].Sector == Event->Sector &&
+        TRACEJSON_Pending[i].Count == Event->Count &&
+        TRACEJSON_Pending[i].isWrite == Event->isWrite)
+    {
+      command = &TRACEJSON_Pending[i];
+      break;
+    }
+  }
+
+  if(Event->Type == AFATFS_TRACE_IO_START){
+    if(command == NULL){
+      for(i = 0; i < TRACEJSON_MAX_PENDING; i++){
+        if(!TRACEJSON_Pending[i].isUsed){
+          command = &TRACEJSON_Pending[i];
+          break;
+        }
+      }
+    }
+    if(command != NULL){
+      command->Start = Time;
+      command->Sector = Event->Sector;
+      command->Count = Event->Count;
+      command->Disk = Event->Disk;
+      command->isWrite = Event->isWrite;
+      command->isUsed = 1;
+    }
+  }else{
+    snprintf(args, sizeof(args), "{\"sector\":%lu,\"count\":%lu,"
+        "\"result\":%u}", (unsigned long)Event->Sector,
+        (unsigned long)Event->Count, (unsigned)Event->Result);
+    TRACEJSON_Slice(Event->isWrite ? "write" : "read", Event->Disk,
+        TRACEJSON_TID_DEVICE, (command != NULL) ? command->Start : Time,
+        Time, args);
+    if(command != NULL){
+      command->isUsed = 0;
+    }
+  }
+}
+
+
+
+EStatus_t TRACEJSON_Begin(FILE *Out)
+{
+  if(Out == NULL){
+    return ERR_NULL_POINTER;
+  }
+
+  TRACEJSON_Out = Out;
+  TRACEJSON_isFirst = 1;
+  TRACEJSON_LastTime = 0;
+  TRACEJSON_TimeHigh = 0;
+  memset(TRACEJSON_Op, 0, sizeof(TRACEJSON_Op));
+  memset(TRACEJSON_Pending, 0, sizeof(TRACEJSON_Pending));
+  memset(TRACEJSON_isDiskNamed, 0, sizeof(TRACEJSON_isDiskNamed));
+  memset(TRACEJSON_isThreadNamed, 0, sizeof(TRACEJSON_isThreadNamed));
+  fprintf(TRACEJSON_Out, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t TRACEJSON_Add(const AfatfsTraceEvent_t *Events, uint32_t Count)
+{
+  uint64_t time;
+  uint32_t i;
+
+  if(TRACEJSON_Out == NULL){
+    return ERR_DISABLED;
+  }
+  if(Events == NULL && Count != 0){
+    return ERR_NULL_POINTER;
+  }
+
+  for(i = 0; i < Count; i++){
+    /* The clock is a free running 32 bit count of microseconds */
+    if(Events[i].Time < TRACEJSON_LastTime){
+      TRACEJSON_TimeHigh += (uint64_t)1 << 32;
+    }
+    TRACEJSON_LastTime = Events[i].Time;
+    time = TRACEJSON_TimeHigh + Events[i].Time;
+
+    if(Events[i].Disk >= TRACEJSON_MAX_DISKS){
+      continue;
+    }
+    if(Events[i].Type < TRACEJSON_OPERATIONS){
+      TRACEJSON_State(&Events[i], time);
+    }else if(Events[i].Type == AFATFS_TRACE_IO_START ||
+        Events[i].Type == AFATFS_TRACE_IO_END)
+    {
+      TRACEJSON_Command(&Events[i], time);
+    }
+  }
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t TRACEJSON_End(void)
+{
+  if(TRACEJSON_Out == NULL){
+    return ERR_DISABLED;
+  }
+
+  fprintf(TRACEJSON_Out, "\n]}\n");
+  TRACEJSON_Out = NULL;
+
+  return ANSWERED_REQUEST;
+}
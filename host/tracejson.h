@@ -0,0 +1,54 @@
+/**
+ * @file  tracejson.h
+ * @date  17-October-2026
+ * @brief Chrome trace-event JSON from the events of AFATFS_GetTrace, for host
+ *        builds.
+ *
+ * The output opens in chrome://tracing or ui.perfetto.dev. Each disk is a
+ * process. Each file is a thread with one slice per AFATFS_Create,
+ * AFATFS_Open and AFATFS_Write call sequence and, inside it, one slice per
+ * state. Mount slices go on a "mount" thread and device commands on a
+ * "device" thread, with their sector, count and result.
+ *
+ * @author
+ * @author
+ */
+
+
+#ifndef TRACEJSON_H
+#define TRACEJSON_H
+
+
+#include <stdio.h>
+#include <stdint.h>
+#include "afatfs.h"
+
+
+/**
+ * @brief  This routine starts a JSON document.
+ * @param  Out : Where the JSON is written, open until TRACEJSON_End.
+ * @retval EStatus_t
+ */
+EStatus_t TRACEJSON_Begin(FILE *Out);
+
+
+/**
+ * @brief  This routine adds events to the document.
+ * @param  Events : Events in the order AFATFS_GetTrace gave them.
+ * @param  Count : Number of events.
+ * @retval EStatus_t
+ * @note   Can be called any number of times, the slices of states and
+ *         device commands may start on a call and end on another. The 32 bit
+ *         microsecond times are unwrapped as they go.
+ */
+EStatus_t TRACEJSON_Add(const AfatfsTraceEvent_t *Events, uint32_t Count);
+
+
+/**
+ * @brief  This routine ends the document. Slices still open are left out.
+ * @retval EStatus_t
+ */
+EStatus_t TRACEJSON_End(void);
+
+
+#endif /* TRACEJSON_H */
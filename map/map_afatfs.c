@@ -3,7 +3,8 @@
 /* #include "nand.h */
 
 DiskIO_t Disk_List[] = {
-    {SDCARD_IntHwInit, SDCARD_ExtHwConfig, SDCARD_Read, SDCARD_Write, 0},
+    {.IntHwInit = SDCARD_IntHwInit, .ExtDevConfig = SDCARD_ExtHwConfig,
+        .Read = SDCARD_Read, .Write = SDCARD_Write},
 };
 
 uint32_t Disk_ListSize = sizeof(Disk_List) / sizeof(DiskIO_t);
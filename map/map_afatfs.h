@@ -38,6 +38,21 @@ typedef struct
   EStatus_t (*Write)(uint8_t *Buffer, uint32_t Sector, uint32_t Count);
 
   EStatus_t (*ReadSpecs)(void);
+
+  /* Optional queued interface, used instead of Read and Write when Submit is
+   * not NULL. Submit queues one request and returns ANSWERED_REQUEST, or
+   * OPERATION_RUNNING if the driver queue is full. The driver reports the
+   * end of each request by calling AFATFS_CompleteRequest with its Tag,
+   * from an interrupt or from Poll. */
+  EStatus_t (*Submit)(uint8_t *Buffer, uint32_t Sector, uint32_t Count,
+      uint8_t isWrite, uint32_t Tag);
+
+  /* Optional, called by the library while it waits for requests, so drivers
+   * without interrupts can report completions */
+  void (*Poll)(void);
+
+  /* Number of requests the driver accepts at once, 0 means 1 */
+  uint8_t QueueDepth;
 }DiskIO_t;
 
 
@@ -2,10 +2,188 @@
 #include <stdio.h>
 #include "afatfs.h"
 #include "afatfs_types.h"
+#include "afatfs_scan.h"
 #include "map_afatfs.h"
 
 
 
+/**
+ * @brief Run of contiguous clusters belonging to a file.
+ */
+typedef struct
+{
+  uint32_t FileCluster; /*!< Cluster index relative to the start of the file */
+
+  uint32_t Cluster; /*!< First cluster number of the run on disk */
+
+  uint32_t Length; /*!< Number of contiguous clusters in the run */
+
+} afatfsExtent_t;
+
+
+
+/**
+ * @brief Cluster of a directory, kept to go on along the cluster chain.
+ */
+typedef struct
+{
+  uint32_t Base; /*!< First cluster of the directory */
+
+  uint32_t Cluster; /*!< Cluster on position Index of the chain */
+
+  uint32_t Prev; /*!< Cluster on position Index - 1, 0 if not known */
+
+  uint32_t Index;
+
+} afatfsDirCursor_t;
+
+
+
+/**
+ * @brief Progress of the operations in course on a file, so operations on
+ *        different files advance independently.
+ */
+typedef struct
+{
+  uint8_t *Owner; /*!< FileHandle variable of the caller while AFATFS_Open or
+                       AFATFS_Create are in progress, NULL otherwise */
+
+  uint8_t State; /*!< State of AFATFS_Open or AFATFS_Create */
+
+  uint8_t WriteState; /*!< State of AFATFS_Write */
+
+  uint32_t WriteDone; /*!< Bytes of the write request already written */
+
+  uint32_t WriteSegment; /*!< Bytes of the part being written */
+
+  uint32_t WriteSector; /*!< First absolute sector of the part being written */
+
+  uint32_t NewCluster; /*!< Cluster being allocated */
+
+  uint32_t NewLength; /*!< Clusters of the run starting at NewCluster, taken
+                           by AFATFS_FILE_MODE_STREAM files */
+
+  uint32_t ReadDone; /*!< Bytes of the read request already copied */
+
+  uint8_t FlushState; /*!< State of AFATFS_Flush */
+
+  uint8_t AllocState; /*!< State of AFATFS_AllocateCluster */
+
+  uint32_t ScanSector; /*!< FAT sector being scanned for a free cluster */
+
+  uint32_t ScanCount; /*!< FAT sectors scanned so far */
+
+  uint32_t RunFirst; /*!< Free run being measured by AFATFS_FindFreeRun */
+
+  uint32_t RunLength;
+
+  uint32_t BestFirst; /*!< Longest free run seen by AFATFS_FindFreeRun */
+
+  uint32_t BestLength;
+
+  uint32_t ChainDone; /*!< FAT entries of the run already changed by
+                           AFATFS_ChainRun */
+
+  uint8_t TrimState; /*!< State of AFATFS_StreamTrim */
+
+  uint8_t isClosing; /*!< Flags if AFATFS_Close is being polled, the calls it
+                          cut short were dropped on its first call */
+
+  uint32_t DirSector; /*!< Directory sector scanned for a free entry */
+
+  uint32_t IndexProbe; /*!< Directory index slots looked at so far */
+
+  uint8_t isIndexCheck; /*!< Flags if the long name entries of an indexed
+                             file are being compared */
+
+  char *LongName; /*!< Name given to AFATFS_Open or AFATFS_Create when it does
+                       not fit 8.3, NULL otherwise */
+
+  uint8_t LongLength; /*!< Characters in LongName */
+
+  uint8_t isShortLookup; /*!< Flags if Name and Extension are looked up even
+                              with LongName set */
+
+  uint8_t NameCase; /*!< FAT_CASE_LOWER_NAME and FAT_CASE_LOWER_EXT flags of
+                         the short entry written by AFATFS_Create */
+
+  uint8_t LfnOrder; /*!< Order of the last long name entry matched, 0 if no
+                         chain is being matched */
+
+  uint8_t LfnSum; /*!< Short name checksum of the chain being matched */
+
+  uint16_t TailMask; /*!< Bit n set if the short name with tail ~n was seen,
+                          bit 0 set once the whole directory was read */
+
+  uint8_t TailTry; /*!< Short names tried by AFATFS_Create */
+
+  uint8_t LongDone; /*!< Long name entries written by AFATFS_Create */
+
+  uint32_t FreeRun; /*!< Consecutive free directory entries found */
+
+  uint32_t FirstFree; /*!< First free directory entry found, 0xFFFFFFFF if
+                           none was found yet */
+
+  uint8_t isFreeScan; /*!< Flags if free directory entries are being looked
+                           for, DirSector started from the free slot hint */
+
+  afatfsDirCursor_t Dir; /*!< Directory cluster last looked up */
+
+  uint32_t GrowCluster; /*!< Cluster being added to a full directory */
+
+  uint8_t ZeroDone; /*!< Sectors of GrowCluster already cleared */
+
+  char *Path; /*!< Rest of the path given to AFATFS_Open or AFATFS_Create,
+                   starting with the name being looked up */
+
+  uint8_t NameLength; /*!< Characters of the name at the start of Path */
+
+  uint8_t isLastName; /*!< Flags if the name looked up is the file's */
+
+#if AFATFS_TRACE_SIZE > 0
+  uint8_t TraceActive; /*!< Bit n set while the operation of trace type n
+                            is in progress on the file */
+#endif
+
+} afatfsContext_t;
+
+
+
+/**
+ * @brief Progress of the operations on a whole disk (mount, sync, FAT resync
+ *        and free cluster count), one of each at a time per disk.
+ */
+typedef struct
+{
+  uint8_t MountState; /*!< State of AFATFS_Mount */
+
+  uint8_t MountPartition; /*!< Partition being read by AFATFS_Mount */
+
+  uint8_t MountErrors; /*!< Partitions found not valid by AFATFS_Mount */
+
+  uint8_t SyncPartition; /*!< FSInfo being written by AFATFS_Sync */
+
+  uint8_t SyncMirror; /*!< Partition + 1 whose FAT copies AFATFS_Sync is
+                           writing, 0 while the cache is written back */
+
+  uint8_t ResyncStep; /*!< Step of AFATFS_ResyncFat */
+
+  uint32_t MirrorOffset; /*!< First FAT sector being copied by
+                              AFATFS_MirrorFat */
+
+  uint32_t MirrorLength; /*!< Sectors being copied, 0 if none */
+
+  uint8_t MirrorCopy; /*!< FAT copy being written, 0 while the sectors are
+                           read from the first one */
+
+  uint32_t CountSector; /*!< FAT sector read by AFATFS_CountFreeClusters */
+
+  uint32_t CountFree; /*!< Free clusters counted so far */
+
+} afatfsDiskContext_t;
+
+
+
 /**
  * @brief File structure.
  */
@@ -21,6 +199,16 @@ typedef struct
 
   uint32_t ClusterPrev; /*!< The previous file cluster */
 
+  afatfsExtent_t Extent[AFATFS_EXTENT_CACHE_SIZE]; /*!< Cluster runs learned
+                                                        from the FAT. Extent[0]
+                                                        starts at ClusterFirst,
+                                                        the others are
+                                                        consecutive runs */
+
+  uint8_t ExtentCount; /*!< Number of valid entries in Extent */
+
+  uint8_t isChainComplete; /*!< Flags if the last extent ends the chain */
+
   uint32_t SectorFirst;
 
   uint32_t SectorPos;
@@ -41,6 +229,43 @@ typedef struct
 
   uint8_t Buffer[AFATFS_MAX_SECTOR_SIZE * AFATFS_FILEBUFFER_SIZE];
 
+  uint32_t BufferSector; /*!< Absolute sector held at the start of Buffer */
+
+  uint32_t BufferCount; /*!< Number of sectors in Buffer equal to the disk,
+                             0 if Buffer holds nothing to reuse */
+
+  uint32_t BufferPos; /*!< File offset of the start of Buffer */
+
+  uint8_t isBufferDirty; /*!< Flags if Buffer holds data not written yet */
+
+  uint8_t isEntryDirty; /*!< Flags if the directory entry is out of date, or
+                             the header sector of a ring file */
+
+  uint8_t SyncPolicy; /*!< One of the AFATFS_SYNC_* values */
+
+  uint32_t SyncValue; /*!< Bytes or milliseconds used by SyncPolicy */
+
+  uint32_t SyncSize; /*!< LogicalSize on the last flush */
+
+  uint32_t SyncTime; /*!< Clock value on the last flush */
+
+  uint32_t RingHead; /*!< File offset the next ring write goes to, up to
+                          LogicalSize until the head wraps around */
+
+  uint32_t RingTail; /*!< File offset of the oldest ring data */
+
+  uint32_t RingWraps; /*!< Times the head wrapped around */
+
+  uint32_t RingCount; /*!< Bytes written to the ring, for AFATFS_SYNC_BYTES */
+
+  uint32_t ReadHits; /*!< Read parts served from Buffer without the disk */
+
+  uint32_t ReadMisses; /*!< Read parts that needed a device read */
+
+#if AFATFS_STATS
+  AfatfsStats_t Stats; /*!< Counters of the calls on this file */
+#endif
+
   uint8_t *pBuffer; /*!< Pointer to the buffer where data should be stored
                          when recovered */
 
@@ -48,497 +273,4850 @@ typedef struct
 
   uint8_t Partition; /*!< Stores te partition from which the file came */
 
-  uint32_t Entry; /*!< Entry position on root dir table */
+  uint32_t Entry; /*!< Entry position on its directory */
+
+  uint32_t DirCluster; /*!< First cluster of the directory of the entry */
+
+  uint32_t EntrySector; /*!< Absolute sector holding the entry */
 
   uint8_t isInUse; /*!< Flags if the structure represents a valid file */
 
+  afatfsContext_t Ctx; /*!< Operations in progress */
+
 } afatfsFile_t;
 
 
 
-struct
+/**
+ * @brief Sector cache slot.
+ */
+typedef struct
 {
-  uint8_t                          isInitialized;
-  ReducedMasterBootRecord_t        MBR;
-  ReducedPartitionParameterTable_t PPR;
-  DirectoryEntryFat32_t            RootDir[16];
-  /*afatfsFile_t                     File[AFATS_MAX_FILES];*/
-  uint8_t                          Buffer[AFATFS_MAX_SECTOR_SIZE];
-  uint8_t                          Busy;
-  /* DiskIO_t                         DiskIO; */
-}FatDisk[AFATS_MAX_DISKS];
-
-
-afatfsFile_t Fat32File[AFATS_MAX_FILES];
+  uint32_t Sector; /*!< Absolute sector held by the slot */
 
+  uint32_t Age; /*!< Value of the cache clock on the last access (LRU) */
 
+  uint8_t isValid; /*!< Flags if Data holds the content of Sector */
 
+  uint8_t isDirty; /*!< Flags if Data was changed and not written back yet */
 
-static EStatus_t AFATFS_ReadBootSector(uint8_t Disk)
-{
-  EStatus_t returncode = OPERATION_RUNNING;
-  uint32_t i, counter;
+  uint8_t Pins; /*!< The slot is not evicted while this is not zero */
 
-  if(Disk < AFATS_MAX_DISKS)
-  {
+  uint8_t isFlushing; /*!< Flags if Data is being written back, isDirty is
+                           set again if Data changes meanwhile */
 
-    returncode = Disk_List[Disk].Read(FatDisk[Disk].Buffer, 0, 1);
-    if(returncode == ANSWERED_REQUEST)
-    {
-      memcpy(&FatDisk[Disk].MBR.Signature,
-          &FatDisk[Disk].Buffer[FAT_SIGNATURE_OFFSET], 2);
-      /* Verifying the FAT boot sector signature */
-      if(FatDisk[Disk].MBR.Signature == FAT_BOOT_SIGNATURE)
-      {
-        counter = 0;
-        /* Saving the FAT type, the partition's start sector and length */
-        for(i = 0; i < FAT_PARTITION_QTY; i++)
-        {
-          if(i < AFATS_MAX_PARTITIONS)
-          {
-            FatDisk[Disk].MBR.FatType[i] =
-                FatDisk[Disk].Buffer[FAT_PARTITION_RECORD0_OFFSET +
-                                     (FAT_PARTITION_RECORD_SIZE * i) +
-                                     FAT_TYPE_OF_PARTITION_OFFSET];
-            memcpy(&FatDisk[Disk].MBR.StartLBA[i],
-                &FatDisk[Disk].Buffer[FAT_PARTITION_RECORD0_OFFSET +
-                                      (FAT_PARTITION_RECORD_SIZE * i) +
-                                      FAT_START_LBA_OFFSET], 4);
-            memcpy(&FatDisk[Disk].MBR.LengthLBA[i],
-                &FatDisk[Disk].Buffer[FAT_PARTITION_RECORD0_OFFSET +
-                                      (FAT_PARTITION_RECORD_SIZE * i) +
-                                      FAT_LENGTH_OFFSET], 4);
-            if(FatDisk[Disk].MBR.FatType[i] == FAT32_LBA){
-              counter++;
-            }
-          }else{
-            break;
-          }
-        }
-        if(counter == 0){
-          returncode = ERR_INVALID_FILE_SYSTEM;
-        }
-      }else{
-        /* Failed to find a FAT file system */
-        returncode = ERR_FAILED;
-      }
-    }
+} afatfsCacheSlot_t;
 
-  }else{
-    returncode = ERR_PARAM_ID;
-  }
 
-  return returncode;
-}
 
+/* Longest folder name kept by the dentry cache */
+#define AFATFS_DENTRY_NAME_SIZE                                               32
 
 
-static EStatus_t AFATFS_ReadBiosParameter(uint8_t Disk, uint8_t Partition)
+/**
+ * @brief Subdirectory remembered by the dentry cache.
+ */
+typedef struct
 {
-  PartitionParameterTable_t Parameters;
-  EStatus_t returncode = OPERATION_RUNNING;
-  uint32_t fatStart, fatSize, dataStart;
+  uint32_t Parent; /*!< First cluster of the directory holding the entry */
 
-  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
-  {
+  uint32_t Entry; /*!< Entry position on the parent directory */
 
-    if(FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA)
-    {
+  uint32_t Cluster; /*!< First cluster of the subdirectory */
 
-      returncode = Disk_List[Disk].Read(FatDisk[Disk].Buffer,
-          FatDisk[Disk].MBR.StartLBA[Partition], 1);
-      if(returncode == ANSWERED_REQUEST)
-      {
-        memcpy(&Parameters, FatDisk[Disk].Buffer, sizeof(Parameters));
+  uint32_t Age; /*!< Value of the dentry clock on the last hit (LRU) */
 
-        fatStart = FatDisk[Disk].MBR.StartLBA[Partition] +
-            Parameters.reservedSectors;
-        fatSize = Parameters.tableSize;
-        dataStart = fatStart + (fatSize * Parameters.fatCopies);
-        FatDisk[Disk].PPR.RootSector[Partition] = dataStart +
-            Parameters.sectorsPerCluster * (Parameters.rootCluster - 2);
-        /* The next two are important to determine file sectors */
-        FatDisk[Disk].PPR.FatStartSector[Partition] = fatStart;
-        FatDisk[Disk].PPR.FatSize[Partition] = fatSize;
-        FatDisk[Disk].PPR.FatCopies[Partition] = Parameters.fatCopies;
-        FatDisk[Disk].PPR.DataStartSector[Partition] = dataStart;
-        FatDisk[Disk].PPR.SectorPerCluster[Partition] =
-            Parameters.sectorsPerCluster;
-      }
+  uint8_t Partition;
 
-    }else{
-      returncode = ERR_INVALID_FILE_SYSTEM;
-    }
+  uint8_t Length; /*!< Characters in Name, 0 if the slot is free */
 
-  }else{
-    returncode = ERR_PARAM_VALUE;
-  }
+  char Name[AFATFS_DENTRY_NAME_SIZE]; /*!< Name as given on the path */
 
-  return returncode;
-}
+} afatfsDentry_t;
 
 
 
-static EStatus_t AFATFS_ReadRootDirEntry(uint8_t Disk, uint8_t Partition,
-    uint8_t SectorOffset)
+/**
+ * @brief First entry of a directory that may be free, entries before it are
+ *        in use.
+ */
+typedef struct
 {
-  EStatus_t returncode = OPERATION_RUNNING;
-  uint32_t clusterOffset;
+  afatfsDirCursor_t Dir; /*!< Directory (Dir.Base, 0 if the slot is free) and
+                              a cluster of its chain not after Entry */
 
-  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
-  {
+  uint32_t Entry;
 
-    if(FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA)
-    {
+  uint32_t Age; /*!< Value of the hint clock on the last use (LRU) */
 
-      clusterOffset = SectorOffset /
-          FatDisk[Disk].PPR.SectorPerCluster[Partition];
-      if(clusterOffset == 0){
-        returncode = Disk_List[Disk].Read(FatDisk[Disk].Buffer,
-            FatDisk[Disk].PPR.RootSector[Partition] + SectorOffset, 1);
-        if(returncode == ANSWERED_REQUEST)
-        {
-          memcpy(&FatDisk[Disk].RootDir[0], FatDisk[Disk].Buffer,
-              sizeof(FatDisk[Disk].RootDir));
-        }
-      }
-      else
-      {
-        /* Not implemented */
-        /* TODO Read on fat table were cluster number clusterOffset is located*/
-        returncode = ERR_NOT_IMPLEMENTED;
-      }
+  uint8_t Partition;
 
-    }else{
-      returncode = ERR_INVALID_FILE_SYSTEM;
-    }
+} afatfsFreeHint_t;
 
-  }else{
-    returncode = ERR_PARAM_VALUE;
-  }
 
-  return returncode;
-}
 
+/**
+ * @brief Run of first FAT sectors changed since they were copied to the other
+ *        FAT copies (offsets from the start of the FAT).
+ */
+typedef struct
+{
+  uint32_t Low; /*!< First sector changed */
 
+  uint32_t High; /*!< Sector after the last one changed */
 
-static EStatus_t AFATFS_WriteRootDirEntry(uint8_t Disk, uint8_t Partition,
-    uint8_t SectorOffset)
-{
-  EStatus_t returncode = OPERATION_RUNNING;
-  uint32_t clusterOffset;
+} afatfsMirrorRange_t;
 
-  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
-  {
 
-    if(FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA)
-    {
 
-      clusterOffset = SectorOffset /
-          FatDisk[Disk].PPR.SectorPerCluster[Partition];
-      if(clusterOffset == 0){
+/**
+ * @brief Device command in progress (drivers are polled with the same
+ *        arguments until they stop returning OPERATION_RUNNING).
+ */
+typedef struct
+{
+  uint8_t *Buffer;
 
-        memcpy(FatDisk[Disk].Buffer, &FatDisk[Disk].RootDir[0],
-            sizeof(FatDisk[Disk].RootDir));
+  uint32_t Sector;
 
-        returncode = Disk_List[Disk].Write(FatDisk[Disk].Buffer,
-            FatDisk[Disk].PPR.RootSector[Partition] + SectorOffset, 1);
+  uint32_t Count;
 
-      }
-      else
-      {
-        /* Not implemented */
-        /* TODO Read on fat table were cluster number clusterOffset is located*/
-        returncode = ERR_NOT_IMPLEMENTED;
-      }
+  uint8_t isWrite;
 
-    }else{
-      returncode = ERR_INVALID_FILE_SYSTEM;
-    }
+  uint8_t isBusy;
 
-  }else{
-    returncode = ERR_PARAM_VALUE;
-  }
+  uint8_t isDone; /*!< Ended while its caller was not polling, Result is
+                       kept until the same command is polled again */
 
-  return returncode;
-}
+  EStatus_t Result;
 
+} afatfsDeviceIO_t;
 
-static EStatus_t AFATFS_FindEmptyRootEntry(uint8_t Disk, uint8_t Partition,
-    uint32_t *Entry)
-{
-  EStatus_t returncode = OPERATION_RUNNING;
-  static uint32_t sectorOffset[AFATS_MAX_DISKS];
 
-  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
-  {
 
-    returncode = AFATFS_ReadRootDirEntry(Disk, Partition, sectorOffset[Disk]);
+
+/**
+ * @brief Request given to a queued driver (DiskIO_t.Submit).
+ */
+typedef struct
+{
+  uint8_t *Buffer;
+
+  uint32_t Sector;
+
+  uint32_t Count;
+
+  uint32_t Tag; /*!< Disk, sequence number and request index */
+
+  volatile EStatus_t Result; /*!< Set by AFATFS_CompleteRequest */
+
+  volatile uint8_t State; /*!< One of the AFATFS_REQUEST_* values */
+
+  uint8_t isWrite;
+
+} afatfsRequest_t;
+
+
+#define AFATFS_REQUEST_FREE                                                    0
+#define AFATFS_REQUEST_QUEUED                                                  1
+#define AFATFS_REQUEST_DONE                                                    2
+
+
+#define AFATFS_INDEX_OFF                                                       0
+#define AFATFS_INDEX_BUILDING                                                  1
+#define AFATFS_INDEX_READY                                                     2
+#define AFATFS_INDEX_FREE_SLOT                                            0xFFFF
+
+/* Short names tried for a long name, 9 numeric tails then hashed ones */
+#define AFATFS_SHORT_NAME_TRIES                                               25
+
+/* Returned by AFATFS_ShortPart for a name part with both cases, not one of
+ * the FAT_CASE_LOWER flags */
+#define AFATFS_CASE_MIXED                                                   0x01
+
+/* Lock owners while AFATFS_Sync and AFATFS_ResyncFat write the FAT copies,
+ * not files. One copy at a time per disk, they share the disk context */
+#define AFATFS_LOCK_SYNC                                 (AFATS_MAX_FILES + 1)
+#define AFATFS_LOCK_RESYNC                               (AFATS_MAX_FILES + 2)
+
+
+
+struct
+{
+  uint8_t                          isInitialized;
+  ReducedMasterBootRecord_t        MBR;
+  ReducedPartitionParameterTable_t PPR;
+  DirectoryEntryFat32_t            RootDir[16];
+  /*afatfsFile_t                     File[AFATS_MAX_FILES];*/
+  afatfsCacheSlot_t                Slot[AFATFS_CACHE_SIZE];
+  uint8_t                          CacheData[AFATFS_CACHE_SIZE]
+                                            [AFATFS_MAX_SECTOR_SIZE];
+  uint32_t                         CacheClock;
+  uint8_t                          CacheLoad; /*!< Slot being filled */
+  uint32_t                         CacheLoadSector;
+#if AFATFS_FAT_READ_BATCH > 1
+  uint8_t                          FatBatch[AFATFS_FAT_READ_BATCH]
+                                           [AFATFS_MAX_SECTOR_SIZE];
+  uint32_t                         FatBatchSector; /*!< First sector held */
+  uint32_t                         FatBatchCount;
+#endif
+  afatfsDeviceIO_t                 DeviceIO;
+  afatfsRequest_t                  Request[AFATFS_QUEUE_DEPTH];
+  uint16_t                         RequestSequence;
+  uint8_t                          *FreeMap[AFATS_MAX_PARTITIONS];
+  uint32_t                         FreeMapSize[AFATS_MAX_PARTITIONS];
+  uint8_t                          isFsInfoDirty[AFATS_MAX_PARTITIONS];
+  afatfsMirrorRange_t              Mirror[AFATS_MAX_PARTITIONS]
+                                         [AFATFS_MIRROR_RANGES];
+  uint8_t                          MirrorCount[AFATS_MAX_PARTITIONS];
+  uint8_t                          MirrorBuffer[AFATFS_MIRROR_BATCH]
+                                               [AFATFS_MAX_SECTOR_SIZE];
+  uint8_t                          isMirrorOff;
+  AfatfsDirIndex_t                 *Index[AFATS_MAX_PARTITIONS];
+  uint32_t                         IndexSize[AFATS_MAX_PARTITIONS];
+  uint8_t                          IndexState[AFATS_MAX_PARTITIONS];
+  uint32_t                         IndexSector[AFATS_MAX_PARTITIONS];
+  afatfsDirCursor_t                IndexCursor[AFATS_MAX_PARTITIONS];
+  uint32_t                         IndexLfnHash[AFATS_MAX_PARTITIONS];
+  uint8_t                          IndexLfnOrder[AFATS_MAX_PARTITIONS];
+  uint8_t                          IndexLfnSum[AFATS_MAX_PARTITIONS];
+#if AFATFS_DENTRY_CACHE_SIZE > 0
+  afatfsDentry_t                   Dentry[AFATFS_DENTRY_CACHE_SIZE];
+  uint32_t                         DentryClock;
+#endif
+#if AFATFS_FREE_HINT_SIZE > 0
+  afatfsFreeHint_t                 FreeHint[AFATFS_FREE_HINT_SIZE];
+  uint32_t                         FreeHintClock;
+#endif
+#if AFATFS_STATS
+  AfatfsStats_t                    Stats;
+#endif
+#if AFATFS_TRACE_SIZE > 0
+  uint8_t                          TraceActive; /*!< Mount in progress */
+#endif
+  uint32_t                         PreallocSize; /*!< 0 for the default */
+  afatfsDiskContext_t              Ctx; /*!< Disk operations in progress */
+  uint8_t                          Busy;
+  /* DiskIO_t                         DiskIO; */
+}FatDisk[AFATS_MAX_DISKS];
+
+
+afatfsFile_t Fat32File[AFATS_MAX_FILES];
+
+/* Millisecond clock used by AFATFS_SYNC_TIME */
+static uint32_t (*AFATFS_Clock)(void);
+
+/* Microsecond clock used by the AFATFS_Poll budget */
+static uint32_t (*AFATFS_MicroClock)(void);
+
+/* Device commands started, counted for the AFATFS_Poll budget */
+static uint32_t AFATFS_Commands;
+
+/* Jobs given to AFATFS_Poll, in the order they were given */
+static AfatfsJob_t *AFATFS_Job[AFATFS_MAX_JOBS];
+static uint8_t AFATFS_JobCount;
+
+/* Written over the sectors of a cluster added to a directory */
+static uint8_t AFATFS_ZeroSector[AFATFS_MAX_SECTOR_SIZE];
+
+#if AFATFS_STATS
+/* Disk and file of the outermost public call in progress, the ones counters
+ * are added to, and how many public calls are nested in it */
+static uint8_t AFATFS_StatsDisk = AFATS_MAX_DISKS;
+static uint8_t AFATFS_StatsFile = AFATS_MAX_FILES;
+static uint8_t AFATFS_StatsDepth;
+
+#define AFATFS_STATS_ENTER(Disk, FileHandle)                                   \
+  AFATFS_StatsEnter((Disk), (FileHandle))
+#define AFATFS_STATS_LEAVE(Result)                   AFATFS_StatsLeave(Result)
+#define AFATFS_STATS_ADD(Disk, FileHandle, Field, Value)                       \
+  do{                                                                          \
+    FatDisk[(Disk)].Stats.Field += (Value);                                    \
+    Fat32File[(FileHandle)].Stats.Field += (Value);                            \
+  }while(0)
+#else
+#define AFATFS_STATS_ENTER(Disk, FileHandle)
+#define AFATFS_STATS_LEAVE(Result)                                    (Result)
+#define AFATFS_STATS_ADD(Disk, FileHandle, Field, Value)
+#endif
+
+#if AFATFS_TRACE_SIZE > 0
+/* Trace ring buffer, Count events ending before Head (oldest overwritten) */
+static AfatfsTraceEvent_t AFATFS_Trace[AFATFS_TRACE_SIZE];
+static uint32_t AFATFS_TraceHead;
+static uint32_t AFATFS_TraceCount;
+static uint32_t AFATFS_TraceLost;
+
+#define AFATFS_TRACE_FROM(Active, Type, State)                                 \
+  ((((Active) >> (Type)) & 1) ? (State) : AFATFS_TRACE_IDLE)
+#define AFATFS_TRACE_STEP(Type, Disk, File, Active, From, State, Result)       \
+  AFATFS_TraceStep((Type), (Disk), (File), &(Active), (From), (State),         \
+      (Result))
+#define AFATFS_TRACE_IO(Type, Disk, isWrite, Sector, Count, Result)            \
+  AFATFS_TraceIO((Type), (Disk), (isWrite), (Sector), (Count), (Result))
+#else
+#define AFATFS_TRACE_FROM(Active, Type, State)                 AFATFS_TRACE_IDLE
+#define AFATFS_TRACE_STEP(Type, Disk, File, Active, From, State, Result)       \
+  ((void)(From))
+#define AFATFS_TRACE_IO(Type, Disk, isWrite, Sector, Count, Result)
+#endif
+
+
+
+
+#if AFATFS_STATS
+static void AFATFS_StatsEnter(uint8_t Disk, uint8_t FileHandle)
+{
+  /*
+   * Notes:
+   * 1 - Only the outermost call sets where counters go, so the work of
+   *     AFATFS_Flush run by AFATFS_Close or AFATFS_Write is added to the
+   *     file being closed or written.
+   * 2 - Calls on a file count on the disk of the file. Calls with no file
+   *     (AFATS_MAX_FILES) only count on the disk.
+   */
+  if(AFATFS_StatsDepth++ == 0){
+    if(FileHandle < AFATS_MAX_FILES && Fat32File[FileHandle].isInUse){
+      Disk = Fat32File[FileHandle].Disk;
+    }else{
+      FileHandle = AFATS_MAX_FILES;
+    }
+    AFATFS_StatsDisk = Disk;
+    AFATFS_StatsFile = FileHandle;
+  }
+}
+
+
+
+static EStatus_t AFATFS_StatsLeave(EStatus_t Result)
+{
+  if(AFATFS_StatsDepth != 0 && --AFATFS_StatsDepth == 0){
+    if(Result == OPERATION_RUNNING){
+      if(AFATFS_StatsDisk < AFATS_MAX_DISKS){
+        FatDisk[AFATFS_StatsDisk].Stats.Polls++;
+      }
+      if(AFATFS_StatsFile < AFATS_MAX_FILES){
+        Fat32File[AFATFS_StatsFile].Stats.Polls++;
+      }
+    }
+    AFATFS_StatsDisk = AFATS_MAX_DISKS;
+    AFATFS_StatsFile = AFATS_MAX_FILES;
+  }
+
+  return Result;
+}
+
+
+
+static void AFATFS_StatsCommand(uint8_t Disk, uint8_t isWrite, uint32_t Count)
+{
+  AfatfsStats_t *stats = &FatDisk[Disk].Stats;
+
+  stats->Commands++;
+  if(isWrite){
+    stats->SectorsWritten += Count;
+  }else{
+    stats->SectorsRead += Count;
+  }
+  if(AFATFS_StatsFile < AFATS_MAX_FILES &&
+      Fat32File[AFATFS_StatsFile].Disk == Disk)
+  {
+    stats = &Fat32File[AFATFS_StatsFile].Stats;
+    stats->Commands++;
+    if(isWrite){
+      stats->SectorsWritten += Count;
+    }else{
+      stats->SectorsRead += Count;
+    }
+  }
+}
+#endif
+
+
+
+#if AFATFS_TRACE_SIZE > 0
+static AfatfsTraceEvent_t *AFATFS_TraceNext(uint8_t Type, uint8_t Disk)
+{
+  AfatfsTraceEvent_t *event;
+
+  event = &AFATFS_Trace[AFATFS_TraceHead];
+  AFATFS_TraceHead = (AFATFS_TraceHead + 1) % AFATFS_TRACE_SIZE;
+  if(AFATFS_TraceCount < AFATFS_TRACE_SIZE){
+    AFATFS_TraceCount++;
+  }else{
+    AFATFS_TraceLost++;
+  }
+
+  memset(event, 0, sizeof(AfatfsTraceEvent_t));
+  event->Time = (AFATFS_MicroClock != NULL) ? AFATFS_MicroClock() : 0;
+  event->Type = Type;
+  event->Disk = Disk;
+  event->File = AFATS_MAX_FILES;
+
+  return event;
+}
+
+
+
+static void AFATFS_TraceStep(uint8_t Type, uint8_t Disk, uint8_t File,
+    uint8_t *Active, uint8_t From, uint8_t State, EStatus_t Result)
+{
+  AfatfsTraceEvent_t *event;
+  uint8_t to;
+
+  /*
+   * Notes:
+   * 1 - From is the state on the start of the call, AFATFS_TRACE_IDLE if
+   *     the operation was not in progress (bit Type of Active clear).
+   * 2 - A call that does not return OPERATION_RUNNING ends the operation,
+   *     whatever state it was left on.
+   * 3 - Calls that stay on the same state are not recorded.
+   */
+  to = (Result == OPERATION_RUNNING) ? State : AFATFS_TRACE_IDLE;
+  if(to != From){
+    event = AFATFS_TraceNext(Type, Disk);
+    event->File = File;
+    event->From = From;
+    event->To = to;
+    event->Result = (uint8_t)Result;
+  }
+  if(to == AFATFS_TRACE_IDLE){
+    *Active &= ~(1 << Type);
+  }else{
+    *Active |= (1 << Type);
+  }
+}
+
+
+
+static void AFATFS_TraceIO(uint8_t Type, uint8_t Disk, uint8_t isWrite,
+    uint32_t Sector, uint32_t Count, EStatus_t Result)
+{
+  AfatfsTraceEvent_t *event;
+
+  event = AFATFS_TraceNext(Type, Disk);
+  event->Sector = Sector;
+  event->Count = Count;
+  event->isWrite = isWrite;
+  event->Result = (uint8_t)Result;
+}
+#endif
+
+
+
+
+static EStatus_t AFATFS_DeviceIO(uint8_t Disk, uint8_t isWrite,
+    uint8_t *Buffer, uint32_t Sector, uint32_t Count)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsDeviceIO_t *io = &FatDisk[Disk].DeviceIO;
+  afatfsRequest_t *request, *ended;
+  uint32_t i, inUse, depth;
+
+  /*
+   * Notes:
+   * 1 - Callers poll with the same arguments until something other than
+   *     OPERATION_RUNNING is returned, the arguments identify the command.
+   * 2 - With Read and Write, only one command is given to the device at a
+   *     time. A different command waits (OPERATION_RUNNING) until the one in
+   *     progress ends, and meanwhile polls it with its own arguments. So a
+   *     command given up by its state machine (an error path, a closed
+   *     file) still ends, and its result waits in case it is polled again.
+   * 3 - With Submit, up to DiskIO_t.QueueDepth commands are in flight, so
+   *     different state machines (cache, file buffers, direct transfers)
+   *     overlap their transfers. When they are all taken, an ended request
+   *     nobody came back for gives its place to the new one.
+   */
+  if(Disk_List[Disk].Submit == NULL)
+  {
+    if(io->isBusy && (io->Buffer != Buffer || io->Sector != Sector ||
+        io->Count != Count || io->isWrite != isWrite))
+    {
+      /* Moving the other command on, this one waits */
+      if(io->isWrite){
+        returncode = Disk_List[Disk].Write(io->Buffer, io->Sector, io->Count);
+      }else{
+        returncode = Disk_List[Disk].Read(io->Buffer, io->Sector, io->Count);
+      }
+      if(returncode != OPERATION_RUNNING){
+        AFATFS_TRACE_IO(AFATFS_TRACE_IO_END, Disk, io->isWrite, io->Sector,
+            io->Count, returncode);
+        io->isBusy = 0;
+        io->isDone = 1;
+        io->Result = returncode;
+      }
+      return OPERATION_RUNNING;
+    }
+
+    if(io->isDone && io->Buffer == Buffer && io->Sector == Sector &&
+        io->Count == Count && io->isWrite == isWrite)
+    {
+      /* Ended while another command was waiting */
+      io->isDone = 0;
+      return io->Result;
+    }
+    io->isDone = 0;
+
+    if(!io->isBusy){
+      AFATFS_Commands++;
+#if AFATFS_STATS
+      AFATFS_StatsCommand(Disk, isWrite, Count);
+#endif
+      AFATFS_TRACE_IO(AFATFS_TRACE_IO_START, Disk, isWrite, Sector, Count,
+          OPERATION_RUNNING);
+    }
+    if(isWrite){
+      returncode = Disk_List[Disk].Write(Buffer, Sector, Count);
+    }else{
+      returncode = Disk_List[Disk].Read(Buffer, Sector, Count);
+    }
+    if(returncode != OPERATION_RUNNING){
+      AFATFS_TRACE_IO(AFATFS_TRACE_IO_END, Disk, isWrite, Sector, Count,
+          returncode);
+    }
+
+    io->isBusy = (returncode == OPERATION_RUNNING);
+    io->Buffer = Buffer;
+    io->Sector = Sector;
+    io->Count = Count;
+    io->isWrite = isWrite;
+  }
+  else
+  {
+    if(Disk_List[Disk].Poll != NULL){
+      Disk_List[Disk].Poll();
+    }
+
+    /* Looking for the request, counting the ones in flight */
+    request = NULL;
+    ended = NULL;
+    for(i = 0, inUse = 0; i < AFATFS_QUEUE_DEPTH; i++){
+      if(FatDisk[Disk].Request[i].State != AFATFS_REQUEST_FREE){
+        inUse++;
+        if(FatDisk[Disk].Request[i].Buffer == Buffer &&
+            FatDisk[Disk].Request[i].Sector == Sector &&
+            FatDisk[Disk].Request[i].Count == Count &&
+            FatDisk[Disk].Request[i].isWrite == isWrite)
+        {
+          request = &FatDisk[Disk].Request[i];
+        }else if(FatDisk[Disk].Request[i].State == AFATFS_REQUEST_DONE){
+          ended = &FatDisk[Disk].Request[i];
+        }
+      }
+    }
+
+    depth = Disk_List[Disk].QueueDepth;
+    if(depth == 0){ depth = 1;}
+    if(depth > AFATFS_QUEUE_DEPTH){ depth = AFATFS_QUEUE_DEPTH;}
+
+    if(request == NULL && inUse >= depth && ended != NULL){
+      /* Given up by its caller, which submits it again if it comes back */
+      ended->State = AFATFS_REQUEST_FREE;
+      inUse--;
+    }
+
+    if(request == NULL && inUse < depth)
+    {
+      /* Submitting a new request */
+      for(i = 0; i < AFATFS_QUEUE_DEPTH; i++){
+        if(FatDisk[Disk].Request[i].State == AFATFS_REQUEST_FREE){ break;}
+      }
+      request = &FatDisk[Disk].Request[i];
+      request->Buffer = Buffer;
+      request->Sector = Sector;
+      request->Count = Count;
+      request->isWrite = isWrite;
+      request->Tag = ((uint32_t)Disk << 24) |
+          ((uint32_t)(++FatDisk[Disk].RequestSequence) << 8) | i;
+      /* Queued before Submit, the driver may complete it right away */
+      request->State = AFATFS_REQUEST_QUEUED;
+      returncode = Disk_List[Disk].Submit(Buffer, Sector, Count, isWrite,
+          request->Tag);
+      if(returncode != ANSWERED_REQUEST){
+        /* Driver queue full (OPERATION_RUNNING) or error */
+        request->State = AFATFS_REQUEST_FREE;
+        request = NULL;
+        if(returncode != OPERATION_RUNNING){
+          AFATFS_TRACE_IO(AFATFS_TRACE_IO_END, Disk, isWrite, Sector, Count,
+              returncode);
+        }
+      }else{
+        AFATFS_Commands++;
+#if AFATFS_STATS
+        AFATFS_StatsCommand(Disk, isWrite, Count);
+#endif
+        AFATFS_TRACE_IO(AFATFS_TRACE_IO_START, Disk, isWrite, Sector, Count,
+            OPERATION_RUNNING);
+        returncode = OPERATION_RUNNING;
+      }
+    }
+
+    if(request != NULL && request->State == AFATFS_REQUEST_DONE){
+      returncode = request->Result;
+      request->State = AFATFS_REQUEST_FREE;
+      AFATFS_TRACE_IO(AFATFS_TRACE_IO_END, Disk, isWrite, Sector, Count,
+          returncode);
+    }
+  }
+
+  return returncode;
+}
+
+
+
+void AFATFS_CompleteRequest(uint32_t Tag, EStatus_t Result)
+{
+  uint8_t Disk = Tag >> 24;
+  uint8_t i = Tag & 0xFF;
+
+  if(Disk < AFATS_MAX_DISKS && i < AFATFS_QUEUE_DEPTH &&
+      FatDisk[Disk].Request[i].State == AFATFS_REQUEST_QUEUED &&
+      FatDisk[Disk].Request[i].Tag == Tag)
+  {
+    FatDisk[Disk].Request[i].Result = Result;
+    FatDisk[Disk].Request[i].State = AFATFS_REQUEST_DONE;
+  }
+}
+
+
+
+static void AFATFS_BufferInvalidate(uint8_t Disk, uint32_t Sector,
+    uint32_t Count)
+{
+  uint8_t i;
+
+  /* File buffers holding any of the sectors are not reused anymore */
+  for(i = 0; i < AFATS_MAX_FILES; i++){
+    if(Fat32File[i].isInUse && Fat32File[i].Disk == Disk &&
+        Fat32File[i].BufferCount != 0 &&
+        Sector < Fat32File[i].BufferSector + Fat32File[i].BufferCount &&
+        Fat32File[i].BufferSector < Sector + Count)
+    {
+      Fat32File[i].BufferCount = 0;
+    }
+  }
+}
+
+
+
+static void AFATFS_CacheReset(uint8_t Disk)
+{
+  uint8_t i;
+
+  memset(FatDisk[Disk].Slot, 0, sizeof(FatDisk[Disk].Slot));
+  FatDisk[Disk].CacheLoad = AFATFS_CACHE_SIZE; /* Nothing being loaded */
+  FatDisk[Disk].DeviceIO.isBusy = 0;
+  FatDisk[Disk].DeviceIO.isDone = 0;
+  /* Late completions of these requests are ignored (tag mismatch) */
+  for(i = 0; i < AFATFS_QUEUE_DEPTH; i++){
+    FatDisk[Disk].Request[i].State = AFATFS_REQUEST_FREE;
+  }
+  /* File buffers are sector copies as well */
+  AFATFS_BufferInvalidate(Disk, 0, 0xFFFFFFFF);
+#if AFATFS_FAT_READ_BATCH > 1
+  FatDisk[Disk].FatBatchCount = 0;
+#endif
+#if AFATFS_DENTRY_CACHE_SIZE > 0
+  /* Folders are looked up again on the disk */
+  memset(FatDisk[Disk].Dentry, 0, sizeof(FatDisk[Disk].Dentry));
+#endif
+#if AFATFS_FREE_HINT_SIZE > 0
+  memset(FatDisk[Disk].FreeHint, 0, sizeof(FatDisk[Disk].FreeHint));
+#endif
+}
+
+
+
+static uint8_t AFATFS_CacheFind(uint8_t Disk, uint32_t Sector)
+{
+  uint8_t i;
+
+  for(i = 0; i < AFATFS_CACHE_SIZE; i++){
+    if(FatDisk[Disk].Slot[i].isValid && FatDisk[Disk].Slot[i].Sector == Sector &&
+        i != FatDisk[Disk].CacheLoad)
+    {
+      break;
+    }
+  }
+
+  return i;
+}
+
+
+
+static uint32_t AFATFS_FatBatchSize(uint8_t Disk, uint32_t Sector)
+{
+  uint32_t count = 0;
+#if AFATFS_FAT_READ_BATCH > 1
+  uint32_t start, end;
+  uint8_t i;
+
+  /* Sectors from Sector to the end of its FAT copy, up to the batch size */
+  for(i = 0; i < AFATS_MAX_PARTITIONS; i++){
+    start = FatDisk[Disk].PPR.FatStartSector[i];
+    end = start + FatDisk[Disk].PPR.FatSize[i] * FatDisk[Disk].PPR.FatCopies[i];
+    if(FatDisk[Disk].MBR.FatType[i] == FAT32_LBA &&
+        Sector >= start && Sector < end)
+    {
+      end = start + FatDisk[Disk].PPR.FatSize[i] *
+          ((Sector - start) / FatDisk[Disk].PPR.FatSize[i] + 1);
+      count = end - Sector;
+      if(count > AFATFS_FAT_READ_BATCH){
+        count = AFATFS_FAT_READ_BATCH;
+      }
+      break;
+    }
+  }
+#else
+  (void)Disk;
+  (void)Sector;
+#endif
+
+  return count;
+}
+
+
+
+static void AFATFS_FatBatchUpdate(uint8_t Disk, uint32_t Sector,
+    const uint8_t *Data)
+{
+#if AFATFS_FAT_READ_BATCH > 1
+  /* The batch holds what the disk will have, like the cache */
+  if(Sector >= FatDisk[Disk].FatBatchSector &&
+      Sector < FatDisk[Disk].FatBatchSector + FatDisk[Disk].FatBatchCount)
+  {
+    memcpy(FatDisk[Disk].FatBatch[Sector - FatDisk[Disk].FatBatchSector],
+        Data, AFATFS_MAX_SECTOR_SIZE);
+  }
+#else
+  (void)Disk;
+  (void)Sector;
+  (void)Data;
+#endif
+}
+
+
+
+static EStatus_t AFATFS_FatBatchRead(uint8_t Disk, uint32_t Sector,
+    uint8_t *Data)
+{
+  EStatus_t returncode = ANSWERED_REQUEST;
+#if AFATFS_FAT_READ_BATCH > 1
+  uint32_t count;
+  uint8_t i;
+
+  /*
+   * Notes:
+   * 1 - Consecutive FAT sectors are read with a single device command into
+   *     FatBatch, and given to the cache one by one without new commands.
+   * 2 - Cached copies are newer than the disk, so they replace what was
+   *     read. Later changes reach the batch through AFATFS_CacheDirty.
+   */
+  if(Sector < FatDisk[Disk].FatBatchSector ||
+      Sector >= FatDisk[Disk].FatBatchSector + FatDisk[Disk].FatBatchCount)
+  {
+    count = AFATFS_FatBatchSize(Disk, Sector);
+    FatDisk[Disk].FatBatchCount = 0;
+    returncode = AFATFS_DeviceIO(Disk, 0, FatDisk[Disk].FatBatch[0], Sector,
+        count);
+    if(returncode == ANSWERED_REQUEST){
+      FatDisk[Disk].FatBatchSector = Sector;
+      FatDisk[Disk].FatBatchCount = count;
+      for(i = 0; i < AFATFS_CACHE_SIZE; i++){
+        if(FatDisk[Disk].Slot[i].isValid){
+          AFATFS_FatBatchUpdate(Disk, FatDisk[Disk].Slot[i].Sector,
+              FatDisk[Disk].CacheData[i]);
+        }
+      }
+    }
+  }
+  if(returncode == ANSWERED_REQUEST){
+    memcpy(Data, FatDisk[Disk].FatBatch[Sector - FatDisk[Disk].FatBatchSector],
+        AFATFS_MAX_SECTOR_SIZE);
+  }
+#else
+  (void)Disk;
+  (void)Sector;
+  (void)Data;
+#endif
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_CacheGet(uint8_t Disk, uint32_t Sector,
+    uint8_t **Data)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsCacheSlot_t *slot;
+  uint8_t *loaded;
+  uint8_t i, victim;
+
+  /*
+   * Steps:
+   * 1 - Look for the sector in the cache.
+   * 2 - If it is not there, choose the least recently used slot not pinned,
+   *     preferring clean slots.
+   * 3 - Write the slot back if it is dirty.
+   * 4 - Read the sector into the slot.
+   *
+   * Notes:
+   * 1 - Only one slot is loaded at a time, other sectors wait and meanwhile
+   *     move the load on. So a load given up by its caller (a closed file,
+   *     an abandoned call) still ends and frees the slot for them.
+   */
+  i = AFATFS_CacheFind(Disk, Sector);
+  if(i < AFATFS_CACHE_SIZE){
+    FatDisk[Disk].Slot[i].Age = ++FatDisk[Disk].CacheClock;
+    *Data = FatDisk[Disk].CacheData[i];
+    return ANSWERED_REQUEST;
+  }
+
+  if(FatDisk[Disk].CacheLoad >= AFATFS_CACHE_SIZE)
+  {
+    victim = AFATFS_CACHE_SIZE;
+    for(i = 0; i < AFATFS_CACHE_SIZE; i++){
+      slot = &FatDisk[Disk].Slot[i];
+      if(slot->Pins != 0 || slot->isFlushing){
+        continue;
+      }
+      if(victim >= AFATFS_CACHE_SIZE || !slot->isValid ||
+          (FatDisk[Disk].Slot[victim].isValid &&
+              (slot->isDirty < FatDisk[Disk].Slot[victim].isDirty ||
+              (slot->isDirty == FatDisk[Disk].Slot[victim].isDirty &&
+                  slot->Age < FatDisk[Disk].Slot[victim].Age))))
+      {
+        victim = i;
+        if(!slot->isValid){ break;}
+      }
+    }
+    if(victim >= AFATFS_CACHE_SIZE){
+      /* Every slot is pinned */
+      return ERR_RESOURCE_DEPLETED;
+    }
+    FatDisk[Disk].CacheLoad = victim;
+    FatDisk[Disk].CacheLoadSector = Sector;
+  }
+  else if(FatDisk[Disk].CacheLoadSector != Sector)
+  {
+    /* Another sector is being loaded, polled as if this was its caller */
+    (void)AFATFS_CacheGet(Disk, FatDisk[Disk].CacheLoadSector, &loaded);
+    return OPERATION_RUNNING;
+  }
+
+  i = FatDisk[Disk].CacheLoad;
+  slot = &FatDisk[Disk].Slot[i];
+  if(slot->isValid && slot->isDirty){
+    returncode = AFATFS_DeviceIO(Disk, 1, FatDisk[Disk].CacheData[i],
+        slot->Sector, 1);
+    if(returncode == ANSWERED_REQUEST){
+      slot->isDirty = 0;
+    }
+  }else{
+    slot->isValid = 0;
+    slot->isDirty = 0;
+    if(AFATFS_FatBatchSize(Disk, Sector) > 1){
+      returncode = AFATFS_FatBatchRead(Disk, Sector,
+          FatDisk[Disk].CacheData[i]);
+    }else{
+      returncode = AFATFS_DeviceIO(Disk, 0, FatDisk[Disk].CacheData[i],
+          Sector, 1);
+    }
+    if(returncode == ANSWERED_REQUEST){
+      slot->isValid = 1;
+      slot->Sector = Sector;
+      slot->Age = ++FatDisk[Disk].CacheClock;
+      FatDisk[Disk].CacheLoad = AFATFS_CACHE_SIZE;
+      *Data = FatDisk[Disk].CacheData[i];
+    }
+  }
+  if(returncode == ANSWERED_REQUEST && FatDisk[Disk].CacheLoad == i){
+    /* Dirty slot written back, the sector is read on the next call */
+    returncode = OPERATION_RUNNING;
+  }else if(returncode >= RETURN_ERROR_VALUE){
+    FatDisk[Disk].CacheLoad = AFATFS_CACHE_SIZE;
+  }
+
+  return returncode;
+}
+
+
+
+static void AFATFS_AddMirrorRange(uint8_t Disk, uint8_t Partition,
+    uint32_t Low, uint32_t High)
+{
+  afatfsMirrorRange_t *range = FatDisk[Disk].Mirror[Partition];
+  uint8_t *count = &FatDisk[Disk].MirrorCount[Partition];
+  uint32_t gap, nearestGap = 0xFFFFFFFF;
+  uint8_t i, nearest = 0;
+
+  /*
+   * Notes:
+   * 1 - Runs that overlap or touch the new one are merged into it.
+   * 2 - With no run left, the nearest one grows to hold the new one. No
+   *     other run lies between them, so the runs never overlap.
+   */
+  for(i = 0; i < *count; ){
+    if(range[i].Low <= High && Low <= range[i].High){
+      if(range[i].Low < Low){ Low = range[i].Low;}
+      if(range[i].High > High){ High = range[i].High;}
+      (*count)--;
+      range[i] = range[*count];
+    }else{
+      i++;
+    }
+  }
+
+  if(*count < AFATFS_MIRROR_RANGES){
+    range[*count].Low = Low;
+    range[*count].High = High;
+    (*count)++;
+  }else{
+    for(i = 0; i < *count; i++){
+      gap = (range[i].High < Low) ? Low - range[i].High :
+          range[i].Low - High;
+      if(gap < nearestGap){
+        nearestGap = gap;
+        nearest = i;
+      }
+    }
+    if(Low < range[nearest].Low){ range[nearest].Low = Low;}
+    if(High > range[nearest].High){ range[nearest].High = High;}
+  }
+}
+
+
+
+static void AFATFS_MarkFatMirror(uint8_t Disk, uint32_t Sector)
+{
+  uint32_t offset;
+  uint8_t i;
+
+  /* Sectors of the first FAT changed since its copies were last written */
+  for(i = 0; i < AFATS_MAX_PARTITIONS; i++){
+    if(FatDisk[Disk].MBR.FatType[i] == FAT32_LBA &&
+        Sector >= FatDisk[Disk].PPR.FatStartSector[i] &&
+        Sector < FatDisk[Disk].PPR.FatStartSector[i] +
+        FatDisk[Disk].PPR.FatSize[i])
+    {
+      offset = Sector - FatDisk[Disk].PPR.FatStartSector[i];
+      AFATFS_AddMirrorRange(Disk, i, offset, offset + 1);
+      break;
+    }
+  }
+}
+
+
+
+static void AFATFS_CacheDirty(uint8_t Disk, uint8_t *Data)
+{
+  uint8_t i;
+
+  for(i = 0; i < AFATFS_CACHE_SIZE; i++){
+    if(Data == FatDisk[Disk].CacheData[i]){
+      FatDisk[Disk].Slot[i].isDirty = 1;
+      AFATFS_FatBatchUpdate(Disk, FatDisk[Disk].Slot[i].Sector, Data);
+      AFATFS_MarkFatMirror(Disk, FatDisk[Disk].Slot[i].Sector);
+      break;
+    }
+  }
+}
+
+
+
+static void AFATFS_CachePin(uint8_t Disk, uint32_t Sector)
+{
+  uint8_t i = AFATFS_CacheFind(Disk, Sector);
+
+  if(i < AFATFS_CACHE_SIZE){
+    FatDisk[Disk].Slot[i].Pins++;
+  }
+}
+
+
+
+static void AFATFS_CacheUnpin(uint8_t Disk, uint32_t Sector)
+{
+  uint8_t i = AFATFS_CacheFind(Disk, Sector);
+
+  if(i < AFATFS_CACHE_SIZE && FatDisk[Disk].Slot[i].Pins != 0){
+    FatDisk[Disk].Slot[i].Pins--;
+  }
+}
+
+
+
+static uint8_t AFATFS_IsFatSector(uint8_t Disk, uint32_t Sector)
+{
+  uint8_t i;
+
+  for(i = 0; i < AFATS_MAX_PARTITIONS; i++){
+    if(FatDisk[Disk].MBR.FatType[i] == FAT32_LBA &&
+        Sector >= FatDisk[Disk].PPR.FatStartSector[i] &&
+        Sector < FatDisk[Disk].PPR.FatStartSector[i] +
+        FatDisk[Disk].PPR.FatSize[i] * FatDisk[Disk].PPR.FatCopies[i])
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+
+static EStatus_t AFATFS_CacheFlush(uint8_t Disk)
+{
+  EStatus_t returncode = ANSWERED_REQUEST, result;
+  afatfsCacheSlot_t *slot;
+  uint8_t i, isFatPending = 0;
+
+  /*
+   * Notes:
+   * 1 - FAT sectors are written before the other ones, so directory entries
+   *     on the disk never point to clusters not yet allocated on the FAT.
+   * 2 - Every slot that can be written is given to AFATFS_DeviceIO on each
+   *     call, a queued driver writes them at the same time. OPERATION_RUNNING
+   *     is returned until no slot is dirty.
+   * 3 - isDirty is cleared when the write starts, so a change made while it
+   *     is in progress is written again.
+   */
+  for(i = 0; i < AFATFS_CACHE_SIZE; i++){
+    slot = &FatDisk[Disk].Slot[i];
+    if(slot->isValid && (slot->isDirty || slot->isFlushing) &&
+        i != FatDisk[Disk].CacheLoad &&
+        AFATFS_IsFatSector(Disk, slot->Sector))
+    {
+      isFatPending = 1;
+    }
+  }
+
+  for(i = 0; i < AFATFS_CACHE_SIZE; i++){
+    slot = &FatDisk[Disk].Slot[i];
+    if(!slot->isValid || !(slot->isDirty || slot->isFlushing) ||
+        i == FatDisk[Disk].CacheLoad)
+    {
+      continue;
+    }
+    if(isFatPending && !AFATFS_IsFatSector(Disk, slot->Sector)){
+      /* Waiting for the FAT sectors */
+      returncode = OPERATION_RUNNING;
+      continue;
+    }
+    if(!slot->isFlushing){
+      slot->isFlushing = 1;
+      slot->isDirty = 0;
+    }
+    result = AFATFS_DeviceIO(Disk, 1, FatDisk[Disk].CacheData[i],
+        slot->Sector, 1);
+    if(result != OPERATION_RUNNING){
+      slot->isFlushing = 0;
+    }
+    if(result >= RETURN_ERROR_VALUE){
+      slot->isDirty = 1;
+      returncode = result;
+      break;
+    }
+    if(result == OPERATION_RUNNING || slot->isDirty){
+      returncode = OPERATION_RUNNING;
+    }
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_DiskRead(uint8_t Disk, uint8_t *Buffer,
+    uint32_t Sector, uint32_t Count)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  uint32_t i, found;
+  uint8_t slot;
+
+  /* Sectors held by the cache are more recent than the ones on the disk */
+  for(i = 0, found = 0; i < Count; i++){
+    if(AFATFS_CacheFind(Disk, Sector + i) < AFATFS_CACHE_SIZE){ found++;}
+  }
+  if(found < Count){
+    returncode = AFATFS_DeviceIO(Disk, 0, Buffer, Sector, Count);
+  }else{
+    returncode = ANSWERED_REQUEST;
+  }
+  if(returncode == ANSWERED_REQUEST && found != 0){
+    for(i = 0; i < Count; i++){
+      slot = AFATFS_CacheFind(Disk, Sector + i);
+      if(slot < AFATFS_CACHE_SIZE){
+        memcpy(Buffer + (i * AFATFS_MAX_SECTOR_SIZE),
+            FatDisk[Disk].CacheData[slot], AFATFS_MAX_SECTOR_SIZE);
+      }
+    }
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_DiskWrite(uint8_t Disk, uint8_t *Buffer,
+    uint32_t Sector, uint32_t Count)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  uint32_t i;
+  uint8_t slot;
+
+  returncode = AFATFS_DeviceIO(Disk, 1, Buffer, Sector, Count);
+  if(returncode == ANSWERED_REQUEST){
+    AFATFS_BufferInvalidate(Disk, Sector, Count);
+    /* Keeping cached copies equal to the disk */
+    for(i = 0; i < Count; i++){
+      slot = AFATFS_CacheFind(Disk, Sector + i);
+      if(slot < AFATFS_CACHE_SIZE){
+        memcpy(FatDisk[Disk].CacheData[slot],
+            Buffer + (i * AFATFS_MAX_SECTOR_SIZE), AFATFS_MAX_SECTOR_SIZE);
+        FatDisk[Disk].Slot[slot].isDirty = 0;
+      }
+      AFATFS_FatBatchUpdate(Disk, Sector + i,
+          Buffer + (i * AFATFS_MAX_SECTOR_SIZE));
+    }
+  }
+
+  return returncode;
+}
+
+
+static EStatus_t AFATFS_MirrorFat(uint8_t Disk, uint8_t Partition)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsDiskContext_t *ctx = &FatDisk[Disk].Ctx;
+  afatfsMirrorRange_t *range = FatDisk[Disk].Mirror[Partition];
+  uint8_t *count = &FatDisk[Disk].MirrorCount[Partition];
+  uint32_t sector;
+  uint8_t i, first;
+
+  /*
+   * Steps:
+   * 1 - Take up to AFATFS_MIRROR_BATCH sectors from the start of the lowest
+   *     run, and read them from the first FAT (cached ones are newer).
+   * 2 - Write them to each of the other copies with one command per copy.
+   * 3 - Go to the next sectors until no run is left.
+   *
+   * Notes:
+   * 1 - Sectors are taken out of the runs before they are read, so a change
+   *     made meanwhile starts a new run and is copied again. The runs never
+   *     move the command in progress.
+   * 2 - The caller holds the disk lock (AFATFS_LOCK_SYNC or _RESYNC), so the
+   *     FAT does not change during the copy.
+   * 3 - Sectors not copied because of an error go back to the runs.
+   */
+  if(FatDisk[Disk].PPR.FatCopies[Partition] < 2){
+    *count = 0;
+    return ANSWERED_REQUEST;
+  }
+
+  if(ctx->MirrorLength == 0){
+    if(*count == 0){
+      return ANSWERED_REQUEST;
+    }
+    for(i = 1, first = 0; i < *count; i++){
+      if(range[i].Low < range[first].Low){ first = i;}
+    }
+    ctx->MirrorOffset = range[first].Low;
+    ctx->MirrorLength = range[first].High - range[first].Low;
+    if(ctx->MirrorLength > AFATFS_MIRROR_BATCH){
+      ctx->MirrorLength = AFATFS_MIRROR_BATCH;
+    }
+    ctx->MirrorCopy = 0;
+    range[first].Low += ctx->MirrorLength;
+    if(range[first].Low >= range[first].High){
+      (*count)--;
+      range[first] = range[*count];
+    }
+  }
+
+  sector = FatDisk[Disk].PPR.FatStartSector[Partition] + ctx->MirrorOffset +
+      (ctx->MirrorCopy * FatDisk[Disk].PPR.FatSize[Partition]);
+  if(ctx->MirrorCopy == 0){
+    returncode = AFATFS_DiskRead(Disk, FatDisk[Disk].MirrorBuffer[0], sector,
+        ctx->MirrorLength);
+  }else{
+    returncode = AFATFS_DiskWrite(Disk, FatDisk[Disk].MirrorBuffer[0], sector,
+        ctx->MirrorLength);
+  }
+  if(returncode == ANSWERED_REQUEST){
+    ctx->MirrorCopy++;
+    if(ctx->MirrorCopy >= FatDisk[Disk].PPR.FatCopies[Partition]){
+      ctx->MirrorCopy = 0;
+      ctx->MirrorLength = 0;
+    }
+    returncode = (ctx->MirrorLength == 0 && *count == 0) ?
+        ANSWERED_REQUEST : OPERATION_RUNNING;
+  }else if(returncode >= RETURN_ERROR_VALUE){
+    AFATFS_AddMirrorRange(Disk, Partition, ctx->MirrorOffset,
+        ctx->MirrorOffset + ctx->MirrorLength);
+    ctx->MirrorCopy = 0;
+    ctx->MirrorLength = 0;
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_ReadBootSector(uint8_t Disk)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  uint32_t i, counter;
+  uint8_t *data;
+
+  if(Disk < AFATS_MAX_DISKS)
+  {
+
+    returncode = AFATFS_CacheGet(Disk, 0, &data);
+    if(returncode == ANSWERED_REQUEST)
+    {
+      memcpy(&FatDisk[Disk].MBR.Signature,
+          &data[FAT_SIGNATURE_OFFSET], 2);
+      /* Verifying the FAT boot sector signature */
+      if(FatDisk[Disk].MBR.Signature == FAT_BOOT_SIGNATURE)
+      {
+        counter = 0;
+        /* Saving the FAT type, the partition's start sector and length */
+        for(i = 0; i < FAT_PARTITION_QTY; i++)
+        {
+          if(i < AFATS_MAX_PARTITIONS)
+          {
+            FatDisk[Disk].MBR.FatType[i] =
+                data[FAT_PARTITION_RECORD0_OFFSET +
+                     (FAT_PARTITION_RECORD_SIZE * i) +
+                     FAT_TYPE_OF_PARTITION_OFFSET];
+            memcpy(&FatDisk[Disk].MBR.StartLBA[i],
+                &data[FAT_PARTITION_RECORD0_OFFSET +
+                      (FAT_PARTITION_RECORD_SIZE * i) +
+                      FAT_START_LBA_OFFSET], 4);
+            memcpy(&FatDisk[Disk].MBR.LengthLBA[i],
+                &data[FAT_PARTITION_RECORD0_OFFSET +
+                      (FAT_PARTITION_RECORD_SIZE * i) +
+                      FAT_LENGTH_OFFSET], 4);
+            if(FatDisk[Disk].MBR.FatType[i] == FAT32_LBA){
+              counter++;
+            }
+          }else{
+            break;
+          }
+        }
+        if(counter == 0){
+          returncode = ERR_INVALID_FILE_SYSTEM;
+        }
+      }else{
+        /* Failed to find a FAT file system */
+        returncode = ERR_FAILED;
+      }
+    }
+
+  }else{
+    returncode = ERR_PARAM_ID;
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_ReadBiosParameter(uint8_t Disk, uint8_t Partition)
+{
+  PartitionParameterTable_t Parameters;
+  EStatus_t returncode = OPERATION_RUNNING;
+  uint32_t fatStart, fatSize, dataStart;
+  uint8_t *data;
+
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
+  {
+
+    if(FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA)
+    {
+
+      returncode = AFATFS_CacheGet(Disk, FatDisk[Disk].MBR.StartLBA[Partition],
+          &data);
+      if(returncode == ANSWERED_REQUEST)
+      {
+        memcpy(&Parameters, data, sizeof(Parameters));
+
+        fatStart = FatDisk[Disk].MBR.StartLBA[Partition] +
+            Parameters.reservedSectors;
+        fatSize = Parameters.tableSize;
+        dataStart = fatStart + (fatSize * Parameters.fatCopies);
+        FatDisk[Disk].PPR.RootSector[Partition] = dataStart +
+            Parameters.sectorsPerCluster * (Parameters.rootCluster - 2);
+        FatDisk[Disk].PPR.RootCluster[Partition] = Parameters.rootCluster;
+        /* The next two are important to determine file sectors */
+        FatDisk[Disk].PPR.FatStartSector[Partition] = fatStart;
+        FatDisk[Disk].PPR.FatSize[Partition] = fatSize;
+        FatDisk[Disk].PPR.FatCopies[Partition] = Parameters.fatCopies;
+        FatDisk[Disk].PPR.DataStartSector[Partition] = dataStart;
+        FatDisk[Disk].PPR.SectorPerCluster[Partition] =
+            Parameters.sectorsPerCluster;
+        FatDisk[Disk].PPR.FsInfoSector[Partition] =
+            FatDisk[Disk].MBR.StartLBA[Partition] + Parameters.fatInfo;
+        if(Parameters.sectorsPerCluster != 0){
+          FatDisk[Disk].PPR.ClusterCount[Partition] =
+              (Parameters.totalSectorCount -
+                  (dataStart - FatDisk[Disk].MBR.StartLBA[Partition])) /
+                  Parameters.sectorsPerCluster;
+        }else{
+          returncode = ERR_INVALID_FILE_SYSTEM;
+        }
+      }
+
+    }else{
+      returncode = ERR_INVALID_FILE_SYSTEM;
+    }
+
+  }else{
+    returncode = ERR_PARAM_VALUE;
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_DirEntrySector(uint8_t Disk, uint8_t Partition,
+    afatfsDirCursor_t *Cursor, uint32_t DirCluster, uint32_t Entry,
+    uint32_t *Sector)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  uint32_t perCluster = 16 * FatDisk[Disk].PPR.SectorPerCluster[Partition];
+  uint32_t index = Entry / perCluster;
+  uint32_t next, fatSector;
+  uint8_t *data;
+
+  /*
+   * Notes:
+   * 1 - The cluster holding Entry is found by following the directory chain
+   *     from the cluster of the last call, or from the first one if the
+   *     directory changed or Entry is before it. The walk goes on while the
+   *     FAT entries are on cached sectors, reading one FAT sector per call.
+   *     The cluster just before is kept too, as long names may start there.
+   * 2 - ERR_RESOURCE_DEPLETED is returned if Entry is past the end of the
+   *     chain, with the cursor left on the last cluster.
+   */
+  if(Cursor->Base == DirCluster && Cursor->Prev >= FAT_FIRST_CLUSTER &&
+      index + 1 == Cursor->Index)
+  {
+    Cursor->Cluster = Cursor->Prev;
+    Cursor->Prev = 0;
+    Cursor->Index--;
+  }
+  if(Cursor->Cluster < FAT_FIRST_CLUSTER || Cursor->Base != DirCluster ||
+      index < Cursor->Index)
+  {
+    Cursor->Base = DirCluster;
+    Cursor->Cluster = DirCluster;
+    Cursor->Prev = 0;
+    Cursor->Index = 0;
+  }
+
+  while(Cursor->Index < index)
+  {
+    fatSector = Cursor->Cluster / FAT_ENTRIES_PER_SECTOR;
+    returncode = AFATFS_CacheGet(Disk,
+        FatDisk[Disk].PPR.FatStartSector[Partition] + fatSector, &data);
+    if(returncode != ANSWERED_REQUEST){
+      return returncode;
+    }
+    do{
+      memcpy(&next, &data[FAT_ENTRY_SIZE *
+          (Cursor->Cluster - (fatSector * FAT_ENTRIES_PER_SECTOR))],
+          FAT_ENTRY_SIZE);
+      next &= FAT_ENTRY_MASK;
+      if(next >= FAT_ENTRY_EOC_MIN){
+        /* Reached the end of the chain */
+        return ERR_RESOURCE_DEPLETED;
+      }
+      if(next < FAT_FIRST_CLUSTER || next == FAT_ENTRY_BAD ||
+          next >= FatDisk[Disk].PPR.ClusterCount[Partition] +
+          FAT_FIRST_CLUSTER ||
+          (Cursor->Index + 1) * perCluster >= FAT_MAX_DIR_ENTRIES)
+      {
+        /* Free or bad cluster inside the chain, or a loop */
+        return ERR_INVALID_FILE_SYSTEM;
+      }
+      Cursor->Prev = Cursor->Cluster;
+      Cursor->Cluster = next;
+      Cursor->Index++;
+    }while(Cursor->Index < index &&
+        next / FAT_ENTRIES_PER_SECTOR == fatSector);
+  }
+
+  *Sector = FatDisk[Disk].PPR.DataStartSector[Partition] +
+      (FatDisk[Disk].PPR.SectorPerCluster[Partition] * (Cursor->Cluster - 2)) +
+      ((Entry / 16) % FatDisk[Disk].PPR.SectorPerCluster[Partition]);
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+static void AFATFS_ResetDirIndex(uint8_t Disk, uint8_t Partition)
+{
+  uint32_t i;
+
+  FatDisk[Disk].IndexSector[Partition] = 0;
+  FatDisk[Disk].IndexCursor[Partition].Cluster = 0;
+  FatDisk[Disk].IndexLfnOrder[Partition] = 0;
+  if(FatDisk[Disk].Index[Partition] != NULL){
+    for(i = 0; i < FatDisk[Disk].IndexSize[Partition]; i++){
+      FatDisk[Disk].Index[Partition][i].Entry = AFATFS_INDEX_FREE_SLOT;
+    }
+    FatDisk[Disk].IndexState[Partition] = AFATFS_INDEX_BUILDING;
+  }else{
+    FatDisk[Disk].IndexState[Partition] = AFATFS_INDEX_OFF;
+  }
+}
+
+
+
+static uint16_t AFATFS_NameHash(const uint8_t *Name, const uint8_t *Extension)
+{
+  uint32_t hash = 2166136261u;
+  uint8_t i;
+
+  /* FNV-1a over the 11 bytes of the name as stored on the entry */
+  for(i = 0; i < 8; i++){
+    hash = (hash ^ Name[i]) * 16777619u;
+  }
+  for(i = 0; i < 3; i++){
+    hash = (hash ^ Extension[i]) * 16777619u;
+  }
+
+  return (uint16_t)(hash ^ (hash >> 16));
+}
+
+
+
+/* Offsets of the 13 UTF-16 characters inside a long name entry */
+static const uint8_t AFATFS_LfnOffset[FAT_LFN_CHARS_PER_ENTRY] =
+    {1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30};
+
+
+
+static uint16_t AFATFS_FoldCase(uint16_t Char)
+{
+  /* Long names are compared ignoring the case of ASCII letters only */
+  if(Char >= 'a' && Char <= 'z'){
+    Char -= 'a' - 'A';
+  }
+
+  return Char;
+}
+
+
+
+static uint8_t AFATFS_ShortNameSum(const uint8_t *Name,
+    const uint8_t *Extension)
+{
+  uint8_t sum = 0;
+  uint8_t i;
+
+  /* Checksum of the 11 bytes of the short name, kept on each entry of the
+   * long name so a chain is known to belong to the short entry after it */
+  for(i = 0; i < 8; i++){
+    sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + Name[i]);
+  }
+  for(i = 0; i < 3; i++){
+    sum = (uint8_t)(((sum & 1) << 7) + (sum >> 1) + Extension[i]);
+  }
+
+  return sum;
+}
+
+
+
+static void AFATFS_BuildLongEntry(const char *Name, uint8_t Length,
+    uint8_t Order, uint8_t Sum, uint8_t *Entry)
+{
+  uint32_t pos = (uint32_t)(Order - 1) * FAT_LFN_CHARS_PER_ENTRY;
+  uint16_t unit;
+  uint8_t i;
+
+  /* Characters are stored as UTF-16, the name ends with 0x0000 and the rest
+   * of the last entry is filled with 0xFFFF */
+  memset(Entry, 0, sizeof(DirectoryEntryFat32_t));
+  Entry[FAT_LFN_ORDER_OFFSET] = Order;
+  if(Order == (Length + FAT_LFN_CHARS_PER_ENTRY - 1) / FAT_LFN_CHARS_PER_ENTRY){
+    Entry[FAT_LFN_ORDER_OFFSET] |= FAT_LFN_LAST_ENTRY;
+  }
+  Entry[FAT_LFN_ATTRIBUTE_OFFSET] = FAT_ATTRIBUTE_LONG_NAME;
+  Entry[FAT_LFN_CHECKSUM_OFFSET] = Sum;
+  for(i = 0; i < FAT_LFN_CHARS_PER_ENTRY; i++, pos++){
+    if(pos < Length){
+      unit = (uint8_t)Name[pos];
+    }else if(pos == Length){
+      unit = 0x0000;
+    }else{
+      unit = 0xFFFF;
+    }
+    Entry[AFATFS_LfnOffset[i]] = unit & 0xFF;
+    Entry[AFATFS_LfnOffset[i] + 1] = unit >> 8;
+  }
+}
+
+
+
+static uint8_t AFATFS_LongNamePart(const char *Name, uint8_t Length,
+    const uint8_t *Entry)
+{
+  uint32_t pos;
+  uint16_t unit;
+  uint8_t i;
+
+  /* Compares the characters of one long name entry with the part of Name
+   * it holds */
+  pos = (uint32_t)((Entry[FAT_LFN_ORDER_OFFSET] & FAT_LFN_ORDER_MASK) - 1) *
+      FAT_LFN_CHARS_PER_ENTRY;
+  for(i = 0; i < FAT_LFN_CHARS_PER_ENTRY; i++, pos++){
+    unit = Entry[AFATFS_LfnOffset[i]] |
+        (uint16_t)(Entry[AFATFS_LfnOffset[i] + 1] << 8);
+    if(pos >= Length){
+      return (unit == 0x0000);
+    }
+    if(AFATFS_FoldCase(unit) != AFATFS_FoldCase((uint8_t)Name[pos])){
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+
+
+static uint32_t AFATFS_LongEntryHash(const uint8_t *Entry)
+{
+  uint32_t hash = 2166136261u;
+  uint16_t unit;
+  uint8_t i;
+
+  /* FNV-1a over the order and the case folded characters of one entry. The
+   * entries of a name are combined with XOR, so they can be hashed in the
+   * order they are stored on the directory */
+  hash = (hash ^ (Entry[FAT_LFN_ORDER_OFFSET] & FAT_LFN_ORDER_MASK)) *
+      16777619u;
+  for(i = 0; i < FAT_LFN_CHARS_PER_ENTRY; i++){
+    unit = AFATFS_FoldCase(Entry[AFATFS_LfnOffset[i]] |
+        (uint16_t)(Entry[AFATFS_LfnOffset[i] + 1] << 8));
+    if(unit == 0x0000){
+      break;
+    }
+    hash = (hash ^ (unit & 0xFF)) * 16777619u;
+    hash = (hash ^ (unit >> 8)) * 16777619u;
+  }
+
+  return hash;
+}
+
+
+
+static uint16_t AFATFS_LongNameHash(const char *Name, uint8_t Length)
+{
+  uint8_t entry[sizeof(DirectoryEntryFat32_t)];
+  uint32_t hash = 0;
+  uint8_t order, count;
+
+  /* Same value AFATFS_BuildDirIndex gets from the entries on the disk */
+  count = (Length + FAT_LFN_CHARS_PER_ENTRY - 1) / FAT_LFN_CHARS_PER_ENTRY;
+  for(order = 1; order <= count; order++){
+    AFATFS_BuildLongEntry(Name, Length, order, 0, entry);
+    hash ^= AFATFS_LongEntryHash(entry);
+  }
+
+  return (uint16_t)(hash ^ (hash >> 16));
+}
+
+
+
+static void AFATFS_IndexInsert(uint8_t Disk, uint8_t Partition,
+    uint16_t Hash, uint32_t Entry, uint32_t Cluster)
+{
+  AfatfsDirIndex_t *slot;
+  uint32_t i, size = FatDisk[Disk].IndexSize[Partition];
+
+  /* Open addressing, looking at the next slots until a free one. The last
+   * entry of a full directory has the number of a free slot */
+  for(i = 0; i < size && Entry < AFATFS_INDEX_FREE_SLOT; i++){
+    slot = &FatDisk[Disk].Index[Partition][(Hash + i) % size];
+    if(slot->Entry == AFATFS_INDEX_FREE_SLOT){
+      slot->Hash = Hash;
+      slot->Entry = Entry;
+      slot->Cluster = Cluster;
+      return;
+    }
+  }
+
+  /* Full, the directory is read as if there was no index */
+  FatDisk[Disk].IndexState[Partition] = AFATFS_INDEX_OFF;
+}
+
+
+
+static void AFATFS_IndexUpdate(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle)
+{
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  AfatfsDirIndex_t *slot;
+  uint32_t i, size = FatDisk[Disk].IndexSize[Partition];
+  uint16_t hash;
+
+  /* Keeping the first cluster of the file, it changes when an empty file
+   * gets its first cluster */
+  if(FatDisk[Disk].IndexState[Partition] != AFATFS_INDEX_READY ||
+      file->DirCluster != FatDisk[Disk].PPR.RootCluster[Partition])
+  {
+    return;
+  }
+  hash = AFATFS_NameHash(file->Name, file->Extension);
+  for(i = 0; i < size; i++){
+    slot = &FatDisk[Disk].Index[Partition][(hash + i) % size];
+    if(slot->Entry == AFATFS_INDEX_FREE_SLOT){
+      break;
+    }
+    if(slot->Entry == file->Entry){
+      if(slot->Cluster != file->ClusterFirst){
+        /* Rare, so the slot of the long name is looked for slot by slot */
+        for(i = 0; i < size; i++){
+          slot = &FatDisk[Disk].Index[Partition][i];
+          if(slot->Entry == file->Entry){
+            slot->Cluster = file->ClusterFirst;
+          }
+        }
+      }
+      break;
+    }
+  }
+}
+
+
+
+static void AFATFS_IndexLongEntry(uint8_t Disk, uint8_t Partition,
+    const uint8_t *Entry)
+{
+  uint8_t *order = &FatDisk[Disk].IndexLfnOrder[Partition];
+  uint8_t *sum = &FatDisk[Disk].IndexLfnSum[Partition];
+  uint32_t *hash = &FatDisk[Disk].IndexLfnHash[Partition];
+
+  /* Chains start with the last part of the name and count down to 1, all
+   * with the checksum of the same short name */
+  if(Entry[FAT_LFN_ORDER_OFFSET] & FAT_LFN_LAST_ENTRY){
+    *order = Entry[FAT_LFN_ORDER_OFFSET] & FAT_LFN_ORDER_MASK;
+    *sum = Entry[FAT_LFN_CHECKSUM_OFFSET];
+    *hash = AFATFS_LongEntryHash(Entry);
+  }else if(*order > 1 && Entry[FAT_LFN_ORDER_OFFSET] == *order - 1 &&
+      Entry[FAT_LFN_CHECKSUM_OFFSET] == *sum)
+  {
+    *order = Entry[FAT_LFN_ORDER_OFFSET];
+    *hash ^= AFATFS_LongEntryHash(Entry);
+  }else{
+    *order = 0;
+  }
+}
+
+
+
+static EStatus_t AFATFS_BuildDirIndex(uint8_t Disk, uint8_t Partition)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  uint32_t *sector = &FatDisk[Disk].IndexSector[Partition];
+  uint8_t *lfnOrder = &FatDisk[Disk].IndexLfnOrder[Partition];
+  DirectoryEntryFat32_t *entry;
+  uint32_t absolute;
+  uint8_t *data;
+  uint8_t i;
+
+  /*
+   * Notes:
+   * 1 - One directory sector is indexed per call. Any open or create of the
+   *     partition moves the building forward, so it does not matter which
+   *     one calls first.
+   * 2 - Free entries and long name entries are not indexed. A file with a
+   *     long name takes two slots, one for each name.
+   * 3 - Every cluster of the directory is indexed, IndexCursor goes along
+   *     the cluster chain.
+   */
+  if(FatDisk[Disk].IndexState[Partition] != AFATFS_INDEX_BUILDING){
+    return ANSWERED_REQUEST;
+  }
+
+  returncode = AFATFS_DirEntrySector(Disk, Partition,
+      &FatDisk[Disk].IndexCursor[Partition],
+      FatDisk[Disk].PPR.RootCluster[Partition], *sector * 16, &absolute);
+  if(returncode == ANSWERED_REQUEST){
+    returncode = AFATFS_CacheGet(Disk, absolute, &data);
+  }else if(returncode == ERR_RESOURCE_DEPLETED){
+    /* Every cluster of the directory was indexed */
+    FatDisk[Disk].IndexState[Partition] = AFATFS_INDEX_READY;
+    return ANSWERED_REQUEST;
+  }
+  if(returncode == ANSWERED_REQUEST)
+  {
+    returncode = OPERATION_RUNNING;
+    for(i = 0; i < 16; i++){
+      entry = (DirectoryEntryFat32_t *)&data[i * sizeof(*entry)];
+      if(entry->Name[0] == FAT_END_OF_DIR ||
+          FatDisk[Disk].IndexState[Partition] != AFATFS_INDEX_BUILDING)
+      {
+        returncode = ANSWERED_REQUEST;
+        break;
+      }
+      if(entry->Name[0] == FAT_UNUSED_ENTRY){
+        *lfnOrder = 0;
+      }else if(entry->Attributes == FAT_ATTRIBUTE_LONG_NAME){
+        AFATFS_IndexLongEntry(Disk, Partition, (uint8_t *)entry);
+      }else{
+        AFATFS_IndexInsert(Disk, Partition,
+            AFATFS_NameHash(entry->Name, entry->Ext), (*sector * 16) + i,
+            ((uint32_t)entry->FirstClusterHi << 16) |
+            entry->FirstClusterLow);
+        if(*lfnOrder == 1 && FatDisk[Disk].IndexLfnSum[Partition] ==
+            AFATFS_ShortNameSum(entry->Name, entry->Ext))
+        {
+          /* The file is also found by its long name */
+          AFATFS_IndexInsert(Disk, Partition,
+              (uint16_t)(FatDisk[Disk].IndexLfnHash[Partition] ^
+                  (FatDisk[Disk].IndexLfnHash[Partition] >> 16)),
+              (*sector * 16) + i,
+              ((uint32_t)entry->FirstClusterHi << 16) |
+              entry->FirstClusterLow);
+        }
+        *lfnOrder = 0;
+      }
+    }
+    (*sector)++;
+    if(returncode == ANSWERED_REQUEST &&
+        FatDisk[Disk].IndexState[Partition] == AFATFS_INDEX_BUILDING)
+    {
+      FatDisk[Disk].IndexState[Partition] = AFATFS_INDEX_READY;
+    }
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_ReadFsInfo(uint8_t Disk, uint8_t Partition)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  uint32_t leadSignature, structSignature, freeCount, nextFree;
+  uint8_t *data;
+
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
+  {
+
+    returncode = AFATFS_CacheGet(Disk, FatDisk[Disk].PPR.FsInfoSector[Partition],
+        &data);
+    if(returncode == ANSWERED_REQUEST)
+    {
+      memcpy(&leadSignature,
+          &data[FAT_FSINFO_LEAD_SIGNATURE_OFFSET], 4);
+      memcpy(&structSignature,
+          &data[FAT_FSINFO_STRUCT_SIGNATURE_OFFSET], 4);
+      memcpy(&freeCount, &data[FAT_FSINFO_FREE_COUNT_OFFSET], 4);
+      memcpy(&nextFree, &data[FAT_FSINFO_NEXT_FREE_OFFSET], 4);
+
+      /* Both values are only hints, anything out of range means unknown */
+      if(leadSignature != FAT_FSINFO_LEAD_SIGNATURE ||
+          structSignature != FAT_FSINFO_STRUCT_SIGNATURE)
+      {
+        freeCount = FAT_FSINFO_UNKNOWN;
+        nextFree = FAT_FSINFO_UNKNOWN;
+      }
+      if(freeCount > FatDisk[Disk].PPR.ClusterCount[Partition]){
+        freeCount = FAT_FSINFO_UNKNOWN;
+      }
+      if(nextFree < FAT_FIRST_CLUSTER || nextFree >=
+          FatDisk[Disk].PPR.ClusterCount[Partition] + FAT_FIRST_CLUSTER)
+      {
+        nextFree = FAT_FSINFO_UNKNOWN;
+      }
+      FatDisk[Disk].PPR.FreeCount[Partition] = freeCount;
+      FatDisk[Disk].PPR.NextFree[Partition] = nextFree;
+      FatDisk[Disk].isFsInfoDirty[Partition] = 0;
+      FatDisk[Disk].MirrorCount[Partition] = 0;
+      FatDisk[Disk].Ctx.MirrorLength = 0;
+      /* The disk might have changed, every FAT sector may have free entries */
+      if(FatDisk[Disk].FreeMap[Partition] != NULL){
+        memset(FatDisk[Disk].FreeMap[Partition], 0xFF,
+            FatDisk[Disk].FreeMapSize[Partition]);
+      }
+      /* ... and the directory index is built again */
+      AFATFS_ResetDirIndex(Disk, Partition);
+    }
+
+  }else{
+    returncode = ERR_PARAM_VALUE;
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_WriteFsInfo(uint8_t Disk, uint8_t Partition)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  uint8_t *data;
+
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
+  {
+
+    /* The sector is written back when the cache is flushed */
+    returncode = AFATFS_CacheGet(Disk, FatDisk[Disk].PPR.FsInfoSector[Partition],
+        &data);
+    if(returncode == ANSWERED_REQUEST)
+    {
+      memcpy(&data[FAT_FSINFO_FREE_COUNT_OFFSET],
+          &FatDisk[Disk].PPR.FreeCount[Partition], 4);
+      memcpy(&data[FAT_FSINFO_NEXT_FREE_OFFSET],
+          &FatDisk[Disk].PPR.NextFree[Partition], 4);
+      AFATFS_CacheDirty(Disk, data);
+      FatDisk[Disk].isFsInfoDirty[Partition] = 0;
+    }
+
+  }else{
+    returncode = ERR_PARAM_VALUE;
+  }
+
+  return returncode;
+}
+
+
+
+static uint32_t AFATFS_GetFreeHint(uint8_t Disk, uint8_t Partition,
+    uint32_t DirCluster, afatfsDirCursor_t *Cursor)
+{
+#if AFATFS_FREE_HINT_SIZE > 0
+  afatfsFreeHint_t *hint;
+  uint8_t i;
+
+  /* The cursor goes on from the cluster of the hint, so the chain is not
+   * followed from the start */
+  for(i = 0; i < AFATFS_FREE_HINT_SIZE; i++){
+    hint = &FatDisk[Disk].FreeHint[i];
+    if(hint->Dir.Base == DirCluster && hint->Partition == Partition){
+      hint->Age = ++FatDisk[Disk].FreeHintClock;
+      *Cursor = hint->Dir;
+      return hint->Entry;
+    }
+  }
+#else
+  (void)Disk;
+  (void)Partition;
+  (void)DirCluster;
+  (void)Cursor;
+#endif
+
+  /* Nothing known, the directory is read from the start */
+  return 0;
+}
+
+
+
+static void AFATFS_SetFreeHint(uint8_t Disk, uint8_t Partition,
+    const afatfsDirCursor_t *Cursor, uint32_t Entry)
+{
+#if AFATFS_FREE_HINT_SIZE > 0
+  afatfsFreeHint_t *hint;
+  uint8_t i, lru = 0;
+
+  /* Taking the slot of the directory, or the one not used for the longest
+   * time */
+  for(i = 0; i < AFATFS_FREE_HINT_SIZE; i++){
+    hint = &FatDisk[Disk].FreeHint[i];
+    if(hint->Dir.Base == Cursor->Base && hint->Partition == Partition){
+      lru = i;
+      break;
+    }
+    if(hint->Age < FatDisk[Disk].FreeHint[lru].Age){
+      /* Free slots have the age 0 */
+      lru = i;
+    }
+  }
+
+  hint = &FatDisk[Disk].FreeHint[lru];
+  hint->Dir = *Cursor;
+  if(Cursor->Index * 16 * FatDisk[Disk].PPR.SectorPerCluster[Partition] >
+      Entry)
+  {
+    /* The cursor went past Entry, the chain is followed from the start */
+    hint->Dir.Cluster = 0;
+  }
+  hint->Partition = Partition;
+  hint->Entry = Entry;
+  hint->Age = ++FatDisk[Disk].FreeHintClock;
+#else
+  (void)Disk;
+  (void)Partition;
+  (void)Cursor;
+  (void)Entry;
+#endif
+}
+
+
+
+static EStatus_t AFATFS_ReadRootDirEntry(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle, uint32_t SectorOffset)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  uint32_t sector;
+  uint8_t *data;
+
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
+  {
+
+    if(FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA)
+    {
+
+      /* SectorOffset counts the sectors of every cluster of the directory */
+      returncode = AFATFS_DirEntrySector(Disk, Partition,
+          &Fat32File[FileHandle].Ctx.Dir, Fat32File[FileHandle].DirCluster,
+          SectorOffset * 16, &sector);
+      if(returncode == ANSWERED_REQUEST){
+        returncode = AFATFS_CacheGet(Disk, sector, &data);
+        if(returncode == ANSWERED_REQUEST)
+        {
+          memcpy(&FatDisk[Disk].RootDir[0], data,
+              sizeof(FatDisk[Disk].RootDir));
+        }
+      }
+
+    }else{
+      returncode = ERR_INVALID_FILE_SYSTEM;
+    }
+
+  }else{
+    returncode = ERR_PARAM_VALUE;
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_FindEmptyRootEntry(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle, uint32_t Count, uint32_t *Entry, uint32_t *Sector)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsContext_t *ctx = &Fat32File[FileHandle].Ctx;
+  uint32_t *sectorOffset = &ctx->DirSector;
+  uint32_t *freeRun = &ctx->FreeRun;
+
+  /*
+   * Notes:
+   * 1 - Count consecutive free entries are looked for (a long name and its
+   *     short entry), they may cross sectors and clusters. Entry is the
+   *     first of them, Sector holds the last one.
+   * 2 - The scan starts at the free slot hint of the directory, as the
+   *     entries before it are in use.
+   * 3 - ERR_RESOURCE_DEPLETED is returned at the end of the cluster chain.
+   *     The scan goes on from where it stopped on the next call, so a
+   *     cluster can be added to the directory meanwhile.
+   */
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
+  {
+
+    if(!ctx->isFreeScan){
+      ctx->isFreeScan = 1;
+      ctx->FirstFree = 0xFFFFFFFF;
+      *sectorOffset = AFATFS_GetFreeHint(Disk, Partition,
+          Fat32File[FileHandle].DirCluster, &ctx->Dir) / 16;
+      *freeRun = 0;
+    }
+
+    if(*sectorOffset * 16 >= FAT_MAX_DIR_ENTRIES){
+      /* The directory can not grow anymore */
+      returncode = ERR_FAILED;
+    }else{
+      returncode = AFATFS_ReadRootDirEntry(Disk, Partition, FileHandle,
+          *sectorOffset);
+    }
+    if(returncode == ANSWERED_REQUEST){
+      *Entry = 0xFFFFFFFF;
+      for(int i = 0; i < 16; i++){
+        if(FatDisk[Disk].RootDir[i].Name[0] == FAT_END_OF_DIR ||
+            FatDisk[Disk].RootDir[i].Name[0] == FAT_UNUSED_ENTRY){
+          if(ctx->FirstFree == 0xFFFFFFFF){
+            ctx->FirstFree = (*sectorOffset * 16) + i;
+          }
+          (*freeRun)++;
+          if(*freeRun >= Count){
+            *Entry = (*sectorOffset * 16) + i + 1 - Count;
+            break;
+          }
+        }else{
+          *freeRun = 0;
+        }
+      }
+      if(*Entry == 0xFFFFFFFF){
+        (*sectorOffset)++;
+        returncode = OPERATION_RUNNING;
+      }else{
+        /* Cached by AFATFS_ReadRootDirEntry, found again without reading */
+        AFATFS_DirEntrySector(Disk, Partition, &ctx->Dir,
+            Fat32File[FileHandle].DirCluster, *sectorOffset * 16, Sector);
+        ctx->isFreeScan = 0;
+        *freeRun = 0;
+      }
+    }else if(returncode >= RETURN_ERROR_VALUE &&
+        returncode != ERR_RESOURCE_DEPLETED)
+    {
+      ctx->isFreeScan = 0;
+      *freeRun = 0;
+    }
+
+  }else{
+    ctx->isFreeScan = 0;
+    *freeRun = 0;
+    returncode = ERR_PARAM_VALUE;
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_AddLongName(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  uint32_t count, entry, sector;
+  uint8_t *data;
+  uint8_t sum;
+
+  /*
+   * Notes:
+   * 1 - The long name takes the entries just before the short one, last part
+   *     first. The entries of one cached sector are written per call, the
+   *     name may start on the previous cluster of the directory.
+   */
+  count = (file->Ctx.LongLength + FAT_LFN_CHARS_PER_ENTRY - 1) /
+      FAT_LFN_CHARS_PER_ENTRY;
+  entry = file->Entry - count + file->Ctx.LongDone;
+  returncode = AFATFS_DirEntrySector(Disk, Partition, &file->Ctx.Dir,
+      file->DirCluster, entry, &sector);
+  if(returncode == ANSWERED_REQUEST){
+    returncode = AFATFS_CacheGet(Disk, sector, &data);
+  }
+  if(returncode == ANSWERED_REQUEST)
+  {
+    sum = AFATFS_ShortNameSum(file->Name, file->Extension);
+    do{
+      AFATFS_BuildLongEntry(file->Ctx.LongName, file->Ctx.LongLength,
+          count - file->Ctx.LongDone, sum,
+          &data[(entry % 16) * sizeof(DirectoryEntryFat32_t)]);
+      file->Ctx.LongDone++;
+      entry++;
+    }while(file->Ctx.LongDone < count && (entry % 16) != 0);
+    AFATFS_CacheDirty(Disk, data);
+    if(file->Ctx.LongDone < count){
+      returncode = OPERATION_RUNNING;
+    }
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_AddRootEntry(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  DirectoryEntryFat32_t entry;
+  uint8_t *data;
+
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
+  {
+    /* The entry is built on the cached sector, written back when the cache
+     * is flushed */
+    returncode = AFATFS_CacheGet(Disk, file->EntrySector, &data);
+    if(returncode == ANSWERED_REQUEST)
+    {
+      /* No date and time support for now, nothing special on attributes */
+      memset(&entry, 0, sizeof(entry));
+      memcpy(entry.Name, file->Name, 8);
+      memcpy(entry.Ext, file->Extension, 3);
+      entry.Reserved = file->Ctx.NameCase;
+      entry.FirstClusterLow = file->Ctx.NewCluster & 0xFFFF;
+      entry.FirstClusterHi = (file->Ctx.NewCluster >> 16) & 0xFFFF;
+      memcpy(&data[(file->Entry % 16) * sizeof(entry)], &entry,
+          sizeof(entry));
+      AFATFS_CacheDirty(Disk, data);
+    }
+  }else{
+    returncode = ERR_PARAM_VALUE;
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_ClearCluster(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle, uint32_t Cluster)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsContext_t *ctx = &Fat32File[FileHandle].Ctx;
+
+  /* One sector written per call, cached copies are updated by
+   * AFATFS_DiskWrite */
+  returncode = AFATFS_DiskWrite(Disk, AFATFS_ZeroSector,
+      FatDisk[Disk].PPR.DataStartSector[Partition] +
+      (FatDisk[Disk].PPR.SectorPerCluster[Partition] * (Cluster - 2)) +
+      ctx->ZeroDone, 1);
+  if(returncode == ANSWERED_REQUEST){
+    ctx->ZeroDone++;
+    if(ctx->ZeroDone < FatDisk[Disk].PPR.SectorPerCluster[Partition]){
+      returncode = OPERATION_RUNNING;
+    }else{
+      ctx->ZeroDone = 0;
+    }
+  }else if(returncode >= RETURN_ERROR_VALUE){
+    ctx->ZeroDone = 0;
+  }
+
+  return returncode;
+}
+
+
+
+
+static uint8_t AFATFS_IsFatSectorFull(uint8_t Disk, uint8_t Partition,
+    uint32_t Sector)
+{
+  uint8_t *map = FatDisk[Disk].FreeMap[Partition];
+
+  /* A cleared bit means the FAT sector was read and has no free entries */
+  return (map != NULL && Sector < 8 * FatDisk[Disk].FreeMapSize[Partition] &&
+      (map[Sector / 8] & (1 << (Sector % 8))) == 0);
+}
+
+
+
+static void AFATFS_SetFatSectorFull(uint8_t Disk, uint8_t Partition,
+    uint32_t Sector)
+{
+  uint8_t *map = FatDisk[Disk].FreeMap[Partition];
+
+  if(map != NULL && Sector < 8 * FatDisk[Disk].FreeMapSize[Partition]){
+    map[Sector / 8] &= ~(1 << (Sector % 8));
+  }
+}
+
+
+
+static void AFATFS_TakeCluster(uint8_t Disk, uint8_t Partition,
+    uint32_t Cluster)
+{
+  /* Keeping the FSInfo hints up to date, written back by AFATFS_Sync */
+  if(FatDisk[Disk].PPR.FreeCount[Partition] != FAT_FSINFO_UNKNOWN &&
+      FatDisk[Disk].PPR.FreeCount[Partition] != 0)
+  {
+    FatDisk[Disk].PPR.FreeCount[Partition]--;
+  }
+  Cluster++;
+  if(Cluster >= FatDisk[Disk].PPR.ClusterCount[Partition] + FAT_FIRST_CLUSTER){
+    Cluster = FAT_FIRST_CLUSTER;
+  }
+  FatDisk[Disk].PPR.NextFree[Partition] = Cluster;
+  FatDisk[Disk].isFsInfoDirty[Partition] = 1;
+}
+
+
+
+static EStatus_t AFATFS_FindEmptyCluster(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle, uint8_t FatNum, uint32_t StartCluster,
+    uint32_t *EntryNumber)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsContext_t *ctx = &Fat32File[FileHandle].Ctx;
+  uint32_t i, entry, first, count, lastCluster, fatSectors, nextFree;
+  uint8_t *data;
+
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS &&
+      FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA &&
+      EntryNumber != NULL)
+  {
+    /*
+     * Notes:
+     * 1 - The scan starts at the FAT sector holding StartCluster, so appending
+     *     to a file usually finds the cluster right after its last one. With
+     *     no StartCluster, or if its sector is full, the scan goes on from
+     *     the FSInfo next free hint, wrapping around the end of the FAT.
+     * 2 - FAT sectors flagged as full on the free map are skipped without
+     *     being read, so each full sector is read at most once after mount.
+     * 3 - Entries before FAT_FIRST_CLUSTER and after the last data cluster
+     *     are never returned.
+     */
+    lastCluster = FatDisk[Disk].PPR.ClusterCount[Partition] + FAT_FIRST_CLUSTER;
+    fatSectors = (lastCluster + FAT_ENTRIES_PER_SECTOR - 1) /
+        FAT_ENTRIES_PER_SECTOR;
+    if(fatSectors > FatDisk[Disk].PPR.FatSize[Partition]){
+      fatSectors = FatDisk[Disk].PPR.FatSize[Partition];
+    }
+    nextFree = FatDisk[Disk].PPR.NextFree[Partition];
+    if(nextFree == FAT_FSINFO_UNKNOWN){
+      nextFree = FAT_FIRST_CLUSTER;
+    }
+    if(ctx->ScanCount == 0){
+      if(StartCluster < FAT_FIRST_CLUSTER || StartCluster >= lastCluster){
+        StartCluster = nextFree;
+      }
+      ctx->ScanSector = StartCluster / FAT_ENTRIES_PER_SECTOR;
+      if(AFATFS_IsFatSectorFull(Disk, Partition, ctx->ScanSector)){
+        ctx->ScanSector = nextFree / FAT_ENTRIES_PER_SECTOR;
+      }
+    }
+
+    /* Skipping sectors known to be full, the +1 accounts for the jump */
+    while(ctx->ScanCount <= fatSectors &&
+        AFATFS_IsFatSectorFull(Disk, Partition, ctx->ScanSector))
+    {
+      ctx->ScanCount++;
+      ctx->ScanSector++;
+      if(ctx->ScanSector >= fatSectors){ ctx->ScanSector = 0;}
+    }
+
+    if(ctx->ScanCount > fatSectors){
+      /* The whole table was scanned, the partition is full */
+      ctx->ScanCount = 0;
+      returncode = ERR_FAILED;
+    }else{
+      returncode = AFATFS_CacheGet(Disk,
+          FatDisk[Disk].PPR.FatStartSector[Partition] +
+          (FatNum * FatDisk[Disk].PPR.FatSize[Partition]) + ctx->ScanSector,
+          &data);
+    }
+    if(returncode == ANSWERED_REQUEST)
+    {
+      AFATFS_STATS_ADD(Disk, FileHandle, FatScanSectors, 1);
+      *EntryNumber = 0; /* Invalid value */
+      /* Only entries of data clusters are looked at */
+      entry = FAT_ENTRIES_PER_SECTOR * ctx->ScanSector;
+      first = (entry < FAT_FIRST_CLUSTER) ? FAT_FIRST_CLUSTER - entry : 0;
+      count = FAT_ENTRIES_PER_SECTOR;
+      if(entry + count > lastCluster){
+        count = lastCluster - entry;
+      }
+      i = AFATFS_ScanFree(data, first, count, NULL);
+      if(i < count){
+        /* Found empty cluster */
+        *EntryNumber = entry + i;
+        ctx->ScanCount = 0;
+      }
+      if(*EntryNumber == 0){
+        AFATFS_SetFatSectorFull(Disk, Partition, ctx->ScanSector);
+        if(ctx->ScanCount == 0 &&
+            ctx->ScanSector != nextFree / FAT_ENTRIES_PER_SECTOR)
+        {
+          /* Going on from the next free hint */
+          ctx->ScanSector = nextFree / FAT_ENTRIES_PER_SECTOR;
+        }else{
+          ctx->ScanSector++;
+          if(ctx->ScanSector >= fatSectors){ ctx->ScanSector = 0;}
+        }
+        ctx->ScanCount++;
+        returncode = OPERATION_RUNNING;
+      }
+    }else if(returncode >= RETURN_ERROR_VALUE){
+      ctx->ScanCount = 0;
+    }
+
+  }else{
+    if(FatDisk[Disk].MBR.FatType[Partition] != FAT32_LBA){
+      returncode = ERR_PARAM_VALUE;
+    }else if(EntryNumber == NULL){
+      returncode = ERR_NULL_POINTER;
+    }else{
+      returncode = ERR_INVALID_FILE_SYSTEM;
+    }
+    ctx->ScanCount = 0;
+  }
+
+  return returncode;
+}
+
+
+
+static void AFATFS_SetFatEntry(uint8_t *Data, uint32_t Cluster, uint32_t Value)
+{
+  uint32_t i = Cluster % FAT_ENTRIES_PER_SECTOR;
+
+  /* The upper 4 bits are reserved and must be preserved */
+  Value = (Value & FAT_ENTRY_MASK) | ((uint32_t)(Data[4*i + 3] & 0xF0) << 24);
+  Data[4*i]     = Value & 0xFF;
+  Data[4*i + 1] = (Value >> 8) & 0xFF;
+  Data[4*i + 2] = (Value >> 16) & 0xFF;
+  Data[4*i + 3] = (Value >> 24) & 0xFF;
+}
+
+
+
+static EStatus_t AFATFS_AllocateCluster(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle, uint8_t FatNum, uint32_t PrevCluster,
+    uint32_t *EntryNumber)
+{
+  enum{UPDATE_SECTOR = 0, UPDATE_PREV_SECTOR};
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsContext_t *ctx = &Fat32File[FileHandle].Ctx;
+  uint32_t sector, fatStart;
+  uint8_t *data;
+
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS &&
+      FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA &&
+      EntryNumber != NULL)
+  {
+    /*
+     * Steps:
+     * 1 - Mark the new cluster as the last one of the chain.
+     * 2 - Link the previous last cluster (PrevCluster, 0 if none) to the new
+     *     one. If both entries are on the same FAT sector they are changed on
+     *     the same cached sector.
+     *
+     * Notes:
+     * 1 - The FAT sectors are written back when the cache is flushed.
+     */
+    fatStart = FatDisk[Disk].PPR.FatStartSector[Partition] +
+        (FatNum * FatDisk[Disk].PPR.FatSize[Partition]);
+    switch(ctx->AllocState)
+    {
+    case UPDATE_SECTOR:
+      sector = *EntryNumber / FAT_ENTRIES_PER_SECTOR;
+      returncode = AFATFS_CacheGet(Disk, fatStart + sector, &data);
+      if(returncode == ANSWERED_REQUEST)
+      {
+        AFATFS_SetFatEntry(data, *EntryNumber, FAT_ENTRY_MASK);
+        if(PrevCluster >= FAT_FIRST_CLUSTER &&
+            PrevCluster / FAT_ENTRIES_PER_SECTOR == sector)
+        {
+          AFATFS_SetFatEntry(data, PrevCluster, *EntryNumber);
+        }
+        AFATFS_CacheDirty(Disk, data);
+        AFATFS_TakeCluster(Disk, Partition, *EntryNumber);
+        if(PrevCluster >= FAT_FIRST_CLUSTER &&
+            PrevCluster / FAT_ENTRIES_PER_SECTOR != sector)
+        {
+          returncode = OPERATION_RUNNING;
+          ctx->AllocState = UPDATE_PREV_SECTOR;
+        }
+      }
+      break;
+
+    case UPDATE_PREV_SECTOR:
+      sector = PrevCluster / FAT_ENTRIES_PER_SECTOR;
+      returncode = AFATFS_CacheGet(Disk, fatStart + sector, &data);
+      if(returncode == ANSWERED_REQUEST)
+      {
+        AFATFS_SetFatEntry(data, PrevCluster, *EntryNumber);
+        AFATFS_CacheDirty(Disk, data);
+        ctx->AllocState = UPDATE_SECTOR;
+      }else if(returncode >= RETURN_ERROR_VALUE){
+        ctx->AllocState = UPDATE_SECTOR;
+      }
+      break;
+
+    default:
+      ctx->AllocState = UPDATE_SECTOR;
+      returncode = OPERATION_RUNNING;
+      break;
+    }
+
+  }else{
+    if(FatDisk[Disk].MBR.FatType[Partition] != FAT32_LBA){
+      returncode = ERR_PARAM_VALUE;
+    }else if(EntryNumber == NULL){
+      returncode = ERR_NULL_POINTER;
+    }else{
+      returncode = ERR_INVALID_FILE_SYSTEM;
+    }
+    ctx->AllocState = 0;
+  }
+
+  return returncode;
+}
+
+
+
+static void AFATFS_GiveCluster(uint8_t Disk, uint8_t Partition,
+    uint32_t Cluster)
+{
+  uint8_t *map = FatDisk[Disk].FreeMap[Partition];
+  uint32_t sector = Cluster / FAT_ENTRIES_PER_SECTOR;
+
+  /* Undoing AFATFS_TakeCluster, the FAT sector has a free entry again */
+  if(FatDisk[Disk].PPR.FreeCount[Partition] != FAT_FSINFO_UNKNOWN){
+    FatDisk[Disk].PPR.FreeCount[Partition]++;
+  }
+  if(map != NULL && sector < 8 * FatDisk[Disk].FreeMapSize[Partition]){
+    map[sector / 8] |= (1 << (sector % 8));
+  }
+  FatDisk[Disk].isFsInfoDirty[Partition] = 1;
+}
+
+
+
+static EStatus_t AFATFS_FindFreeRun(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle, uint32_t StartCluster, uint32_t Wanted,
+    uint32_t *First, uint32_t *Length)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsContext_t *ctx = &Fat32File[FileHandle].Ctx;
+  uint32_t i, entry, first, from, count, length, lastCluster, fatSectors;
+  uint8_t *data;
+
+  /*
+   * Notes:
+   * 1 - One FAT sector is read per call, from the one holding StartCluster
+   *     (or the FSInfo next free hint), wrapping around the end of the FAT,
+   *     until Wanted free clusters in a row are found. Runs go on across
+   *     sectors read one after the other.
+   * 2 - If the whole FAT is read first, the longest run seen is returned,
+   *     ERR_FAILED if there was no free cluster at all.
+   * 3 - FAT sectors flagged as full on the free map are skipped, ending the
+   *     run being measured.
+   */
+  lastCluster = FatDisk[Disk].PPR.ClusterCount[Partition] + FAT_FIRST_CLUSTER;
+  fatSectors = (lastCluster + FAT_ENTRIES_PER_SECTOR - 1) /
+      FAT_ENTRIES_PER_SECTOR;
+  if(fatSectors > FatDisk[Disk].PPR.FatSize[Partition]){
+    fatSectors = FatDisk[Disk].PPR.FatSize[Partition];
+  }
+  if(StartCluster < FAT_FIRST_CLUSTER || StartCluster >= lastCluster){
+    StartCluster = FatDisk[Disk].PPR.NextFree[Partition];
+    if(StartCluster < FAT_FIRST_CLUSTER || StartCluster >= lastCluster){
+      StartCluster = FAT_FIRST_CLUSTER;
+    }
+  }
+  if(ctx->ScanCount == 0){
+    ctx->ScanSector = StartCluster / FAT_ENTRIES_PER_SECTOR;
+    ctx->RunLength = 0;
+    ctx->BestLength = 0;
+  }
+
+  while(ctx->ScanCount < fatSectors &&
+      AFATFS_IsFatSectorFull(Disk, Partition, ctx->ScanSector))
+  {
+    ctx->RunLength = 0;
+    ctx->ScanCount++;
+    ctx->ScanSector++;
+    if(ctx->ScanSector >= fatSectors){ ctx->ScanSector = 0;}
+  }
+
+  if(ctx->ScanCount >= fatSectors){
+    /* The whole table was read, taking the longest run seen */
+    ctx->ScanCount = 0;
+    if(ctx->BestLength == 0){
+      return ERR_FAILED;
+    }
+    *First = ctx->BestFirst;
+    *Length = ctx->BestLength;
+    return ANSWERED_REQUEST;
+  }
+
+  returncode = AFATFS_CacheGet(Disk,
+      FatDisk[Disk].PPR.FatStartSector[Partition] + ctx->ScanSector, &data);
+  if(returncode == ANSWERED_REQUEST)
+  {
+    AFATFS_STATS_ADD(Disk, FileHandle, FatScanSectors, 1);
+    entry = FAT_ENTRIES_PER_SECTOR * ctx->ScanSector;
+    first = (entry < FAT_FIRST_CLUSTER) ? FAT_FIRST_CLUSTER - entry : 0;
+    /* The first sector is looked at from StartCluster on, so a file that
+     * grows stays contiguous when it can */
+    from = first;
+    if(ctx->ScanCount == 0 && StartCluster - entry > first){
+      from = StartCluster - entry;
+    }
+    count = FAT_ENTRIES_PER_SECTOR;
+    if(entry + count > lastCluster){
+      count = lastCluster - entry;
+    }
+
+    for(i = AFATFS_ScanFree(data, from, count, &length); i < count;
+        i = AFATFS_ScanFree(data, i + length, count, &length))
+    {
+      if(ctx->RunLength == 0 || ctx->RunFirst + ctx->RunLength != entry + i){
+        ctx->RunFirst = entry + i;
+        ctx->RunLength = 0;
+      }
+      ctx->RunLength += length;
+      if(ctx->RunLength > ctx->BestLength){
+        ctx->BestFirst = ctx->RunFirst;
+        ctx->BestLength = ctx->RunLength;
+      }
+      if(ctx->RunLength >= Wanted || i + length >= count){
+        break;
+      }
+    }
+
+    if(ctx->RunLength >= Wanted){
+      *First = ctx->RunFirst;
+      *Length = Wanted;
+      ctx->ScanCount = 0;
+    }else{
+      if(ctx->RunLength != 0 &&
+          ctx->RunFirst + ctx->RunLength != entry + count)
+      {
+        /* The run ended inside this sector */
+        ctx->RunLength = 0;
+      }
+      if(AFATFS_ScanFree(data, first, count, NULL) >= count){
+        AFATFS_SetFatSectorFull(Disk, Partition, ctx->ScanSector);
+      }
+      ctx->ScanSector++;
+      if(ctx->ScanSector >= fatSectors){
+        /* Sector 0 does not follow the last one */
+        ctx->ScanSector = 0;
+        ctx->RunLength = 0;
+      }
+      ctx->ScanCount++;
+      returncode = OPERATION_RUNNING;
+    }
+  }else if(returncode >= RETURN_ERROR_VALUE){
+    ctx->ScanCount = 0;
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_ChainRun(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle, uint32_t First, uint32_t Length, uint8_t isFree)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsContext_t *ctx = &Fat32File[FileHandle].Ctx;
+  uint32_t cluster, end, sector;
+  uint8_t *data;
+
+  /*
+   * Notes:
+   * 1 - One FAT sector is changed per call, Ctx.ChainDone counts the entries
+   *     already changed. A chained run links each cluster to the next one and
+   *     ends with the end of chain mark, a freed run is set to 0.
+   */
+  cluster = First + ctx->ChainDone;
+  sector = cluster / FAT_ENTRIES_PER_SECTOR;
+  returncode = AFATFS_CacheGet(Disk,
+      FatDisk[Disk].PPR.FatStartSector[Partition] + sector, &data);
+  if(returncode == ANSWERED_REQUEST)
+  {
+    end = (sector + 1) * FAT_ENTRIES_PER_SECTOR;
+    if(end > First + Length){
+      end = First + Length;
+    }
+    for(; cluster < end; cluster++){
+      if(isFree){
+        AFATFS_SetFatEntry(data, cluster, FAT_ENTRY_FREE);
+        AFATFS_GiveCluster(Disk, Partition, cluster);
+      }else{
+        AFATFS_SetFatEntry(data, cluster,
+            (cluster + 1 < First + Length) ? cluster + 1 : FAT_ENTRY_MASK);
+        AFATFS_TakeCluster(Disk, Partition, cluster);
+      }
+    }
+    AFATFS_CacheDirty(Disk, data);
+    ctx->ChainDone = end - First;
+    if(ctx->ChainDone < Length){
+      returncode = OPERATION_RUNNING;
+    }else{
+      ctx->ChainDone = 0;
+    }
+  }else if(returncode >= RETURN_ERROR_VALUE){
+    ctx->ChainDone = 0;
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_SetFatValue(uint8_t Disk, uint8_t Partition,
+    uint32_t Cluster, uint32_t Value)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  uint8_t *data;
+
+  returncode = AFATFS_CacheGet(Disk,
+      FatDisk[Disk].PPR.FatStartSector[Partition] +
+      (Cluster / FAT_ENTRIES_PER_SECTOR), &data);
+  if(returncode == ANSWERED_REQUEST){
+    AFATFS_SetFatEntry(data, Cluster, Value);
+    AFATFS_CacheDirty(Disk, data);
+  }
+
+  return returncode;
+}
+
+
+
+static uint32_t AFATFS_PreallocClusters(uint8_t Disk, uint8_t Partition)
+{
+  uint32_t size, clusterSize;
+
+  size = (FatDisk[Disk].PreallocSize != 0) ? FatDisk[Disk].PreallocSize :
+      AFATFS_PREALLOC_SIZE;
+  clusterSize = AFATFS_MAX_SECTOR_SIZE *
+      FatDisk[Disk].PPR.SectorPerCluster[Partition];
+
+  return (size / clusterSize) + ((size % clusterSize) != 0);
+}
+
+
+
+static void AFATFS_ResetExtents(uint8_t FileHandle)
+{
+  afatfsFile_t *file = &Fat32File[FileHandle];
+
+  if(file->ClusterFirst >= FAT_FIRST_CLUSTER){
+    file->Extent[0].FileCluster = 0;
+    file->Extent[0].Cluster = file->ClusterFirst;
+    file->Extent[0].Length = 1;
+    file->ExtentCount = 1;
+    file->isChainComplete = 0;
+  }else{
+    /* Empty file, no cluster allocated */
+    file->ExtentCount = 0;
+    file->isChainComplete = 1;
+  }
+}
+
+
+
+static void AFATFS_PushExtent(uint8_t FileHandle, uint32_t Cluster,
+    uint32_t Length)
+{
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  afatfsExtent_t *last;
+  uint32_t clusterSize;
+
+  if(file->ExtentCount == 0){
+    /* First cluster of an empty file */
+    file->Extent[0].FileCluster = 0;
+    file->Extent[0].Cluster = Cluster;
+    file->Extent[0].Length = Length;
+    file->ExtentCount = 1;
+  }else if(Cluster == file->Extent[file->ExtentCount - 1].Cluster +
+      file->Extent[file->ExtentCount - 1].Length)
+  {
+    file->Extent[file->ExtentCount - 1].Length += Length;
+  }else{
+    last = &file->Extent[file->ExtentCount - 1];
+    if(file->ExtentCount >= AFATFS_EXTENT_CACHE_SIZE){
+      /* Dropping the oldest run after the first one */
+      memmove(&file->Extent[1], &file->Extent[2],
+          (AFATFS_EXTENT_CACHE_SIZE - 2) * sizeof(afatfsExtent_t));
+      file->ExtentCount--;
+      last = &file->Extent[file->ExtentCount - 1];
+    }
+    file->Extent[file->ExtentCount].FileCluster =
+        last->FileCluster + last->Length;
+    file->Extent[file->ExtentCount].Cluster = Cluster;
+    file->Extent[file->ExtentCount].Length = Length;
+    file->ExtentCount++;
+  }
+
+  /* Keeping track of the allocated size known so far */
+  last = &file->Extent[file->ExtentCount - 1];
+  clusterSize = 512 *
+      FatDisk[file->Disk].PPR.SectorPerCluster[file->Partition];
+  if(file->PhysicalSize < (last->FileCluster + last->Length) * clusterSize){
+    file->PhysicalSize = (last->FileCluster + last->Length) * clusterSize;
+  }
+}
+
+
+
+static uint8_t AFATFS_LookupExtent(uint8_t FileHandle, uint32_t Index,
+    uint32_t *Cluster, uint32_t *Run)
+{
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  uint32_t i;
+
+  for(i = 0; i < file->ExtentCount; i++){
+    if(Index >= file->Extent[i].FileCluster &&
+        Index < file->Extent[i].FileCluster + file->Extent[i].Length)
+    {
+      *Cluster = file->Extent[i].Cluster + (Index - file->Extent[i].FileCluster);
+      *Run = file->Extent[i].Length - (Index - file->Extent[i].FileCluster);
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+
+static EStatus_t AFATFS_MapCluster(uint8_t FileHandle, uint32_t Index,
+    uint32_t *Cluster, uint32_t *Run)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  afatfsExtent_t *last;
+  uint8_t Disk = file->Disk, Partition = file->Partition;
+  uint32_t walk, next, fatSector, i;
+  uint8_t *data;
+
+  /*
+   * Steps:
+   * 1 - Look for the cluster index in the extents already known.
+   * 2 - If it is not there, read the FAT sector holding the entry of the last
+   *     known cluster and follow the chain while it stays inside that sector,
+   *     merging contiguous clusters into runs.
+   *
+   * Notes:
+   * 1 - Extent[0] always describes the start of the file and Extent[1..n] are
+   *     consecutive runs, so walking always continues from the last extent.
+   *     Indexes that fall between Extent[0] and Extent[1] restart the walk
+   *     from Extent[0].
+   * 2 - *Cluster is 0 if Index is past the end of the chain.
+   */
+  if(AFATFS_LookupExtent(FileHandle, Index, Cluster, Run)){
+    return ANSWERED_REQUEST;
+  }
+
+  if(file->ExtentCount == 0 ||
+      Index < file->Extent[file->ExtentCount - 1].FileCluster)
+  {
+    AFATFS_ResetExtents(FileHandle);
+  }
+
+  if(file->isChainComplete){
+    *Cluster = 0;
+    *Run = 0;
+    return ANSWERED_REQUEST;
+  }
+
+  last = &file->Extent[file->ExtentCount - 1];
+  walk = last->Cluster + last->Length - 1;
+  fatSector = walk / FAT_ENTRIES_PER_SECTOR;
+  returncode = AFATFS_CacheGet(Disk,
+      FatDisk[Disk].PPR.FatStartSector[Partition] + fatSector, &data);
+  if(returncode == ANSWERED_REQUEST)
+  {
+    returncode = OPERATION_RUNNING;
+    while(1)
+    {
+      i = walk - (fatSector * FAT_ENTRIES_PER_SECTOR);
+      memcpy(&next, &data[FAT_ENTRY_SIZE * i], FAT_ENTRY_SIZE);
+      next &= FAT_ENTRY_MASK;
+      if(next >= FAT_ENTRY_EOC_MIN){
+        /* Reached the end of the chain */
+        file->isChainComplete = 1;
+        break;
+      }
+      if(next < FAT_FIRST_CLUSTER || next == FAT_ENTRY_BAD ||
+          next >= FatDisk[Disk].PPR.ClusterCount[Partition] +
+          FAT_FIRST_CLUSTER ||
+          last->FileCluster + last->Length >
+          FatDisk[Disk].PPR.ClusterCount[Partition])
+      {
+        /* Free or bad cluster inside the chain, or a loop */
+        returncode = ERR_INVALID_FILE_SYSTEM;
+        break;
+      }
+      if(next != walk + 1 && file->ExtentCount >= AFATFS_EXTENT_CACHE_SIZE &&
+          Index < last->FileCluster + last->Length)
+      {
+        /* Keeping the extent just found instead of sliding the window */
+        break;
+      }
+      AFATFS_PushExtent(FileHandle, next, 1);
+      last = &file->Extent[file->ExtentCount - 1];
+      walk = next;
+      if(walk / FAT_ENTRIES_PER_SECTOR != fatSector){
+        /* Next entry is on another FAT sector */
+        break;
+      }
+    }
+
+    if(returncode == OPERATION_RUNNING){
+      if(AFATFS_LookupExtent(FileHandle, Index, Cluster, Run)){
+        returncode = ANSWERED_REQUEST;
+      }else if(file->isChainComplete){
+        *Cluster = 0;
+        *Run = 0;
+        returncode = ANSWERED_REQUEST;
+      }
+    }
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_BufferFlush(uint8_t FileHandle)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  uint32_t count = file->BufferCount;
+
+  if(file->isBufferDirty && count != 0){
+    returncode = AFATFS_DiskWrite(file->Disk, file->Buffer,
+        file->BufferSector, count);
+    if(returncode == ANSWERED_REQUEST){
+      /* Still equal to the disk, so it can be read again */
+      file->BufferCount = count;
+      file->isBufferDirty = 0;
+    }
+  }else{
+    file->isBufferDirty = 0;
+    returncode = ANSWERED_REQUEST;
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_UpdateFileEntry(uint8_t FileHandle, uint32_t Size)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  uint8_t Disk = file->Disk, Partition = file->Partition;
+  DirectoryEntryFat32_t entry;
+  uint8_t *data;
+
+  /*
+   * Notes:
+   * 1 - The entry is changed on the cached directory sector in a single call,
+   *     so other files can update entries of the same sector meanwhile. The
+   *     sector reaches the disk when the cache is flushed.
+   * 2 - The first cluster changes if the file was empty.
+   */
+  returncode = AFATFS_CacheGet(Disk, file->EntrySector, &data);
+  if(returncode == ANSWERED_REQUEST)
+  {
+    memcpy(&entry, &data[(file->Entry % 16) * sizeof(entry)], sizeof(entry));
+    entry.Size = Size;
+    entry.FirstClusterLow = file->ClusterFirst & 0xFFFF;
+    entry.FirstClusterHi = (file->ClusterFirst >> 16) & 0xFFFF;
+    memcpy(&data[(file->Entry % 16) * sizeof(entry)], &entry, sizeof(entry));
+    AFATFS_CacheDirty(Disk, data);
+    file->isEntryDirty = 0;
+    AFATFS_IndexUpdate(Disk, Partition, FileHandle);
+  }
+
+  return returncode;
+}
+
+
+
+static void AFATFS_ResetSync(uint8_t FileHandle)
+{
+  afatfsFile_t *file = &Fat32File[FileHandle];
+
+  file->SyncSize = (file->Mode & AFATFS_FILE_MODE_RING) ? file->RingCount :
+      file->LogicalSize;
+  if(AFATFS_Clock != NULL){
+    file->SyncTime = AFATFS_Clock();
+  }
+}
+
+
+
+static uint8_t AFATFS_IsSyncDue(uint8_t FileHandle)
+{
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  uint8_t isDue = 0;
+
+  if(file->SyncPolicy == AFATFS_SYNC_BYTES){
+    isDue = (((file->Mode & AFATFS_FILE_MODE_RING) ? file->RingCount :
+        file->LogicalSize) - file->SyncSize >= file->SyncValue);
+  }else if(file->SyncPolicy == AFATFS_SYNC_TIME && AFATFS_Clock != NULL){
+    /* Unsigned difference, so the clock may wrap around */
+    isDue = (AFATFS_Clock() - file->SyncTime >= file->SyncValue);
+  }
+
+  return isDue;
+}
+
+
+
+static uint8_t AFATFS_Lock(uint8_t Disk, uint8_t FileHandle)
+{
+  /*
+   * Notes:
+   * 1 - FAT and directory updates that span several calls (allocating a
+   *     cluster, adding an entry) are done by one file at a time on each
+   *     disk, so two files never take the same cluster or entry. Other files
+   *     keep reading and writing their data meanwhile.
+   */
+  if(FatDisk[Disk].Busy == 0xFF){
+    FatDisk[Disk].Busy = FileHandle;
+  }
+
+  return (FatDisk[Disk].Busy == FileHandle);
+}
+
+
+
+static void AFATFS_Unlock(uint8_t Disk, uint8_t FileHandle)
+{
+  if(FatDisk[Disk].Busy == FileHandle){
+    FatDisk[Disk].Busy = 0xFF; /* Not busy */
+  }
+}
+
+
+
+static uint32_t AFATFS_StreamSector(uint8_t FileHandle, uint32_t Offset)
+{
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  afatfsExtent_t *last = &file->Extent[file->ExtentCount - 1];
+  uint8_t Disk = file->Disk, Partition = file->Partition;
+  uint32_t clusterSize = AFATFS_MAX_SECTOR_SIZE *
+      FatDisk[Disk].PPR.SectorPerCluster[Partition];
+
+  /* Offset lies on the last run of the file, the one being filled */
+  return FatDisk[Disk].PPR.DataStartSector[Partition] +
+      FatDisk[Disk].PPR.SectorPerCluster[Partition] *
+      (last->Cluster - FAT_FIRST_CLUSTER +
+      (Offset / clusterSize) - last->FileCluster) +
+      ((Offset % clusterSize) / AFATFS_MAX_SECTOR_SIZE);
+}
+
+
+
+static EStatus_t AFATFS_StreamTrim(uint8_t FileHandle)
+{
+  enum{END_CHAIN = 0, FREE_RUN};
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  afatfsExtent_t *last;
+  uint8_t Disk = file->Disk, Partition = file->Partition;
+  uint32_t clusterSize, used, end;
+
+  /*
+   * Steps:
+   * 1 - Mark the last cluster holding data as the end of the chain.
+   * 2 - Free the clusters after it on the last run, the only one that can
+   *     have clusters not written.
+   *
+   * Notes:
+   * 1 - The chain is cut first, so a power loss in between only leaves
+   *     clusters marked as used.
+   * 2 - A file keeps at least one cluster of its last run.
+   */
+  if(file->ExtentCount == 0){
+    return ANSWERED_REQUEST;
+  }
+  last = &file->Extent[file->ExtentCount - 1];
+  clusterSize = AFATFS_MAX_SECTOR_SIZE *
+      FatDisk[Disk].PPR.SectorPerCluster[Partition];
+  used = (file->LogicalSize / clusterSize) +
+      ((file->LogicalSize % clusterSize) != 0);
+  if(used <= last->FileCluster){
+    used = last->FileCluster + 1;
+  }
+  end = last->FileCluster + last->Length;
+  if(used >= end){
+    /* Nothing to give back */
+    return ANSWERED_REQUEST;
+  }
+  if(!AFATFS_Lock(Disk, FileHandle)){
+    /* Another file is changing the FAT or the directory */
+    return OPERATION_RUNNING;
+  }
+
+  switch(file->Ctx.TrimState)
+  {
+  case END_CHAIN:
+    returncode = AFATFS_SetFatValue(Disk, Partition,
+        last->Cluster + (used - 1 - last->FileCluster), FAT_ENTRY_MASK);
+    if(returncode == ANSWERED_REQUEST){
+      returncode = OPERATION_RUNNING;
+      file->Ctx.TrimState = FREE_RUN;
+    }
+    break;
+
+  case FREE_RUN:
+    returncode = AFATFS_ChainRun(Disk, Partition, FileHandle,
+        last->Cluster + (used - last->FileCluster), end - used, 1);
+    if(returncode == ANSWERED_REQUEST){
+      last->Length = used - last->FileCluster;
+      file->PhysicalSize = used * clusterSize;
+      file->Ctx.TrimState = END_CHAIN;
+    }
+    break;
+
+  default:
+    file->Ctx.TrimState = END_CHAIN;
+    break;
+  }
+
+  if(returncode != OPERATION_RUNNING){
+    AFATFS_Unlock(Disk, FileHandle);
+  }
+  if(returncode >= RETURN_ERROR_VALUE){
+    file->Ctx.TrimState = END_CHAIN;
+  }
+
+  return returncode;
+}
+
+
+
+static void AFATFS_StreamAdvance(uint8_t FileHandle, uint32_t Count)
+{
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  uint32_t space, head;
+
+  /*
+   * Notes:
+   * 1 - Stream files grow, the cursor stays at their end.
+   * 2 - Ring files move their head. If the Count bytes reach the tail, the
+   *     tail goes to the sector after the new head, so the sector being
+   *     filled never holds the oldest data.
+   */
+  if(!(file->Mode & AFATFS_FILE_MODE_RING)){
+    file->LogicalSize += Count;
+    file->FilePos += Count;
+  }else{
+    space = (file->RingTail > file->RingHead) ?
+        file->RingTail - file->RingHead :
+        (file->LogicalSize - file->RingHead) +
+        (file->RingTail - AFATFS_MAX_SECTOR_SIZE);
+    file->RingHead += Count;
+    file->RingCount += Count;
+    if(Count >= space){
+      head = (file->RingHead >= file->LogicalSize) ?
+          AFATFS_MAX_SECTOR_SIZE : file->RingHead;
+      file->RingTail =
+          ((head / AFATFS_MAX_SECTOR_SIZE) + 1) * AFATFS_MAX_SECTOR_SIZE;
+      if(file->RingTail >= file->LogicalSize){
+        file->RingTail = AFATFS_MAX_SECTOR_SIZE;
+      }
+    }
+  }
+  file->isEntryDirty = 1;
+}
+
+
+
+static EStatus_t AFATFS_WriteRingHeader(uint8_t FileHandle)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  AfatfsRingHeader_t header;
+  uint8_t *data;
+
+  /*
+   * Notes:
+   * 1 - The header is changed on the cached sector, like directory entries,
+   *     so steady writes keep it cached and do not read it again.
+   * 2 - A head at the end of the file is written as the first data offset,
+   *     where the next write goes.
+   */
+  returncode = AFATFS_CacheGet(file->Disk, file->SectorFirst, &data);
+  if(returncode == ANSWERED_REQUEST){
+    memcpy(header.Signature, AFATFS_RING_SIGNATURE, sizeof(header.Signature));
+    header.Size = file->LogicalSize;
+    header.Head = (file->RingHead >= file->LogicalSize) ?
+        AFATFS_MAX_SECTOR_SIZE : file->RingHead;
+    header.Tail = file->RingTail;
+    header.Wraps = file->RingWraps;
+    memset(data, 0, AFATFS_MAX_SECTOR_SIZE);
+    memcpy(data, &header, sizeof(header));
+    AFATFS_CacheDirty(file->Disk, data);
+    /* A file buffer holding the sector would be out of date */
+    AFATFS_BufferInvalidate(file->Disk, file->SectorFirst, 1);
+    file->isEntryDirty = 0;
+  }
+
+  return returncode;
+}
+
+
+
+static uint8_t AFATFS_ShortChar(char Char)
+{
+  uint8_t c = (uint8_t)Char;
+
+  /* Short names are upper case, characters only valid on long names are
+   * replaced */
+  if(c >= 'a' && c <= 'z'){
+    c -= 'a' - 'A';
+  }else if(c >= 0x80 || strchr("+,;=[]", c) != NULL){
+    c = '_';
+  }
+
+  return c;
+}
+
+
+
+static uint8_t AFATFS_ShortPart(const char *Part, uint32_t Length,
+    uint8_t *Short, uint8_t LowerFlag)
+{
+  uint8_t lower = 0, upper = 0;
+  uint32_t i;
+
+  /* Copies the name or the extension in upper case, returns LowerFlag if it
+   * was all in lower case and AFATFS_CASE_MIXED if it had both cases */
+  for(i = 0; i < Length; i++){
+    Short[i] = (uint8_t)Part[i];
+    if(Short[i] >= 'a' && Short[i] <= 'z'){
+      Short[i] -= 'a' - 'A';
+      lower = 1;
+    }else if(Short[i] >= 'A' && Short[i] <= 'Z'){
+      upper = 1;
+    }
+  }
+
+  return (lower && upper) ? AFATFS_CASE_MIXED : (lower ? LowerFlag : 0);
+}
+
+
+
+static void AFATFS_ShortName(const char *LongName, uint8_t Length,
+    uint8_t Try, uint8_t *Name, uint8_t *Extension)
+{
+  const char hexChar[] = "0123456789ABCDEF";
+  uint32_t i, end;
+  uint16_t hash;
+  uint8_t n, size;
+
+  /*
+   * Notes:
+   * 1 - The first 9 tries are the first 6 characters of the name with tails
+   *     ~1 to ~9 (LONGNA~1.TXT). The next ones keep 2 characters and add 4
+   *     hex digits from the hash of the long name (LO3F2A~1.TXT).
+   * 2 - Spaces and dots are left out, the extension comes after the last
+   *     dot.
+   */
+  memset(Name, ' ', 8);
+  memset(Extension, ' ', 3);
+
+  for(end = Length; end > 0 && LongName[end - 1] != '.'; end--);
+  if(end != 0){
+    for(i = end, n = 0; i < Length && n < 3; i++){
+      if(LongName[i] != ' '){
+        Extension[n++] = AFATFS_ShortChar(LongName[i]);
+      }
+    }
+    end--;
+  }else{
+    end = Length;
+  }
+
+  size = (Try < 9) ? 6 : 2;
+  for(i = 0, n = 0; i < end && n < size; i++){
+    if(LongName[i] != ' ' && LongName[i] != '.'){
+      Name[n++] = AFATFS_ShortChar(LongName[i]);
+    }
+  }
+  if(n == 0){
+    Name[n++] = '_';
+  }
+  if(Try >= 9){
+    hash = AFATFS_LongNameHash(LongName, Length) + Try;
+    for(i = 0; i < 4; i++){
+      Name[n++] = hexChar[(hash >> (12 - (4 * i))) & 0x0F];
+    }
+  }
+  Name[n++] = '~';
+  Name[n] = (Try < 9) ? '1' + Try : '1';
+}
+
+
+
+static EStatus_t AFATFS_ParseName(char *FileName, uint32_t Length,
+    uint8_t *Name, uint8_t *Extension, uint8_t *isLong, uint8_t *Case)
+{
+  EStatus_t returncode = ANSWERED_REQUEST;
+  const char forbidenChar[] = {'/', ':'};
+  const char longOnlyChar[] = {' ', '+', ',', ';', '=', '[', ']'};
+  const char forbidenLongChar[] = {'\\', '*', '?', '"', '<', '>', '|'};
+  uint32_t i, nameSize, extensionSize, length = Length;
+  char *p;
+
+  /* One name of the path, disk identifiers not allowed */
+  *Case = 0;
+  for(i = 0; i < sizeof(forbidenChar); i++){
+    if(memchr(FileName, forbidenChar[i], length) != NULL){
+      returncode = ERR_PARAM_NAME;
+    }
+  }
+  if(length == 0){
+    returncode = ERR_PARAM_NAME;
+  }
+
+  if(returncode == ANSWERED_REQUEST){
+    p = memchr(FileName, '.', length);
+    if(p != NULL){
+      /* File has extension */
+      nameSize = p - FileName;
+      extensionSize = length - nameSize - 1;
+    }else{
+      /* File has no extension */
+      nameSize = length;
+      extensionSize = 0;
+    }
+
+    /* Anything 8.3 can not hold takes a long name */
+    *isLong = (nameSize > 8 || extensionSize > 3);
+    if(p != NULL && (nameSize == 0 ||
+        memchr(p + 1, '.', extensionSize) != NULL))
+    {
+      *isLong = 1;
+    }
+    for(i = 0; i < sizeof(longOnlyChar); i++){
+      if(memchr(FileName, longOnlyChar[i], length) != NULL){
+        *isLong = 1;
+      }
+    }
+
+    for(i = 0; i < length; i++){
+      if((uint8_t)FileName[i] < 0x20 ||
+          memchr(forbidenLongChar, FileName[i], sizeof(forbidenLongChar)))
+      {
+        returncode = ERR_PARAM_NAME;
+      }
+    }
+
+    if(returncode != ANSWERED_REQUEST){
+      /* Not valid on any name */
+    }else if(*isLong == 0){
+      /*
+       * Notes:
+       * 1 - Completing with spaces, letters in upper case as on any short
+       *     entry. A part all in lower case is flagged on the entry.
+       * 2 - A part with both cases takes a long name, Name and Extension
+       *     stay its short name. Without long names the case is lost.
+       */
+      memset(Name, ' ', 8);
+      memset(Extension, ' ', 3);
+      *Case = AFATFS_ShortPart(FileName, nameSize, Name,
+          FAT_CASE_LOWER_NAME);
+      *Case |= AFATFS_ShortPart(FileName + nameSize + 1, extensionSize,
+          Extension, FAT_CASE_LOWER_EXT);
+      if(*Case & AFATFS_CASE_MIXED){
+        *Case = (AFATFS_MAX_NAME_LENGTH > 12) ? AFATFS_CASE_MIXED : 0;
+        *isLong = (*Case != 0);
+      }
+    }else if(AFATFS_MAX_NAME_LENGTH > 12 && length <= AFATFS_MAX_NAME_LENGTH &&
+        FileName[length - 1] != '.' && FileName[length - 1] != ' ')
+    {
+      /* First short name tried, AFATFS_Create picks a free one */
+      AFATFS_ShortName(FileName, length, 0, Name, Extension);
+    }else{
+      returncode = ERR_PARAM_NAME;
+    }
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_NextName(uint8_t FileHandle)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  char *end;
+  uint32_t length;
+  uint8_t isLong, nameCase;
+
+  /* Taking the name at the start of the path, up to the next '/' */
+  end = strchr(file->Ctx.Path, '/');
+  length = (end != NULL) ? (uint32_t)(end - file->Ctx.Path) :
+      strlen(file->Ctx.Path);
+  file->Ctx.isLastName = (end == NULL);
+  if(length > AFATFS_MAX_NAME_LENGTH){
+    return ERR_PARAM_NAME;
+  }
+
+  returncode = AFATFS_ParseName(file->Ctx.Path, length, file->Name,
+      file->Extension, &isLong, &nameCase);
+  if(returncode == ANSWERED_REQUEST){
+    file->Ctx.NameLength = length;
+    file->Ctx.LongName = isLong ? file->Ctx.Path : NULL;
+    file->Ctx.LongLength = isLong ? length : 0;
+    /* A long name kept only for its case goes with its own short name, any
+     * case of it finds the same file */
+    file->Ctx.isShortLookup = (nameCase == AFATFS_CASE_MIXED);
+    file->Ctx.NameCase = nameCase & (FAT_CASE_LOWER_NAME | FAT_CASE_LOWER_EXT);
+  }
+
+  return returncode;
+}
+
+
+
+static uint8_t AFATFS_PendingFile(uint8_t *FileHandle)
+{
+  uint8_t i;
+
+  /* The handle variable of the caller tells which open or create call is
+   * being polled */
+  for(i = 0; i < AFATS_MAX_FILES; i++){
+    if(Fat32File[i].isInUse && Fat32File[i].Ctx.Owner == FileHandle){
+      break;
+    }
+  }
+
+  return i;
+}
+
+
+
+static EStatus_t AFATFS_ReserveFile(uint8_t Disk, uint8_t Partition,
+    char *FileName, uint8_t *FileHandle)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsFile_t *file;
+  uint8_t i;
+
+  /* Verifying if there is a file structure free */
+  for(i = 0; i < AFATS_MAX_FILES; i++){
+    if(!Fat32File[i].isInUse){
+      break;
+    }
+  }
+
+  if(i >= AFATS_MAX_FILES){
+    returncode = ERR_RESOURCE_DEPLETED;
+  }else{
+    file = &Fat32File[i];
+    memset(&file->Ctx, 0, sizeof(file->Ctx));
+#if AFATFS_STATS
+    memset(&file->Stats, 0, sizeof(file->Stats));
+#endif
+    /* The path is read again from the caller's string while the request
+     * runs, starting from the root directory */
+    file->Ctx.Path = (FileName[0] == '/') ? FileName + 1 : FileName;
+    returncode = AFATFS_NextName(i);
     if(returncode == ANSWERED_REQUEST){
-      *Entry = 0xFFFFFFFF;
-      for(int i = 0; i < 16; i++){
-        if(FatDisk[Disk].RootDir[i].Name[0] == FAT_END_OF_DIR ||
-            FatDisk[Disk].RootDir[i].Name[0] == FAT_UNUSED_ENTRY){
-          *Entry = (sectorOffset[Disk] * 16) + i;
+      file->Ctx.Owner = FileHandle;
+      file->Disk = Disk;
+      file->Partition = Partition;
+      file->Entry = 0;
+      file->DirCluster = FatDisk[Disk].PPR.RootCluster[Partition];
+      file->isInUse = 1;
+      *FileHandle = i;
+      returncode = OPERATION_RUNNING;
+    }
+  }
+
+  return returncode;
+}
+
+
+
+static void AFATFS_ReleaseFile(uint8_t *FileHandle)
+{
+  Fat32File[*FileHandle].Ctx.Owner = NULL;
+  Fat32File[*FileHandle].isInUse = 0;
+  *FileHandle = AFATS_MAX_FILES;
+}
+
+
+
+static void AFATFS_LoadEntry(uint8_t FileHandle, uint8_t Disk,
+    uint8_t Partition, DirectoryEntryFat32_t *Entry, uint32_t EntryNumber)
+{
+  afatfsFile_t *file = &Fat32File[FileHandle];
+
+  file->Disk = Disk;
+  file->Partition = Partition;
+  file->Entry = EntryNumber;
+  file->Attrib = Entry->Attributes;
+  file->FilePos = 0; /*Start of file*/
+  file->LogicalSize = Entry->Size;
+  /* Grows as the cluster chain is followed */
+  file->PhysicalSize = 0;
+
+  file->ClusterFirst = (uint32_t) (Entry->FirstClusterHi << 16) |
+      Entry->FirstClusterLow;
+  file->ClusterPos = file->ClusterFirst;
+  file->ClusterPrev = 0; /*Invalid value*/
+  AFATFS_ResetExtents(FileHandle);
+  if(file->ExtentCount != 0){
+    file->PhysicalSize = 512 * FatDisk[Disk].PPR.SectorPerCluster[Partition];
+  }
+
+  file->SectorFirst = FatDisk[Disk].PPR.DataStartSector[Partition] +
+      ( FatDisk[Disk].PPR.SectorPerCluster[Partition] *
+          (file->ClusterFirst - 2) );
+  file->SectorPos = file->SectorFirst;
+  file->SectorPrev = 0; /*Invalid value*/
+  file->BufferCount = 0; /* Nothing buffered */
+  file->isBufferDirty = 0;
+  file->isEntryDirty = 0;
+  file->SyncPolicy = AFATFS_SYNC_ENTRY;
+  file->SyncValue = 0;
+  AFATFS_ResetSync(FileHandle);
+  file->ReadHits = 0;
+  file->ReadMisses = 0;
+
+  file->isInUse = 1;
+}
+
+
+
+static uint8_t AFATFS_MatchEntry(uint8_t FileHandle, const uint8_t *Entry)
+{
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  afatfsContext_t *ctx = &file->Ctx;
+  uint8_t order = Entry[FAT_LFN_ORDER_OFFSET];
+  uint8_t isMatch = 0;
+  uint8_t tilde;
+
+  /*
+   * Notes:
+   * 1 - Entries are given in directory order. Long names are matched entry by
+   *     entry as the directory is read: a chain with another number of
+   *     entries, or whose order or checksum breaks, is skipped by its first
+   *     bytes, without looking at the characters.
+   * 2 - The short names made from the same long name are recorded, so
+   *     AFATFS_Create picks a tail not in use.
+   */
+  if(ctx->LongName == NULL || ctx->isShortLookup){
+    return (Entry[FAT_LFN_ATTRIBUTE_OFFSET] != FAT_ATTRIBUTE_LONG_NAME &&
+        !memcmp(Entry, file->Name, 8) && !memcmp(Entry + 8, file->Extension, 3));
+  }
+
+  if(order == FAT_UNUSED_ENTRY){
+    ctx->LfnOrder = 0;
+  }else if(Entry[FAT_LFN_ATTRIBUTE_OFFSET] == FAT_ATTRIBUTE_LONG_NAME){
+    if(order & FAT_LFN_LAST_ENTRY){
+      order &= FAT_LFN_ORDER_MASK;
+      ctx->LfnOrder = (order == (ctx->LongLength + FAT_LFN_CHARS_PER_ENTRY - 1) /
+          FAT_LFN_CHARS_PER_ENTRY) ? order : 0;
+      ctx->LfnSum = Entry[FAT_LFN_CHECKSUM_OFFSET];
+    }else if(ctx->LfnOrder > 1 && order == ctx->LfnOrder - 1 &&
+        Entry[FAT_LFN_CHECKSUM_OFFSET] == ctx->LfnSum)
+    {
+      ctx->LfnOrder = order;
+    }else{
+      ctx->LfnOrder = 0;
+    }
+    if(ctx->LfnOrder != 0 &&
+        !AFATFS_LongNamePart(ctx->LongName, ctx->LongLength, Entry))
+    {
+      ctx->LfnOrder = 0;
+    }
+  }else{
+    isMatch = (ctx->LfnOrder == 1 &&
+        ctx->LfnSum == AFATFS_ShortNameSum(Entry, Entry + 8));
+    ctx->LfnOrder = 0;
+
+    for(tilde = 7; tilde > 0 && file->Name[tilde] != '~'; tilde--);
+    if(tilde > 0 && tilde < 7 && Entry[tilde] == '~' &&
+        Entry[tilde + 1] >= '1' && Entry[tilde + 1] <= '9' &&
+        !memcmp(Entry, file->Name, tilde) &&
+        !memcmp(Entry + tilde + 2, file->Name + tilde + 2, 6 - tilde) &&
+        !memcmp(Entry + 8, file->Extension, 3))
+    {
+      ctx->TailMask |= 1 << (Entry[tilde + 1] - '0');
+    }
+  }
+
+  return isMatch;
+}
+
+
+
+static EStatus_t AFATFS_IndexFind(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  uint32_t *probe = &file->Ctx.IndexProbe;
+  uint32_t size = FatDisk[Disk].IndexSize[Partition];
+  uint32_t count, sector;
+  AfatfsDirIndex_t *slot;
+  DirectoryEntryFat32_t entry;
+  uint16_t hash;
+  uint8_t *data;
+  uint8_t isLong, isMatch = 0;
+
+  /*
+   * Notes:
+   * 1 - Slots with the same hash are checked against the directory entry,
+   *     one sector per call. A free slot ends the search.
+   * 2 - For a long name, the entries before the short one are compared, from
+   *     the first entry of a chain of the right length (up to 3 sectors).
+   */
+  isLong = (file->Ctx.LongName != NULL && !file->Ctx.isShortLookup);
+  if(isLong){
+    hash = AFATFS_LongNameHash(file->Ctx.LongName, file->Ctx.LongLength);
+    count = (file->Ctx.LongLength + FAT_LFN_CHARS_PER_ENTRY - 1) /
+        FAT_LFN_CHARS_PER_ENTRY;
+  }else{
+    hash = AFATFS_NameHash(file->Name, file->Extension);
+    count = 0;
+  }
+  while(*probe < size)
+  {
+    slot = &FatDisk[Disk].Index[Partition][(hash + *probe) % size];
+    if(slot->Entry == AFATFS_INDEX_FREE_SLOT){
+      break;
+    }
+    if(slot->Hash == hash && slot->Entry >= count)
+    {
+      if(!file->Ctx.isIndexCheck){
+        file->Entry = slot->Entry - count;
+        file->Ctx.LfnOrder = 0;
+        file->Ctx.isIndexCheck = 1;
+      }
+      returncode = AFATFS_DirEntrySector(Disk, Partition, &file->Ctx.Dir,
+          file->DirCluster, file->Entry, &sector);
+      if(returncode == ANSWERED_REQUEST){
+        returncode = AFATFS_CacheGet(Disk, sector, &data);
+      }
+      if(returncode != ANSWERED_REQUEST){
+        if(returncode >= RETURN_ERROR_VALUE){
+          *probe = 0;
+          file->Ctx.isIndexCheck = 0;
+          file->Entry = 0;
+        }
+        return returncode;
+      }
+      do{
+        isMatch = AFATFS_MatchEntry(FileHandle,
+            &data[(file->Entry % 16) * sizeof(entry)]);
+        file->Entry++;
+      }while(file->Entry <= slot->Entry && (file->Entry % 16) != 0);
+      if(file->Entry <= slot->Entry){
+        /* The chain goes on in the next sector */
+        return OPERATION_RUNNING;
+      }
+      file->Ctx.isIndexCheck = 0;
+      if(isMatch)
+      {
+        /* File was found */
+        memcpy(&entry, &data[(slot->Entry % 16) * sizeof(entry)],
+            sizeof(entry));
+        *probe = 0;
+        AFATFS_LoadEntry(FileHandle, Disk, Partition, &entry, slot->Entry);
+        file->EntrySector = sector;
+        return ANSWERED_REQUEST;
+      }
+      (*probe)++;
+      return OPERATION_RUNNING;
+    }
+    (*probe)++;
+  }
+
+  /* Not on the directory */
+  *probe = 0;
+  file->Entry = 0;
+
+  return ERR_FAILED;
+}
+
+
+
+static EStatus_t AFATFS_FindFile(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+  uint32_t sector;
+  uint8_t *data;
+
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS &&
+      FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA &&
+      Fat32File[FileHandle].isInUse == 1 && FileHandle < AFATS_MAX_FILES)
+  {
+
+    /* With a directory index, the entry is found by the name hash. Only the
+     * root directory is indexed */
+    if(Fat32File[FileHandle].DirCluster ==
+        FatDisk[Disk].PPR.RootCluster[Partition])
+    {
+      if(FatDisk[Disk].IndexState[Partition] == AFATFS_INDEX_BUILDING){
+        returncode = AFATFS_BuildDirIndex(Disk, Partition);
+        if(returncode == ANSWERED_REQUEST){
+          returncode = OPERATION_RUNNING;
+        }
+        return returncode;
+      }
+      if(FatDisk[Disk].IndexState[Partition] == AFATFS_INDEX_READY){
+        return AFATFS_IndexFind(Disk, Partition, FileHandle);
+      }
+    }
+
+    /* Reading one sector from the directory */
+    returncode = AFATFS_DirEntrySector(Disk, Partition,
+        &Fat32File[FileHandle].Ctx.Dir, Fat32File[FileHandle].DirCluster,
+        Fat32File[FileHandle].Entry, &sector);
+    if(returncode == ANSWERED_REQUEST){
+      returncode = AFATFS_CacheGet(Disk, sector, &data);
+    }
+    if(returncode == ANSWERED_REQUEST)
+    {
+
+      returncode = OPERATION_RUNNING;
+      memcpy(&FatDisk[Disk].RootDir[0], data,
+          sizeof(FatDisk[Disk].RootDir));
+      for(int i = 0; i < 16; i++)
+      {
+        if(FatDisk[Disk].RootDir[i].Name[0] == FAT_END_OF_DIR)
+        {
+          /* Reached end of directory */
+          Fat32File[FileHandle].Entry = 0;
+          returncode = ERR_FAILED;
+          break;
+        }
+        else if(AFATFS_MatchEntry(FileHandle,
+            (uint8_t *)&FatDisk[Disk].RootDir[i]))
+        {
+          /* File was found */
+          AFATFS_LoadEntry(FileHandle, Disk, Partition,
+              &FatDisk[Disk].RootDir[i], Fat32File[FileHandle].Entry + i);
+          Fat32File[FileHandle].EntrySector = sector;
+          returncode = ANSWERED_REQUEST;
           break;
         }
       }
-      if(*Entry == 0xFFFFFFFF){
-        sectorOffset[Disk]++;
-        if(sectorOffset[Disk] >= FatDisk[Disk].PPR.SectorPerCluster[Partition]){
-          sectorOffset[Disk] = 0;
-          returncode = ERR_FAILED;
+      if(returncode == OPERATION_RUNNING){
+        Fat32File[FileHandle].Entry += 16;
+      }
+      if(returncode == ERR_FAILED){
+        /* Every short name of the directory was seen */
+        Fat32File[FileHandle].Ctx.TailMask |= 1;
+      }
+
+    }else if(returncode == ERR_RESOURCE_DEPLETED){
+      /* Reached end of the cluster chain without finding end of directory */
+      Fat32File[FileHandle].Entry = 0;
+      Fat32File[FileHandle].Ctx.TailMask |= 1;
+      returncode = ERR_FAILED;
+    }else if(returncode >= RETURN_ERROR_VALUE){
+      Fat32File[FileHandle].Entry = 0;
+    }
+
+  }else{
+    if(Disk >= AFATS_MAX_DISKS || Partition >= AFATS_MAX_PARTITIONS){
+      returncode = ERR_PARAM_VALUE;
+    }else if(FatDisk[Disk].MBR.FatType[Partition] != FAT32_LBA){
+      returncode = ERR_INVALID_FILE_SYSTEM;
+    }else{
+      returncode = ERR_PARAM_VALUE;
+    }
+    Fat32File[FileHandle].Entry = 0;
+  }
+
+  return returncode;
+}
+
+
+
+static uint8_t AFATFS_DentryFind(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle)
+{
+#if AFATFS_DENTRY_CACHE_SIZE > 0
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  afatfsDentry_t *dentry;
+  uint8_t i;
+
+  /* Folders are remembered by their parent and the name given on the path */
+  for(i = 0; i < AFATFS_DENTRY_CACHE_SIZE; i++){
+    dentry = &FatDisk[Disk].Dentry[i];
+    if(dentry->Length == file->Ctx.NameLength &&
+        dentry->Partition == Partition &&
+        dentry->Parent == file->DirCluster &&
+        !memcmp(dentry->Name, file->Ctx.Path, dentry->Length))
+    {
+      dentry->Age = ++FatDisk[Disk].DentryClock;
+      file->DirCluster = dentry->Cluster;
+      return 1;
+    }
+  }
+#else
+  (void)Disk;
+  (void)Partition;
+  (void)FileHandle;
+#endif
+
+  return 0;
+}
+
+
+
+static void AFATFS_DentryInsert(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle)
+{
+#if AFATFS_DENTRY_CACHE_SIZE > 0
+  afatfsFile_t *file = &Fat32File[FileHandle];
+  afatfsDentry_t *dentry;
+  uint8_t i, lru = 0;
+
+  /* Taking a free slot, or the one not used for the longest time */
+  if(file->Ctx.NameLength > AFATFS_DENTRY_NAME_SIZE){
+    return;
+  }
+  for(i = 0; i < AFATFS_DENTRY_CACHE_SIZE; i++){
+    if(FatDisk[Disk].Dentry[i].Length == 0){
+      lru = i;
+      break;
+    }
+    if(FatDisk[Disk].Dentry[i].Age < FatDisk[Disk].Dentry[lru].Age){
+      lru = i;
+    }
+  }
+
+  dentry = &FatDisk[Disk].Dentry[lru];
+  dentry->Parent = file->DirCluster;
+  dentry->Entry = file->Entry;
+  dentry->Cluster = file->ClusterFirst;
+  dentry->Partition = Partition;
+  dentry->Length = file->Ctx.NameLength;
+  memcpy(dentry->Name, file->Ctx.Path, dentry->Length);
+  dentry->Age = ++FatDisk[Disk].DentryClock;
+#else
+  (void)Disk;
+  (void)Partition;
+  (void)FileHandle;
+#endif
+}
+
+
+
+static EStatus_t AFATFS_WalkPath(uint8_t Disk, uint8_t Partition,
+    uint8_t FileHandle)
+{
+  EStatus_t returncode = ANSWERED_REQUEST;
+  afatfsFile_t *file = &Fat32File[FileHandle];
+
+  /*
+   * Steps:
+   * 1 - Look the next folder of the path up on the dentry cache, or on its
+   *     parent directory (AFATFS_FindFile, one sector per call). It must be
+   *     a directory.
+   * 2 - Go into it and take the next name of the path.
+   * 3 - Stop at the last name, left to the caller to look up or create in
+   *     file->DirCluster.
+   */
+  while(!file->Ctx.isLastName && returncode == ANSWERED_REQUEST)
+  {
+    if(!AFATFS_DentryFind(Disk, Partition, FileHandle)){
+      returncode = AFATFS_FindFile(Disk, Partition, FileHandle);
+      if(returncode == ANSWERED_REQUEST){
+        if(!(file->Attrib & SUBDIRECTORY) ||
+            file->ClusterFirst < FAT_FIRST_CLUSTER)
+        {
+          /* Not a folder */
+          file->Entry = 0;
+          returncode = ERR_FAILED;
+        }else{
+          AFATFS_DentryInsert(Disk, Partition, FileHandle);
+          file->DirCluster = file->ClusterFirst;
+        }
+      }
+    }
+    if(returncode == ANSWERED_REQUEST){
+      file->Entry = 0;
+      file->Ctx.LfnOrder = 0;
+      file->Ctx.TailMask = 0;
+      file->Ctx.Path += file->Ctx.NameLength + 1;
+      returncode = AFATFS_NextName(FileHandle);
+    }
+  }
+
+  return returncode;
+}
+
+
+
+static EStatus_t AFATFS_RunJob(AfatfsJob_t *Job)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+
+  switch(Job->Operation)
+  {
+  case AFATFS_JOB_MOUNT:
+    returncode = AFATFS_Mount(Job->Disk);
+    break;
+
+  case AFATFS_JOB_CREATE:
+    returncode = AFATFS_Create(Job->Disk, Job->Partition, Job->FileName,
+        Job->Mode, &Job->Handle);
+    break;
+
+  case AFATFS_JOB_OPEN:
+    returncode = AFATFS_Open(Job->Disk, Job->Partition, Job->FileName,
+        Job->Mode, &Job->Handle);
+    break;
+
+  case AFATFS_JOB_READ:
+    returncode = AFATFS_Read(Job->Handle, Job->Buffer, Job->Size, &Job->Bytes);
+    break;
+
+  case AFATFS_JOB_WRITE:
+    returncode = AFATFS_Write(Job->Handle, Job->Buffer, Job->Size);
+    break;
+
+  case AFATFS_JOB_FLUSH:
+    returncode = AFATFS_Flush(Job->Handle);
+    break;
+
+  case AFATFS_JOB_CLOSE:
+    returncode = AFATFS_Close(Job->Disk, Job->Partition, &Job->Handle);
+    break;
+
+  case AFATFS_JOB_SYNC:
+    returncode = AFATFS_Sync(Job->Disk);
+    break;
+
+  default:
+    returncode = ERR_PARAM_VALUE;
+    break;
+  }
+
+  return returncode;
+}
+
+
+
+static uint8_t AFATFS_IsJobWaiting(uint8_t Index)
+{
+  AfatfsJob_t *job = AFATFS_Job[Index];
+  AfatfsJob_t *other;
+  uint8_t isFileJob, isOtherFileJob;
+  uint8_t i;
+
+  /* A job waits for older jobs on the same file, or for older mount and
+   * sync jobs on the same disk */
+  isFileJob = (job->Operation >= AFATFS_JOB_READ &&
+      job->Operation <= AFATFS_JOB_CLOSE);
+  for(i = 0; i < Index; i++){
+    other = AFATFS_Job[i];
+    isOtherFileJob = (other->Operation >= AFATFS_JOB_READ &&
+        other->Operation <= AFATFS_JOB_CLOSE);
+    if(isFileJob && isOtherFileJob && other->Handle == job->Handle){
+      return 1;
+    }
+    if(!isFileJob && !isOtherFileJob && other->Disk == job->Disk &&
+        (job->Operation == AFATFS_JOB_MOUNT ||
+            job->Operation == AFATFS_JOB_SYNC) &&
+        (other->Operation == AFATFS_JOB_MOUNT ||
+            other->Operation == AFATFS_JOB_SYNC))
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+
+EStatus_t AFATFS_Mount(uint8_t Disk)
+{
+  enum{INT_HW_INIT = 0, EXT_DEV_CONFIG, READ_BOOT, READ_BIOS, READ_FSINFO,
+    BUILD_INDEX, NOP};
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsDiskContext_t *ctx;
+  uint8_t traceFrom;
+
+  AFATFS_STATS_ENTER(Disk, AFATS_MAX_FILES);
+
+  if(Disk < AFATS_MAX_DISKS && Disk < Disk_ListSize)
+  {
+    ctx = &FatDisk[Disk].Ctx;
+    traceFrom = AFATFS_TRACE_FROM(FatDisk[Disk].TraceActive,
+        AFATFS_TRACE_MOUNT, ctx->MountState);
+    if(Disk_List[Disk].IntHwInit != NULL &&
+        Disk_List[Disk].ExtDevConfig != NULL &&
+        ((Disk_List[Disk].Read != NULL && Disk_List[Disk].Write != NULL) ||
+            Disk_List[Disk].Submit != NULL))
+    {
+      switch(ctx->MountState)
+      {
+      case INT_HW_INIT:
+        /* Initializing internal hardware */
+        returncode = Disk_List[Disk].IntHwInit();
+        if( returncode == ANSWERED_REQUEST ){
+          returncode = OPERATION_RUNNING;
+          ctx->MountState = EXT_DEV_CONFIG;
+        }
+        break;
+
+      case EXT_DEV_CONFIG:
+        /* Configuring device */
+        returncode = Disk_List[Disk].ExtDevConfig();
+        if( returncode == ANSWERED_REQUEST ){
+          returncode = OPERATION_RUNNING;
+          /* Nothing cached before is known to be on this disk */
+          AFATFS_CacheReset(Disk);
+          ctx->MountState = READ_BOOT;
+        }else if(returncode >= RETURN_ERROR_VALUE){
+          ctx->MountState = EXT_DEV_CONFIG;
+        }
+        break;
+
+      case READ_BOOT:
+        /* Reading boot sector (sector 0) */
+        returncode = AFATFS_ReadBootSector(Disk);
+        if(returncode == ANSWERED_REQUEST){
+          returncode = OPERATION_RUNNING;
+          ctx->MountState = READ_BIOS;
+        }else if(returncode >= RETURN_ERROR_VALUE){
+          ctx->MountState = EXT_DEV_CONFIG;
+        }
+        break;
+
+      case READ_BIOS:
+        /* Reading what seems to be an extension of the boot sector */
+        returncode = AFATFS_ReadBiosParameter(Disk, ctx->MountPartition);
+        if(returncode == ANSWERED_REQUEST){
+          returncode = OPERATION_RUNNING;
+          ctx->MountState = READ_FSINFO;
+        }else if(returncode == ERR_INVALID_FILE_SYSTEM){
+          ctx->MountErrors++;
+          ctx->MountPartition++;
+          if(ctx->MountPartition >= AFATS_MAX_PARTITIONS){
+            ctx->MountPartition = 0;
+            if(ctx->MountErrors < AFATS_MAX_PARTITIONS){
+              /* At least one valid partition was found */
+              FatDisk[Disk].isInitialized = 1;
+              FatDisk[Disk].Busy = 0xFF; /* Not busy */
+              ctx->MountState = NOP;
+              returncode = ANSWERED_REQUEST;
+            }else{
+              /* No valid partition was found */
+              ctx->MountState = EXT_DEV_CONFIG;
+            }
+            ctx->MountErrors = 0;
+            ctx->MountPartition = 0;
+          }else{
+            returncode = OPERATION_RUNNING;
+          }
+        } else if(returncode >= RETURN_ERROR_VALUE){
+          ctx->MountState = EXT_DEV_CONFIG;
+        }
+        break;
+
+      case READ_FSINFO:
+        /* Reading the free clusters information of the partition */
+        returncode = AFATFS_ReadFsInfo(Disk, ctx->MountPartition);
+        if(returncode == ANSWERED_REQUEST){
+          returncode = OPERATION_RUNNING;
+          ctx->MountState = BUILD_INDEX;
+        }else if(returncode >= RETURN_ERROR_VALUE){
+          ctx->MountState = EXT_DEV_CONFIG;
+        }
+        break;
+
+      case BUILD_INDEX:
+        /* Indexing the root directory, if memory was given for it */
+        returncode = AFATFS_BuildDirIndex(Disk, ctx->MountPartition);
+        if(returncode == ANSWERED_REQUEST){
+          ctx->MountPartition++;
+          if(ctx->MountPartition >= AFATS_MAX_PARTITIONS){
+            /* All partitions were read, and at least one is valid */
+            ctx->MountPartition = 0;
+            ctx->MountErrors = 0;
+            ctx->MountPartition = 0;
+            FatDisk[Disk].isInitialized = 1;
+            FatDisk[Disk].Busy = 0xFF; /* Not busy */
+            ctx->MountState = NOP;
+          }else{
+            returncode = OPERATION_RUNNING;
+            ctx->MountState = READ_BIOS;
+          }
+        }else if(returncode >= RETURN_ERROR_VALUE){
+          ctx->MountState = EXT_DEV_CONFIG;
+        }
+        break;
+
+      case NOP:
+        /* Will configure the disk again */
+        FatDisk[Disk].isInitialized = 0;
+        ctx->MountState = EXT_DEV_CONFIG;
+        break;
+
+      default:
+        /* What happened? Maybe cosmic rays */
+        ctx->MountState = INT_HW_INIT;
+        break;
+      }
+    }
+    AFATFS_TRACE_STEP(AFATFS_TRACE_MOUNT, Disk, AFATS_MAX_FILES,
+        FatDisk[Disk].TraceActive, traceFrom, ctx->MountState, returncode);
+  }else{
+    returncode = ERR_PARAM_VALUE;
+  }
+
+  return AFATFS_STATS_LEAVE(returncode);
+}
+
+
+
+EStatus_t AFATFS_Create(uint8_t Disk, uint8_t Partition, char *FileName,
+    uint8_t Mode, uint8_t *FileHandle)
+{
+  enum{WALK_PATH = 0, FIND_FILE, CHECK_SHORT_NAME, FIND_EMPTY_CLUSTER,
+    FIND_EMPTY_ROOT_ENTRY, FIND_DIR_CLUSTER, CLEAR_DIR_CLUSTER,
+    LINK_DIR_CLUSTER, ALOCATE_CLUSTER, WRITE_LONG_NAME, WRITE_ROOT_ENTRY,
+    WRITE_RING_HEADER};
+  EStatus_t returncode = OPERATION_RUNNING;
+  afatfsFile_t *file;
+  uint32_t count;
+  uint8_t h, traceFrom;
+
+  AFATFS_STATS_ENTER(Disk, AFATS_MAX_FILES);
+
+  if(Disk < AFATS_MAX_DISKS && Disk < Disk_ListSize &&
+      Partition < AFATS_MAX_PARTITIONS &&
+      FileName != NULL && FileHandle != NULL &&
+      FatDisk[Disk].isInitialized == 1)
+  {
+    /*
+     * Steps:
+     * 1 - Verify if the file already exists. If yes, returns failure
+     * 2 - Find a empty cluster on the FAT (File Allocation Table)
+     *     Clust is free if 0x00000000 is written
+     * 3 - Write 0xFFFFFFFF on the space for the empty cluster (means it is the
+     *     last cluster for the file)
+     * 4 - Find a free entry on ROOT_DIR (FAT_END_OF_DIR or FAT_UNUSED_ENTRY)
+     * 5 - Write file entry on ROOT_DIR
+     *
+     * For a long name, a short name not in use is chosen after step 1, the
+     * free entries found on step 4 also hold the long name, written before
+     * the short entry.
+     *
+     * If the directory is full on step 4, a cluster is cleared and linked
+     * after its last one, then the steps go on from step 2 (the cluster
+     * found before may be the one just taken).
+     *
+     * With AFATFS_FILE_MODE_STREAM, step 2 looks for a run of free clusters
+     * (AFATFS_FindFreeRun) and step 3 chains the whole run.
+     *
+     * With AFATFS_FILE_MODE_RING, the run must be as long as asked. After
+     * step 5 the entry gets the size of the run and the first sector an
+     * empty ring header.
+     *
+     *
+     * Notes:
+     * 1 - Not sure if it is best to write the rootfirst, then the FAT, or the
+     *     opposite.
+     * 2 - The file structure is taken on the first call and holds the progress
+     *     of the request, so creates and opens of other files run at the same
+     *     time. Steps 1 to 5 hold the disk lock (AFATFS_Lock).
+     */
+    h = AFATFS_PendingFile(FileHandle);
+    if(h >= AFATS_MAX_FILES){
+      returncode = AFATFS_ReserveFile(Disk, Partition, FileName, FileHandle);
+#if AFATFS_TRACE_SIZE > 0
+      if(returncode == OPERATION_RUNNING){
+        AFATFS_TraceStep(AFATFS_TRACE_CREATE, Disk, *FileHandle,
+            &Fat32File[*FileHandle].Ctx.TraceActive, AFATFS_TRACE_IDLE,
+            Fat32File[*FileHandle].Ctx.State, returncode);
+      }
+#endif
+      return AFATFS_STATS_LEAVE(returncode);
+    }
+    file = &Fat32File[h];
+    traceFrom = AFATFS_TRACE_FROM(file->Ctx.TraceActive, AFATFS_TRACE_CREATE,
+        file->Ctx.State);
+
+    switch(file->Ctx.State)
+    {
+    case WALK_PATH:
+      /* Going into the folders of the path */
+      returncode = AFATFS_WalkPath(Disk, Partition, h);
+      if(returncode == ANSWERED_REQUEST){
+        file->Ctx.State = FIND_FILE;
+        returncode = OPERATION_RUNNING;
+      }
+      break;
+
+    case FIND_FILE:
+      if(!AFATFS_Lock(Disk, h)){
+        /* Another file is changing the FAT or the directory */
+        break;
+      }
+      returncode = AFATFS_FindFile(Disk, Partition, h);
+      if(returncode == ERR_FAILED){
+        /* File does not exist */
+        file->Ctx.State = FIND_EMPTY_CLUSTER;
+        returncode = OPERATION_RUNNING;
+        if(file->Ctx.LongName != NULL && !file->Ctx.isShortLookup){
+          /* The whole directory was read, so the short names in use are
+           * known. Otherwise they are looked up one by one */
+          if(file->Ctx.TailMask & 1){
+            while(file->Ctx.TailTry < 9 &&
+                (file->Ctx.TailMask & (1 << (file->Ctx.TailTry + 1))))
+            {
+              file->Ctx.TailTry++;
+            }
+          }
+          if(!(file->Ctx.TailMask & 1) || file->Ctx.TailTry >= 9){
+            file->Ctx.State = CHECK_SHORT_NAME;
+          }
+          AFATFS_ShortName(file->Ctx.LongName, file->Ctx.LongLength,
+              file->Ctx.TailTry, file->Name, file->Extension);
+        }
+      }else if(returncode == ANSWERED_REQUEST){
+        /* File already exists */
+        returncode = ERR_FAILED;
+      }
+      break;
+
+    case CHECK_SHORT_NAME:
+      file->Ctx.isShortLookup = 1;
+      returncode = AFATFS_FindFile(Disk, Partition, h);
+      if(returncode == ERR_FAILED){
+        /* Short name not in use */
+        file->Ctx.isShortLookup = 0;
+        file->Ctx.State = FIND_EMPTY_CLUSTER;
+        returncode = OPERATION_RUNNING;
+      }else if(returncode == ANSWERED_REQUEST){
+        file->Entry = 0;
+        file->Ctx.TailTry++;
+        if(file->Ctx.TailTry < AFATFS_SHORT_NAME_TRIES){
+          AFATFS_ShortName(file->Ctx.LongName, file->Ctx.LongLength,
+              file->Ctx.TailTry, file->Name, file->Extension);
+          returncode = OPERATION_RUNNING;
         }else{
+          returncode = ERR_FAILED;
+        }
+      }
+      break;
+
+    case FIND_EMPTY_CLUSTER:
+      count = AFATFS_PreallocClusters(Disk, Partition);
+      if(Mode & AFATFS_FILE_MODE_RING){
+        /* A header sector and two data sectors at least */
+        while(count * FatDisk[Disk].PPR.SectorPerCluster[Partition] < 3){
+          count++;
+        }
+      }
+      if(Mode & (AFATFS_FILE_MODE_STREAM | AFATFS_FILE_MODE_RING)){
+        returncode = AFATFS_FindFreeRun(Disk, Partition, h, 0, count,
+            &file->Ctx.NewCluster, &file->Ctx.NewLength);
+        if(returncode == ANSWERED_REQUEST &&
+            (Mode & AFATFS_FILE_MODE_RING) && file->Ctx.NewLength < count)
+        {
+          /* The size of a ring file is fixed */
+          returncode = ERR_FAILED;
+        }
+      }else{
+        returncode = AFATFS_FindEmptyCluster(Disk, Partition, h, 0, 0,
+            &file->Ctx.NewCluster);
+      }
+      if(returncode == ANSWERED_REQUEST){
+        file->Ctx.State = FIND_EMPTY_ROOT_ENTRY;
+        returncode = OPERATION_RUNNING;
+      }else if(returncode >= RETURN_ERROR_VALUE){
+        returncode = ERR_FAILED;
+      }
+      break;
+
+    case FIND_EMPTY_ROOT_ENTRY:
+      count = (file->Ctx.LongLength + FAT_LFN_CHARS_PER_ENTRY - 1) /
+          FAT_LFN_CHARS_PER_ENTRY;
+      returncode = AFATFS_FindEmptyRootEntry(Disk, Partition, h, count + 1,
+          &file->Entry, &file->EntrySector);
+      if(returncode == ANSWERED_REQUEST){
+        /* The short entry comes after the long name */
+        file->Entry += count;
+        /* Keeping the directory sector cached until the entry is written */
+        AFATFS_CachePin(Disk, file->EntrySector);
+        file->Ctx.State = ALOCATE_CLUSTER;
+        returncode = OPERATION_RUNNING;
+      }else if(returncode == ERR_RESOURCE_DEPLETED){
+        /* No room left on the clusters of the directory */
+        file->Ctx.State = FIND_DIR_CLUSTER;
+        returncode = OPERATION_RUNNING;
+      }else if(returncode >= RETURN_ERROR_VALUE){
+        returncode = ERR_FAILED;
+      }
+      break;
+
+    case FIND_DIR_CLUSTER:
+      /* Looking from the last cluster of the directory, so it stays close */
+      returncode = AFATFS_FindEmptyCluster(Disk, Partition, h, 0,
+          file->Ctx.Dir.Cluster, &file->Ctx.GrowCluster);
+      if(returncode == ANSWERED_REQUEST){
+        file->Ctx.State = CLEAR_DIR_CLUSTER;
+        returncode = OPERATION_RUNNING;
+      }else if(returncode >= RETURN_ERROR_VALUE){
+        returncode = ERR_FAILED;
+      }
+      break;
+
+    case CLEAR_DIR_CLUSTER:
+      /* Cleared before being linked, so the directory never ends on stale
+       * data */
+      returncode = AFATFS_ClearCluster(Disk, Partition, h,
+          file->Ctx.GrowCluster);
+      if(returncode == ANSWERED_REQUEST){
+        file->Ctx.State = LINK_DIR_CLUSTER;
+        returncode = OPERATION_RUNNING;
+      }else if(returncode >= RETURN_ERROR_VALUE){
+        returncode = ERR_FAILED;
+      }
+      break;
+
+    case LINK_DIR_CLUSTER:
+      returncode = AFATFS_AllocateCluster(Disk, Partition, h, 0,
+          file->Ctx.Dir.Cluster, &file->Ctx.GrowCluster);
+      if(returncode == ANSWERED_REQUEST){
+        file->Ctx.State = FIND_EMPTY_CLUSTER;
+        returncode = OPERATION_RUNNING;
+      }else if(returncode >= RETURN_ERROR_VALUE){
+        returncode = ERR_FAILED;
+      }
+      break;
+
+    case ALOCATE_CLUSTER:
+      /* If something goes wrong between ALOCATE_CLUSTER and WRITE_ROOT_ENTRY
+       * states, one of the listed bellow can happen:
+       * 1 - One cluster is marked as used, but an error occur while adding the
+       *     root entry. The cluster is lost until disk is formatted.
+       * 2 - An error occur while allocating the cluster, but it pass as if
+       *     everything is OK and the entry is added to the root dir. Not sure
+       *     about what might happen when plugging the card on a computer, but
+       *     the file migt end up being overwritten.
+       *   */
+      if(Mode & (AFATFS_FILE_MODE_STREAM | AFATFS_FILE_MODE_RING)){
+        returncode = AFATFS_ChainRun(Disk, Partition, h,
+            file->Ctx.NewCluster, file->Ctx.NewLength, 0);
+      }else{
+        returncode = AFATFS_AllocateCluster(Disk, Partition, h, 0, 0,
+            &file->Ctx.NewCluster);
+      }
+      if(returncode == ANSWERED_REQUEST){
+        file->Ctx.State = (file->Ctx.LongName != NULL) ?
+            WRITE_LONG_NAME : WRITE_ROOT_ENTRY;
+        returncode = OPERATION_RUNNING;
+      }else if(returncode >= RETURN_ERROR_VALUE){
+        AFATFS_CacheUnpin(Disk, file->EntrySector);
+        returncode = ERR_FAILED;
+      }
+      break;
+
+    case WRITE_LONG_NAME:
+      returncode = AFATFS_AddLongName(Disk, Partition, h);
+      if(returncode == ANSWERED_REQUEST){
+        file->Ctx.State = WRITE_ROOT_ENTRY;
+        returncode = OPERATION_RUNNING;
+      }else if(returncode >= RETURN_ERROR_VALUE){
+        AFATFS_CacheUnpin(Disk, file->EntrySector);
+        returncode = ERR_FAILED;
+      }
+      break;
+
+    case WRITE_ROOT_ENTRY:
+      returncode = AFATFS_AddRootEntry(Disk, Partition, h);
+      if(returncode != OPERATION_RUNNING){
+        AFATFS_CacheUnpin(Disk, file->EntrySector);
+      }
+      if(returncode == ANSWERED_REQUEST){
+
+        /* The next create in the directory looks for free entries from the
+         * first one seen, or after this file if it took that one */
+        count = (file->Ctx.LongLength + FAT_LFN_CHARS_PER_ENTRY - 1) /
+            FAT_LFN_CHARS_PER_ENTRY;
+        AFATFS_SetFreeHint(Disk, Partition, &file->Ctx.Dir,
+            (file->Ctx.FirstFree + count == file->Entry) ?
+            file->Entry + 1 : file->Ctx.FirstFree);
+
+        file->FilePos = 0; /*Start of file*/
+        file->LogicalSize = 0;
+        /* One cluster allocated, grows as the file is written */
+        file->PhysicalSize =
+            512 * FatDisk[Disk].PPR.SectorPerCluster[Partition];
+
+        file->ClusterFirst = file->Ctx.NewCluster;
+        file->ClusterPos = file->ClusterFirst;
+        file->ClusterPrev = 0; /*Invalid value*/
+        AFATFS_ResetExtents(h);
+        /* The cluster was just allocated, so it is the last one */
+        file->isChainComplete = 1;
+        if(Mode & (AFATFS_FILE_MODE_STREAM | AFATFS_FILE_MODE_RING)){
+          /* The whole run was taken */
+          file->Extent[0].Length = file->Ctx.NewLength;
+          file->PhysicalSize *= file->Ctx.NewLength;
+        }
+
+        file->SectorFirst =
+            FatDisk[Disk].PPR.DataStartSector[Partition] +
+            ( FatDisk[Disk].PPR.SectorPerCluster[Partition] *
+                (file->ClusterFirst - 2) );
+        file->SectorPos = file->SectorFirst;
+        file->SectorPrev = 0; /*Invalid value*/
+        file->BufferSector = file->SectorFirst;
+        file->BufferPos = 0;
+        file->BufferCount = 0; /* Nothing buffered */
+        file->isBufferDirty = 0;
+        file->isEntryDirty = 0;
+        file->Mode = Mode;
+        file->SyncPolicy = (Mode & (AFATFS_FILE_MODE_BUFFERED |
+            AFATFS_FILE_MODE_STREAM | AFATFS_FILE_MODE_RING)) ?
+            AFATFS_SYNC_ON_FLUSH : AFATFS_SYNC_ENTRY;
+        file->SyncValue = 0;
+        if(Mode & AFATFS_FILE_MODE_RING){
+          /* Full size at once, empty ring after the header sector */
+          file->LogicalSize = file->PhysicalSize;
+          file->RingHead = AFATFS_MAX_SECTOR_SIZE;
+          file->RingTail = AFATFS_MAX_SECTOR_SIZE;
+          file->RingWraps = 0;
+          file->RingCount = 0;
+          file->BufferPos = AFATFS_MAX_SECTOR_SIZE;
+          file->BufferSector++;
+        }
+        AFATFS_ResetSync(h);
+        file->ReadHits = 0;
+        file->ReadMisses = 0;
+
+        if(FatDisk[Disk].IndexState[Partition] == AFATFS_INDEX_READY &&
+            file->DirCluster == FatDisk[Disk].PPR.RootCluster[Partition])
+        {
+          AFATFS_IndexInsert(Disk, Partition,
+              AFATFS_NameHash(file->Name, file->Extension), file->Entry,
+              file->ClusterFirst);
+        }
+        if(FatDisk[Disk].IndexState[Partition] == AFATFS_INDEX_READY &&
+            file->DirCluster == FatDisk[Disk].PPR.RootCluster[Partition] &&
+            file->Ctx.LongName != NULL)
+        {
+          AFATFS_IndexInsert(Disk, Partition,
+              AFATFS_LongNameHash(file->Ctx.LongName, file->Ctx.LongLength),
+              file->Entry, file->ClusterFirst);
+        }
+
+        returncode = ANSWERED_REQUEST;
+        if(Mode & AFATFS_FILE_MODE_RING){
+          file->Ctx.State = WRITE_RING_HEADER;
           returncode = OPERATION_RUNNING;
         }
+
+      }else if(returncode >= RETURN_ERROR_VALUE){
+        returncode = ERR_FAILED;
+      }
+      break;
+
+    case WRITE_RING_HEADER:
+      /* Both on cached sectors, the header is written again if the entry
+       * sector has to be read */
+      returncode = AFATFS_WriteRingHeader(h);
+      if(returncode == ANSWERED_REQUEST){
+        returncode = AFATFS_UpdateFileEntry(h, file->LogicalSize);
+      }
+      if(returncode >= RETURN_ERROR_VALUE){
+        returncode = ERR_FAILED;
       }
+      break;
+
+    default:
+      file->Ctx.State = WALK_PATH;
+      returncode = OPERATION_RUNNING;
+      break;
+
+    }
 
+    if(returncode == ANSWERED_REQUEST){
+      AFATFS_Unlock(Disk, h);
+      memset(&file->Ctx, 0, sizeof(file->Ctx));
+    }else if(returncode >= RETURN_ERROR_VALUE){
+      AFATFS_Unlock(Disk, h);
+      AFATFS_ReleaseFile(FileHandle);
     }
+    AFATFS_TRACE_STEP(AFATFS_TRACE_CREATE, Disk, h, file->Ctx.TraceActive,
+        traceFrom, file->Ctx.State, returncode);
 
   }else{
-    sectorOffset[Disk] = 0;
-    returncode = ERR_PARAM_VALUE;
+    if(FileName == NULL || FileHandle == NULL){
+      returncode = ERR_NULL_POINTER;
+    }else if(Disk >= AFATS_MAX_DISKS || Partition >= AFATS_MAX_PARTITIONS){
+      returncode = ERR_PARAM_VALUE;
+    }else if(FatDisk[Disk].MBR.FatType[Partition] != FAT32_LBA){
+      returncode = ERR_INVALID_FILE_SYSTEM;
+    }else{
+      returncode = ERR_PARAM_VALUE;
+    }
   }
 
-  return returncode;
+  return AFATFS_STATS_LEAVE(returncode);
 }
 
 
 
-static EStatus_t AFATFS_AddRootEntry(uint8_t Disk, uint8_t Partition,
-    uint32_t *Entry)
+EStatus_t AFATFS_Open(uint8_t Disk, uint8_t Partition, char *FileName,
+    uint8_t Mode, uint8_t *FileHandle)
 {
+  enum{WALK_PATH = 0, FIND_FILE, MAP_RING, READ_RING_HEADER};
   EStatus_t returncode = OPERATION_RUNNING;
-  uint32_t sectorOffset;
+  afatfsFile_t *file;
+  AfatfsRingHeader_t header;
+  uint32_t cluster, run, clusterSize;
+  uint8_t *data;
+  uint8_t h;
+#if AFATFS_TRACE_SIZE > 0
+  uint8_t traceFrom;
+#endif
 
-  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
+  AFATFS_STATS_ENTER(Disk, AFATS_MAX_FILES);
+
+  if(Disk < AFATS_MAX_DISKS && Disk < Disk_ListSize &&
+      FileName != NULL && FileHandle != NULL)
   {
-    sectorOffset = (*Entry) / 16;
-    returncode = AFATFS_WriteRootDirEntry(Disk, Partition, sectorOffset);
+    if(FatDisk[Disk].isInitialized == 1)
+    {
+      /*
+       * This piece of code performs the following:
+       * 1 - Find a file structure not in use.
+       * 2 - Fetch the first name of the path, 8.3 or long.
+       * 3 - Go into the folders of the path (AFATFS_WalkPath).
+       * 4 - Search for the file name in the directory of the last folder.
+       * 5 - Save relevant data from file entry.
+       *
+       * Steps 1 and 2 are done on the first call, which takes the file
+       * structure. The next calls with the same FileHandle variable go on
+       * with steps 3 to 5, so several files are opened at the same time.
+       *
+       * With AFATFS_FILE_MODE_RING, the chain is then followed to the end of
+       * the file, which must be a single run, and the head and tail are read
+       * from the header sector.
+       */
+      h = AFATFS_PendingFile(FileHandle);
+#if AFATFS_TRACE_SIZE > 0
+      traceFrom = (h < AFATS_MAX_FILES) ?
+          AFATFS_TRACE_FROM(Fat32File[h].Ctx.TraceActive, AFATFS_TRACE_OPEN,
+              Fat32File[h].Ctx.State) : AFATFS_TRACE_IDLE;
+#endif
+      if(h >= AFATS_MAX_FILES){
+        returncode = AFATFS_ReserveFile(Disk, Partition, FileName,
+            FileHandle);
+      }else if(Fat32File[h].Ctx.State == WALK_PATH){
+        /* Going into the folders of the path */
+        returncode = AFATFS_WalkPath(Disk, Partition, h);
+        if(returncode == ANSWERED_REQUEST){
+          Fat32File[h].Ctx.State = FIND_FILE;
+          returncode = OPERATION_RUNNING;
+        }else if(returncode >= RETURN_ERROR_VALUE){
+          AFATFS_ReleaseFile(FileHandle);
+        }
+      }else if(Fat32File[h].Ctx.State == FIND_FILE){
+        returncode = AFATFS_FindFile(Disk, Partition, h);
+        if(returncode == ANSWERED_REQUEST){
+          if(Mode & AFATFS_FILE_MODE_STREAM){
+            /* Only files created so take clusters in advance */
+            Mode = (Mode & ~AFATFS_FILE_MODE_STREAM) |
+                AFATFS_FILE_MODE_BUFFERED;
+          }
+          Fat32File[h].Mode = Mode;
+          if(Mode & (AFATFS_FILE_MODE_BUFFERED | AFATFS_FILE_MODE_RING)){
+            Fat32File[h].SyncPolicy = AFATFS_SYNC_ON_FLUSH;
+          }
+          if(Mode & AFATFS_FILE_MODE_RING){
+            Fat32File[h].Ctx.State = MAP_RING;
+            returncode = OPERATION_RUNNING;
+          }else{
+            Fat32File[h].Ctx.Owner = NULL;
+          }
+        }else if(returncode >= RETURN_ERROR_VALUE){
+          AFATFS_ReleaseFile(FileHandle);
+        }
+      }else{
+        file = &Fat32File[h];
+        clusterSize = AFATFS_MAX_SECTOR_SIZE *
+            FatDisk[Disk].PPR.SectorPerCluster[Partition];
+        if(file->LogicalSize < 3 * AFATFS_MAX_SECTOR_SIZE ||
+            file->LogicalSize % clusterSize != 0)
+        {
+          /* Ring files are whole clusters */
+          returncode = ERR_FAILED;
+        }else if(file->Ctx.State == MAP_RING){
+          returncode = AFATFS_MapCluster(h,
+              (file->LogicalSize / clusterSize) - 1, &cluster, &run);
+          if(returncode == ANSWERED_REQUEST){
+            /* Sectors are then found without the FAT */
+            returncode = (file->ExtentCount == 1 && cluster != 0) ?
+                OPERATION_RUNNING : ERR_FAILED;
+            file->Ctx.State = READ_RING_HEADER;
+          }
+        }else{
+          returncode = AFATFS_CacheGet(Disk, file->SectorFirst, &data);
+          if(returncode == ANSWERED_REQUEST){
+            memcpy(&header, data, sizeof(header));
+            if(memcmp(header.Signature, AFATFS_RING_SIGNATURE,
+                sizeof(header.Signature)) || header.Size != file->LogicalSize ||
+                header.Head < AFATFS_MAX_SECTOR_SIZE ||
+                header.Head >= header.Size ||
+                header.Tail < AFATFS_MAX_SECTOR_SIZE ||
+                header.Tail >= header.Size)
+            {
+              returncode = ERR_FAILED;
+            }else{
+              file->RingHead = header.Head;
+              file->RingTail = header.Tail;
+              file->RingWraps = header.Wraps;
+              file->RingCount = 0;
+              AFATFS_ResetSync(h);
+              file->Ctx.Owner = NULL;
+            }
+          }
+        }
+        if(returncode >= RETURN_ERROR_VALUE){
+          AFATFS_ReleaseFile(FileHandle);
+        }
+      }
+#if AFATFS_TRACE_SIZE > 0
+      if(h >= AFATS_MAX_FILES && returncode == OPERATION_RUNNING){
+        /* Started by this call */
+        h = *FileHandle;
+      }
+      if(h < AFATS_MAX_FILES){
+        AFATFS_TraceStep(AFATFS_TRACE_OPEN, Disk, h,
+            &Fat32File[h].Ctx.TraceActive, traceFrom, Fat32File[h].Ctx.State,
+            returncode);
+      }
+#endif
+    }else{
+      returncode = ERR_DISABLED;
+    }
   }else{
-    returncode = ERR_PARAM_VALUE;
+    if(FileName == NULL || FileHandle == NULL){
+      returncode = ERR_NULL_POINTER;
+    }else{
+      returncode = ERR_PARAM_VALUE;
+    }
   }
 
-  return returncode;
+  return AFATFS_STATS_LEAVE(returncode);
 }
 
 
 
-
-static EStatus_t AFATFS_FindEmptyCluster(uint8_t Disk, uint8_t Partition,
-    uint8_t FatNum, uint32_t *EntryNumber)
+EStatus_t AFATFS_Close(uint8_t Disk, uint8_t Partition, uint8_t *FileHandle)
 {
   EStatus_t returncode = OPERATION_RUNNING;
-  static uint32_t sector[AFATS_MAX_DISKS];
-  uint32_t i;
+  afatfsContext_t *ctx;
+
+  AFATFS_STATS_ENTER(Disk,
+      (FileHandle != NULL) ? *FileHandle : AFATS_MAX_FILES);
 
   if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS &&
-      FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA &&
-      EntryNumber != NULL)
+      FileHandle != NULL && *FileHandle < AFATS_MAX_FILES &&
+      Fat32File[*FileHandle].isInUse == 1)
   {
+    ctx = &Fat32File[*FileHandle].Ctx;
+    if(!ctx->isClosing){
+      /* A call of the file given up half way (a write adding clusters) may
+       * still hold the disk lock, the close starts its own steps afresh */
+      AFATFS_Unlock(Fat32File[*FileHandle].Disk, *FileHandle);
+      ctx->AllocState = 0;
+      ctx->ChainDone = 0;
+      ctx->TrimState = 0;
+      ctx->FlushState = 0;
+      ctx->isClosing = 1;
+    }
 
-    returncode = Disk_List[Disk].Read(FatDisk[Disk].Buffer,
-        FatDisk[Disk].PPR.FatStartSector[Partition] +
-        (FatNum * FatDisk[Disk].PPR.FatSize[Partition]) + sector[Disk], 1);
-    if(returncode == ANSWERED_REQUEST)
-    {
-      *EntryNumber = 0; /* Invalid value */
-      /* Skipping first 2 integers, root dir and the next cluster */
-      if(sector[Disk] == 0){ i = 4;}
-      else{ i = 0;}
-      for(; i < 128; i++){
-        if(FatDisk[Disk].Buffer[4*i] == 0 &&
-            FatDisk[Disk].Buffer[4*i + 1] == 0 &&
-            FatDisk[Disk].Buffer[4*i + 2] == 0 &&
-            FatDisk[Disk].Buffer[4*i + 3] == 0)
-        {
-          /* Found empty cluster */
-          *EntryNumber = (128 * sector[Disk]) + i;
-          sector[Disk] = 0;
-          break;
-        }
-      }
-      if(*EntryNumber == 0){
-        sector[Disk]++;
-        if(sector[Disk] >= FatDisk[Disk].PPR.FatSize[Partition]){
-          sector[Disk] = 0;
-          returncode = ERR_FAILED;
-        }else{
-          returncode = OPERATION_RUNNING;
-        }
-      }
+    /* Clusters taken in advance and not used are given back, then changes
+     * kept in memory reach the disk before the file is closed */
+    returncode = ANSWERED_REQUEST;
+    if(Fat32File[*FileHandle].Mode & AFATFS_FILE_MODE_STREAM){
+      returncode = AFATFS_StreamTrim(*FileHandle);
+    }
+    if(returncode == ANSWERED_REQUEST){
+      returncode = AFATFS_Flush(*FileHandle);
+    }
+    if(returncode == ANSWERED_REQUEST){
+      Fat32File[*FileHandle].isInUse = 0;
+      *FileHandle = AFATS_MAX_FILES;
+    }else if(returncode >= RETURN_ERROR_VALUE){
+      /* The file stays open */
+      ctx->isClosing = 0;
     }
 
   }else{
-    if(FatDisk[Disk].MBR.FatType[Partition] != FAT32_LBA){
-      returncode = ERR_PARAM_VALUE;
-    }else if(EntryNumber == NULL){
+    if(FileHandle == NULL){
       returncode = ERR_NULL_POINTER;
     }else{
-      returncode = ERR_INVALID_FILE_SYSTEM;
+      returncode = ERR_PARAM_VALUE;
     }
-    sector[Disk] = 0;
   }
 
-  return returncode;
+  return AFATFS_STATS_LEAVE(returncode);
 }
 
 
 
-static EStatus_t AFATFS_AllocateCluster(uint8_t Disk, uint8_t Partition,
-    uint8_t FatNum, uint32_t *EntryNumber)
+EStatus_t AFATFS_Flush(uint8_t FileHandle)
 {
-  enum{READ_SECTOR = 0, WRITE_TO_SECTOR};
+  enum{FLUSH_BUFFER = 0, UPDATE_ENTRY, SYNC};
   EStatus_t returncode = OPERATION_RUNNING;
-  static uint8_t state[AFATS_MAX_DISKS];
-  uint32_t sector;
+  uint8_t *state;
 
-  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS &&
-      FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA &&
-      EntryNumber != NULL)
-  {
+  AFATFS_STATS_ENTER(AFATS_MAX_DISKS, FileHandle);
 
-    switch(state[Disk])
+  if(FileHandle < AFATS_MAX_FILES && Fat32File[FileHandle].isInUse == 1)
+  {
+    state = &Fat32File[FileHandle].Ctx.FlushState;
+    /*
+     * Steps:
+     * 1 - Write the buffered sectors of the file.
+     * 2 - Update the directory entry if the size or first cluster changed,
+     *     or the header sector of a ring file.
+     * 3 - Write back every sector changed in the disk cache.
+     */
+    switch(*state)
     {
-    case READ_SECTOR:
-      sector = *EntryNumber / 128;
-      returncode = Disk_List[Disk].Read(FatDisk[Disk].Buffer,
-          FatDisk[Disk].PPR.FatStartSector[Partition] +
-          (FatNum * FatDisk[Disk].PPR.FatSize[Partition]) + sector, 1);
-      if(returncode == ANSWERED_REQUEST)
+    case FLUSH_BUFFER:
+      returncode = AFATFS_BufferFlush(FileHandle);
+      if(returncode == ANSWERED_REQUEST){
+        returncode = OPERATION_RUNNING;
+        *state = UPDATE_ENTRY;
+      }
+      break;
+
+    case UPDATE_ENTRY:
+      if(Fat32File[FileHandle].isEntryDirty &&
+          (Fat32File[FileHandle].Mode & AFATFS_FILE_MODE_RING))
       {
+        returncode = AFATFS_WriteRingHeader(FileHandle);
+      }else if(Fat32File[FileHandle].isEntryDirty){
+        returncode = AFATFS_UpdateFileEntry(FileHandle,
+            Fat32File[FileHandle].LogicalSize);
+      }else{
+        returncode = ANSWERED_REQUEST;
+      }
+      if(returncode == ANSWERED_REQUEST){
         returncode = OPERATION_RUNNING;
-        sector = *EntryNumber - 128 * sector;
-        FatDisk[Disk].Buffer[4*sector] = 0xFF;
-        FatDisk[Disk].Buffer[4*sector + 1] = 0xFF;
-        FatDisk[Disk].Buffer[4*sector + 2] = 0xFF;
-        FatDisk[Disk].Buffer[4*sector + 3] = 0xFF;
-        state[Disk] = WRITE_TO_SECTOR;
+        *state = SYNC;
       }
       break;
 
-    case WRITE_TO_SECTOR:
-      sector = *EntryNumber / 128;
-      returncode = Disk_List[Disk].Write(FatDisk[Disk].Buffer,
-          FatDisk[Disk].PPR.FatStartSector[Partition] +
-          (FatNum * FatDisk[Disk].PPR.FatSize[Partition]) + sector, 1);
-      if(returncode == ANSWERED_REQUEST || returncode >= RETURN_ERROR_VALUE){
-        state[Disk] = READ_SECTOR;
+    case SYNC:
+      returncode = AFATFS_Sync(Fat32File[FileHandle].Disk);
+      if(returncode == ANSWERED_REQUEST){
+        AFATFS_ResetSync(FileHandle);
+      }
+      if(returncode != OPERATION_RUNNING){
+        *state = FLUSH_BUFFER;
       }
       break;
 
     default:
-      state[Disk] = READ_SECTOR;
-      returncode = OPERATION_RUNNING;
+      *state = FLUSH_BUFFER;
       break;
     }
 
+    if(returncode >= RETURN_ERROR_VALUE){
+      *state = FLUSH_BUFFER;
+    }
+
   }else{
-    if(FatDisk[Disk].MBR.FatType[Partition] != FAT32_LBA){
+    if(FileHandle >= AFATS_MAX_FILES){
       returncode = ERR_PARAM_VALUE;
-    }else if(EntryNumber == NULL){
-      returncode = ERR_NULL_POINTER;
     }else{
-      returncode = ERR_INVALID_FILE_SYSTEM;
+      returncode = ERR_DISABLED;
     }
-    state[Disk] = 0;
   }
 
-  return returncode;
+  return AFATFS_STATS_LEAVE(returncode);
 }
 
 
 
-static EStatus_t AFATFS_FindFile(uint8_t Disk, uint8_t Partition,
-    uint8_t FileHandle)
+EStatus_t AFATFS_Sync(uint8_t Disk)
 {
   EStatus_t returncode = OPERATION_RUNNING;
-  uint32_t sectorOffset;
+  afatfsDiskContext_t *ctx;
 
-  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS &&
-      FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA &&
-      Fat32File[FileHandle].isInUse == 1 && FileHandle < AFATS_MAX_FILES)
-  {
+  AFATFS_STATS_ENTER(Disk, AFATS_MAX_FILES);
 
-    /* Reading one sector from root directory */
-    sectorOffset = Fat32File[FileHandle].Entry / 16;
-    returncode = Disk_List[Disk].Read(FatDisk[Disk].Buffer,
-        FatDisk[Disk].PPR.RootSector[Partition] + sectorOffset, 1);
-    if(returncode == ANSWERED_REQUEST)
+  if(Disk < AFATS_MAX_DISKS && Disk < Disk_ListSize)
+  {
+    ctx = &FatDisk[Disk].Ctx;
+    if(FatDisk[Disk].isInitialized == 1)
     {
-
-      returncode = OPERATION_RUNNING;
-      memcpy(&FatDisk[Disk].RootDir[0], FatDisk[Disk].Buffer,
-          sizeof(FatDisk[Disk].RootDir));
-      for(int i = 0; i < 16; i++)
+      /* Writing back the free clusters information of each partition */
+      while(ctx->SyncPartition < AFATS_MAX_PARTITIONS &&
+          FatDisk[Disk].isFsInfoDirty[ctx->SyncPartition] == 0)
       {
-        if(!memcmp(FatDisk[Disk].RootDir[i].Name,
-            Fat32File[FileHandle].Name, 8) &&
-            !memcmp(FatDisk[Disk].RootDir[i].Ext,
-                Fat32File[FileHandle].Extension, 3))
-        {
-          /* File was found */
-          Fat32File[FileHandle].Disk = Disk;
-          Fat32File[FileHandle].Partition = Partition;
-          Fat32File[FileHandle].Entry += i;
-          Fat32File[FileHandle].FilePos = 0; /*Start of file*/
-          Fat32File[FileHandle].LogicalSize =
-              FatDisk[Disk].RootDir[i].Size;
-          /* Considering a file is only one cluster in size */
-          Fat32File[FileHandle].PhysicalSize =
-              512 * FatDisk[Disk].PPR.SectorPerCluster[Partition];
-
-          Fat32File[FileHandle].ClusterFirst =
-              (uint32_t) (FatDisk[Disk].RootDir[i].FirstClusterHi
-                  << 16) |
-                  FatDisk[Disk].RootDir[i].FirstClusterLow;
-          Fat32File[FileHandle].ClusterPos =
-              Fat32File[FileHandle].ClusterFirst;
-          Fat32File[FileHandle].ClusterPrev = 0; /*Invalid value*/
-
-          Fat32File[FileHandle].SectorFirst =
-              FatDisk[Disk].PPR.DataStartSector[Partition] +
-              ( FatDisk[Disk].PPR.SectorPerCluster[Partition] *
-                  (Fat32File[FileHandle].ClusterFirst - 2) );
-          Fat32File[FileHandle].SectorPos =
-              Fat32File[FileHandle].SectorFirst;
-          Fat32File[FileHandle].SectorPrev = 0; /*Invalid value*/
-
-          Fat32File[FileHandle].isInUse = 1;
-          returncode = ANSWERED_REQUEST;
-          break;
-        }
-        else if(FatDisk[Disk].RootDir[i].Name[0] == FAT_END_OF_DIR)
-        {
-          /* Reached end of directory */
-          Fat32File[FileHandle].Entry = 0;
-          returncode = ERR_FAILED;
-          break;
-        }
+        ctx->SyncPartition++;
       }
-      if(returncode == OPERATION_RUNNING){
-          if(sectorOffset < FatDisk[Disk].PPR.SectorPerCluster[Partition]-1){
-            Fat32File[FileHandle].Entry += 16;
-          }else{
-            /* Reached end of cluster without finding end of directory*/
-            Fat32File[FileHandle].Entry = 0;
-            returncode = ERR_FAILED;
+      if(ctx->SyncPartition >= AFATS_MAX_PARTITIONS){
+        if(ctx->SyncMirror == 0){
+          /* Writing back every dirty sector of the cache */
+          returncode = AFATFS_CacheFlush(Disk);
+          if(returncode == ANSWERED_REQUEST &&
+              FatDisk[Disk].isMirrorOff == 0)
+          {
+            returncode = OPERATION_RUNNING;
+            ctx->SyncMirror = 1;
+          }
+        }else if(AFATFS_Lock(Disk, AFATFS_LOCK_SYNC)){
+          /* ... and the changed FAT sectors to the other FAT copies, with
+           * no file changing the FAT meanwhile */
+          returncode = AFATFS_MirrorFat(Disk, ctx->SyncMirror - 1);
+          if(returncode == ANSWERED_REQUEST &&
+              ctx->SyncMirror < AFATS_MAX_PARTITIONS)
+          {
+            returncode = OPERATION_RUNNING;
+            ctx->SyncMirror++;
+          }
+          if(returncode != OPERATION_RUNNING){
+            AFATFS_Unlock(Disk, AFATFS_LOCK_SYNC);
           }
+        }
+        if(returncode != OPERATION_RUNNING){
+          ctx->SyncPartition = 0;
+          ctx->SyncMirror = 0;
+        }
+      }else{
+        returncode = AFATFS_WriteFsInfo(Disk, ctx->SyncPartition);
+        if(returncode == ANSWERED_REQUEST){
+          returncode = OPERATION_RUNNING;
+          ctx->SyncPartition++;
+        }else if(returncode >= RETURN_ERROR_VALUE){
+          ctx->SyncPartition = 0;
+        }
       }
-
-    }else if(returncode >= RETURN_ERROR_VALUE){
-      Fat32File[FileHandle].Entry = 0;
+    }else{
+      returncode = ERR_DISABLED;
     }
+  }else{
+    returncode = ERR_PARAM_VALUE;
+  }
+
+  return AFATFS_STATS_LEAVE(returncode);
+}
+
 
+
+EStatus_t AFATFS_SetSyncPolicy(uint8_t FileHandle, uint8_t Policy,
+    uint32_t Value)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+
+  if(FileHandle < AFATS_MAX_FILES && Policy <= AFATFS_SYNC_ON_FLUSH)
+  {
+    if(Fat32File[FileHandle].isInUse == 1){
+      Fat32File[FileHandle].SyncPolicy = Policy;
+      Fat32File[FileHandle].SyncValue = Value;
+      AFATFS_ResetSync(FileHandle);
+      returncode = ANSWERED_REQUEST;
+    }else{
+      returncode = ERR_DISABLED;
+    }
   }else{
-    if(Disk >= AFATS_MAX_DISKS || Partition >= AFATS_MAX_PARTITIONS){
-      returncode = ERR_PARAM_VALUE;
-    }else if(FatDisk[Disk].MBR.FatType[Partition] != FAT32_LBA){
-      returncode = ERR_INVALID_FILE_SYSTEM;
+    returncode = ERR_PARAM_VALUE;
+  }
+
+  return returncode;
+}
+
+
+
+EStatus_t AFATFS_SetClock(uint32_t (*Clock)(void))
+{
+  uint8_t i;
+
+  AFATFS_Clock = Clock;
+  /* Time based policies count from now on */
+  for(i = 0; i < AFATS_MAX_FILES; i++){
+    if(Fat32File[i].isInUse == 1){
+      AFATFS_ResetSync(i);
+    }
+  }
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t AFATFS_SetPreallocSize(uint8_t Disk, uint32_t Size)
+{
+  if(Disk >= AFATS_MAX_DISKS){
+    return ERR_PARAM_VALUE;
+  }
+
+  FatDisk[Disk].PreallocSize = Size;
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t AFATFS_GetRingOffsets(uint8_t FileHandle, uint32_t *Head,
+    uint32_t *Tail)
+{
+  afatfsFile_t *file;
+
+  if(Head == NULL || Tail == NULL){
+    return ERR_NULL_POINTER;
+  }
+  if(FileHandle >= AFATS_MAX_FILES || !Fat32File[FileHandle].isInUse ||
+      !(Fat32File[FileHandle].Mode & AFATFS_FILE_MODE_RING))
+  {
+    return ERR_PARAM_VALUE;
+  }
+
+  file = &Fat32File[FileHandle];
+  /* A head at the end of the file has wrapped around already */
+  *Head = (file->RingHead >= file->LogicalSize) ?
+      AFATFS_MAX_SECTOR_SIZE : file->RingHead;
+  *Tail = file->RingTail;
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t AFATFS_SetFreeMap(uint8_t Disk, uint8_t Partition, uint8_t *Map,
+    uint32_t Size)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
+  {
+    /* Every FAT sector starts flagged as possibly having free entries */
+    if(Map != NULL){
+      memset(Map, 0xFF, Size);
     }else{
-      returncode = ERR_PARAM_VALUE;
+      Size = 0;
     }
-    Fat32File[FileHandle].Entry = 0;
+    FatDisk[Disk].FreeMap[Partition] = Map;
+    FatDisk[Disk].FreeMapSize[Partition] = Size;
+    returncode = ANSWERED_REQUEST;
+  }else{
+    returncode = ERR_PARAM_VALUE;
+  }
+
+  return returncode;
+}
+
+
+
+EStatus_t AFATFS_SetDirIndex(uint8_t Disk, uint8_t Partition,
+    AfatfsDirIndex_t *Table, uint32_t Size)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
+  {
+    if(Size == 0){
+      Table = NULL;
+    }
+    FatDisk[Disk].Index[Partition] = Table;
+    FatDisk[Disk].IndexSize[Partition] = Size;
+    /* Built by the mount or by the next open or create */
+    AFATFS_ResetDirIndex(Disk, Partition);
+    returncode = ANSWERED_REQUEST;
+  }else{
+    returncode = ERR_PARAM_VALUE;
   }
 
   return returncode;
@@ -546,106 +5124,15 @@ static EStatus_t AFATFS_FindFile(uint8_t Disk, uint8_t Partition,
 
 
 
-EStatus_t AFATFS_Mount(uint8_t Disk)
+EStatus_t AFATFS_SetFatMirror(uint8_t Disk, uint8_t isEnabled)
 {
-  enum{INT_HW_INIT = 0, EXT_DEV_CONFIG, READ_BOOT, READ_BIOS, NOP};
   EStatus_t returncode = OPERATION_RUNNING;
-  static uint8_t state[AFATS_MAX_DISKS];
-  static uint8_t partCounter[AFATS_MAX_DISKS];
-  static uint8_t errorCounter[AFATS_MAX_DISKS];
 
-  if(Disk < AFATS_MAX_DISKS && Disk < Disk_ListSize)
+  if(Disk < AFATS_MAX_DISKS)
   {
-    if(Disk_List[Disk].IntHwInit != NULL &&
-        Disk_List[Disk].ExtDevConfig != NULL &&
-        Disk_List[Disk].Read != NULL && Disk_List[Disk].Write != NULL)
-    {
-      switch(state[Disk])
-      {
-      case INT_HW_INIT:
-        /* Initializing internal hardware */
-        returncode = Disk_List[Disk].IntHwInit();
-        if( returncode == ANSWERED_REQUEST ){
-          returncode = OPERATION_RUNNING;
-          state[Disk] = EXT_DEV_CONFIG;
-        }
-        break;
-
-      case EXT_DEV_CONFIG:
-        /* Configuring device */
-        returncode = Disk_List[Disk].ExtDevConfig();
-        if( returncode == ANSWERED_REQUEST ){
-          returncode = OPERATION_RUNNING;
-          state[Disk] = READ_BOOT;
-        }else if(returncode >= RETURN_ERROR_VALUE){
-          state[Disk] = EXT_DEV_CONFIG;
-        }
-        break;
-
-      case READ_BOOT:
-        /* Reading boot sector (sector 0) */
-        returncode = AFATFS_ReadBootSector(Disk);
-        if(returncode == ANSWERED_REQUEST){
-          returncode = OPERATION_RUNNING;
-          state[Disk] = READ_BIOS;
-        }else if(returncode >= RETURN_ERROR_VALUE){
-          state[Disk] = EXT_DEV_CONFIG;
-        }
-        break;
-
-      case READ_BIOS:
-        /* Reading what seems to be an extension of the boot sector */
-        returncode = AFATFS_ReadBiosParameter(Disk, partCounter[Disk]);
-        if(returncode == ANSWERED_REQUEST){
-          partCounter[Disk]++;
-          if(partCounter[Disk] >= AFATS_MAX_PARTITIONS){
-            /* All partitions were read, and at least one is valid */
-            partCounter[Disk] = 0;
-            errorCounter[Disk] = 0;
-            partCounter[Disk] = 0;
-            FatDisk[Disk].isInitialized = 1;
-            FatDisk[Disk].Busy = 0xFF; /* Not busy */
-            state[Disk] = NOP;
-          }else{
-            returncode = OPERATION_RUNNING;
-          }
-        }else if(returncode == ERR_INVALID_FILE_SYSTEM){
-          errorCounter[Disk]++;
-          partCounter[Disk]++;
-          if(partCounter[Disk] >= AFATS_MAX_PARTITIONS){
-            partCounter[Disk] = 0;
-            if(errorCounter[Disk] < AFATS_MAX_PARTITIONS){
-              /* At least one valid partition was found */
-              FatDisk[Disk].isInitialized = 1;
-              FatDisk[Disk].Busy = 0xFF; /* Not busy */
-              state[Disk] = NOP;
-              returncode = ANSWERED_REQUEST;
-            }else{
-              /* No valid partition was found */
-              state[Disk] = EXT_DEV_CONFIG;
-            }
-            errorCounter[Disk] = 0;
-            partCounter[Disk] = 0;
-          }else{
-            returncode = OPERATION_RUNNING;
-          }
-        } else if(returncode >= RETURN_ERROR_VALUE){
-          state[Disk] = EXT_DEV_CONFIG;
-        }
-        break;
-
-      case NOP:
-        /* Will configure the disk again */
-        FatDisk[Disk].isInitialized = 0;
-        state[Disk] = EXT_DEV_CONFIG;
-        break;
-
-      default:
-        /* What happened? Maybe cosmic rays */
-        state[Disk] = INT_HW_INIT;
-        break;
-      }
-    }
+    /* The changed runs are still kept, AFATFS_ResyncFat copies them */
+    FatDisk[Disk].isMirrorOff = (isEnabled == 0) ? 1 : 0;
+    returncode = ANSWERED_REQUEST;
   }else{
     returncode = ERR_PARAM_VALUE;
   }
@@ -655,212 +5142,74 @@ EStatus_t AFATFS_Mount(uint8_t Disk)
 
 
 
-EStatus_t AFATFS_Create(uint8_t Disk, uint8_t Partition, char *FileName,
-    uint8_t Mode, uint8_t *FileHandle)
+EStatus_t AFATFS_ResyncFat(uint8_t Disk, uint8_t Partition, uint8_t isWholeFat)
 {
-  enum{FIND_FILE = 0, FIND_EMPTY_CLUSTER, FIND_EMPTY_ROOT_ENTRY,
-    ALOCATE_CLUSTER, WRITE_ROOT_ENTRY};
   EStatus_t returncode = OPERATION_RUNNING;
-  static uint8_t state[AFATS_MAX_DISKS];
-  static uint32_t fatEntry[AFATS_MAX_DISKS];
-  static uint32_t rootEntry[AFATS_MAX_DISKS];
-  DirectoryEntryFat32_t *entryPointer;
-  char *p;
-  uint32_t nameSize, extensionSize;
+  afatfsDiskContext_t *ctx;
 
-  if(Disk < AFATS_MAX_DISKS && Disk < Disk_ListSize &&
-      FileName != NULL && FileHandle != NULL &&
-      FatDisk[Disk].isInitialized == 1)
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS)
   {
-    /*
-     * Steps:
-     * 1 - Verify if the file already exists. If yes, returns failure
-     * 2 - Find a empty cluster on the FAT (File Allocation Table)
-     *     Clust is free if 0x00000000 is written
-     * 3 - Write 0xFFFFFFFF on the space for the empty cluster (means it is the
-     *     last cluster for the file)
-     * 4 - Find a free entry on ROOT_DIR (FAT_END_OF_DIR or FAT_UNUSED_ENTRY)
-     * 5 - Write file entry on ROOT_DIR
-     *
-     *
-     * Notes:
-     * 1 - Not sure if it is best to write the rootfirst, then the FAT, or the
-     *     opposite.
-     */
-    switch(state[Disk])
+    ctx = &FatDisk[Disk].Ctx;
+    if(FatDisk[Disk].isInitialized == 1 &&
+        FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA)
     {
-    case FIND_FILE:
-      returncode = AFATFS_Open(Disk, Partition, FileName, 0, FileHandle);
-      if(returncode == ERR_FAILED){
-        /* File does not exist, the name is validated */
-        /* Probably there is space on the root dir */
-        /* Verifying if there is a file structure free */
-        *FileHandle = AFATS_MAX_FILES;
-        for(int i = 0; i < AFATS_MAX_FILES; i++){
-          if(!Fat32File[i].isInUse){
-            *FileHandle = i;
-            break;
+      /*
+       * Steps:
+       * 1 - Write back the dirty sectors of the cache, so the first FAT on
+       *     the disk is up to date.
+       * 2 - Copy the changed sectors of the first FAT, or all of them, to
+       *     the other copies.
+       */
+      if(ctx->ResyncStep == 0){
+        returncode = AFATFS_CacheFlush(Disk);
+        if(returncode == ANSWERED_REQUEST){
+          if(isWholeFat != 0){
+            AFATFS_AddMirrorRange(Disk, Partition, 0,
+                FatDisk[Disk].PPR.FatSize[Partition]);
           }
-        }
-        if(*FileHandle >= AFATS_MAX_FILES){
-          returncode = ERR_RESOURCE_DEPLETED;
-        }else{
-          Fat32File[*FileHandle].isInUse = 1;
-          state[Disk] = FIND_EMPTY_CLUSTER;
           returncode = OPERATION_RUNNING;
+          ctx->ResyncStep = 1;
+        }
+      }else if(AFATFS_Lock(Disk, AFATFS_LOCK_RESYNC)){
+        returncode = AFATFS_MirrorFat(Disk, Partition);
+        if(returncode != OPERATION_RUNNING){
+          AFATFS_Unlock(Disk, AFATFS_LOCK_RESYNC);
         }
-      }else if(returncode == ANSWERED_REQUEST){
-        /* File already exists, closing file and returning error */
-        Fat32File[*FileHandle].isInUse = 0;
-        *FileHandle = AFATS_MAX_FILES;
-        returncode = ERR_FAILED;
-      }
-      break;
-
-    case FIND_EMPTY_CLUSTER:
-      returncode = AFATFS_FindEmptyCluster(Disk, Partition, 0, &fatEntry[Disk]);
-      if(returncode == ANSWERED_REQUEST){
-        state[Disk] = FIND_EMPTY_ROOT_ENTRY;
-        returncode = OPERATION_RUNNING;
-      }else if(returncode >= RETURN_ERROR_VALUE){
-        Fat32File[*FileHandle].isInUse = 0;
-        *FileHandle = AFATS_MAX_FILES;
-        fatEntry[Disk] = 0;
-        returncode = ERR_FAILED;
-      }
-      break;
-
-    case FIND_EMPTY_ROOT_ENTRY:
-      returncode = AFATFS_FindEmptyRootEntry(Disk, Partition, &rootEntry[Disk]);
-      if(returncode == ANSWERED_REQUEST){
-        /* Building an new entry on a global variable */
-        entryPointer = &FatDisk[Disk].RootDir[rootEntry[Disk]%16];
-        entryPointer->Attributes = 0; /* Nothing special */
-        p = strchr(FileName,'.');
-        if(p != NULL){
-          /* File has extension */
-          nameSize = p - FileName;
-          extensionSize = strlen(FileName) - nameSize -1;
-          /* Completing with spaces */
-          memset(entryPointer->Name, ' ', 8);
-          memset(entryPointer->Ext, ' ', 3);
-          /* Copying the name */
-          memcpy(entryPointer->Name, FileName, nameSize);
-          /* Copying the extension */
-          memcpy(entryPointer->Ext,
-              FileName + nameSize + 1 , extensionSize);
-        }else{
-          /* File has no extension */
-          nameSize = strlen(FileName);
-          /* Completing with spaces */
-          memset(entryPointer->Name, ' ', 8);
-          memset(entryPointer->Ext, ' ', 3);
-          /* Copying the name */
-          memcpy(entryPointer->Name, FileName, nameSize);
-        }
-        /* No date and time support for now */
-        entryPointer->Size = 0;
-        entryPointer->aTime = 0;
-        entryPointer->cDate = 0;
-        entryPointer->cTime = 0;
-        entryPointer->cTimeTenth = 0;
-        entryPointer->wDate = 0;
-        entryPointer->wTime = 0;
-
-        entryPointer->FirstClusterLow = fatEntry[Disk] & 0xFFFF;
-        entryPointer->FirstClusterHi = (fatEntry[Disk] >> 16) & 0xFFFF;
-
-        state[Disk] = ALOCATE_CLUSTER;
-        returncode = OPERATION_RUNNING;
-      }else if(returncode >= RETURN_ERROR_VALUE){
-        Fat32File[*FileHandle].isInUse = 0;
-        *FileHandle = AFATS_MAX_FILES;
-        fatEntry[Disk] = 0;
-        rootEntry[Disk] = 0;
-        returncode = ERR_FAILED;
       }
-      break;
-
-    case ALOCATE_CLUSTER:
-      /* If something goes wrong between ALOCATE_CLUSTER and WRITE_ROOT_ENTRY
-       * states, one of the listed bellow can happen:
-       * 1 - One cluster is marked as used, but an error occur while adding the
-       *     root entry. The cluster is lost until disk is formatted.
-       * 2 - An error occur while allocating the cluster, but it pass as if
-       *     everything is OK and the entry is added to the root dir. Not sure
-       *     about what might happen when plugging the card on a computer, but
-       *     the file migt end up being overwritten.
-       *   */
-      returncode = AFATFS_AllocateCluster(Disk, Partition, 0, &fatEntry[Disk]);
-      if(returncode == ANSWERED_REQUEST){
-        state[Disk] = WRITE_ROOT_ENTRY;
-        returncode = OPERATION_RUNNING;
-      }else if(returncode >= RETURN_ERROR_VALUE){
-        Fat32File[*FileHandle].isInUse = 0;
-        *FileHandle = AFATS_MAX_FILES;
-        fatEntry[Disk] = 0;
-        rootEntry[Disk] = 0;
-        returncode = ERR_FAILED;
+      if(returncode != OPERATION_RUNNING){
+        ctx->ResyncStep = 0;
       }
-      break;
-
-    case WRITE_ROOT_ENTRY:
-
-      returncode = AFATFS_AddRootEntry(Disk, Partition, &rootEntry[Disk]);
-      if(returncode == ANSWERED_REQUEST){
-
-        entryPointer = &FatDisk[Disk].RootDir[rootEntry[Disk]%16];
-        memcpy(Fat32File[*FileHandle].Name, entryPointer->Name, 8);
-        memcpy(Fat32File[*FileHandle].Extension, entryPointer->Ext, 3);
-        Fat32File[*FileHandle].Disk = Disk;
-        Fat32File[*FileHandle].Partition = Partition;
-        Fat32File[*FileHandle].Entry = rootEntry[Disk];
-
-        Fat32File[*FileHandle].FilePos = 0; /*Start of file*/
-        Fat32File[*FileHandle].LogicalSize = 0;
-        /* Considering a file is only one cluster in size */
-        Fat32File[*FileHandle].PhysicalSize =
-            512 * FatDisk[Disk].PPR.SectorPerCluster[Partition];
-
-        Fat32File[*FileHandle].ClusterFirst =
-            (uint32_t) (entryPointer->FirstClusterHi << 16) |
-                entryPointer->FirstClusterLow;
-        Fat32File[*FileHandle].ClusterPos =
-            Fat32File[*FileHandle].ClusterFirst;
-        Fat32File[*FileHandle].ClusterPrev = 0; /*Invalid value*/
+    }else{
+      returncode = ERR_DISABLED;
+    }
+  }else{
+    returncode = ERR_PARAM_VALUE;
+  }
 
-        Fat32File[*FileHandle].SectorFirst =
-            FatDisk[Disk].PPR.DataStartSector[Partition] +
-            ( FatDisk[Disk].PPR.SectorPerCluster[Partition] *
-                (Fat32File[*FileHandle].ClusterFirst - 2) );
-        Fat32File[*FileHandle].SectorPos =
-            Fat32File[*FileHandle].SectorFirst;
-        Fat32File[*FileHandle].SectorPrev = 0; /*Invalid value*/
+  return returncode;
+}
 
-        state[Disk] = FIND_FILE;
-        returncode = ANSWERED_REQUEST;
 
-      }else if(returncode >= RETURN_ERROR_VALUE){
-        Fat32File[*FileHandle].isInUse = 0;
-        *FileHandle = AFATS_MAX_FILES;
-        fatEntry[Disk] = 0;
-        rootEntry[Disk] = 0;
-        returncode = ERR_FAILED;
-      }
-      break;
 
-    default:
-      state[Disk] = FIND_FILE;
-      returncode = OPERATION_RUNNING;
-      break;
+EStatus_t AFATFS_GetFreeClusters(uint8_t Disk, uint8_t Partition,
+    uint32_t *Clusters)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
 
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS &&
+      Clusters != NULL)
+  {
+    if(FatDisk[Disk].isInitialized == 1 &&
+        FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA)
+    {
+      *Clusters = FatDisk[Disk].PPR.FreeCount[Partition];
+      returncode = ANSWERED_REQUEST;
+    }else{
+      returncode = ERR_DISABLED;
     }
-
   }else{
-    if(Disk >= AFATS_MAX_DISKS || Partition >= AFATS_MAX_PARTITIONS){
-      returncode = ERR_PARAM_VALUE;
-    }else if(FatDisk[Disk].MBR.FatType[Partition] != FAT32_LBA){
-      returncode = ERR_INVALID_FILE_SYSTEM;
+    if(Clusters == NULL){
+      returncode = ERR_NULL_POINTER;
     }else{
       returncode = ERR_PARAM_VALUE;
     }
@@ -871,120 +5220,77 @@ EStatus_t AFATFS_Create(uint8_t Disk, uint8_t Partition, char *FileName,
 
 
 
-EStatus_t AFATFS_Open(uint8_t Disk, uint8_t Partition, char *FileName,
-    uint8_t Mode, uint8_t *FileHandle)
+EStatus_t AFATFS_CountFreeClusters(uint8_t Disk, uint8_t Partition,
+    uint32_t *Clusters)
 {
-  enum{FETCH_NAME = 0, FIND_FILE};
   EStatus_t returncode = OPERATION_RUNNING;
-  static uint8_t state[AFATS_MAX_DISKS];
-  uint32_t i;
-
-  /* Variables used for file name's string manipulation */
-  const char forbidenChar[] = {'/', ':'};
-  char *p;
-  uint32_t nameSize, extensionSize;
+  afatfsDiskContext_t *ctx;
+  uint32_t entry, first, count, free, lastCluster, fatSectors;
+  uint8_t *data;
 
-  if(Disk < AFATS_MAX_DISKS && Disk < Disk_ListSize &&
-      FileName != NULL && FileHandle != NULL)
+  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS &&
+      Clusters != NULL)
   {
-    if(FatDisk[Disk].isInitialized == 1)
+    ctx = &FatDisk[Disk].Ctx;
+    if(FatDisk[Disk].isInitialized == 1 &&
+        FatDisk[Disk].MBR.FatType[Partition] == FAT32_LBA)
     {
       /*
-       * This piece of code performs the following:
-       * 1 - Find a file structure not in use.
-       * 2 - Fetch the file name. Verify if it is 8.3 or less, verify if there
-       *     are no subfolders in the name.
-       * 3 - Read root directory entry.
-       * 4 - Search for the suplied file name in the root dir entry.
-       * 5 - Save relevant data from file entry.
+       * Steps:
+       * 1 - Take the disk lock, so no cluster is allocated while counting.
+       * 2 - Read the first FAT sector by sector, counting the free entries
+       *     of data clusters. Sectors with none are flagged on the free map.
+       * 3 - Keep the count as the FSInfo free count, AFATFS_Sync writes it.
+       *
+       * Notes:
+       * 1 - AFATS_MAX_FILES is used as the lock owner, it is not a file.
        */
-      switch(state[Disk]){
-      case FETCH_NAME:
-        returncode = OPERATION_RUNNING;
-        /* Verifying if there is a file structure free */
-        for(i = 0; i < AFATS_MAX_FILES; i++){
-          if(!Fat32File[i].isInUse){
-            *FileHandle = i;
-            break;
-          }
-        }
-        if(i >= AFATS_MAX_FILES){
-          returncode = ERR_RESOURCE_DEPLETED;
-        }
+      if(!AFATFS_Lock(Disk, AFATS_MAX_FILES)){
+        return OPERATION_RUNNING;
+      }
+      lastCluster = FatDisk[Disk].PPR.ClusterCount[Partition] +
+          FAT_FIRST_CLUSTER;
+      fatSectors = (lastCluster + FAT_ENTRIES_PER_SECTOR - 1) /
+          FAT_ENTRIES_PER_SECTOR;
+      if(fatSectors > FatDisk[Disk].PPR.FatSize[Partition]){
+        fatSectors = FatDisk[Disk].PPR.FatSize[Partition];
+      }
 
-        /* Validating file name
-         * Subfolders not implemented, disk identifiers not allowed */
-        if(returncode == OPERATION_RUNNING){
-          for(i = 0; i < sizeof(forbidenChar); i++){
-            p = strchr(FileName,forbidenChar[i]);
-            if(p != NULL){
-              returncode = ERR_PARAM_NAME;
-              break;
-            }
-          }
+      returncode = AFATFS_CacheGet(Disk,
+          FatDisk[Disk].PPR.FatStartSector[Partition] + ctx->CountSector,
+          &data);
+      if(returncode == ANSWERED_REQUEST)
+      {
+        entry = FAT_ENTRIES_PER_SECTOR * ctx->CountSector;
+        first = (entry < FAT_FIRST_CLUSTER) ? FAT_FIRST_CLUSTER - entry : 0;
+        count = FAT_ENTRIES_PER_SECTOR;
+        if(entry + count > lastCluster){
+          count = lastCluster - entry;
         }
-
-        /* Validating file name - sizing and saving to file structure */
-        if(returncode == OPERATION_RUNNING){
-          p = strchr(FileName,'.');
-          if(p != NULL){
-            /* File has extension */
-            nameSize = p - FileName;
-            extensionSize = strlen(FileName) - nameSize -1;
-            if(nameSize <= 8 && extensionSize <= 3 ){
-              /* Completing with spaces */
-              memset(Fat32File[*FileHandle].Name, ' ', 8);
-              memset(Fat32File[*FileHandle].Extension, ' ', 3);
-              /* Copying the name */
-              memcpy(Fat32File[*FileHandle].Name, FileName, nameSize);
-              /* Copying the extension */
-              memcpy(Fat32File[*FileHandle].Extension,
-                  FileName + nameSize + 1 , extensionSize);
-              Fat32File[*FileHandle].isInUse = 1;
-              Fat32File[*FileHandle].Entry = 0;
-              state[Disk] = FIND_FILE;
-            }else{
-              returncode = ERR_PARAM_NAME;
-            }
-          }else{
-            /* File has no extension */
-            nameSize = strlen(FileName);
-            if(nameSize <= 8){
-              /* Completing with spaces */
-              memset(Fat32File[*FileHandle].Name, ' ', 8);
-              memset(Fat32File[*FileHandle].Extension, ' ', 3);
-              /* Copying the name */
-              memcpy(Fat32File[*FileHandle].Name, FileName, nameSize);
-              Fat32File[*FileHandle].isInUse = 1;
-              Fat32File[*FileHandle].Entry = 0;
-              state[Disk] = FIND_FILE;
-            }else{
-              returncode = ERR_PARAM_NAME;
-            }
-          }
+        free = AFATFS_CountFree(data + (4 * first), count - first);
+        if(free == 0){
+          AFATFS_SetFatSectorFull(Disk, Partition, ctx->CountSector);
         }
-        break;
-
-      case FIND_FILE:
-        returncode = AFATFS_FindFile(Disk, Partition, *FileHandle);
-        if(returncode == ANSWERED_REQUEST){
-          Fat32File[*FileHandle].isInUse = 1;
-          state[Disk] = FETCH_NAME;
-        }else if(returncode >= RETURN_ERROR_VALUE){
-          Fat32File[*FileHandle].isInUse = 0;
-          state[Disk] = FETCH_NAME;
+        ctx->CountFree += free;
+        ctx->CountSector++;
+        if(ctx->CountSector >= fatSectors){
+          FatDisk[Disk].PPR.FreeCount[Partition] = ctx->CountFree;
+          FatDisk[Disk].isFsInfoDirty[Partition] = 1;
+          *Clusters = ctx->CountFree;
+        }else{
+          returncode = OPERATION_RUNNING;
         }
-        break;
-
-      default:
-        state[Disk] = FETCH_NAME;
-        break;
+      }
+      if(returncode != OPERATION_RUNNING){
+        ctx->CountSector = 0;
+        ctx->CountFree = 0;
+        AFATFS_Unlock(Disk, AFATS_MAX_FILES);
       }
     }else{
       returncode = ERR_DISABLED;
     }
   }else{
-    if(FileName == NULL || FileHandle == NULL){
+    if(Clusters == NULL){
       returncode = ERR_NULL_POINTER;
     }else{
       returncode = ERR_PARAM_VALUE;
@@ -996,25 +5302,110 @@ EStatus_t AFATFS_Open(uint8_t Disk, uint8_t Partition, char *FileName,
 
 
 
-EStatus_t AFATFS_Close(uint8_t Disk, uint8_t Partition, uint8_t *FileHandle)
+EStatus_t AFATFS_GetReadStats(uint8_t FileHandle, uint32_t *Hits,
+    uint32_t *Misses)
 {
   EStatus_t returncode = OPERATION_RUNNING;
 
-  if(Disk < AFATS_MAX_DISKS && Partition < AFATS_MAX_PARTITIONS &&
-      FileHandle != NULL && *FileHandle < AFATS_MAX_FILES &&
-      Fat32File[*FileHandle].isInUse == 1)
+  if(FileHandle < AFATS_MAX_FILES && Fat32File[FileHandle].isInUse == 1)
   {
+    if(Hits != NULL && Misses != NULL){
+      *Hits = Fat32File[FileHandle].ReadHits;
+      *Misses = Fat32File[FileHandle].ReadMisses;
+      returncode = ANSWERED_REQUEST;
+    }else{
+      returncode = ERR_NULL_POINTER;
+    }
+  }else{
+    if(FileHandle >= AFATS_MAX_FILES){
+      returncode = ERR_PARAM_VALUE;
+    }else{
+      returncode = ERR_DISABLED;
+    }
+  }
+
+  return returncode;
+}
 
-    Fat32File[*FileHandle].isInUse = 0;
-    *FileHandle = AFATS_MAX_FILES;
 
+
+EStatus_t AFATFS_GetStats(uint8_t Disk, uint8_t FileHandle,
+    AfatfsStats_t *Stats, uint8_t isReset)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+#if AFATFS_STATS
+  AfatfsStats_t *stats = NULL;
+
+  if(Disk < AFATS_MAX_DISKS && FileHandle == AFATFS_STATS_DISK){
+    stats = &FatDisk[Disk].Stats;
+  }else if(Disk < AFATS_MAX_DISKS && FileHandle < AFATS_MAX_FILES &&
+      Fat32File[FileHandle].isInUse == 1 &&
+      Fat32File[FileHandle].Disk == Disk)
+  {
+    stats = &Fat32File[FileHandle].Stats;
+  }
+
+  if(stats != NULL){
+    if(Stats != NULL){
+      *Stats = *stats;
+    }
+    if(isReset){
+      memset(stats, 0, sizeof(AfatfsStats_t));
+    }
+    returncode = ANSWERED_REQUEST;
   }else{
-    if(FileHandle == NULL){
-      returncode = ERR_NULL_POINTER;
-    }else{
+    if(Disk >= AFATS_MAX_DISKS || FileHandle >= AFATS_MAX_FILES){
       returncode = ERR_PARAM_VALUE;
+    }else{
+      returncode = ERR_DISABLED;
+    }
+  }
+#else
+  (void)Disk;
+  (void)FileHandle;
+  (void)Stats;
+  (void)isReset;
+  returncode = ERR_NOT_IMPLEMENTED;
+#endif
+
+  return returncode;
+}
+
+
+
+EStatus_t AFATFS_GetTrace(AfatfsTraceEvent_t *Events, uint32_t Size,
+    uint32_t *Count, uint32_t *Lost)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+#if AFATFS_TRACE_SIZE > 0
+  uint32_t i, first;
+
+  if(Events != NULL && Count != NULL){
+    /* Oldest event first, the ring may have wrapped */
+    first = (AFATFS_TraceHead + AFATFS_TRACE_SIZE - AFATFS_TraceCount) %
+        AFATFS_TRACE_SIZE;
+    for(i = 0; i < Size && i < AFATFS_TraceCount; i++){
+      Events[i] = AFATFS_Trace[(first + i) % AFATFS_TRACE_SIZE];
+    }
+    AFATFS_TraceCount -= i;
+    *Count = i;
+    if(Lost != NULL){
+      *Lost = AFATFS_TraceLost;
+      AFATFS_TraceLost = 0;
     }
+    returncode = ANSWERED_REQUEST;
+  }else{
+    returncode = ERR_NULL_POINTER;
+  }
+#else
+  (void)Events;
+  (void)Size;
+  (void)Lost;
+  if(Count != NULL){
+    *Count = 0;
   }
+  returncode = ERR_NOT_IMPLEMENTED;
+#endif
 
   return returncode;
 }
@@ -1027,7 +5418,8 @@ EStatus_t AFATFS_Seek(uint8_t FileHandle, uint32_t Offset)
 
   if(Fat32File[FileHandle].isInUse == 1 && FileHandle < AFATS_MAX_FILES)
   {
-    if(Offset < Fat32File[FileHandle].LogicalSize)
+    /* Seeking to the end of the file allows appending to it */
+    if(Offset <= Fat32File[FileHandle].LogicalSize)
     {
       Fat32File[FileHandle].FilePos = Offset;
       returncode = ANSWERED_REQUEST;
@@ -1053,24 +5445,42 @@ EStatus_t AFATFS_Read(uint8_t FileHandle, uint8_t *Buffer, uint32_t Size,
     uint32_t *BytesRead)
 {
   EStatus_t returncode = OPERATION_RUNNING;
-  uint32_t sectorFirst, sectorLast, nSectors, sectorOffset;
-  uint8_t Disk;
+  uint32_t *done;
+  uint32_t total, segment, sectorFirst, nSectors, sectorOffset, bufferOffset;
+  uint32_t clusterSize, clusterOffset, cluster, run;
+  uint8_t Disk, Partition, isDirect;
+  afatfsFile_t *file;
+
+  AFATFS_STATS_ENTER(AFATS_MAX_DISKS, FileHandle);
 
 
   if(Fat32File[FileHandle].isInUse == 1 && FileHandle < AFATS_MAX_FILES)
   {
+    done = &Fat32File[FileHandle].Ctx.ReadDone;
     /*
      * Steps:
-     * 1 - Compute the starting sector and number of sectors where the data is
-     *     based on cursor position on file, sector size, file size.
-     * 2 - Read the data from the memory.
-     * 3 - Copy the data requested tyo the supplied buffer.
+     * 1 - Map the cluster where the cursor is to a run of contiguous clusters,
+     *     following the FAT chain if needed.
+     * 2 - Compute the starting sector and number of sectors of the part of
+     *     the request that lies inside the run.
+     * 3 - If the first sector of that part is in the file buffer, copy what
+     *     is buffered. If not, read as many sectors of the run as the file
+     *     buffer holds.
+     * 4 - Copy the data requested to the supplied buffer. If the request goes
+     *     past the run or the buffer, go back to step 1 on the next call.
      *
      * Notes:
      * 1 - Sector position is updated only after its memory content is read.
-     *
-     * TODO: reduce disk access if the data requested is already buffered, maybe
-     * using SectorPos and SectorPrev values.
+     * 2 - The cursor advances as each part is copied, Ctx.ReadDone holds how much of
+     *     the request was already copied.
+     * 3 - BufferSector and BufferCount tell which sectors the file buffer
+     *     holds, so small sequential reads are served by memcpy only. Writes
+     *     to any of those sectors drop them (AFATFS_BufferInvalidate).
+     * 4 - With AFATFS_FILE_MODE_DIRECT, whole sectors not in the file buffer
+     *     are read straight into the supplied buffer, and only the unaligned
+     *     head and tail of the request go through the file buffer.
+     * 5 - Requests of any size are split in parts that fit in a run and in
+     *     the file buffer.
      */
     if(Size == 0){
       if(BytesRead != NULL){ *BytesRead = 0;}
@@ -1084,58 +5494,141 @@ EStatus_t AFATFS_Read(uint8_t FileHandle, uint8_t *Buffer, uint32_t Size,
     }else
     {
       Disk = Fat32File[FileHandle].Disk;
-      /* First sector relative to beginning of file */
-      sectorFirst = Fat32File[FileHandle].FilePos / 512;
-      /* Cursor positon within the first sector*/
-      sectorOffset = Fat32File[FileHandle].FilePos - (512 * sectorFirst);
-      /* Last sector relative to beginning of file */
-      if((Size + Fat32File[FileHandle].FilePos) <
-          Fat32File[FileHandle].LogicalSize)
-      {
-        sectorLast = (Fat32File[FileHandle].FilePos + Size) / 512;
-      }else
-      {
-        /* If the size requested is bigger than file size */
-        sectorLast = (Fat32File[FileHandle].LogicalSize) / 512;
+      Partition = Fat32File[FileHandle].Partition;
+      clusterSize = 512 * FatDisk[Disk].PPR.SectorPerCluster[Partition];
+      /* Bytes available for the whole request */
+      total = Fat32File[FileHandle].LogicalSize -
+          (Fat32File[FileHandle].FilePos - *done);
+      if(Size < total){
+        total = Size;
       }
-      /* Computing number of sectors to read */
-      nSectors = 1 + (sectorLast - sectorFirst);
-      /* Transforming relative first sector into absolute value */
-      sectorFirst += Fat32File[FileHandle].SectorFirst;
 
-      if(nSectors <= AFATFS_FILEBUFFER_SIZE)
-      {
+      returncode = AFATFS_MapCluster(FileHandle,
+          Fat32File[FileHandle].FilePos / clusterSize, &cluster, &run);
+      if(returncode == ANSWERED_REQUEST && cluster == 0){
+        /* File size points past the end of the cluster chain */
+        returncode = ERR_INVALID_FILE_SYSTEM;
+      }
 
-        returncode = Disk_List[Disk].Read(Fat32File[FileHandle].Buffer,
-            sectorFirst , nSectors);
-        if(returncode == ANSWERED_REQUEST)
+      if(returncode == ANSWERED_REQUEST)
+      {
+        /* Part of the request that lies inside the run */
+        clusterOffset = Fat32File[FileHandle].FilePos % clusterSize;
+        segment = total - *done;
+        if(segment > (run * clusterSize) - clusterOffset){
+          segment = (run * clusterSize) - clusterOffset;
+        }
+        /* Cursor positon within the first sector*/
+        sectorOffset = Fat32File[FileHandle].FilePos % 512;
+        /* Absolute first sector */
+        sectorFirst = FatDisk[Disk].PPR.DataStartSector[Partition] +
+            FatDisk[Disk].PPR.SectorPerCluster[Partition] *
+            (cluster - FAT_FIRST_CLUSTER) + (clusterOffset / 512);
+
+        file = &Fat32File[FileHandle];
+        isDirect = 0;
+        if(file->BufferCount != 0 && sectorFirst >= file->BufferSector &&
+            sectorFirst < file->BufferSector + file->BufferCount)
+        {
+          /* Hit, copying only the part that is already buffered */
+          bufferOffset = (sectorFirst - file->BufferSector) * 512 +
+              sectorOffset;
+          if(segment > (file->BufferCount * 512) - bufferOffset){
+            segment = (file->BufferCount * 512) - bufferOffset;
+          }
+          file->ReadHits++;
+        }
+        else
         {
-          /* Copying requested data to supplied buffer */
-          if((Size + Fat32File[FileHandle].FilePos) <
-              Fat32File[FileHandle].LogicalSize)
+          /* Miss, filling the buffer with as many sectors of the run as fit,
+           * but not with sectors past the end of the file */
+          nSectors = (run * FatDisk[Disk].PPR.SectorPerCluster[Partition]) -
+              (clusterOffset / 512);
+          if(nSectors > AFATFS_FILEBUFFER_SIZE){
+            nSectors = AFATFS_FILEBUFFER_SIZE;
+          }
+          if(nSectors > (file->LogicalSize + 511) / 512 - file->FilePos / 512){
+            nSectors = (file->LogicalSize + 511) / 512 - file->FilePos / 512;
+          }
+          if(segment > (nSectors * 512) - sectorOffset){
+            segment = (nSectors * 512) - sectorOffset;
+          }
+          if((file->Mode & AFATFS_FILE_MODE_DIRECT) && sectorOffset != 0 &&
+              nSectors > 1)
           {
-            *BytesRead = Size;
+            /* Only the unaligned head goes through the buffer */
+            nSectors = 1;
+            if(segment > 512 - sectorOffset){
+              segment = 512 - sectorOffset;
+            }
           }
-          else
+          if(file->isBufferDirty){
+            /* Buffered writes reach the disk before the buffer is reused or
+             * the sectors are read around it */
+            returncode = AFATFS_BufferFlush(FileHandle);
+            if(returncode == ANSWERED_REQUEST){
+              returncode = OPERATION_RUNNING;
+            }
+          }else if((file->Mode & AFATFS_FILE_MODE_DIRECT) &&
+              sectorOffset == 0 && total - *done >= 512)
           {
-            /* If the size requested is bigger than file size */
-            *BytesRead = Fat32File[FileHandle].LogicalSize -
-                Fat32File[FileHandle].FilePos;
+            /* Aligned middle, read straight into the supplied buffer */
+            segment = total - *done;
+            if(segment > (run * clusterSize) - clusterOffset){
+              segment = (run * clusterSize) - clusterOffset;
+            }
+            segment -= segment % 512;
+            returncode = AFATFS_DiskRead(Disk, Buffer + *done,
+                sectorFirst, segment / 512);
+            if(returncode == ANSWERED_REQUEST){
+              file->ReadMisses++;
+            }
+            isDirect = 1;
+          }else{
+            file->BufferCount = 0;
+            returncode = AFATFS_DiskRead(Disk, file->Buffer, sectorFirst,
+                nSectors);
+            if(returncode == ANSWERED_REQUEST){
+              file->BufferSector = sectorFirst;
+              file->BufferPos = file->FilePos - sectorOffset;
+              file->BufferCount = nSectors;
+              file->ReadMisses++;
+            }
+          }
+          bufferOffset = sectorOffset;
+        }
+
+        if(returncode == ANSWERED_REQUEST)
+        {
+          if(!isDirect){
+            /* Copying requested data to supplied buffer */
+            memcpy(Buffer + *done, file->Buffer + bufferOffset,
+                segment);
           }
-          memcpy(Buffer, Fat32File[FileHandle].Buffer + sectorOffset,
-              *BytesRead);
+          *done += segment;
           /* Updating file cursor position */
-          Fat32File[FileHandle].FilePos += *BytesRead;
+          file->FilePos += segment;
           /* Updating cluster position */
-          Fat32File[FileHandle].ClusterPrev = Fat32File[FileHandle].ClusterPos;
+          file->ClusterPrev = file->ClusterPos;
+          file->ClusterPos = cluster;
           /* Updating sector positon */
-          Fat32File[FileHandle].SectorPrev = Fat32File[FileHandle].SectorPos;
-          Fat32File[FileHandle].SectorPos = sectorFirst;
+          file->SectorPrev = file->SectorPos;
+          file->SectorPos = sectorFirst + (bufferOffset / 512);
 
+          if(*done >= total){
+            *BytesRead = total;
+            *done = 0;
+            AFATFS_STATS_ADD(Disk, FileHandle, BytesRead, total);
+          }else{
+            returncode = OPERATION_RUNNING;
+          }
         }
+      }
 
-      }else{
-        returncode = ERR_BUFFER_SIZE;
+      if(returncode >= RETURN_ERROR_VALUE){
+        /* Giving the cursor back to where the request started */
+        Fat32File[FileHandle].FilePos -= *done;
+        *done = 0;
       }
 
     }
@@ -1148,31 +5641,75 @@ EStatus_t AFATFS_Read(uint8_t FileHandle, uint8_t *Buffer, uint32_t Size,
     }
   }
 
-  return returncode;
+  return AFATFS_STATS_LEAVE(returncode);
 }
 
 
 
 EStatus_t AFATFS_Write(uint8_t FileHandle, uint8_t *Buffer, uint32_t Size)
 {
-  enum{READ_FIRST_SECTOR = 0, READ_LAST_SECTOR, WRITE_DATA, READ_ENTRY,
-    UPDATE_ENTRY};
-  static uint8_t state[AFATS_MAX_DISKS];
+  enum{MAP_CLUSTER = 0, FIND_EMPTY_CLUSTER, ALLOCATE_CLUSTER,
+    READ_FIRST_SECTOR, READ_LAST_SECTOR, WRITE_DATA, UPDATE_ENTRY,
+    FLUSH_BUFFER, SYNC_FILE, STREAM_APPEND, STREAM_READ_TAIL,
+    STREAM_WRITE_BUFFER, STREAM_WRITE_DIRECT, STREAM_FIND_RUN,
+    STREAM_CHAIN_RUN, STREAM_LINK_RUN};
+  uint8_t *state;
+  uint32_t *done, *segment, *sectorFirst, *newCluster;
   EStatus_t returncode = OPERATION_RUNNING;
-  uint32_t sectorFirst, sectorLast, nSectors, sectorFOffset, sectorLOffset;
-  uint8_t Disk, Partition;
-  uint32_t Entry;
+  uint32_t sectorLast, nSectors, sectorFOffset, sectorLOffset;
+  uint32_t clusterSize, clusterOffset, cluster, run, prevCluster;
+  uint32_t bufferEnd, count, runEnd, *end;
+  uint8_t Disk, Partition, traceFrom;
+  afatfsFile_t *file;
+  afatfsExtent_t *last;
+  uint8_t *data;
+
+  AFATFS_STATS_ENTER(AFATS_MAX_DISKS, FileHandle);
 
   if(Fat32File[FileHandle].isInUse == 1 && FileHandle < AFATS_MAX_FILES)
   {
+    state = &Fat32File[FileHandle].Ctx.WriteState;
+    done = &Fat32File[FileHandle].Ctx.WriteDone;
+    segment = &Fat32File[FileHandle].Ctx.WriteSegment;
+    sectorFirst = &Fat32File[FileHandle].Ctx.WriteSector;
+    newCluster = &Fat32File[FileHandle].Ctx.NewCluster;
     /*
      * Steps:
-     * 1 - Read first sector from the disk
-     * 2 - Copy data in the correct position of file buffer
-     * 3 - Read last sector from the disk
-     * 4 - Update file buffer with the new data supplyed
-     * 5 - Write data back to the disk
-     * 6 - Update root entry list with new file size
+     * 1 - Map the cluster where the cursor is to a run of contiguous clusters.
+     *     If the cursor is past the end of the chain, find an empty cluster
+     *     and link it to the last cluster of the file.
+     * 2 - Read first sector from the disk
+     * 3 - Copy data in the correct position of file buffer
+     * 4 - Read last sector from the disk
+     * 5 - Update file buffer with the new data supplyed
+     * 6 - Write data back to the disk. If the request goes past the run, go
+     *     back to step 1.
+     * 7 - Update root entry list with new file size
+     *
+     * With AFATFS_FILE_MODE_BUFFERED:
+     * 1 - If the file buffer holds data not written yet and the cursor is on
+     *     it, the new data is copied to the buffer. When the buffer gets full,
+     *     or the cursor is somewhere else, the buffer is written first.
+     * 2 - An incomplete last sector is kept in the buffer instead of being
+     *     written (step 6).
+     *
+     * With AFATFS_FILE_MODE_STREAM (STREAM_* states), instead of steps 1
+     * to 6:
+     * 1 - The data is copied to the file buffer, which holds the end of the
+     *     file from a sector boundary. A full buffer is written at once.
+     * 2 - When the buffer holds no data and whole sectors are left, they are
+     *     written straight from the supplied buffer.
+     * 3 - Once the clusters taken in advance are used up, another run of free
+     *     clusters is chained and linked after the last one.
+     *
+     * AFATFS_FILE_MODE_RING files take the same states, writing at the ring
+     * head instead of the end of the file. At the end of the file the head
+     * goes back to the first data sector instead of step 3.
+     *
+     * Step 7 follows the sync policy of the file: AFATFS_SYNC_ENTRY updates
+     * the entry after each write that grows the file, AFATFS_SYNC_BYTES and
+     * AFATFS_SYNC_TIME run AFATFS_Flush when due, otherwise the new size is
+     * only kept in memory until AFATFS_Flush or AFATFS_Close.
      *
      * Notes:
      * 1 - Sector position is updated only after its memory content is written
@@ -1180,11 +5717,20 @@ EStatus_t AFATFS_Write(uint8_t FileHandle, uint8_t *Buffer, uint32_t Size)
      * 2 - There are three cases:
      *     a - There is only one sector to write
      *     b - There are two or more sectors to write
+     * 3 - Sectors that only hold data past the end of the file are not read
+     *     before being written.
+     * 4 - The cursor advances as each part is written, Ctx.WriteDone holds how much
+     *     of the request was already written.
+     * 5 - Requests of any size are split in parts that fit in a run and in
+     *     the file buffer. With AFATFS_FILE_MODE_DIRECT, whole sectors are
+     *     written straight from the supplied buffer (steps 2 to 5 skipped),
+     *     and only the unaligned head and tail go through the file buffer.
      */
     if(Size == 0){
       returncode = ANSWERED_REQUEST;
-    }else if( Fat32File[FileHandle].FilePos + Size >=
-        Fat32File[FileHandle].PhysicalSize ){
+    }else if(!(Fat32File[FileHandle].Mode & AFATFS_FILE_MODE_RING) &&
+        Size > 0xFFFFFFFF - (Fat32File[FileHandle].FilePos - *done)){
+      /* FAT32 files are limited to 4 GiB, ring files do not grow */
       returncode = ERR_FAILED;
     }else if(Buffer == NULL){
       returncode = ERR_NULL_POINTER;
@@ -1192,135 +5738,521 @@ EStatus_t AFATFS_Write(uint8_t FileHandle, uint8_t *Buffer, uint32_t Size)
     {
       Disk = Fat32File[FileHandle].Disk;
       Partition = Fat32File[FileHandle].Partition;
-      Entry = Fat32File[FileHandle].Entry;
-      /* First sector relative to beginning of file */
-      sectorFirst = Fat32File[FileHandle].FilePos / 512;
+      file = &Fat32File[FileHandle];
+      if((file->Mode & (AFATFS_FILE_MODE_STREAM | AFATFS_FILE_MODE_RING)) &&
+          *state == MAP_CLUSTER)
+      {
+        /* Appends to the clusters taken in advance */
+        *state = STREAM_APPEND;
+      }
+      /* Where stream data goes, the end of the file or the ring head */
+      end = (file->Mode & AFATFS_FILE_MODE_RING) ? &file->RingHead :
+          &file->LogicalSize;
+      traceFrom = AFATFS_TRACE_FROM(file->Ctx.TraceActive, AFATFS_TRACE_WRITE,
+          *state);
+      clusterSize = 512 * FatDisk[Disk].PPR.SectorPerCluster[Partition];
       /* Cursor positon within the first sector (remainder of division) */
-      sectorFOffset = Fat32File[FileHandle].FilePos - (512 * sectorFirst);
-      /* Last sector relative to beginning of file */
-      sectorLast = (Fat32File[FileHandle].FilePos + Size) / 512;
-      /* Cursor positon within the last sector  (remainder of division) */
-      sectorLOffset = (Fat32File[FileHandle].FilePos + Size) -
-          (512 * sectorLast);
-      /* Computing number of sectors to read */
-      nSectors = 1 + (sectorLast - sectorFirst);
-      /* Transforming relative first sector into absolute value */
-      sectorFirst += Fat32File[FileHandle].SectorFirst;
-      sectorLast  += Fat32File[FileHandle].SectorFirst;
-
-      if(nSectors <= AFATFS_FILEBUFFER_SIZE)
+      sectorFOffset = Fat32File[FileHandle].FilePos % 512;
+      /* Cursor positon within the last sector (remainder of division) */
+      sectorLOffset = (Fat32File[FileHandle].FilePos + *segment) % 512;
+      if(sectorLOffset == 0){ sectorLOffset = 512;}
+      /* Computing number of sectors to write */
+      nSectors = (sectorFOffset + *segment + 511) / 512;
+      sectorLast = *sectorFirst + nSectors - 1;
+
+      switch(*state)
       {
-
-        switch(state[Disk])
+      case MAP_CLUSTER:
+        if(file->isBufferDirty)
         {
-        case READ_FIRST_SECTOR:
-          /* 1 - Reading first sector from the disk */
-          returncode = Disk_List[Disk].Read(Fat32File[FileHandle].Buffer,
-              sectorFirst , 1);
-          if(returncode == ANSWERED_REQUEST)
+          /* Data joins the buffered sectors if the cursor is on them */
+          bufferEnd = file->BufferPos + (file->BufferCount * 512);
+          if(file->FilePos >= file->BufferPos && file->FilePos < bufferEnd){
+            count = Size - *done;
+            if(count > bufferEnd - file->FilePos){
+              count = bufferEnd - file->FilePos;
+            }
+            memcpy(file->Buffer + (file->FilePos - file->BufferPos),
+                Buffer + *done, count);
+            file->FilePos += count;
+            *done += count;
+            AFATFS_STATS_ADD(Disk, FileHandle, BytesWritten, count);
+            if(file->FilePos > file->LogicalSize){
+              file->LogicalSize = file->FilePos;
+              file->isEntryDirty = 1;
+            }
+          }
+          if(file->FilePos >= file->BufferPos && file->FilePos < bufferEnd &&
+              *done >= Size)
           {
-            returncode = OPERATION_RUNNING;
-            /* 2 - Copying data in the correct position of file buffer */
-            /* Updating the first file sector with new data */
-            if(nSectors == 1){
-              /* If there is only one sector to write */
-              memcpy(Fat32File[FileHandle].Buffer + sectorFOffset, Buffer,
-                  sectorLOffset - sectorFOffset);
-              state[Disk] = WRITE_DATA;
+            *done = 0;
+            returncode = ANSWERED_REQUEST;
+          }else{
+            /* Buffer complete or not where the cursor is, writing it */
+            *state = FLUSH_BUFFER;
+          }
+          break;
+        }
+        /* 1 - Finding the run of clusters where the cursor is */
+        returncode = AFATFS_MapCluster(FileHandle,
+            Fat32File[FileHandle].FilePos / clusterSize, &cluster, &run);
+        if(returncode == ANSWERED_REQUEST)
+        {
+          returncode = OPERATION_RUNNING;
+          if(cluster == 0){
+            /* Past the end of the chain, the file must grow */
+            *state = FIND_EMPTY_CLUSTER;
+          }else{
+            clusterOffset = Fat32File[FileHandle].FilePos % clusterSize;
+            *segment = Size - *done;
+            if(*segment > (run * clusterSize) - clusterOffset){
+              *segment = (run * clusterSize) - clusterOffset;
+            }
+            *sectorFirst = FatDisk[Disk].PPR.DataStartSector[Partition] +
+                FatDisk[Disk].PPR.SectorPerCluster[Partition] *
+                (cluster - FAT_FIRST_CLUSTER) + (clusterOffset / 512);
+            Fat32File[FileHandle].ClusterPrev =
+                Fat32File[FileHandle].ClusterPos;
+            Fat32File[FileHandle].ClusterPos = cluster;
+            if((file->Mode & AFATFS_FILE_MODE_DIRECT) && sectorFOffset == 0 &&
+                *segment >= 512)
+            {
+              /* Aligned middle, written straight from the supplied buffer */
+              *segment -= *segment % 512;
+              *state = WRITE_DATA;
             }else{
-              /* If there is more than one sector to write */
-              /* (512 - sectorFOffset) is the qty of new data writen to the
-               * 1st sector in this case*/
-              memcpy(Fat32File[FileHandle].Buffer + sectorFOffset, Buffer,
-                  512 - sectorFOffset);
-              state[Disk] = READ_LAST_SECTOR;
+              /* The part must fit in the file buffer */
+              if(*segment >
+                  (AFATFS_FILEBUFFER_SIZE * 512) - sectorFOffset)
+              {
+                *segment = (AFATFS_FILEBUFFER_SIZE * 512) - sectorFOffset;
+              }
+              if((file->Mode & AFATFS_FILE_MODE_DIRECT) &&
+                  *segment > 512 - sectorFOffset)
+              {
+                /* Only the unaligned head goes through the buffer */
+                *segment = 512 - sectorFOffset;
+              }
+              *state = READ_FIRST_SECTOR;
             }
           }
+        }
+        break;
+
+      case FIND_EMPTY_CLUSTER:
+        /* Starting right after the last cluster keeps the file contiguous */
+        prevCluster = 0;
+        if(Fat32File[FileHandle].ExtentCount != 0){
+          last = &Fat32File[FileHandle].Extent[
+              Fat32File[FileHandle].ExtentCount - 1];
+          prevCluster = last->Cluster + last->Length;
+        }
+        if(!AFATFS_Lock(Disk, FileHandle)){
+          /* Another file is changing the FAT or the directory */
           break;
+        }
+        returncode = AFATFS_FindEmptyCluster(Disk, Partition, FileHandle, 0,
+            prevCluster, newCluster);
+        if(returncode == ANSWERED_REQUEST){
+          returncode = OPERATION_RUNNING;
+          *state = ALLOCATE_CLUSTER;
+        }
+        break;
 
-        case READ_LAST_SECTOR:
-          /* 3 - Reading last sector from the disk */
-          returncode = Disk_List[Disk].Read(Fat32File[FileHandle].Buffer +
-              ((nSectors - 1) * 512) , sectorLast , 1);
-          if(returncode == ANSWERED_REQUEST)
-          {
-            returncode = OPERATION_RUNNING;
-            /* 4 - Updating file buffer with the new data supplyed */
-            /* Updating the remaining file sectors with new data */
+      case ALLOCATE_CLUSTER:
+        prevCluster = 0;
+        if(Fat32File[FileHandle].ExtentCount != 0){
+          last = &Fat32File[FileHandle].Extent[
+              Fat32File[FileHandle].ExtentCount - 1];
+          prevCluster = last->Cluster + last->Length - 1;
+        }
+        returncode = AFATFS_AllocateCluster(Disk, Partition, FileHandle, 0,
+            prevCluster, newCluster);
+        if(returncode == ANSWERED_REQUEST){
+          returncode = OPERATION_RUNNING;
+          AFATFS_Unlock(Disk, FileHandle);
+          if(Fat32File[FileHandle].ExtentCount == 0){
+            /* First cluster of an empty file, saved on the entry later */
+            Fat32File[FileHandle].ClusterFirst = *newCluster;
+          }
+          AFATFS_PushExtent(FileHandle, *newCluster, 1);
+          *state = MAP_CLUSTER;
+        }
+        break;
+
+      case READ_FIRST_SECTOR:
+        /* The file buffer is used to build the sectors to write */
+        Fat32File[FileHandle].BufferCount = 0;
+        if(sectorFOffset == 0 && (nSectors > 1 || sectorLOffset == 512)){
+          /* The whole first sector will be overwritten */
+          returncode = ANSWERED_REQUEST;
+        }else if(sectorFOffset == 0 &&
+            Fat32File[FileHandle].FilePos >= Fat32File[FileHandle].LogicalSize)
+        {
+          /* Nothing after the end of the file is worth keeping */
+          returncode = ANSWERED_REQUEST;
+        }else{
+          /* 2 - Reading first sector from the disk, through the cache since
+           * small appends keep changing the same sector */
+          returncode = AFATFS_CacheGet(Disk, *sectorFirst, &data);
+          if(returncode == ANSWERED_REQUEST){
+            AFATFS_STATS_ADD(Disk, FileHandle, ReadModifyWrites, 1);
+            memcpy(Fat32File[FileHandle].Buffer, data, 512);
+          }
+        }
+        if(returncode == ANSWERED_REQUEST)
+        {
+          returncode = OPERATION_RUNNING;
+          /* 3 - Copying data in the correct position of file buffer */
+          /* Updating the first file sector with new data */
+          if(nSectors == 1){
+            /* If there is only one sector to write */
+            memcpy(Fat32File[FileHandle].Buffer + sectorFOffset,
+                Buffer + *done, *segment);
+            *state = WRITE_DATA;
+          }else{
+            /* If there is more than one sector to write */
             /* (512 - sectorFOffset) is the qty of new data writen to the
              * 1st sector in this case*/
-            memcpy(Fat32File[FileHandle].Buffer + 512,
-                Buffer + (512 - sectorFOffset), Size - (512 - sectorFOffset));
-            state[Disk] = WRITE_DATA;
+            memcpy(Fat32File[FileHandle].Buffer + sectorFOffset,
+                Buffer + *done, 512 - sectorFOffset);
+            *state = READ_LAST_SECTOR;
           }
-          else if(returncode >= RETURN_ERROR_VALUE)
-          {
-            state[Disk] = READ_FIRST_SECTOR;
+        }
+        break;
+
+      case READ_LAST_SECTOR:
+        if(sectorLOffset == 512 ||
+            (Fat32File[FileHandle].FilePos + *segment - sectorLOffset) >=
+            Fat32File[FileHandle].LogicalSize)
+        {
+          /* Overwritten entirely or past the end of the file */
+          returncode = ANSWERED_REQUEST;
+        }else{
+          /* 4 - Reading last sector from the disk */
+          returncode = AFATFS_DiskRead(Disk, Fat32File[FileHandle].Buffer +
+              ((nSectors - 1) * 512) , sectorLast , 1);
+          if(returncode == ANSWERED_REQUEST){
+            AFATFS_STATS_ADD(Disk, FileHandle, ReadModifyWrites, 1);
           }
-          break;
+        }
+        if(returncode == ANSWERED_REQUEST)
+        {
+          returncode = OPERATION_RUNNING;
+          /* 5 - Updating file buffer with the new data supplyed */
+          /* Updating the remaining file sectors with new data */
+          /* (512 - sectorFOffset) is the qty of new data writen to the
+           * 1st sector in this case*/
+          memcpy(Fat32File[FileHandle].Buffer + 512,
+              Buffer + *done + (512 - sectorFOffset),
+              *segment - (512 - sectorFOffset));
+          *state = WRITE_DATA;
+        }
+        break;
 
-        case WRITE_DATA:
-          /* 5 - Writing data back to the disk */
-          returncode = Disk_List[Disk].Write(Fat32File[FileHandle].Buffer,
-              sectorFirst, nSectors);
-          if(returncode == ANSWERED_REQUEST)
+      case WRITE_DATA:
+        if((file->Mode & AFATFS_FILE_MODE_DIRECT) && sectorFOffset == 0 &&
+            (*segment % 512) == 0)
+        {
+          /* Whole sectors, the file buffer is not involved */
+          returncode = AFATFS_DiskWrite(Disk, Buffer + *done,
+              *sectorFirst, nSectors);
+        }
+        else if((file->Mode & AFATFS_FILE_MODE_BUFFERED) &&
+            sectorLOffset != 512)
+        {
+          /* The incomplete last sector is kept in the buffer */
+          if(nSectors > 1){
+            returncode = AFATFS_DiskWrite(Disk, file->Buffer,
+                *sectorFirst, nSectors - 1);
+          }else{
+            returncode = ANSWERED_REQUEST;
+          }
+          if(returncode == ANSWERED_REQUEST){
+            memmove(file->Buffer, file->Buffer + ((nSectors - 1) * 512), 512);
+            file->BufferSector = sectorLast;
+            file->BufferPos = file->FilePos - sectorFOffset +
+                ((nSectors - 1) * 512);
+            file->BufferCount = 1;
+            file->isBufferDirty = 1;
+          }
+        }else{
+          /* 6 - Writing data back to the disk */
+          returncode = AFATFS_DiskWrite(Disk, file->Buffer,
+              *sectorFirst, nSectors);
+          if(returncode == ANSWERED_REQUEST){
+            /* The file buffer now holds what was written, reads can reuse
+             * it */
+            file->BufferSector = *sectorFirst;
+            file->BufferPos = file->FilePos - sectorFOffset;
+            file->BufferCount = nSectors;
+          }
+        }
+        if(returncode == ANSWERED_REQUEST)
+        {
+          returncode = OPERATION_RUNNING;
+          file->FilePos += *segment;
+          *done += *segment;
+          AFATFS_STATS_ADD(Disk, FileHandle, BytesWritten, *segment);
+          /* Updating sector positon */
+          file->SectorPrev = file->SectorPos;
+          file->SectorPos = *sectorFirst;
+          if(*done < Size){
+            /* The rest of the request is on another run of clusters */
+            *state = MAP_CLUSTER;
+          }
+          else
           {
-            /* Computing if file size increased */
-            if((Fat32File[FileHandle].FilePos + Size) >
-            Fat32File[FileHandle].LogicalSize)
-            {
-              returncode = OPERATION_RUNNING;
-              state[Disk] = READ_ENTRY;
+            if(file->FilePos > file->LogicalSize){
+              /* 7 - File size increased, the sync policy tells when it is
+               * written on the directory entry */
+              file->LogicalSize = file->FilePos;
+              file->isEntryDirty = 1;
             }
-            else
-            {
-              Fat32File[FileHandle].FilePos += Size;
-              state[Disk] = READ_FIRST_SECTOR;
-            }
-          }else if(returncode >= RETURN_ERROR_VALUE){
-            state[Disk] = READ_FIRST_SECTOR;
+            *done = 0;
+            *state = MAP_CLUSTER;
+            returncode = ANSWERED_REQUEST;
           }
-          break;
+        }
+        break;
 
-        case READ_ENTRY:
-          returncode = AFATFS_ReadRootDirEntry(Disk, Partition, Entry / 16);
-          if(returncode == ANSWERED_REQUEST){
+      case UPDATE_ENTRY:
+        returncode = (file->Mode & AFATFS_FILE_MODE_RING) ?
+            AFATFS_WriteRingHeader(FileHandle) :
+            AFATFS_UpdateFileEntry(FileHandle, file->LogicalSize);
+        if(returncode == ANSWERED_REQUEST){
+          *state = MAP_CLUSTER;
+        }
+        break;
+
+      case SYNC_FILE:
+        returncode = AFATFS_Flush(FileHandle);
+        if(returncode == ANSWERED_REQUEST){
+          *state = MAP_CLUSTER;
+        }
+        break;
+
+      case FLUSH_BUFFER:
+        returncode = AFATFS_BufferFlush(FileHandle);
+        if(returncode == ANSWERED_REQUEST){
+          *state = MAP_CLUSTER;
+          if(*done >= Size){
+            *done = 0;
+          }else{
             returncode = OPERATION_RUNNING;
-            Entry = Entry - ((Entry / 16) * 16); /* Entry MOD 16 */
-            FatDisk[Disk].RootDir[Entry].Size =
-                Fat32File[FileHandle].FilePos + Size;
-            state[Disk] = UPDATE_ENTRY;
-          }else if(returncode >= RETURN_ERROR_VALUE){
-            state[Disk] = READ_FIRST_SECTOR;
           }
-          break;
+        }
+        break;
 
-        case UPDATE_ENTRY:
-          returncode = AFATFS_WriteRootDirEntry(Disk, Partition, Entry / 16);
-          if(returncode == ANSWERED_REQUEST){
-            Fat32File[FileHandle].FilePos += Size;
-            Fat32File[FileHandle].LogicalSize = Fat32File[FileHandle].FilePos;
-            state[Disk] = READ_FIRST_SECTOR;
-          }else if(returncode >= RETURN_ERROR_VALUE){
-            state[Disk] = READ_FIRST_SECTOR;
+      case STREAM_APPEND:
+        last = &file->Extent[file->ExtentCount - 1];
+        runEnd = (last->FileCluster + last->Length) * clusterSize;
+        if(!(file->Mode & AFATFS_FILE_MODE_RING) &&
+            file->FilePos != file->LogicalSize)
+        {
+          /* Stream files are only appended to */
+          returncode = ERR_PARAM_OFFSET;
+          break;
+        }
+        if(!file->isBufferDirty &&
+            (file->BufferPos % AFATFS_MAX_SECTOR_SIZE != 0 ||
+            file->BufferPos > *end ||
+            *end - file->BufferPos >
+            file->BufferCount * AFATFS_MAX_SECTOR_SIZE))
+        {
+          /* The buffer was taken by a read or dropped, the end of the file
+           * is read again if it is not on a sector boundary */
+          if(*end % AFATFS_MAX_SECTOR_SIZE != 0){
+            *state = STREAM_READ_TAIL;
+            break;
+          }
+          file->BufferPos = *end;
+          file->BufferCount = 0;
+        }
+        count = *end - file->BufferPos;
+        if(!file->isBufferDirty && count >= AFATFS_MAX_SECTOR_SIZE){
+          /* Sectors already written leave the buffer */
+          memmove(file->Buffer,
+              file->Buffer + (count - (count % AFATFS_MAX_SECTOR_SIZE)),
+              count % AFATFS_MAX_SECTOR_SIZE);
+          file->BufferPos += count - (count % AFATFS_MAX_SECTOR_SIZE);
+          file->BufferSector += count / AFATFS_MAX_SECTOR_SIZE;
+          count %= AFATFS_MAX_SECTOR_SIZE;
+          file->BufferCount = (count != 0);
+        }
+        if(*end >= runEnd && file->isBufferDirty){
+          /* Clusters used up, the buffer is written before going on */
+          *state = STREAM_WRITE_BUFFER;
+          break;
+        }
+        if(*end >= runEnd && (file->Mode & AFATFS_FILE_MODE_RING)){
+          /* Back to the first data sector, no FAT or directory change */
+          *end = AFATFS_MAX_SECTOR_SIZE;
+          file->BufferPos = AFATFS_MAX_SECTOR_SIZE;
+          file->BufferCount = 0;
+          file->RingWraps++;
+          break;
+        }
+        if(*end >= runEnd){
+          *state = STREAM_FIND_RUN;
+          break;
+        }
+        if(count == 0 && Size - *done >= AFATFS_MAX_SECTOR_SIZE){
+          /* Whole sectors, written straight from the supplied buffer */
+          *segment = Size - *done;
+          if(*segment > runEnd - *end){
+            *segment = runEnd - *end;
           }
+          *segment -= *segment % AFATFS_MAX_SECTOR_SIZE;
+          *sectorFirst = AFATFS_StreamSector(FileHandle, *end);
+          *state = STREAM_WRITE_DIRECT;
           break;
+        }
+        if(count == 0){
+          file->BufferSector = AFATFS_StreamSector(FileHandle, *end);
+        }
+        bufferEnd = file->BufferPos +
+            (AFATFS_FILEBUFFER_SIZE * AFATFS_MAX_SECTOR_SIZE);
+        if(bufferEnd > runEnd){
+          bufferEnd = runEnd;
+        }
+        count = Size - *done;
+        if(count > bufferEnd - *end){
+          count = bufferEnd - *end;
+        }
+        memcpy(file->Buffer + (*end - file->BufferPos), Buffer + *done, count);
+        AFATFS_StreamAdvance(FileHandle, count);
+        *done += count;
+        AFATFS_STATS_ADD(Disk, FileHandle, BytesWritten, count);
+        file->BufferCount = (*end - file->BufferPos +
+            (AFATFS_MAX_SECTOR_SIZE - 1)) / AFATFS_MAX_SECTOR_SIZE;
+        file->isBufferDirty = 1;
+        if(*end >= bufferEnd){
+          *state = STREAM_WRITE_BUFFER;
+        }else if(*done >= Size){
+          /* The rest stays in the buffer */
+          *done = 0;
+          *state = MAP_CLUSTER;
+          returncode = ANSWERED_REQUEST;
+        }
+        break;
+
+      case STREAM_READ_TAIL:
+        /* Only after a read used the buffer */
+        *sectorFirst = AFATFS_StreamSector(FileHandle,
+            *end - (*end % AFATFS_MAX_SECTOR_SIZE));
+        file->BufferCount = 0;
+        returncode = AFATFS_DiskRead(Disk, file->Buffer, *sectorFirst, 1);
+        if(returncode == ANSWERED_REQUEST){
+          returncode = OPERATION_RUNNING;
+          AFATFS_STATS_ADD(Disk, FileHandle, ReadModifyWrites, 1);
+          file->BufferSector = *sectorFirst;
+          file->BufferPos = *end - (*end % AFATFS_MAX_SECTOR_SIZE);
+          file->BufferCount = 1;
+          *state = STREAM_APPEND;
+        }
+        break;
+
+      case STREAM_WRITE_BUFFER:
+        returncode = AFATFS_BufferFlush(FileHandle);
+        if(returncode == ANSWERED_REQUEST){
+          if(*done >= Size){
+            *done = 0;
+            *state = MAP_CLUSTER;
+          }else{
+            returncode = OPERATION_RUNNING;
+            *state = STREAM_APPEND;
+          }
+        }
+        break;
+
+      case STREAM_WRITE_DIRECT:
+        returncode = AFATFS_DiskWrite(Disk, Buffer + *done, *sectorFirst,
+            *segment / AFATFS_MAX_SECTOR_SIZE);
+        if(returncode == ANSWERED_REQUEST){
+          AFATFS_StreamAdvance(FileHandle, *segment);
+          *done += *segment;
+          AFATFS_STATS_ADD(Disk, FileHandle, BytesWritten, *segment);
+          file->BufferPos = *end;
+          file->BufferCount = 0;
+          if(*done >= Size){
+            *done = 0;
+            *state = MAP_CLUSTER;
+          }else{
+            returncode = OPERATION_RUNNING;
+            *state = STREAM_APPEND;
+          }
+        }
+        break;
 
-        default:
-          state[Disk] = READ_FIRST_SECTOR;
+      case STREAM_FIND_RUN:
+        if(!AFATFS_Lock(Disk, FileHandle)){
+          /* Another file is changing the FAT or the directory */
           break;
         }
+        /* Starting right after the last cluster keeps the file contiguous */
+        last = &file->Extent[file->ExtentCount - 1];
+        returncode = AFATFS_FindFreeRun(Disk, Partition, FileHandle,
+            last->Cluster + last->Length,
+            AFATFS_PreallocClusters(Disk, Partition), newCluster,
+            &file->Ctx.NewLength);
+        if(returncode == ANSWERED_REQUEST){
+          returncode = OPERATION_RUNNING;
+          *state = STREAM_CHAIN_RUN;
+        }
+        break;
+
+      case STREAM_CHAIN_RUN:
+        returncode = AFATFS_ChainRun(Disk, Partition, FileHandle, *newCluster,
+            file->Ctx.NewLength, 0);
+        if(returncode == ANSWERED_REQUEST){
+          returncode = OPERATION_RUNNING;
+          *state = STREAM_LINK_RUN;
+        }
+        break;
 
+      case STREAM_LINK_RUN:
+        /* The run is linked once it is chained, so the file never points to
+         * free clusters */
+        last = &file->Extent[file->ExtentCount - 1];
+        returncode = AFATFS_SetFatValue(Disk, Partition,
+            last->Cluster + last->Length - 1, *newCluster);
+        if(returncode == ANSWERED_REQUEST){
+          returncode = OPERATION_RUNNING;
+          AFATFS_Unlock(Disk, FileHandle);
+          AFATFS_PushExtent(FileHandle, *newCluster, file->Ctx.NewLength);
+          *state = STREAM_APPEND;
+        }
+        break;
 
+      default:
+        *state = MAP_CLUSTER;
+        break;
       }
 
-      if(returncode == ANSWERED_REQUEST){
-        /* Updating cluster position */
-        Fat32File[FileHandle].ClusterPrev = Fat32File[FileHandle].ClusterPos;
-        /* Updating sector positon */
-        Fat32File[FileHandle].SectorPrev = Fat32File[FileHandle].SectorPos;
-        Fat32File[FileHandle].SectorPos = sectorFirst;
+      if(returncode == ANSWERED_REQUEST && file->isEntryDirty){
+        /* Request done, applying the sync policy of the file */
+        if(file->SyncPolicy == AFATFS_SYNC_ENTRY){
+          *state = UPDATE_ENTRY;
+          returncode = OPERATION_RUNNING;
+        }else if(AFATFS_IsSyncDue(FileHandle)){
+          *state = SYNC_FILE;
+          returncode = OPERATION_RUNNING;
+        }
+      }
+
+      if(returncode >= RETURN_ERROR_VALUE){
+        /* Giving the cursor back to where the request started, stream and
+         * ring files keep what was appended */
+        if(!(file->Mode & (AFATFS_FILE_MODE_STREAM | AFATFS_FILE_MODE_RING))){
+          Fat32File[FileHandle].FilePos -= *done;
+        }
+        *done = 0;
+        *state = MAP_CLUSTER;
+        AFATFS_Unlock(Disk, FileHandle);
       }
+      AFATFS_TRACE_STEP(AFATFS_TRACE_WRITE, Disk, FileHandle,
+          file->Ctx.TraceActive, traceFrom, *state, returncode);
 
     }
 
@@ -1332,6 +6264,104 @@ EStatus_t AFATFS_Write(uint8_t FileHandle, uint8_t *Buffer, uint32_t Size)
     }
   }
 
+  return AFATFS_STATS_LEAVE(returncode);
+
+}
+
+
+
+EStatus_t AFATFS_QueueJob(AfatfsJob_t *Job)
+{
+  EStatus_t returncode = OPERATION_RUNNING;
+
+  if(Job != NULL && Job->Operation <= AFATFS_JOB_SYNC &&
+      Job->Disk < AFATS_MAX_DISKS)
+  {
+    if(AFATFS_JobCount < AFATFS_MAX_JOBS){
+      Job->Result = OPERATION_RUNNING;
+      Job->Bytes = 0;
+      AFATFS_Job[AFATFS_JobCount++] = Job;
+      returncode = ANSWERED_REQUEST;
+    }else{
+      returncode = ERR_RESOURCE_DEPLETED;
+    }
+  }else{
+    if(Job == NULL){
+      returncode = ERR_NULL_POINTER;
+    }else{
+      returncode = ERR_PARAM_VALUE;
+    }
+  }
+
   return returncode;
+}
+
+
+
+EStatus_t AFATFS_SetMicroClock(uint32_t (*Clock)(void))
+{
+  AFATFS_MicroClock = Clock;
+
+  return ANSWERED_REQUEST;
+}
+
+
+
+EStatus_t AFATFS_Poll(uint32_t MaxMicros, uint32_t MaxCommands)
+{
+  EStatus_t result;
+  uint32_t start = 0, commands, passCommands;
+  uint8_t i, isSpent, isIdle;
+
+  /*
+   * Steps:
+   * 1 - Call each job once, in the order they were given, skipping the ones
+   *     that wait for an older job (AFATFS_IsJobWaiting).
+   * 2 - Jobs that end get their result and leave the list.
+   * 3 - Check the budget after each call.
+   * 4 - Go back to step 1 while there are jobs, the budget is not spent and
+   *     the last pass did something (started a command or ended a job).
+   */
+  if(AFATFS_MicroClock != NULL){
+    start = AFATFS_MicroClock();
+  }
+  commands = AFATFS_Commands;
+  isSpent = 0;
+
+  do
+  {
+    passCommands = AFATFS_Commands;
+    isIdle = 1;
+    i = 0;
+    while(i < AFATFS_JobCount && !isSpent)
+    {
+      if(AFATFS_IsJobWaiting(i)){
+        i++;
+        continue;
+      }
+      result = AFATFS_RunJob(AFATFS_Job[i]);
+      if(result != OPERATION_RUNNING){
+        AFATFS_Job[i]->Result = result;
+        AFATFS_JobCount--;
+        memmove(&AFATFS_Job[i], &AFATFS_Job[i + 1],
+            (AFATFS_JobCount - i) * sizeof(AFATFS_Job[0]));
+        isIdle = 0;
+      }else{
+        i++;
+      }
+      if(MaxCommands != 0 && AFATFS_Commands - commands >= MaxCommands){
+        isSpent = 1;
+      }
+      if(MaxMicros != 0 && AFATFS_MicroClock != NULL &&
+          AFATFS_MicroClock() - start >= MaxMicros)
+      {
+        isSpent = 1;
+      }
+    }
+    if(AFATFS_Commands != passCommands){
+      isIdle = 0;
+    }
+  }while(AFATFS_JobCount != 0 && !isSpent && !isIdle);
 
+  return (AFATFS_JobCount == 0) ? ANSWERED_REQUEST : OPERATION_RUNNING;
 }
@@ -63,11 +63,388 @@
 #endif
 
 
+/**
+ * @brief Number of sectors cached per disk (FAT, directory and file sectors).
+ */
+#ifndef AFATFS_CACHE_SIZE
+#define AFATFS_CACHE_SIZE                                                      4
+#endif
+
+
+/**
+ * @brief Number of consecutive FAT sectors read by one device command when a
+ *        FAT sector is not cached (allocation, free cluster counting and
+ *        cluster chain walks). 1 reads a sector at a time and uses no extra
+ *        memory, larger values take that many sectors of memory per disk.
+ */
+#ifndef AFATFS_FAT_READ_BATCH
+#define AFATFS_FAT_READ_BATCH                                                  1
+#endif
+
+
+/**
+ * @brief Number of separate runs of changed FAT sectors remembered per
+ *        partition for the copy to the other FATs. When they are all taken,
+ *        the run nearest to a new change grows over the gap between them.
+ */
+#ifndef AFATFS_MIRROR_RANGES
+#define AFATFS_MIRROR_RANGES                                                   4
+#endif
+
+
+/**
+ * @brief Number of consecutive FAT sectors copied to each other FAT by one
+ *        device command. Takes that many sectors of memory per disk.
+ */
+#ifndef AFATFS_MIRROR_BATCH
+#define AFATFS_MIRROR_BATCH                                                    4
+#endif
+
+
+/**
+ * @brief Max number of requests in flight per disk with a queued driver
+ *        (DiskIO_t.Submit).
+ */
+#ifndef AFATFS_QUEUE_DEPTH
+#define AFATFS_QUEUE_DEPTH                                                     4
+#endif
+
+
+/**
+ * @brief Max number of jobs waiting for AFATFS_Poll.
+ */
+#ifndef AFATFS_MAX_JOBS
+#define AFATFS_MAX_JOBS                      (AFATS_MAX_FILES + AFATS_MAX_DISKS)
+#endif
+
+
+/**
+ * @brief Number of cluster runs (extents) remembered per opened file.
+ */
+#ifndef AFATFS_EXTENT_CACHE_SIZE
+#define AFATFS_EXTENT_CACHE_SIZE                                               4
+#endif
+
+
+/**
+ * @brief Number of subdirectories remembered per disk with the cluster they
+ *        start on, so opening files of the same folders does not read the
+ *        folders above them again. 0 remembers none.
+ */
+#ifndef AFATFS_DENTRY_CACHE_SIZE
+#define AFATFS_DENTRY_CACHE_SIZE                                               8
+#endif
+
+
+/**
+ * @brief Number of directories per disk whose first free entry is remembered,
+ *        so creating files in them does not read the directory from the
+ *        start again. 0 remembers none.
+ */
+#ifndef AFATFS_FREE_HINT_SIZE
+#define AFATFS_FREE_HINT_SIZE                                                  4
+#endif
+
+
+/**
+ * @brief Longest file name accepted. Names that do not fit 8.3 are stored as
+ *        long (VFAT) names up to this length, 12 keeps 8.3 names only.
+ */
+#ifndef AFATFS_MAX_NAME_LENGTH
+#define AFATFS_MAX_NAME_LENGTH                                               255
+#endif
+
+
+/**
+ * @brief Set to 1 to count device commands, sectors, read-modify-write
+ *        cycles, FAT scans and polls per disk and per file (see
+ *        AFATFS_GetStats). 0 leaves the counters out.
+ */
+#ifndef AFATFS_STATS
+#define AFATFS_STATS                                                           0
+#endif
+
+
+/**
+ * @brief Number of events kept by the trace ring buffer: state changes of
+ *        AFATFS_Mount, AFATFS_Create, AFATFS_Open and AFATFS_Write, and
+ *        device commands (see AFATFS_GetTrace). 0 leaves tracing out.
+ */
+#ifndef AFATFS_TRACE_SIZE
+#define AFATFS_TRACE_SIZE                                                      0
+#endif
+
+
+/**
+ * @brief Bytes of contiguous clusters taken by a file created with
+ *        AFATFS_FILE_MODE_STREAM, and again each time it uses them up,
+ *        unless AFATFS_SetPreallocSize gives another size for the disk. Also
+ *        the size of files created with AFATFS_FILE_MODE_RING.
+ */
+#ifndef AFATFS_PREALLOC_SIZE
+#define AFATFS_PREALLOC_SIZE                                           1048576UL
+#endif
+
+
+
+/**
+ * @brief File modes, combined on the Mode argument of AFATFS_Open and
+ *        AFATFS_Create.
+ */
+#define AFATFS_FILE_MODE_BUFFERED   0x01 /*!< Writes are kept in the file buffer
+                                              until a sector is complete, the
+                                              buffer is needed, AFATFS_Flush
+                                              or AFATFS_Close */
+#define AFATFS_FILE_MODE_DIRECT     0x02 /*!< Whole sectors are read to and
+                                              written from the caller's buffer
+                                              without the file buffer */
+#define AFATFS_FILE_MODE_STREAM     0x04 /*!< AFATFS_Create only: contiguous
+                                              clusters are taken in advance
+                                              and writes append whole sectors
+                                              to them, see AFATFS_Write */
+#define AFATFS_FILE_MODE_RING       0x08 /*!< Fixed size file of contiguous
+                                              clusters, writes go round it
+                                              after a header sector, see
+                                              AfatfsRingHeader_t */
+
+
+/**
+ * @brief Signature at the start of the header sector of a ring file.
+ */
+#define AFATFS_RING_SIGNATURE                                         "AFATRING"
+
+
+/**
+ * @brief Directory entry sync policies, see AFATFS_SetSyncPolicy.
+ */
+#define AFATFS_SYNC_ENTRY           0 /*!< Entry updated in the disk cache by
+                                           every write that grows the file */
+#define AFATFS_SYNC_BYTES           1 /*!< File flushed once it grew Value
+                                           bytes since the last flush */
+#define AFATFS_SYNC_TIME            2 /*!< File flushed by the first write that
+                                           ends Value milliseconds after the
+                                           last flush */
+#define AFATFS_SYNC_ON_FLUSH        3 /*!< Only AFATFS_Flush and AFATFS_Close
+                                           write the entry */
+
+
+/**
+ * @brief Slot of a directory index, see AFATFS_SetDirIndex.
+ */
+typedef struct
+{
+  uint16_t Hash; /*!< Hash of the 8.3 name, or of the long name */
+
+  uint16_t Entry; /*!< Entry position on the directory, 0xFFFF if the slot
+                       is free */
+
+  uint32_t Cluster; /*!< First cluster of the file */
+
+}AfatfsDirIndex_t;
+
+
+/**
+ * @brief Job operations, see AFATFS_QueueJob.
+ */
+#define AFATFS_JOB_MOUNT            0 /*!< AFATFS_Mount(Disk) */
+#define AFATFS_JOB_CREATE           1 /*!< AFATFS_Create, sets Handle */
+#define AFATFS_JOB_OPEN             2 /*!< AFATFS_Open, sets Handle */
+#define AFATFS_JOB_READ             3 /*!< AFATFS_Read, sets Bytes */
+#define AFATFS_JOB_WRITE            4 /*!< AFATFS_Write */
+#define AFATFS_JOB_FLUSH            5 /*!< AFATFS_Flush(Handle) */
+#define AFATFS_JOB_CLOSE            6 /*!< AFATFS_Close */
+#define AFATFS_JOB_SYNC             7 /*!< AFATFS_Sync(Disk) */
+
+
+/**
+ * @brief Request run by AFATFS_Poll. The structure belongs to the caller and
+ *        must stay valid until Result is not OPERATION_RUNNING.
+ */
+typedef struct
+{
+  uint8_t Operation; /*!< One of the AFATFS_JOB_* values */
+
+  uint8_t Disk;
+
+  uint8_t Partition;
+
+  uint8_t Mode; /*!< AFATFS_FILE_MODE_* flags for create and open jobs */
+
+  char *FileName; /*!< Name for create and open jobs */
+
+  uint8_t Handle; /*!< File handle, set by create and open jobs */
+
+  uint8_t *Buffer; /*!< Data of read and write jobs */
+
+  uint32_t Size; /*!< Bytes to read or write */
+
+  uint32_t Bytes; /*!< Bytes read, set by read jobs */
+
+  volatile EStatus_t Result; /*!< OPERATION_RUNNING until the job ends, then
+                                  what the routine returned */
+
+}AfatfsJob_t;
+
+
+/**
+ * @brief Counters of a disk or of a file, see AFATFS_GetStats. File counters
+ *        hold what the calls on that file did, disk counters hold everything
+ *        done on the disk.
+ */
+typedef struct
+{
+  uint32_t Commands; /*!< Device commands started */
+
+  uint32_t SectorsRead; /*!< Sectors read from the device */
+
+  uint32_t SectorsWritten; /*!< Sectors written to the device */
+
+  uint32_t ReadModifyWrites; /*!< Sectors AFATFS_Write had to read to merge
+                                  new data with data already on them */
+
+  uint32_t FatScanSectors; /*!< FAT sectors looked at for a free cluster */
+
+  uint32_t Polls; /*!< Calls that returned OPERATION_RUNNING */
+
+  uint32_t BytesRead; /*!< Bytes returned by AFATFS_Read */
+
+  uint32_t BytesWritten; /*!< Bytes given to AFATFS_Write */
+
+}AfatfsStats_t;
+
+
+/**
+ * @brief FileHandle given to AFATFS_GetStats for the counters of the disk.
+ */
+#define AFATFS_STATS_DISK                                                   0xFF
+
+
+/**
+ * @brief Trace event types, see AfatfsTraceEvent_t.
+ */
+#define AFATFS_TRACE_MOUNT          0 /*!< State change of AFATFS_Mount */
+#define AFATFS_TRACE_CREATE         1 /*!< State change of AFATFS_Create */
+#define AFATFS_TRACE_OPEN           2 /*!< State change of AFATFS_Open */
+#define AFATFS_TRACE_WRITE          3 /*!< State change of AFATFS_Write */
+#define AFATFS_TRACE_IO_START       4 /*!< Device command given to the driver */
+#define AFATFS_TRACE_IO_END         5 /*!< Device command ended */
+
+/**
+ * @brief From of the first state change of an operation, To of the last.
+ */
+#define AFATFS_TRACE_IDLE                                                   0xFF
+
+
+/**
+ * @brief Event of the trace ring buffer. State changes use File, From, To
+ *        and Result (what the call returned), device events use Sector,
+ *        Count, isWrite and, when the command ends, Result.
+ */
+typedef struct
+{
+  uint32_t Time; /*!< Microseconds, from the clock of AFATFS_SetMicroClock
+                      (0 without a clock) */
+
+  uint32_t Sector;
+
+  uint32_t Count;
+
+  uint8_t Type; /*!< One of the AFATFS_TRACE_* types */
+
+  uint8_t Disk;
+
+  uint8_t File; /*!< File handle, AFATS_MAX_FILES for mount and device
+                     events */
+
+  uint8_t From; /*!< State before the call, AFATFS_TRACE_IDLE if the call
+                     started the operation */
+
+  uint8_t To; /*!< State after the call, AFATFS_TRACE_IDLE if the call ended
+                   the operation */
+
+  uint8_t isWrite;
+
+  uint8_t Result; /*!< EStatus_t value */
+
+}AfatfsTraceEvent_t;
+
+
+/**
+ * @brief Start of the first sector of a file created with
+ *        AFATFS_FILE_MODE_RING, the rest of the sector is zero. Data goes from
+ *        the end of this sector (AFATFS_MAX_SECTOR_SIZE) to the end of the
+ *        file and then wraps around to it again. Offsets are file offsets,
+ *        Head equal to Tail means the ring is empty. Values are in the byte
+ *        order of the CPU.
+ */
+typedef struct
+{
+  uint8_t Signature[8]; /*!< AFATFS_RING_SIGNATURE, not terminated */
+
+  uint32_t Size; /*!< File size, equal to the size on the directory entry */
+
+  uint32_t Head; /*!< Where the next write goes */
+
+  uint32_t Tail; /*!< Oldest data kept */
+
+  uint32_t Wraps; /*!< Times Head went back to the first data sector */
+
+}AfatfsRingHeader_t;
+
+
 
 #if AFATFS_MIN_SECTOR_SIZE > AFATFS_MAX_SECTOR_SIZE
 #error AFATFS_MAX_SECTOR_SIZE smaller than AFATFS_MIN_SECTOR_SIZE.
 #endif
 
+#if AFATFS_CACHE_SIZE < 2
+#error AFATFS_CACHE_SIZE must hold at least two sectors.
+#endif
+
+#if AFATFS_FAT_READ_BATCH < 1
+#error AFATFS_FAT_READ_BATCH must be at least 1.
+#endif
+
+#if AFATFS_MIRROR_RANGES < 1 || AFATFS_MIRROR_RANGES > 255
+#error AFATFS_MIRROR_RANGES must be between 1 and 255.
+#endif
+
+#if AFATFS_MIRROR_BATCH < 1
+#error AFATFS_MIRROR_BATCH must be at least 1.
+#endif
+
+#if AFATFS_QUEUE_DEPTH < 1 || AFATFS_QUEUE_DEPTH > 255
+#error AFATFS_QUEUE_DEPTH must be between 1 and 255.
+#endif
+
+#if AFATFS_EXTENT_CACHE_SIZE < 2
+#error AFATFS_EXTENT_CACHE_SIZE must hold at least two extents.
+#endif
+
+#if AFATFS_DENTRY_CACHE_SIZE < 0 || AFATFS_DENTRY_CACHE_SIZE > 255
+#error AFATFS_DENTRY_CACHE_SIZE must be between 0 and 255.
+#endif
+
+#if AFATFS_FREE_HINT_SIZE < 0 || AFATFS_FREE_HINT_SIZE > 255
+#error AFATFS_FREE_HINT_SIZE must be between 0 and 255.
+#endif
+
+#if AFATFS_MAX_NAME_LENGTH < 12 || AFATFS_MAX_NAME_LENGTH > 255
+#error AFATFS_MAX_NAME_LENGTH must be between 12 and 255.
+#endif
+
+#if AFATFS_STATS != 0 && AFATFS_STATS != 1
+#error AFATFS_STATS must be 0 or 1.
+#endif
+
+#if AFATFS_TRACE_SIZE < 0 || AFATFS_TRACE_SIZE > 65535
+#error AFATFS_TRACE_SIZE must be between 0 and 65535.
+#endif
+
+#if AFATFS_PREALLOC_SIZE < 1
+#error AFATFS_PREALLOC_SIZE must be at least 1.
+#endif
+
 
 /**
  * @brief  This routine configures a specified disk.
@@ -79,26 +456,67 @@ EStatus_t AFATFS_Mount(uint8_t Disk);
 
 
 /**
- * @brief  This routine creates an empty file on root directory.
+ * @brief  This routine creates an empty file.
  * @param  Disk : A number that will identify the disk.
  * @param  Partition : A number that will identify a partition.
- * @param  FileName : A string containing the file name.
- * @param  Mode : The mode in wich the file will be created.
+ * @param  FileName : A string containing the file name, with the folders
+ *         it is in separated by '/' (LOGS/2026/RUN01.CSV).
+ * @param  Mode : The mode in wich the file will be created, a combination
+ *         of AFATFS_FILE_MODE_* flags.
  * @param  FileHandle : A value returned by the function to identify the file.
  * @retval EStatus_t
+ * @note   The file structure is taken on the first call and the request is
+ *         told apart by the address of FileHandle, so the same variable must
+ *         be given until the routine stops returning OPERATION_RUNNING. Other
+ *         files may be opened, created, read or written meanwhile.
+ * @note   Names that do not fit 8.3 (longer, several dots, spaces or any of
+ *         "+,;=[]") are written as a long name, plus a short name made from
+ *         it (LONGNA~1.TXT). FileName must not change until the routine stops
+ *         returning OPERATION_RUNNING.
+ * @note   8.3 names are stored in upper case. A name or extension all in
+ *         lower case is flagged on the entry, one with both cases also gets
+ *         a long name with the 8.3 name as its short name (Log.txt is
+ *         LOG.TXT), so names that only differ in case are the same file.
+ * @note   The folders of the path must exist, only the file is created.
+ * @note   A full directory gets one more cluster, up to 65536 entries.
+ * @note   With AFATFS_FILE_MODE_STREAM the file takes the longest run of
+ *         free clusters found, up to AFATFS_SetPreallocSize bytes, chained
+ *         on the FAT in one pass. Clusters it does not use are given back by
+ *         AFATFS_Close.
+ * @note   With AFATFS_FILE_MODE_RING the file takes a run of free clusters of
+ *         AFATFS_SetPreallocSize bytes, ERR_FAILED if there is none that
+ *         long. The directory entry gets the whole size and the header sector
+ *         an empty ring at once, neither changes size afterwards.
  */
 EStatus_t AFATFS_Create(uint8_t Disk, uint8_t Partition, char *FileName,
     uint8_t Mode, uint8_t *FileHandle);
 
 
 /**
- * @brief  This routine opens a file from root directory.
+ * @brief  This routine opens a file.
  * @param  Disk : A number that will identify the disk.
  * @param  Partition : A number that will identify a partition.
- * @param  FileName : A string containing the file name.
- * @param  Mode : The mode in wich the file will be opened.
+ * @param  FileName : A string containing the file name, with the folders
+ *         it is in separated by '/' (LOGS/2026/RUN01.CSV).
+ * @param  Mode : The mode in wich the file will be opened, a combination
+ *         of AFATFS_FILE_MODE_* flags.
  * @param  FileHandle : A value returned by the function to identify the file.
  * @retval EStatus_t
+ * @note   The file structure is taken on the first call and the request is
+ *         told apart by the address of FileHandle, so the same variable must
+ *         be given until the routine stops returning OPERATION_RUNNING. Other
+ *         files may be opened, created, read or written meanwhile.
+ * @note   8.3 names, in any case, are compared with the short name of the
+ *         entries. Other names are compared, ignoring the case of ASCII
+ *         letters, with the long names, and FileName must not change until
+ *         the routine stops returning OPERATION_RUNNING.
+ * @note   Folders found on the way are remembered (AFATFS_DENTRY_CACHE_SIZE),
+ *         so files of the same folders are opened reading only the
+ *         sectors of their own folder.
+ * @note   AFATFS_FILE_MODE_STREAM is taken as AFATFS_FILE_MODE_BUFFERED.
+ * @note   With AFATFS_FILE_MODE_RING the chain of the file is checked to be
+ *         contiguous and the head and tail are loaded from its header sector.
+ *         ERR_FAILED is returned if the file is not a ring file.
  */
 EStatus_t AFATFS_Open(uint8_t Disk, uint8_t Partition, char *FileName,
     uint8_t Mode, uint8_t *FileHandle);
@@ -109,18 +527,273 @@ EStatus_t AFATFS_Open(uint8_t Disk, uint8_t Partition, char *FileName,
  * @param  Disk : A number that will identify the disk.
  * @param  Partition : A number that will identify a partition.
  * @param  FileHandle : A handle to the file.
- * @note   This function only free the memory used to handle the file. Any
- *         write operation is performed inside AFATFS_Write.
+ * @note   The file is flushed (AFATFS_Flush) before the memory used to
+ *         handle it is freed.
+ * @note   Clusters taken in advance by AFATFS_FILE_MODE_STREAM and not
+ *         written are freed first.
+ * @note   Ring files get their header written, see AFATFS_Flush.
+ * @note   A read or write of the file that was not polled to the end is
+ *         given up, and the disk it was changing is left to other files.
+ *         Data it already wrote is kept.
  * @retval EStatus_t
  */
 EStatus_t AFATFS_Close(uint8_t Disk, uint8_t Partition, uint8_t *FileHandle);
 
 
+/**
+ * @brief  This routine writes to the disk the data a file keeps in memory: the
+ *         sectors buffered by AFATFS_FILE_MODE_BUFFERED writes, the file size
+ *         and first cluster on its directory entry and, through AFATFS_Sync,
+ *         every sector changed in the disk cache.
+ * @param  FileHandle : A handle to the file.
+ * @retval EStatus_t
+ * @note   Ring files have the head and tail written on their header sector
+ *         instead of the directory entry, which does not change.
+ */
+EStatus_t AFATFS_Flush(uint8_t FileHandle);
+
+
+/**
+ * @brief  This routine writes back to the disk the information kept in memory
+ *         for all partitions of a disk (free clusters count, next free
+ *         cluster hint and every sector changed in the disk cache).
+ * @param  Disk : A number that will identify the disk.
+ * @note   FAT and directory changes are kept in the cache until this routine
+ *         is called, the file is closed or the cache needs the slot.
+ * @note   Only the first FAT is written while files change. The FAT sectors
+ *         changed since the last sync are then copied here to the other FAT
+ *         copies, unless turned off by AFATFS_SetFatMirror.
+ * @retval EStatus_t
+ */
+EStatus_t AFATFS_Sync(uint8_t Disk);
+
+
+/**
+ * @brief  This routine chooses when the size of a file is written on its
+ *         directory entry.
+ * @param  FileHandle : A handle to the file.
+ * @param  Policy : One of the AFATFS_SYNC_* values.
+ * @param  Value : Bytes for AFATFS_SYNC_BYTES, milliseconds for
+ *         AFATFS_SYNC_TIME, not used by the other policies.
+ * @note   Files start with AFATFS_SYNC_ENTRY, or AFATFS_SYNC_ON_FLUSH when
+ *         opened with AFATFS_FILE_MODE_BUFFERED, AFATFS_FILE_MODE_STREAM or
+ *         AFATFS_FILE_MODE_RING. For ring files the policies apply to the
+ *         header sector, AFATFS_SYNC_BYTES counting the bytes written.
+ * @note   What a power loss can lose: the file keeps the size and first
+ *         cluster written on its entry by the last flush. Data written after
+ *         that is lost even if its sectors reached the disk. With
+ *         AFATFS_SYNC_BYTES that is less than Value bytes plus the last write,
+ *         with AFATFS_SYNC_TIME it is what was written in the last Value
+ *         milliseconds, and with AFATFS_SYNC_ON_FLUSH it is everything since
+ *         the file was opened. With AFATFS_SYNC_ENTRY the entry is only as
+ *         recent as the last time the disk cache wrote its sector back. Clusters
+ *         allocated after the last flush may stay marked as used.
+ * @retval EStatus_t
+ */
+EStatus_t AFATFS_SetSyncPolicy(uint8_t FileHandle, uint8_t Policy,
+    uint32_t Value);
+
+
+/**
+ * @brief  This routine supplies the clock used by AFATFS_SYNC_TIME.
+ * @param  Clock : Function returning a free running count of milliseconds,
+ *         NULL to stop using it (AFATFS_SYNC_TIME then never flushes).
+ * @retval EStatus_t
+ */
+EStatus_t AFATFS_SetClock(uint32_t (*Clock)(void));
+
+
+/**
+ * @brief  This routine sets how much space files created with
+ *         AFATFS_FILE_MODE_STREAM take at a time.
+ * @param  Disk : A number that will identify the disk.
+ * @param  Size : Bytes, rounded up to whole clusters. 0 for
+ *         AFATFS_PREALLOC_SIZE.
+ * @retval EStatus_t
+ * @note   Used by the creates started afterwards and when a file uses up
+ *         its clusters. A shorter run is taken if no free run is as long.
+ * @note   Also the size of the ring files created afterwards, at least three
+ *         sectors.
+ */
+EStatus_t AFATFS_SetPreallocSize(uint8_t Disk, uint32_t Size);
+
+
+/**
+ * @brief  This routine tells where the data of a ring file is.
+ * @param  FileHandle : A handle to a file opened or created with
+ *         AFATFS_FILE_MODE_RING.
+ * @param  Head : File offset where the next write goes.
+ * @param  Tail : File offset of the oldest data kept.
+ * @retval EStatus_t
+ * @note   The data is read with AFATFS_Seek and AFATFS_Read from Tail to the
+ *         end of the file and then from AFATFS_MAX_SECTOR_SIZE to Head if
+ *         Head is lower than Tail, from Tail to Head otherwise. Values are
+ *         the ones in memory, the header sector gets them on the next flush.
+ */
+EStatus_t AFATFS_GetRingOffsets(uint8_t FileHandle, uint32_t *Head,
+    uint32_t *Tail);
+
+
+/**
+ * @brief  This routine supplies memory used to remember which FAT sectors have
+ *         no free clusters, so they are not read again when allocating.
+ * @param  Disk : A number that will identify the disk.
+ * @param  Partition : A number that will identify a partition.
+ * @param  Map : Buffer with one bit per FAT sector, NULL to stop using it.
+ * @param  Size : Size of Map in bytes. FAT sectors not covered by the map are
+ *         always read.
+ * @note   Each byte covers 8 FAT sectors, or 1024 clusters.
+ * @retval EStatus_t
+ */
+EStatus_t AFATFS_SetFreeMap(uint8_t Disk, uint8_t Partition, uint8_t *Map,
+    uint32_t Size);
+
+
+/**
+ * @brief  This routine supplies memory for an index of the root directory, so
+ *         files are found without reading the directory sector by sector.
+ * @param  Disk : A number that will identify the disk.
+ * @param  Partition : A number that will identify a partition.
+ * @param  Table : Array of index slots, NULL to stop using the index.
+ * @param  Size : Number of slots in Table.
+ * @retval EStatus_t
+ * @note   The index is built by AFATFS_Mount, or by the next open or create
+ *         if the disk is already mounted, and kept up to date by
+ *         AFATFS_Create. Opening a file then reads at most the sector of its
+ *         entry, and a missing file is reported without reading the disk.
+ * @note   Give at least one slot per file plus some spare (about twice the
+ *         number of files keeps lookups short). If the index gets full it
+ *         is dropped and the directory is read as before.
+ */
+EStatus_t AFATFS_SetDirIndex(uint8_t Disk, uint8_t Partition,
+    AfatfsDirIndex_t *Table, uint32_t Size);
+
+
+/**
+ * @brief  This routine gives the number of free clusters of a partition.
+ * @param  Disk : A number that will identify the disk.
+ * @param  Partition : A number that will identify a partition.
+ * @param  Clusters : Number of free clusters, 0xFFFFFFFF if unknown.
+ * @retval EStatus_t
+ */
+EStatus_t AFATFS_GetFreeClusters(uint8_t Disk, uint8_t Partition,
+    uint32_t *Clusters);
+
+
+/**
+ * @brief  This routine turns on or off the copy of the first FAT to the other
+ *         FAT copies done by AFATFS_Sync.
+ * @param  Disk : A number that will identify the disk.
+ * @param  isEnabled : 0 to keep only the first FAT up to date.
+ * @retval EStatus_t
+ * @note   Meant for loggers that sync often. While off, the other copies
+ *         differ from the first one (the BPB still says they are mirrored),
+ *         so call AFATFS_ResyncFat before the disk is removed. Enabled by
+ *         default.
+ */
+EStatus_t AFATFS_SetFatMirror(uint8_t Disk, uint8_t isEnabled);
+
+
+/**
+ * @brief  This routine copies the first FAT of a partition to the other FAT
+ *         copies.
+ * @param  Disk : A number that will identify the disk.
+ * @param  Partition : A number that will identify a partition.
+ * @param  isWholeFat : 0 to copy only the sectors changed since the last
+ *         copy, otherwise every FAT sector is copied.
+ * @retval EStatus_t
+ * @note   The cache is written back first. Up to AFATFS_MIRROR_BATCH FAT
+ *         sectors are read or written per call. The whole FAT is only needed
+ *         if the copies were left different by an earlier mount.
+ */
+EStatus_t AFATFS_ResyncFat(uint8_t Disk, uint8_t Partition, uint8_t isWholeFat);
+
+
+/**
+ * @brief  This routine counts the free clusters of a partition by reading the
+ *         whole FAT, for when the FSInfo count is unknown or not trusted.
+ * @param  Disk : A number that will identify the disk.
+ * @param  Partition : A number that will identify a partition.
+ * @param  Clusters : Number of free clusters.
+ * @retval EStatus_t
+ * @note   One FAT sector is read per call. Clusters are not allocated until
+ *         the count ends. The count is kept as the FSInfo free count, and
+ *         written by AFATFS_Sync.
+ */
+EStatus_t AFATFS_CountFreeClusters(uint8_t Disk, uint8_t Partition,
+    uint32_t *Clusters);
+
+
+/**
+ * @brief  This routine gives how many parts of the reads of a file were served
+ *         from the file buffer (hits) and how many needed a device read
+ *         (misses) since the file was opened.
+ * @param  FileHandle : A handle to the file.
+ * @param  Hits : Number of read parts copied from the file buffer.
+ * @param  Misses : Number of device reads issued by AFATFS_Read.
+ * @retval EStatus_t
+ */
+EStatus_t AFATFS_GetReadStats(uint8_t FileHandle, uint32_t *Hits,
+    uint32_t *Misses);
+
+
+/**
+ * @brief  This routine gives the counters of a disk or of an opened file.
+ * @param  Disk : A number that will identify the disk.
+ * @param  FileHandle : A handle to the file, or AFATFS_STATS_DISK for the
+ *         counters of the disk.
+ * @param  Stats : Copy of the counters, NULL to only reset them.
+ * @param  isReset : Set to 1 to zero the counters after the copy.
+ * @retval EStatus_t
+ * @note   Needs AFATFS_STATS set to 1, ERR_NOT_IMPLEMENTED is returned
+ *         otherwise.
+ * @note   File counters start at zero when the file is opened or created,
+ *         and count what the calls on the file did after that, including
+ *         FAT and directory sectors. Polls of a call that runs another one
+ *         (AFATFS_Close running AFATFS_Flush) are counted once.
+ * @note   Counters are plain 32 bit values that wrap around, read them with
+ *         isReset set to 1 to get the counts of each period.
+ */
+EStatus_t AFATFS_GetStats(uint8_t Disk, uint8_t FileHandle,
+    AfatfsStats_t *Stats, uint8_t isReset);
+
+
+/**
+ * @brief  This routine takes the oldest events out of the trace ring buffer.
+ * @param  Events : Where the events are copied, oldest first.
+ * @param  Size : Max number of events copied.
+ * @param  Count : Number of events copied.
+ * @param  Lost : Number of events overwritten by newer ones since the last
+ *         call, NULL if not needed.
+ * @retval EStatus_t
+ * @note   Needs AFATFS_TRACE_SIZE above 0, ERR_NOT_IMPLEMENTED is returned
+ *         otherwise.
+ * @note   A state change is recorded by the call that made it, so each
+ *         event tells how long the operation stayed in From. Device commands
+ *         are recorded when given to the driver and when they end, not on
+ *         each poll. "host/tracejson.c" turns the events into Chrome trace
+ *         JSON.
+ */
+EStatus_t AFATFS_GetTrace(AfatfsTraceEvent_t *Events, uint32_t Size,
+    uint32_t *Count, uint32_t *Lost);
+
+
+/**
+ * @brief  This routine is called by a queued driver (DiskIO_t.Submit) when a
+ *         request ends.
+ * @param  Tag : The tag given to Submit with the request.
+ * @param  Result : ANSWERED_REQUEST, or an error code if the request failed.
+ * @note   Can be called from an interrupt. Tags of requests the library no
+ *         longer waits for are ignored.
+ */
+void AFATFS_CompleteRequest(uint32_t Tag, EStatus_t Result);
+
+
 /**
  * @brief  This moves a file pointer to the specified offset.
  * @param  FileHandle : A handle to the file.
  * @param  Offset : Number in bytes to move the file cursor from the begining of
- *         the file.
+ *         the file. Seeking to the file size allows appending to the file.
  * @retval EStatus_t
  */
 EStatus_t AFATFS_Seek(uint8_t FileHandle, uint32_t Offset);
@@ -135,6 +808,12 @@ EStatus_t AFATFS_Seek(uint8_t FileHandle, uint32_t Offset);
  * @retval EStatus_t
  * @note   The data is read from an offset set by a call to AFATFS_Write or
  *         to AFATFS_Seek
+ * @note   Sectors already held by the file buffer are copied without
+ *         accessing the disk, and a miss fills the whole buffer, so small
+ *         sequential reads cost one device read per buffer.
+ * @note   There is no limit on Size, large requests take several calls.
+ *         With AFATFS_FILE_MODE_DIRECT the sector aligned part of the request
+ *         is read by the disk straight into Buffer.
  */
 EStatus_t AFATFS_Read(uint8_t FileHandle, uint8_t *Buffer, uint32_t Size,
     uint32_t *BytesRead);
@@ -148,7 +827,68 @@ EStatus_t AFATFS_Read(uint8_t FileHandle, uint8_t *Buffer, uint32_t Size,
  * @retval EStatus_t
  * @note   The data is written to an offset set by a call to AFATFS_Read or
  *         to AFATFS_Seek
+ * @note   Clusters are allocated and linked to the file as it grows.
+ * @note   The new file size and clusters stay in the disk cache until
+ *         AFATFS_Sync or AFATFS_Close is called.
+ * @note   With AFATFS_FILE_MODE_BUFFERED, data that does not complete a sector
+ *         stays in the file buffer, and the directory entry is only updated
+ *         by AFATFS_Flush or AFATFS_Close. Appending small records then costs
+ *         about one sector write per sector of data.
+ * @note   There is no limit on Size, large requests take several calls.
+ *         With AFATFS_FILE_MODE_DIRECT the sector aligned part of the request
+ *         is written by the disk straight from Buffer.
+ * @note   With AFATFS_FILE_MODE_STREAM the data is appended (the cursor must
+ *         be at the end of the file). It is gathered in the file buffer and
+ *         written a whole buffer at a time, or straight from Buffer when
+ *         whole sectors are left, with no sector read and no FAT access
+ *         while the clusters taken in advance last. The entry is written by
+ *         AFATFS_Flush (see AFATFS_SetSyncPolicy). An error keeps the data
+ *         already appended, the file size tells how much.
+ * @note   With AFATFS_FILE_MODE_RING the data goes to the head of the ring
+ *         whatever the cursor, as with AFATFS_FILE_MODE_STREAM but without
+ *         touching the FAT or the directory. Once the end of the file is
+ *         reached the head goes back to AFATFS_MAX_SECTOR_SIZE. When the head
+ *         reaches the tail, the tail moves to the sector after the head, so
+ *         up to a sector of the oldest data is dropped at a time.
  */
 EStatus_t AFATFS_Write(uint8_t FileHandle, uint8_t *Buffer, uint32_t Size);
 
+
+/**
+ * @brief  This routine gives a job to AFATFS_Poll.
+ * @param  Job : The job, filled according to Job->Operation.
+ * @retval EStatus_t
+ * @note   Jobs on the same file, or mount and sync jobs on the same disk, run
+ *         one after the other in the order they were given. Other jobs run
+ *         at the same time.
+ */
+EStatus_t AFATFS_QueueJob(AfatfsJob_t *Job);
+
+
+/**
+ * @brief  This routine supplies the clock used by the AFATFS_Poll budget and
+ *         by the trace events.
+ * @param  Clock : Function returning a free running count of microseconds,
+ *         NULL to stop using it (MaxMicros is then ignored).
+ * @retval EStatus_t
+ */
+EStatus_t AFATFS_SetMicroClock(uint32_t (*Clock)(void));
+
+
+/**
+ * @brief  This routine runs the queued jobs until they end or the budget is
+ *         spent.
+ * @param  MaxMicros : Time budget in microseconds, 0 for no time limit.
+ * @param  MaxCommands : Number of device commands (reads, writes or queued
+ *         requests) that may be started, 0 for no limit.
+ * @retval ANSWERED_REQUEST if no job is left, OPERATION_RUNNING otherwise.
+ * @note   The jobs are called in turns, once each per pass. The budget is
+ *         checked after each call, so a call may go over it by the cost of a
+ *         single step (one sector copy, one device command).
+ * @note   With no limit, or when every job is waiting for the device, the
+ *         routine returns after a pass that neither started a command nor
+ *         ended a job.
+ */
+EStatus_t AFATFS_Poll(uint32_t MaxMicros, uint32_t MaxCommands);
+
 #endif /* AFATFS_H */
@@ -0,0 +1,140 @@
+#include <string.h>
+#include "afatfs_scan.h"
+
+#if !defined(AFATFS_SCAN_PORTABLE) && defined(__AVX2__)
+#include <immintrin.h>
+#define AFATFS_SCAN_LANES                                                      8
+#elif !defined(AFATFS_SCAN_PORTABLE) && defined(__SSE2__)
+#include <emmintrin.h>
+#define AFATFS_SCAN_LANES                                                      4
+#elif UINTPTR_MAX > 0xFFFFFFFFu
+#define AFATFS_SCAN_LANES                                                      2
+#else
+#define AFATFS_SCAN_LANES                                                      1
+#endif
+
+#define AFATFS_SCAN_ALL_LANES                    ((1u << AFATFS_SCAN_LANES) - 1)
+
+
+
+static uint32_t AFATFS_EntryMask(void)
+{
+  /* Lower 28 bits of a little endian entry, in the byte order of the CPU */
+  static const uint8_t bytes[4] = {0xFF, 0xFF, 0xFF, 0x0F};
+  uint32_t mask;
+
+  memcpy(&mask, bytes, sizeof(mask));
+
+  return mask;
+}
+
+
+
+static uint8_t AFATFS_IsEntryFree(const uint8_t *Data)
+{
+  uint32_t entry;
+
+  memcpy(&entry, Data, sizeof(entry));
+
+  return ((entry & AFATFS_EntryMask()) == 0);
+}
+
+
+
+static uint32_t AFATFS_FreeBits(const uint8_t *Data)
+{
+  /* One bit per entry, set if the entry is free */
+#if AFATFS_SCAN_LANES == 8
+  __m256i v = _mm256_loadu_si256((const __m256i *)Data);
+
+  v = _mm256_and_si256(v, _mm256_set1_epi32((int)AFATFS_EntryMask()));
+  v = _mm256_cmpeq_epi32(v, _mm256_setzero_si256());
+  return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(v));
+#elif AFATFS_SCAN_LANES == 4
+  __m128i v = _mm_loadu_si128((const __m128i *)Data);
+
+  v = _mm_and_si128(v, _mm_set1_epi32((int)AFATFS_EntryMask()));
+  v = _mm_cmpeq_epi32(v, _mm_setzero_si128());
+  return (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(v));
+#elif AFATFS_SCAN_LANES == 2
+  uint64_t v, mask = AFATFS_EntryMask();
+
+  /* Masked entries stay below bit 31, so a lane holds a zero only if
+   * subtracting one sets its top bit */
+  mask |= mask << 32;
+  memcpy(&v, Data, sizeof(v));
+  v &= mask;
+  if(((v - 0x0000000100000001ull) & ~v & 0x8000000080000000ull) == 0){
+    return 0;
+  }
+  return AFATFS_IsEntryFree(Data) | (AFATFS_IsEntryFree(Data + 4) << 1);
+#else
+  return AFATFS_IsEntryFree(Data);
+#endif
+}
+
+
+
+static uint32_t AFATFS_FindEntry(const uint8_t *Data, uint32_t First,
+    uint32_t Count, uint8_t isFree)
+{
+  uint32_t i = First, bits;
+
+  /* Whole groups of entries first, then one by one */
+  while(i + AFATFS_SCAN_LANES <= Count){
+    bits = AFATFS_FreeBits(Data + (4 * i));
+    if(!isFree){
+      bits = ~bits & AFATFS_SCAN_ALL_LANES;
+    }
+    if(bits != 0){
+      while((bits & 1) == 0){
+        bits >>= 1;
+        i++;
+      }
+      return i;
+    }
+    i += AFATFS_SCAN_LANES;
+  }
+  while(i < Count && AFATFS_IsEntryFree(Data + (4 * i)) != isFree){
+    i++;
+  }
+
+  return i;
+}
+
+
+
+uint32_t AFATFS_ScanFree(const uint8_t *Data, uint32_t First, uint32_t Count,
+    uint32_t *Length)
+{
+  uint32_t start, end;
+
+  start = AFATFS_FindEntry(Data, First, Count, 1);
+  if(Length != NULL){
+    end = (start < Count) ? AFATFS_FindEntry(Data, start, Count, 0) : start;
+    *Length = end - start;
+  }
+
+  return start;
+}
+
+
+
+uint32_t AFATFS_CountFree(const uint8_t *Data, uint32_t Count)
+{
+  uint32_t i = 0, free = 0, bits;
+
+  while(i + AFATFS_SCAN_LANES <= Count){
+    bits = AFATFS_FreeBits(Data + (4 * i));
+    while(bits != 0){
+      bits &= bits - 1;
+      free++;
+    }
+    i += AFATFS_SCAN_LANES;
+  }
+  for(; i < Count; i++){
+    free += AFATFS_IsEntryFree(Data + (4 * i));
+  }
+
+  return free;
+}
@@ -0,0 +1,48 @@
+/**
+ * @file  afatfs_scan.h
+ * @date  17-October-2026
+ * @brief Scanning of FAT32 table sectors for free entries.
+ *
+ * @author
+ * @author
+ */
+
+
+#ifndef AFATFS_SCAN_H
+#define AFATFS_SCAN_H
+
+
+#include <stdint.h>
+
+
+/**
+ * @brief The scan tests several entries at once: 8 with AVX2, 4 with SSE2,
+ *        2 on 64-bit targets without them and 1 word per entry otherwise.
+ *        Defining AFATFS_SCAN_PORTABLE leaves SSE2 and AVX2 out even when the
+ *        compiler enables them.
+ */
+
+
+/**
+ * @brief  This routine finds the first run of free entries on a piece of FAT.
+ * @param  Data : FAT entries as read from the disk (little endian).
+ * @param  First : Index of the first entry to look at.
+ * @param  Count : Number of entries in Data.
+ * @param  Length : Number of free entries in a row from the one returned,
+ *         may be NULL.
+ * @retval Index of the first free entry from First on, Count if there is none.
+ * @note   Only the lower 28 bits of each entry are tested, as on FAT32.
+ */
+uint32_t AFATFS_ScanFree(const uint8_t *Data, uint32_t First, uint32_t Count,
+    uint32_t *Length);
+
+
+/**
+ * @brief  This routine counts the free entries on a piece of FAT.
+ * @param  Data : FAT entries as read from the disk (little endian).
+ * @param  Count : Number of entries in Data.
+ * @retval Number of free entries.
+ */
+uint32_t AFATFS_CountFree(const uint8_t *Data, uint32_t Count);
+
+#endif /* AFATFS_SCAN_H */
@@ -37,6 +37,36 @@
 
 #define FAT_END_OF_DIR                                                      0x00
 #define FAT_UNUSED_ENTRY                                                    0xE5
+#define FAT_ATTRIBUTE_LONG_NAME                                             0x0F
+#define FAT_MAX_DIR_ENTRIES                                                65536
+#define FAT_CASE_LOWER_NAME                                                 0x08
+#define FAT_CASE_LOWER_EXT                                                  0x10
+
+/** Inside long name (VFAT) directory entries **/
+#define FAT_LFN_ORDER_OFFSET                                                   0
+#define FAT_LFN_ATTRIBUTE_OFFSET                                              11
+#define FAT_LFN_CHECKSUM_OFFSET                                               13
+#define FAT_LFN_LAST_ENTRY                                                  0x40
+#define FAT_LFN_ORDER_MASK                                                  0x1F
+#define FAT_LFN_CHARS_PER_ENTRY                                               13
+
+/** Inside FSInfo sector **/
+#define FAT_FSINFO_LEAD_SIGNATURE_OFFSET                                       0
+#define FAT_FSINFO_STRUCT_SIGNATURE_OFFSET                                   484
+#define FAT_FSINFO_FREE_COUNT_OFFSET                                         488
+#define FAT_FSINFO_NEXT_FREE_OFFSET                                          492
+#define FAT_FSINFO_LEAD_SIGNATURE                                     0x41615252
+#define FAT_FSINFO_STRUCT_SIGNATURE                                   0x61417272
+#define FAT_FSINFO_UNKNOWN                                            0xFFFFFFFF
+
+/** File allocation table entries (FAT32 uses only the lower 28 bits) **/
+#define FAT_ENTRY_SIZE                                                         4
+#define FAT_ENTRIES_PER_SECTOR                                               128
+#define FAT_ENTRY_MASK                                                0x0FFFFFFF
+#define FAT_ENTRY_FREE                                                0x00000000
+#define FAT_ENTRY_BAD                                                 0x0FFFFFF7
+#define FAT_ENTRY_EOC_MIN                                             0x0FFFFFF8
+#define FAT_FIRST_CLUSTER                                                      2
 
 
 /**
@@ -132,7 +162,7 @@ typedef struct __attribute__((packed))
   uint8_t Name[8];           /*!< File name (8 chars, padded with spaces) */
   uint8_t Ext[3];            /*!< File extension (3 char, padded with spaces */
   uint8_t Attributes;        /*!< Combination of FAT32 file attributes */
-  uint8_t Reserved;
+  uint8_t Reserved;          /*!< FAT_CASE_LOWER_NAME and FAT_CASE_LOWER_EXT */
   uint8_t cTimeTenth;
   uint16_t cTime;
   uint16_t cDate;
@@ -171,7 +201,12 @@ typedef struct
   uint8_t  FatCopies[AFATS_MAX_PARTITIONS];
   uint32_t DataStartSector[AFATS_MAX_PARTITIONS];
   uint32_t SectorPerCluster[AFATS_MAX_PARTITIONS];
+  uint32_t ClusterCount[AFATS_MAX_PARTITIONS];
   uint32_t RootSector[AFATS_MAX_PARTITIONS];
+  uint32_t RootCluster[AFATS_MAX_PARTITIONS];
+  uint32_t FsInfoSector[AFATS_MAX_PARTITIONS];
+  uint32_t FreeCount[AFATS_MAX_PARTITIONS]; /*!< From FSInfo, kept up to date */
+  uint32_t NextFree[AFATS_MAX_PARTITIONS];  /*!< From FSInfo, kept up to date */
 }ReducedPartitionParameterTable_t;
 
 #endif /* AFATFS_TYPES_H */
@@ -0,0 +1,1143 @@
+/**
+ * @file  afatfs_test.c
+ * @date  17-October-2026
+ * @brief Tests run by ctest against a freshly formatted RAM disk, simulated
+ *        SD card or queued disk.
+ *
+ * Each test formats the disk, mounts it and checks what was written is read
+ * back: across cluster and extent boundaries in every file mode, with long
+ * names, in folders, on stream and ring files. The FAT copies are compared
+ * byte by byte after every AFATFS_Sync.
+ *
+ *   afatfs_test [ram|sim|queue]
+ *
+ * The sim backend uses the SD card timing of SIMDISK_DefaultConfig with a
+ * fixed seed, so every run polls the same way, and also makes chosen
+ * sectors fail (SIMDISK_AddFault). The queue backend serves the disk through
+ * Submit and Poll, ending the requests in flight out of order with a fixed
+ * seed. The exit code is the number of tests that failed.
+ *
+ * @author
+ * @author
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "afatfs.h"
+#include "map_host.h"
+#include "ramdisk.h"
+#include "simdisk.h"
+#include "queuedisk.h"
+#include "fatimage.h"
+
+
+#define TEST_PARTITION                                                         0
+#define TEST_SECTORS                                                       32768
+#define TEST_SECTOR_SIZE                                                     512
+#define TEST_PARTITION_START                                                2048
+#define TEST_ROOT_CLUSTER                                                      2
+#define TEST_SEED                                                             17
+
+/* A call still OPERATION_RUNNING after this many polls is taken as wedged */
+#define TEST_MAX_POLLS                                                10000000UL
+
+#define TEST_FILE_SIZE                                                    150000
+#define TEST_RING_SIZE                                                     32768
+#define TEST_INDEX_FILES                                                     300
+#define TEST_INDEX_SIZE                                                     1024
+
+/* Disks a test runs on, bit (1 << HOST_DISK_*) */
+#define TEST_ALL_DISKS                                                      0xFF
+
+
+/**
+ * @brief Calls Call until it is not OPERATION_RUNNING, or TEST_MAX_POLLS
+ *        times.
+ */
+#define TEST_POLL(Result, Call)                                                \
+  do{                                                                          \
+    uint32_t polls = 0;                                                        \
+    do{                                                                        \
+      (Result) = (Call);                                                       \
+    }while((Result) == OPERATION_RUNNING && ++polls < TEST_MAX_POLLS);         \
+  }while(0)
+
+
+/**
+ * @brief Fails the running test if Condition is false.
+ */
+#define TEST_CHECK(Condition)                                                  \
+  do{                                                                          \
+    if(!(Condition)){                                                          \
+      printf("  %s:%d: %s\n", __FILE__, __LINE__, #Condition);                 \
+      return 1;                                                                \
+    }                                                                          \
+  }while(0)
+
+
+/**
+ * @brief Polls Call and fails the running test unless it answers.
+ */
+#define TEST_DO(Result, Call)                                                  \
+  do{                                                                          \
+    TEST_POLL(Result, Call);                                                   \
+    if((Result) != ANSWERED_REQUEST){                                          \
+      printf("  %s:%d: %s returned %d\n", __FILE__, __LINE__, #Call,           \
+          (int)(Result));                                                      \
+      return 1;                                                                \
+    }                                                                          \
+  }while(0)
+
+
+typedef struct
+{
+  const char *Name;
+  int (*Run)(void);
+  uint8_t Disks; /*!< TEST_ALL_DISKS or bits (1 << HOST_DISK_*) */
+}TestCase_t;
+
+
+static uint8_t TEST_Disk = HOST_DISK_RAM;
+static uint8_t *TEST_Memory;
+static uint8_t TEST_Data[TEST_FILE_SIZE];
+static uint8_t TEST_Read[TEST_FILE_SIZE];
+static uint32_t TEST_Random;
+static AfatfsDirIndex_t TEST_Index[TEST_INDEX_SIZE];
+
+
+
+static uint32_t TEST_Get32(const uint8_t *Data)
+{
+  return (uint32_t)Data[0] | ((uint32_t)Data[1] << 8) |
+      ((uint32_t)Data[2] << 16) | ((uint32_t)Data[3] << 24);
+}
+
+
+
+static void TEST_Put32(uint8_t *Data, uint32_t Value)
+{
+  Data[0] = Value & 0xFF;
+  Data[1] = (Value >> 8) & 0xFF;
+  Data[2] = (Value >> 16) & 0xFF;
+  Data[3] = (Value >> 24) & 0xFF;
+}
+
+
+
+/* Same sequence on every run, so failures can be reproduced */
+static uint32_t TEST_Rand(void)
+{
+  TEST_Random = TEST_Random * 1103515245UL + 12345UL;
+
+  return (TEST_Random >> 16) & 0x7FFF;
+}
+
+
+
+static void TEST_Fill(uint8_t *Data, uint32_t Size, uint32_t Seed)
+{
+  uint32_t i;
+
+  for(i = 0; i < Size; i++){
+    Data[i] = (uint8_t)((i * 131) + (i >> 9) + (Seed * 7));
+  }
+}
+
+
+
+static uint8_t *TEST_Sector(uint32_t Sector)
+{
+  return TEST_Memory + ((size_t)Sector * TEST_SECTOR_SIZE);
+}
+
+
+
+static uint8_t *TEST_Boot(void)
+{
+  return TEST_Sector(TEST_PARTITION_START);
+}
+
+
+
+static uint32_t TEST_FatSize(void)
+{
+  return TEST_Get32(&TEST_Boot()[36]);
+}
+
+
+
+static uint32_t TEST_FatSector(uint8_t Copy)
+{
+  uint8_t *boot = TEST_Boot();
+  uint32_t reserved = boot[14] | ((uint32_t)boot[15] << 8);
+
+  return TEST_PARTITION_START + reserved + (Copy * TEST_FatSize());
+}
+
+
+
+static uint32_t TEST_ClusterSector(uint32_t Cluster)
+{
+  uint8_t *boot = TEST_Boot();
+
+  return TEST_FatSector(boot[16]) + ((Cluster - 2) * boot[13]);
+}
+
+
+
+static uint8_t *TEST_Fat(uint8_t Copy)
+{
+  return TEST_Sector(TEST_FatSector(Copy));
+}
+
+
+
+static uint8_t *TEST_Cluster(uint32_t Cluster)
+{
+  return TEST_Sector(TEST_ClusterSector(Cluster));
+}
+
+
+
+static uint8_t TEST_isFatMirrored(void)
+{
+  return memcmp(TEST_Fat(0), TEST_Fat(1),
+      (size_t)TEST_FatSize() * TEST_SECTOR_SIZE) == 0;
+}
+
+
+
+/*
+ * Adds a folder to the formatted image, before it is mounted, as the library
+ * only creates files. Parent must fit one cluster.
+ */
+static void TEST_AddFolder(uint32_t Parent, const char *Name,
+    uint32_t Cluster)
+{
+  uint8_t *entry = TEST_Cluster(Parent), *fsInfo;
+  uint32_t size = TEST_Boot()[13] * TEST_SECTOR_SIZE;
+  uint8_t copy;
+
+  while(entry[0] != 0){
+    entry += 32;
+  }
+  memcpy(entry, Name, 11);
+  entry[11] = 0x10;
+  entry[20] = (Cluster >> 16) & 0xFF;
+  entry[21] = (Cluster >> 24) & 0xFF;
+  entry[26] = Cluster & 0xFF;
+  entry[27] = (Cluster >> 8) & 0xFF;
+
+  entry = TEST_Cluster(Cluster);
+  memset(entry, 0, size);
+  memcpy(entry, ".          ", 11);
+  entry[11] = 0x10;
+  entry[26] = Cluster & 0xFF;
+  entry[27] = (Cluster >> 8) & 0xFF;
+  memcpy(entry + 32, "..         ", 11);
+  entry[32 + 11] = 0x10;
+  if(Parent != TEST_ROOT_CLUSTER){
+    entry[32 + 26] = Parent & 0xFF;
+    entry[32 + 27] = (Parent >> 8) & 0xFF;
+  }
+
+  for(copy = 0; copy < 2; copy++){
+    TEST_Put32(TEST_Fat(copy) + (4 * Cluster), 0x0FFFFFFF);
+  }
+  fsInfo = TEST_Sector(TEST_PARTITION_START + 1);
+  TEST_Put32(&fsInfo[488], TEST_Get32(&fsInfo[488]) - 1);
+  TEST_Put32(&fsInfo[492], Cluster + 1);
+}
+
+
+
+static EStatus_t TEST_Format(uint8_t SectorsPerCluster)
+{
+  EStatus_t returncode;
+  SimdiskConfig_t config;
+
+  returncode = FATIMAGE_Format(TEST_Memory, TEST_SECTORS, SectorsPerCluster);
+  if(returncode == ANSWERED_REQUEST){
+    if(TEST_Disk == HOST_DISK_SIM){
+      SIMDISK_DefaultConfig(&config);
+      config.Seed = TEST_SEED;
+      returncode = SIMDISK_Setup(TEST_Memory, TEST_SECTORS, &config);
+      SIMDISK_ClearFaults();
+    }else if(TEST_Disk == HOST_DISK_QUEUE){
+      returncode = QUEUEDISK_Setup(TEST_Memory, TEST_SECTORS, TEST_SEED);
+    }else{
+      returncode = RAMDISK_Setup(TEST_Memory, TEST_SECTORS);
+    }
+  }
+  AFATFS_SetPreallocSize(TEST_Disk, 0);
+  AFATFS_SetFatMirror(TEST_Disk, 1);
+
+  return returncode;
+}
+
+
+
+static EStatus_t TEST_Mount(void)
+{
+  EStatus_t returncode;
+
+  TEST_POLL(returncode, AFATFS_Mount(TEST_Disk));
+
+  return returncode;
+}
+
+
+
+/* Reads the whole file from the start in parts of Part bytes */
+static int TEST_ReadBack(uint8_t FileHandle, const uint8_t *Expected,
+    uint32_t Size, uint32_t Part)
+{
+  EStatus_t result;
+  uint32_t done = 0, got;
+
+  TEST_CHECK(AFATFS_Seek(FileHandle, 0) == ANSWERED_REQUEST);
+  while(done < Size){
+    TEST_DO(result, AFATFS_Read(FileHandle, TEST_Read + done, Part, &got));
+    TEST_CHECK(got != 0 && got <= Part);
+    done += got;
+  }
+  TEST_CHECK(done == Size);
+  TEST_POLL(result, AFATFS_Read(FileHandle, TEST_Read, 1, &got));
+  TEST_CHECK(result == ERR_FAILED);
+  TEST_CHECK(memcmp(TEST_Read, Expected, Size) == 0);
+
+  return 0;
+}
+
+
+
+static int TEST_Sync(void)
+{
+  EStatus_t result;
+
+  TEST_DO(result, AFATFS_Sync(TEST_Disk));
+  TEST_CHECK(TEST_isFatMirrored());
+
+  return 0;
+}
+
+
+
+/*
+ * Two files written in turns, so their clusters interleave and each one has
+ * more runs than the extent cache holds. Parts of many sizes land on every
+ * offset of a sector and cross cluster boundaries.
+ */
+static int TEST_RoundTrip(uint8_t Mode)
+{
+  static const uint32_t part[] = {1, 511, 512, 513, 1000, 4096, 3333, 700};
+  EStatus_t result;
+  uint8_t handle[2];
+  uint32_t done = 0, size, i;
+  uint8_t f;
+
+  TEST_CHECK(TEST_Format(1) == ANSWERED_REQUEST);
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_Fill(TEST_Data, TEST_FILE_SIZE, Mode);
+
+  TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "A.BIN", Mode,
+      &handle[0]));
+  TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "B.BIN", Mode,
+      &handle[1]));
+  for(i = 0; done < TEST_FILE_SIZE; i++){
+    size = part[i % (sizeof(part) / sizeof(part[0]))];
+    if(size > TEST_FILE_SIZE - done){
+      size = TEST_FILE_SIZE - done;
+    }
+    for(f = 0; f < 2; f++){
+      TEST_DO(result, AFATFS_Write(handle[f], TEST_Data + done, size));
+    }
+    done += size;
+  }
+  for(f = 0; f < 2; f++){
+    TEST_CHECK(TEST_ReadBack(handle[f], TEST_Data, TEST_FILE_SIZE, 777) == 0);
+  }
+
+  /* Overwriting across a cluster boundary keeps the size */
+  for(i = 0; i < 3000; i++){
+    TEST_Data[1000 + i] ^= 0x5A;
+  }
+  TEST_CHECK(AFATFS_Seek(handle[0], 1000) == ANSWERED_REQUEST);
+  TEST_DO(result, AFATFS_Write(handle[0], TEST_Data + 1000, 3000));
+  for(f = 0; f < 2; f++){
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle[f]));
+  }
+  TEST_CHECK(TEST_Sync() == 0);
+
+  /* ... and everything is found again after a new mount */
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, "A.BIN", Mode,
+      &handle[0]));
+  TEST_CHECK(TEST_ReadBack(handle[0], TEST_Data, TEST_FILE_SIZE, 4096) == 0);
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle[0]));
+
+  return 0;
+}
+
+
+
+static int TEST_RoundTripDefault(void)
+{
+  return TEST_RoundTrip(0);
+}
+
+
+
+static int TEST_RoundTripBuffered(void)
+{
+  return TEST_RoundTrip(AFATFS_FILE_MODE_BUFFERED);
+}
+
+
+
+static int TEST_RoundTripDirect(void)
+{
+  return TEST_RoundTrip(AFATFS_FILE_MODE_DIRECT);
+}
+
+
+
+/* Enough long names to fill the root cluster, which then grows */
+static int TEST_LongNames(void)
+{
+  EStatus_t result;
+  char name[40];
+  uint8_t handle;
+  uint8_t i;
+
+  TEST_CHECK(TEST_Format(1) == ANSWERED_REQUEST);
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+
+  for(i = 0; i < 12; i++){
+    sprintf(name, "Flight log 2026-10-%02u.csv", (unsigned)i);
+    TEST_Fill(TEST_Data, 1000, i);
+    TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, name, 0,
+        &handle));
+    TEST_DO(result, AFATFS_Write(handle, TEST_Data, 1000));
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  }
+  TEST_CHECK(TEST_Sync() == 0);
+
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  for(i = 0; i < 12; i++){
+    /* Long names are matched ignoring the case */
+    sprintf(name, "FLIGHT LOG 2026-10-%02u.CSV", (unsigned)i);
+    TEST_Fill(TEST_Data, 1000, i);
+    TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, name, 0,
+        &handle));
+    TEST_CHECK(TEST_ReadBack(handle, TEST_Data, 1000, 300) == 0);
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  }
+  TEST_POLL(result, AFATFS_Open(TEST_Disk, TEST_PARTITION,
+      "Flight log 2026-10-99.csv", 0, &handle));
+  TEST_CHECK(result >= RETURN_ERROR_VALUE);
+
+  return 0;
+}
+
+
+
+/* Name of the files of the index test, one in four with an 8.3 name */
+static void TEST_IndexName(char *Name, uint32_t File)
+{
+  if(File % 4 == 0){
+    sprintf(Name, "IDX%05u.BIN", (unsigned)File);
+  }else{
+    sprintf(Name, "Index test file %03u.dat", (unsigned)File);
+  }
+}
+
+
+
+static int TEST_DirIndexRun(uint32_t Size)
+{
+  EStatus_t result;
+  char name[40];
+  uint32_t i, used;
+  uint8_t handle;
+
+  TEST_CHECK(TEST_Format(1) == ANSWERED_REQUEST);
+  TEST_CHECK(AFATFS_SetDirIndex(TEST_Disk, TEST_PARTITION, TEST_Index,
+      Size) == ANSWERED_REQUEST);
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+
+  /* Each file is found right after its create, and so is an older one */
+  for(i = 0; i < TEST_INDEX_FILES; i++){
+    TEST_IndexName(name, i);
+    TEST_Fill(TEST_Data, 700, i);
+    TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, name, 0,
+        &handle));
+    TEST_DO(result, AFATFS_Write(handle, TEST_Data, 700));
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+    TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, name, 0,
+        &handle));
+    TEST_CHECK(TEST_ReadBack(handle, TEST_Data, 700, 700) == 0);
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+    TEST_IndexName(name, i / 2);
+    TEST_Fill(TEST_Data, 700, i / 2);
+    TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, name, 0,
+        &handle));
+    TEST_CHECK(TEST_ReadBack(handle, TEST_Data, 700, 700) == 0);
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  }
+  TEST_CHECK(TEST_Sync() == 0);
+  if(Size >= 2 * TEST_INDEX_FILES){
+    /* One slot per name, nothing was dropped */
+    for(i = 0, used = 0; i < Size; i++){
+      used += (TEST_Index[i].Entry != 0xFFFF);
+    }
+    TEST_CHECK(used == TEST_INDEX_FILES + TEST_INDEX_FILES * 3 / 4);
+  }
+
+  /* Built by the mount, then by the first open once given again */
+  for(i = 0; i < 2; i++){
+    if(i == 0){
+      TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+    }else{
+      TEST_CHECK(AFATFS_SetDirIndex(TEST_Disk, TEST_PARTITION, TEST_Index,
+          Size) == ANSWERED_REQUEST);
+    }
+    TEST_POLL(result, AFATFS_Open(TEST_Disk, TEST_PARTITION,
+        "Index test file 999.dat", 0, &handle));
+    TEST_CHECK(result >= RETURN_ERROR_VALUE);
+    TEST_POLL(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, "IDX99999.BIN",
+        0, &handle));
+    TEST_CHECK(result >= RETURN_ERROR_VALUE);
+  }
+  for(i = 0; i < TEST_INDEX_FILES; i++){
+    TEST_IndexName(name, i);
+    TEST_Fill(TEST_Data, 700, i);
+    TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, name, 0,
+        &handle));
+    TEST_CHECK(TEST_ReadBack(handle, TEST_Data, 700, 300) == 0);
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  }
+
+  return 0;
+}
+
+
+
+/*
+ * Files created and opened with the root directory index, then found again
+ * after a mount. A table too small for the files is dropped when full and
+ * the directory is read as before.
+ */
+static int TEST_DirIndex(void)
+{
+  int failed;
+
+  failed = TEST_DirIndexRun(TEST_INDEX_SIZE);
+  if(failed == 0){
+    failed = TEST_DirIndexRun(TEST_INDEX_FILES / 4);
+  }
+  AFATFS_SetDirIndex(TEST_Disk, TEST_PARTITION, NULL, 0);
+
+  return failed;
+}
+
+
+
+/* Entry of the root cluster with the given short name, NULL if none */
+static uint8_t *TEST_RootEntry(const char *Name)
+{
+  uint8_t *entry = TEST_Cluster(TEST_ROOT_CLUSTER);
+  uint32_t size = TEST_Boot()[13] * TEST_SECTOR_SIZE, i;
+
+  for(i = 0; i < size && entry[i] != 0; i += 32){
+    if(entry[i] != 0xE5 && entry[i + 11] != 0x0F &&
+        memcmp(&entry[i], Name, 11) == 0)
+    {
+      return &entry[i];
+    }
+  }
+
+  return NULL;
+}
+
+
+
+/*
+ * 8.3 names are stored in upper case with the lower case flags, a name with
+ * both cases gets a long name. Any case of a name finds the same file.
+ */
+static int TEST_NameCase(void)
+{
+  static char *taken[] = {"f3.txt", "F3.txt", "f3.TXT", "lower.TXT",
+      "MIXED.TXT", "mixed.txt"};
+  EStatus_t result;
+  uint8_t *entry;
+  uint8_t handle;
+  uint8_t i;
+
+  TEST_CHECK(TEST_Format(1) == ANSWERED_REQUEST);
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+
+  TEST_Fill(TEST_Data, 3000, 3);
+  TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "F3.TXT", 0,
+      &handle));
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "lower.txt", 0,
+      &handle));
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "Mixed.Txt", 0,
+      &handle));
+  TEST_DO(result, AFATFS_Write(handle, TEST_Data, 3000));
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  for(i = 0; i < sizeof(taken) / sizeof(taken[0]); i++){
+    TEST_POLL(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, taken[i], 0,
+        &handle));
+    TEST_CHECK(result >= RETURN_ERROR_VALUE);
+  }
+  TEST_CHECK(TEST_Sync() == 0);
+
+  entry = TEST_RootEntry("F3      TXT");
+  TEST_CHECK(entry != NULL && entry[12] == 0x00);
+  entry = TEST_RootEntry("LOWER   TXT");
+  TEST_CHECK(entry != NULL && entry[12] == 0x18 && entry[-32 + 11] != 0x0F);
+  entry = TEST_RootEntry("MIXED   TXT");
+  TEST_CHECK(entry != NULL && entry[12] == 0x00 && entry[-32 + 11] == 0x0F);
+  TEST_CHECK(memcmp(TEST_Cluster(TEST_ROOT_CLUSTER) + 3 * 32, entry, 11) == 0);
+
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, "mixed.TXT", 0,
+      &handle));
+  TEST_CHECK(TEST_ReadBack(handle, TEST_Data, 3000, 1000) == 0);
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, "LOWER.txt", 0,
+      &handle));
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+
+  return 0;
+}
+
+
+
+static int TEST_Folders(void)
+{
+  static char *path[] = {"LOGS/RUN01.CSV", "LOGS/2026/RUN02.CSV",
+      "LOGS/2026/A longer name.csv"};
+  EStatus_t result;
+  uint8_t handle;
+  uint8_t i;
+
+  TEST_CHECK(TEST_Format(1) == ANSWERED_REQUEST);
+  TEST_AddFolder(TEST_ROOT_CLUSTER, "LOGS       ", 3);
+  TEST_AddFolder(3, "2026       ", 4);
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+
+  for(i = 0; i < 3; i++){
+    TEST_Fill(TEST_Data, 5000, i);
+    TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, path[i], 0,
+        &handle));
+    TEST_DO(result, AFATFS_Write(handle, TEST_Data, 5000));
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  }
+  TEST_POLL(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "NOPE/X.TXT", 0,
+      &handle));
+  TEST_CHECK(result >= RETURN_ERROR_VALUE);
+  TEST_CHECK(TEST_Sync() == 0);
+
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  for(i = 0; i < 3; i++){
+    TEST_Fill(TEST_Data, 5000, i);
+    TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, path[i], 0,
+        &handle));
+    TEST_CHECK(TEST_ReadBack(handle, TEST_Data, 5000, 512) == 0);
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  }
+  TEST_POLL(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, "RUN01.CSV", 0,
+      &handle));
+  TEST_CHECK(result >= RETURN_ERROR_VALUE);
+
+  return 0;
+}
+
+
+
+/*
+ * The file takes 16 clusters at a time and gives back the ones it did not
+ * use when closed, so the free count kept matches a count of the FAT.
+ */
+static int TEST_Stream(void)
+{
+  EStatus_t result;
+  uint32_t done = 0, size, kept, counted;
+  uint8_t handle;
+
+  TEST_CHECK(TEST_Format(1) == ANSWERED_REQUEST);
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_CHECK(AFATFS_SetPreallocSize(TEST_Disk, 8192) == ANSWERED_REQUEST);
+  TEST_Fill(TEST_Data, TEST_FILE_SIZE, 3);
+  TEST_Random = TEST_SEED;
+
+  TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "S.BIN",
+      AFATFS_FILE_MODE_STREAM, &handle));
+  while(done < TEST_FILE_SIZE){
+    size = TEST_Rand() % 3000;
+    if(size > TEST_FILE_SIZE - done){
+      size = TEST_FILE_SIZE - done;
+    }
+    TEST_DO(result, AFATFS_Write(handle, TEST_Data + done, size));
+    done += size;
+  }
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  TEST_CHECK(TEST_Sync() == 0);
+
+  TEST_CHECK(AFATFS_GetFreeClusters(TEST_Disk, TEST_PARTITION, &kept) ==
+      ANSWERED_REQUEST);
+  TEST_DO(result, AFATFS_CountFreeClusters(TEST_Disk, TEST_PARTITION,
+      &counted));
+  TEST_CHECK(kept == counted);
+
+  TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, "S.BIN", 0,
+      &handle));
+  TEST_CHECK(TEST_ReadBack(handle, TEST_Data, TEST_FILE_SIZE, 5000) == 0);
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+
+  return 0;
+}
+
+
+
+/* The data between the tail and the head is the last data written */
+static int TEST_RingCheck(uint8_t FileHandle, uint32_t Written)
+{
+  EStatus_t result;
+  uint32_t head, tail, used, got, done = 0;
+
+  TEST_CHECK(AFATFS_GetRingOffsets(FileHandle, &head, &tail) ==
+      ANSWERED_REQUEST);
+  used = (head >= tail) ? head - tail :
+      (TEST_RING_SIZE - tail) + (head - TEST_SECTOR_SIZE);
+  TEST_CHECK(used <= Written);
+  TEST_CHECK(Written < TEST_RING_SIZE || used + (2 * TEST_SECTOR_SIZE) >
+      TEST_RING_SIZE - TEST_SECTOR_SIZE);
+
+  if(head < tail){
+    TEST_CHECK(AFATFS_Seek(FileHandle, tail) == ANSWERED_REQUEST);
+    TEST_DO(result, AFATFS_Read(FileHandle, TEST_Read, TEST_RING_SIZE - tail,
+        &got));
+    done = got;
+    tail = TEST_SECTOR_SIZE;
+  }
+  if(head > tail){
+    TEST_CHECK(AFATFS_Seek(FileHandle, tail) == ANSWERED_REQUEST);
+    TEST_DO(result, AFATFS_Read(FileHandle, TEST_Read + done, head - tail,
+        &got));
+    done += got;
+  }
+  TEST_CHECK(done == used);
+  TEST_CHECK(memcmp(TEST_Read, TEST_Data + Written - used, used) == 0);
+
+  return 0;
+}
+
+
+
+static int TEST_Ring(void)
+{
+  EStatus_t result;
+  uint32_t done = 0, size, head, tail, head2, tail2;
+  uint8_t handle;
+
+  TEST_CHECK(TEST_Format(1) == ANSWERED_REQUEST);
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_CHECK(AFATFS_SetPreallocSize(TEST_Disk, TEST_RING_SIZE) ==
+      ANSWERED_REQUEST);
+  TEST_Fill(TEST_Data, TEST_FILE_SIZE, 5);
+  TEST_Random = TEST_SEED;
+
+  TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "RING.LOG",
+      AFATFS_FILE_MODE_RING, &handle));
+  TEST_CHECK(TEST_RingCheck(handle, 0) == 0);
+  /* Several times around the ring */
+  while(done < 100000){
+    size = TEST_Rand() % 2000;
+    TEST_DO(result, AFATFS_Write(handle, TEST_Data + done, size));
+    done += size;
+  }
+  TEST_CHECK(TEST_RingCheck(handle, done) == 0);
+  TEST_CHECK(AFATFS_GetRingOffsets(handle, &head, &tail) == ANSWERED_REQUEST);
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  TEST_CHECK(TEST_Sync() == 0);
+
+  /* The header sector keeps where the data is */
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, "RING.LOG",
+      AFATFS_FILE_MODE_RING, &handle));
+  TEST_CHECK(AFATFS_GetRingOffsets(handle, &head2, &tail2) ==
+      ANSWERED_REQUEST);
+  TEST_CHECK(head == head2 && tail == tail2);
+  TEST_CHECK(TEST_RingCheck(handle, done) == 0);
+  while(done < TEST_FILE_SIZE - 2000){
+    size = TEST_Rand() % 2000;
+    TEST_DO(result, AFATFS_Write(handle, TEST_Data + done, size));
+    done += size;
+  }
+  TEST_CHECK(TEST_RingCheck(handle, done) == 0);
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  TEST_CHECK(TEST_Sync() == 0);
+
+  return 0;
+}
+
+
+
+/* Single-FAT mode leaves the copies behind until AFATFS_ResyncFat */
+static int TEST_FatMirror(void)
+{
+  EStatus_t result;
+  uint8_t handle;
+
+  TEST_CHECK(TEST_Format(1) == ANSWERED_REQUEST);
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_Fill(TEST_Data, TEST_FILE_SIZE, 9);
+
+  TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "M.BIN", 0,
+      &handle));
+  TEST_DO(result, AFATFS_Write(handle, TEST_Data, 20000));
+  TEST_CHECK(TEST_Sync() == 0);
+
+  TEST_CHECK(AFATFS_SetFatMirror(TEST_Disk, 0) == ANSWERED_REQUEST);
+  TEST_DO(result, AFATFS_Write(handle, TEST_Data + 20000, 100000));
+  TEST_DO(result, AFATFS_Sync(TEST_Disk));
+  TEST_CHECK(!TEST_isFatMirrored());
+  TEST_DO(result, AFATFS_ResyncFat(TEST_Disk, TEST_PARTITION, 0));
+  TEST_CHECK(TEST_isFatMirrored());
+
+  /* A copy changed behind the library's back is rewritten whole */
+  TEST_Fat(1)[TEST_FatSize() * TEST_SECTOR_SIZE - 1] ^= 0xFF;
+  TEST_DO(result, AFATFS_ResyncFat(TEST_Disk, TEST_PARTITION, 1));
+  TEST_CHECK(TEST_isFatMirrored());
+
+  TEST_CHECK(AFATFS_SetFatMirror(TEST_Disk, 1) == ANSWERED_REQUEST);
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  TEST_CHECK(TEST_Sync() == 0);
+
+  return 0;
+}
+
+
+
+/*
+ * Calls given up after some polls leave nothing behind: a cache sector
+ * another call started loading is still loaded for everyone else.
+ */
+static int TEST_Abandon(void)
+{
+  EStatus_t result;
+  uint32_t polls, got, n;
+  uint8_t handle, other;
+
+  TEST_CHECK(TEST_Format(1) == ANSWERED_REQUEST);
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_Fill(TEST_Data, TEST_FILE_SIZE, 13);
+
+  /* A on another FAT sector than the start of B */
+  TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "B.BIN", 0,
+      &handle));
+  TEST_DO(result, AFATFS_Write(handle, TEST_Data, TEST_FILE_SIZE));
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "A.BIN", 0,
+      &handle));
+  TEST_DO(result, AFATFS_Write(handle, TEST_Data, 20000));
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  TEST_CHECK(TEST_Sync() == 0);
+
+  /* A far read of B polled a few times, then A is read before and after B
+   * is closed */
+  for(polls = 1; polls <= 20; polls++){
+    TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+    TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, "A.BIN", 0,
+        &handle));
+    TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, "B.BIN", 0,
+        &other));
+    TEST_CHECK(AFATFS_Seek(other, TEST_FILE_SIZE - 1000) ==
+        ANSWERED_REQUEST);
+    for(got = 0, n = 0; n < polls; n++){
+      if(AFATFS_Read(other, TEST_Read, 1000, &got) != OPERATION_RUNNING){
+        break;
+      }
+    }
+    TEST_CHECK(TEST_ReadBack(handle, TEST_Data, 20000, 700) == 0);
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &other));
+    TEST_CHECK(TEST_ReadBack(handle, TEST_Data, 20000, 3000) == 0);
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  }
+
+  return 0;
+}
+
+
+
+/*
+ * Two files written in turns, one of them closed after its write was given
+ * up at every point: the other one still grows, so nothing of the closed
+ * file is left holding the disk.
+ */
+static int TEST_AbandonClose(void)
+{
+  EStatus_t result, other;
+  char name[16];
+  uint32_t turn, n;
+  uint8_t handle[2];
+  uint8_t mode;
+
+  TEST_CHECK(TEST_Format(1) == ANSWERED_REQUEST);
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_CHECK(AFATFS_SetPreallocSize(TEST_Disk, 8192) == ANSWERED_REQUEST);
+  TEST_Fill(TEST_Data, TEST_FILE_SIZE, 15);
+
+  for(turn = 1; turn <= 40; turn++){
+    /* Stream files hold the disk while they take and chain their run */
+    mode = (turn % 2) ? AFATFS_FILE_MODE_STREAM : 0;
+    sprintf(name, "A%02u.BIN", (unsigned)turn);
+    TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, name, mode,
+        &handle[0]));
+    sprintf(name, "B%02u.BIN", (unsigned)turn);
+    TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, name, mode,
+        &handle[1]));
+    other = OPERATION_RUNNING;
+    for(n = 0; n < turn; n++){
+      AFATFS_Write(handle[0], TEST_Data, 20000);
+      if(other == OPERATION_RUNNING){
+        other = AFATFS_Write(handle[1], TEST_Data + turn, 20000);
+      }
+    }
+    /* B may hold the disk, it goes on while A closes */
+    do{
+      result = AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle[0]);
+      TEST_CHECK(result == ANSWERED_REQUEST || result == OPERATION_RUNNING);
+      if(other == OPERATION_RUNNING){
+        other = AFATFS_Write(handle[1], TEST_Data + turn, 20000);
+      }
+    }while(result == OPERATION_RUNNING && ++n < TEST_MAX_POLLS);
+    TEST_CHECK(result == ANSWERED_REQUEST);
+    if(other == OPERATION_RUNNING){
+      TEST_POLL(other, AFATFS_Write(handle[1], TEST_Data + turn, 20000));
+    }
+    TEST_CHECK(other == ANSWERED_REQUEST);
+    TEST_DO(result, AFATFS_Write(handle[1], TEST_Data + turn + 20000,
+        10000));
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle[1]));
+  }
+  TEST_CHECK(TEST_Sync() == 0);
+
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  for(turn = 1; turn <= 40; turn++){
+    sprintf(name, "B%02u.BIN", (unsigned)turn);
+    TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, name, 0,
+        &handle[1]));
+    TEST_CHECK(TEST_ReadBack(handle[1], TEST_Data + turn, 30000, 4000) == 0);
+    TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle[1]));
+  }
+
+  return 0;
+}
+
+
+
+/*
+ * Device errors on chosen sectors reach the caller, and the same calls
+ * succeed once the fault is gone: nothing is left waiting for the failed
+ * command.
+ */
+static int TEST_FaultRun(SimdiskStats_t *Stats, uint32_t *Micros)
+{
+  EStatus_t result;
+  uint32_t data, got;
+  uint8_t handle, other;
+
+  TEST_CHECK(TEST_Format(1) == ANSWERED_REQUEST);
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_Fill(TEST_Data, TEST_FILE_SIZE, 11);
+  TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "F.BIN", 0,
+      &handle));
+  TEST_DO(result, AFATFS_Write(handle, TEST_Data, 20000));
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  TEST_CHECK(TEST_Sync() == 0);
+  /* First file of a blank disk, right after the root cluster */
+  data = TEST_ClusterSector(TEST_ROOT_CLUSTER + 1);
+
+  /* A read fails once */
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_CHECK(SIMDISK_AddFault(data, 1, SIMDISK_FAULT_READ, ERR_DEVICE, 1) ==
+      ANSWERED_REQUEST);
+  TEST_DO(result, AFATFS_Open(TEST_Disk, TEST_PARTITION, "F.BIN", 0,
+      &handle));
+  TEST_POLL(result, AFATFS_Read(handle, TEST_Read, 512, &got));
+  TEST_CHECK(result == ERR_DEVICE);
+  TEST_CHECK(TEST_ReadBack(handle, TEST_Data, 20000, 512) == 0);
+
+  /* A write fails until the fault is cleared, meanwhile other files go on */
+  TEST_CHECK(SIMDISK_AddFault(data, 1, SIMDISK_FAULT_WRITE, ERR_DEVICE, 0) ==
+      ANSWERED_REQUEST);
+  TEST_Data[0] ^= 0xFF;
+  TEST_CHECK(AFATFS_Seek(handle, 0) == ANSWERED_REQUEST);
+  TEST_POLL(result, AFATFS_Write(handle, TEST_Data, 512));
+  TEST_CHECK(result == ERR_DEVICE);
+  TEST_DO(result, AFATFS_Create(TEST_Disk, TEST_PARTITION, "G.BIN", 0,
+      &other));
+  TEST_DO(result, AFATFS_Write(other, TEST_Data, 3000));
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &other));
+  SIMDISK_ClearFaults();
+  TEST_CHECK(AFATFS_Seek(handle, 0) == ANSWERED_REQUEST);
+  TEST_DO(result, AFATFS_Write(handle, TEST_Data, 512));
+  TEST_CHECK(TEST_ReadBack(handle, TEST_Data, 20000, 4096) == 0);
+
+  /* Writing the second FAT fails once, the next sync copies it again */
+  TEST_DO(result, AFATFS_Write(handle, TEST_Data + 20000, 20000));
+  TEST_CHECK(SIMDISK_AddFault(TEST_FatSector(1), 1, SIMDISK_FAULT_WRITE,
+      ERR_DEVICE, 1) == ANSWERED_REQUEST);
+  TEST_POLL(result, AFATFS_Sync(TEST_Disk));
+  TEST_CHECK(result == ERR_DEVICE);
+  TEST_CHECK(!TEST_isFatMirrored());
+  TEST_CHECK(TEST_Sync() == 0);
+  TEST_DO(result, AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle));
+  TEST_CHECK(TEST_Sync() == 0);
+
+  SIMDISK_GetStats(Stats, 0);
+  TEST_CHECK(Stats->Faults == 3);
+  *Micros = SIMDISK_Micros();
+
+  return 0;
+}
+
+
+
+/* Same seed and faults, same commands and polls on every run */
+static int TEST_Faults(void)
+{
+  SimdiskStats_t first, second;
+  uint32_t firstMicros, secondMicros;
+
+  TEST_CHECK(TEST_FaultRun(&first, &firstMicros) == 0);
+  TEST_CHECK(TEST_FaultRun(&second, &secondMicros) == 0);
+  TEST_CHECK(first.Commands == second.Commands &&
+      first.Polls == second.Polls && firstMicros == secondMicros);
+
+  return 0;
+}
+
+
+
+/*
+ * Two files written in turns on the queued disk: their transfers are in
+ * flight together, end out of order and are sometimes refused by a full
+ * queue, and both files read back.
+ */
+static int TEST_Queue(void)
+{
+  QueuediskStats_t stats;
+  EStatus_t result[2];
+  uint32_t n;
+  uint8_t handle[2];
+
+  TEST_CHECK(TEST_Format(1) == ANSWERED_REQUEST);
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_Fill(TEST_Data, TEST_FILE_SIZE, 19);
+  QUEUEDISK_GetStats(NULL, 1);
+
+  TEST_DO(result[0], AFATFS_Create(TEST_Disk, TEST_PARTITION, "A.BIN",
+      AFATFS_FILE_MODE_DIRECT, &handle[0]));
+  TEST_DO(result[1], AFATFS_Create(TEST_Disk, TEST_PARTITION, "B.BIN", 0,
+      &handle[1]));
+  result[0] = OPERATION_RUNNING;
+  result[1] = OPERATION_RUNNING;
+  for(n = 0; n < TEST_MAX_POLLS && (result[0] == OPERATION_RUNNING ||
+      result[1] == OPERATION_RUNNING); n++)
+  {
+    if(result[0] == OPERATION_RUNNING){
+      result[0] = AFATFS_Write(handle[0], TEST_Data, 100000);
+    }
+    if(result[1] == OPERATION_RUNNING){
+      result[1] = AFATFS_Write(handle[1], TEST_Data + 7, 100000);
+    }
+  }
+  TEST_CHECK(result[0] == ANSWERED_REQUEST && result[1] == ANSWERED_REQUEST);
+  TEST_DO(result[0], AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle[0]));
+  TEST_DO(result[1], AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle[1]));
+  TEST_CHECK(TEST_Sync() == 0);
+
+  QUEUEDISK_GetStats(&stats, 0);
+  TEST_CHECK(stats.MaxInFlight > 1);
+  TEST_CHECK(stats.Reordered > 0);
+  TEST_CHECK(stats.Busy > 0);
+
+  TEST_CHECK(TEST_Mount() == ANSWERED_REQUEST);
+  TEST_DO(result[0], AFATFS_Open(TEST_Disk, TEST_PARTITION, "A.BIN", 0,
+      &handle[0]));
+  TEST_CHECK(TEST_ReadBack(handle[0], TEST_Data, 100000, 5000) == 0);
+  TEST_DO(result[0], AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle[0]));
+  TEST_DO(result[1], AFATFS_Open(TEST_Disk, TEST_PARTITION, "B.BIN", 0,
+      &handle[1]));
+  TEST_CHECK(TEST_ReadBack(handle[1], TEST_Data + 7, 100000, 5000) == 0);
+  TEST_DO(result[1], AFATFS_Close(TEST_Disk, TEST_PARTITION, &handle[1]));
+
+  return 0;
+}
+
+
+
+static const TestCase_t TEST_Cases[] = {
+  {"round trip, default mode", TEST_RoundTripDefault, TEST_ALL_DISKS},
+  {"round trip, buffered", TEST_RoundTripBuffered, TEST_ALL_DISKS},
+  {"round trip, direct", TEST_RoundTripDirect, TEST_ALL_DISKS},
+  {"long names", TEST_LongNames, TEST_ALL_DISKS},
+  {"root directory index", TEST_DirIndex, TEST_ALL_DISKS},
+  {"name case", TEST_NameCase, TEST_ALL_DISKS},
+  {"folders", TEST_Folders, TEST_ALL_DISKS},
+  {"stream file", TEST_Stream, TEST_ALL_DISKS},
+  {"ring file", TEST_Ring, TEST_ALL_DISKS},
+  {"FAT copies", TEST_FatMirror, TEST_ALL_DISKS},
+  {"abandoned calls", TEST_Abandon, TEST_ALL_DISKS},
+  {"close after abandoned calls", TEST_AbandonClose, TEST_ALL_DISKS},
+  {"device faults", TEST_Faults, 1 << HOST_DISK_SIM},
+  {"queued requests", TEST_Queue, 1 << HOST_DISK_QUEUE},
+};
+
+
+
+int main(int argc, char **argv)
+{
+  uint32_t i, failed = 0;
+
+  if(argc > 1 && strcmp(argv[1], "sim") == 0){
+    TEST_Disk = HOST_DISK_SIM;
+  }else if(argc > 1 && strcmp(argv[1], "queue") == 0){
+    TEST_Disk = HOST_DISK_QUEUE;
+  }else if(argc > 1 && strcmp(argv[1], "ram") != 0){
+    fprintf(stderr, "usage: afatfs_test [ram|sim|queue]\n");
+    return 1;
+  }
+
+  TEST_Memory = calloc(TEST_SECTORS, TEST_SECTOR_SIZE);
+  if(TEST_Memory == NULL){
+    fprintf(stderr, "afatfs_test: out of memory\n");
+    return 1;
+  }
+
+  for(i = 0; i < sizeof(TEST_Cases) / sizeof(TEST_Cases[0]); i++){
+    if(!(TEST_Cases[i].Disks & (1 << TEST_Disk))){
+      continue;
+    }
+    printf("%s\n", TEST_Cases[i].Name);
+    if(TEST_Cases[i].Run() != 0){
+      printf("  FAILED\n");
+      failed++;
+    }
+  }
+  printf("%u failed\n", (unsigned)failed);
+
+  free(TEST_Memory);
+
+  return (int)failed;
+}
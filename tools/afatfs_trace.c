@@ -0,0 +1,68 @@
+/**
+ * @file  afatfs_trace.c
+ * @date  17-October-2026
+ * @brief Turns a dump of trace events into Chrome trace-event JSON.
+ *
+ * The input is the raw array of AfatfsTraceEvent_t filled by AFATFS_GetTrace
+ * on the target, as stored in memory (little endian, 20 bytes per event),
+ * for instance written to a file on the card or sent over a serial port.
+ *
+ *   afatfs_trace EVENTS.BIN [OUT.json]
+ *
+ * @author
+ * @author
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "afatfs.h"
+#include "tracejson.h"
+
+
+#define TRACE_CHUNK                                                         1024
+
+
+
+int main(int argc, char *argv[])
+{
+  static AfatfsTraceEvent_t events[TRACE_CHUNK];
+  FILE *in, *out = stdout;
+  size_t count;
+  uint64_t total = 0;
+
+  if(argc < 2 || argc > 3){
+    fprintf(stderr, "usage: afatfs_trace EVENTS.BIN [OUT.json]\n");
+    return EXIT_FAILURE;
+  }
+  in = fopen(argv[1], "rb");
+  if(in == NULL){
+    perror(argv[1]);
+    return EXIT_FAILURE;
+  }
+  if(argc == 3){
+    out = fopen(argv[2], "w");
+    if(out == NULL){
+      perror(argv[2]);
+      fclose(in);
+      return EXIT_FAILURE;
+    }
+  }
+
+  TRACEJSON_Begin(out);
+  while((count = fread(events, sizeof(AfatfsTraceEvent_t), TRACE_CHUNK,
+      in)) > 0)
+  {
+    TRACEJSON_Add(events, (uint32_t)count);
+    total += count;
+  }
+  TRACEJSON_End();
+
+  fclose(in);
+  if(out != stdout){
+    fclose(out);
+  }
+  fprintf(stderr, "afatfs_trace: %llu events\n", (unsigned long long)total);
+
+  return EXIT_SUCCESS;
+}